@@ -0,0 +1,2172 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  alloc.c
+ *
+ *    Description:  out of place writes on a volume of flash devices. Host
+ *                  units are allocated round robin over the devices and
+ *                  their dies, from a write frontier block on every plane,
+ *                  and every device collects its garbage with its own
+ *                  worker: greedy on the fewest valid units, copies kept on
+ *                  the same die when it has room. Programs and erases go
+ *                  to a die through its dispatcher, so reads do not queue
+ *                  behind them.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+#include "alloc.h"
+#include "pack.h"
+#include "dedup.h"
+#include "scan.h"
+#include "sftl_trace.h"
+
+/*
+ * a few synchronous flash ios, done once all of them have completed
+ */
+struct vol_io {
+    atomic_t pending;       // ios in flight, plus one held by the submitter
+    int error;
+    struct completion done;
+};
+
+static void vol_io_init(struct vol_io * io)
+{
+    atomic_set(&io->pending, 1);
+    io->error = 0;
+    init_completion(&io->done);
+}
+
+static void vol_io_done(void * priv, int error)
+{
+    struct vol_io * io = priv;
+
+    if (error)
+        io->error = error;
+    if (atomic_dec_and_test(&io->pending))
+        complete(&io->done);
+}
+
+static void vol_io_submit(struct ssd_disk * sdk, struct vol_io * io, int rw, pfn_t ppn,
+        unsigned int nr, struct page ** pages)
+{
+    atomic_inc(&io->pending);
+    if (ftl_submit_io(sdk, rw, ppn, nr, pages, NULL, vol_io_done, io))
+        vol_io_done(io, -ENOMEM);
+}
+
+static int vol_io_wait(struct vol_io * io)
+{
+    if (!atomic_dec_and_test(&io->pending))
+        wait_for_completion(&io->done);
+    return io->error;
+}
+
+static inline struct ftl_dev * ppn_dev(struct ssd_disk * sdk, pfn_t ppn)
+{
+    return &sdk->vol->devs[PPN_DEV(ppn)];
+}
+
+static inline u32 block_pages(struct ftl_dev * dev)
+{
+    return 1U << dev->geo.block_shift;
+}
+
+/* flash pages of a mapping unit, they are allocated and moved together */
+static inline u32 unit_pages(struct ftl_dev * dev)
+{
+    return 1U << dev->sdk->unit_shift;
+}
+
+static inline u32 block_units(struct ftl_dev * dev)
+{
+    return block_pages(dev) >> dev->sdk->unit_shift;
+}
+
+/* where the lpn of the unit at @page is kept */
+static inline pfn_t * page_rmap(struct ftl_dev * dev, u32 page)
+{
+    return &dev->rmap[page >> dev->sdk->unit_shift];
+}
+
+/* and how many lpns are mapped to it if it is shared */
+static inline u16 * page_refs(struct ftl_dev * dev, u32 page)
+{
+    return &dev->refs[page >> dev->sdk->unit_shift];
+}
+
+static inline u32 ppn_pbn(struct ftl_dev * dev, pfn_t ppn)
+{
+    return PPN_PAGE(ppn) >> dev->geo.block_shift;
+}
+
+static inline struct ftl_block * ppn_block(struct ssd_disk * sdk, pfn_t ppn)
+{
+    struct ftl_dev * dev = ppn_dev(sdk, ppn);
+
+    return &dev->blocks[ppn_pbn(dev, ppn)];
+}
+
+static inline u32 block_pbn(struct ftl_dev * dev, struct ftl_block * blk)
+{
+    return blk - dev->blocks;
+}
+
+/* where the blocks are, see struct ftl_geo */
+static inline struct ftl_die * pbn_die(struct ftl_dev * dev, u32 pbn)
+{
+    return &dev->dies[pbn % dev->nr_dies];
+}
+
+static inline struct ftl_plane * pbn_plane(struct ftl_dev * dev, u32 pbn)
+{
+    return &pbn_die(dev, pbn)->planes[pbn / dev->nr_dies % dev->geo.nr_planes];
+}
+
+static inline struct ftl_die * ppn_die(struct ssd_disk * sdk, pfn_t ppn)
+{
+    struct ftl_dev * dev = ppn_dev(sdk, ppn);
+
+    return pbn_die(dev, ppn_pbn(dev, ppn));
+}
+
+static void gc_kick(struct ftl_dev * dev)
+{
+    if (!ACCESS_ONCE(dev->sdk->vol->quiesced))
+        queue_work(dev->gc_wq, &dev->gc_work);
+}
+
+/* a program or erase may go to @die now, under its lock */
+static inline bool die_may_dispatch(struct ftl_die * die)
+{
+    return die->busy < (atomic_read(&die->reads) ? 1 : DIE_QUEUE_DEPTH);
+}
+
+/* the die may take more, send what waits for it */
+static void die_kick(struct ftl_die * die)
+{
+    // completions come in interrupt context, the bios are sent from a worker
+    if (!bio_list_empty(&die->queue))
+        queue_work(die->dev->sdk->vol->wq, &die->work);
+    if (waitqueue_active(&die->wait))
+        wake_up(&die->wait);
+}
+
+/*
+ * gc takes the die for a program or an erase, after the reads on it and
+ * the host programs queued there, unless it is @urgent
+ */
+static inline bool die_may_gc(struct ftl_die * die, bool urgent)
+{
+    return die_may_dispatch(die) && (urgent || bio_list_empty(&die->queue));
+}
+
+static void die_get(struct ftl_die * die, bool urgent)
+{
+    unsigned long flags;
+    bool got;
+
+    for (;;) {
+        spin_lock_irqsave(&die->lock, flags);
+        got = die_may_gc(die, urgent);
+        if (got)
+            die->busy ++;
+        spin_unlock_irqrestore(&die->lock, flags);
+        if (got)
+            return;
+        wait_event(die->wait, die_may_gc(die, urgent));
+    }
+}
+
+static void die_put(struct ftl_die * die)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&die->lock, flags);
+    die->busy --;
+    spin_unlock_irqrestore(&die->lock, flags);
+    die_kick(die);
+}
+
+static void die_dispatch(struct work_struct * work)
+{
+    struct ftl_die * die = container_of(work, struct ftl_die, work);
+    struct ssd_disk * sdk = die->dev->sdk;
+    unsigned long flags;
+    struct bio * bio;
+
+    for (;;) {
+        bio = NULL;
+        spin_lock_irqsave(&die->lock, flags);
+        if (die_may_dispatch(die)) {
+            bio = bio_list_pop(&die->queue);
+            if (bio)
+                die->busy ++;
+        }
+        spin_unlock_irqrestore(&die->lock, flags);
+        if (!bio)
+            break;
+        ss_submit_bio(sdk, bio);
+    }
+}
+
+static void die_write_endio(struct bio * bio, int error)
+{
+    struct ss_clone * sc = ss_clone(bio);
+
+    bio->bi_end_io = sc->end_io;
+    die_put(ppn_die(sc->sdk, sc->ppn));
+    bio->bi_end_io(bio, error);
+}
+
+/*
+ * Send a host program of @ppn to its die, or queue it there if the die
+ * has enough to do or reads to serve first. @bio has to come from the
+ * bio_set of the disk, the dispatcher keeps its end_io in front of it.
+ */
+void ftl_submit_write(struct ssd_disk * sdk, pfn_t ppn, struct bio * bio)
+{
+    struct ftl_die * die = ppn_die(sdk, ppn);
+    struct ss_clone * sc = ss_clone(bio);
+    unsigned long flags;
+    bool now;
+
+    sc->ppn = ppn;
+    sc->sdk = sdk;
+    sc->end_io = bio->bi_end_io;
+    bio->bi_end_io = die_write_endio;
+
+    spin_lock_irqsave(&die->lock, flags);
+    now = bio_list_empty(&die->queue) && die_may_dispatch(die);
+    if (now)
+        die->busy ++;
+    else
+        bio_list_add(&die->queue, bio);
+    spin_unlock_irqrestore(&die->lock, flags);
+
+    if (now)
+        ss_submit_bio(sdk, bio);
+    else
+        ftl_stat_inc(sdk, FTL_STAT_DIE_WAITS);
+}
+
+/*
+ * Take the next unit of a frontier on @die for @lpn, the planes in turn
+ * so that a multi-plane program finds them at the same page. Host writes
+ * leave the last GC_RESERVE_BLOCKS free blocks of the device to gc, so
+ * it can always make room. Called under the lock of the device.
+ */
+static pfn_t die_alloc(struct ftl_dev * dev, struct ftl_die * die, pfn_t lpn, bool gc)
+{
+    struct ftl_block ** front, * blk;
+    struct ftl_plane * pl;
+    unsigned int i, p;
+    u32 page;
+
+    for (i = 0; i < dev->geo.nr_planes; i++) {
+        p = (die->next[gc] + i) % dev->geo.nr_planes;
+        pl = &die->planes[p];
+        front = gc ? &pl->gc : &pl->host;
+        blk = *front;
+        if (!blk) {
+            if (list_empty(&pl->free) || (!gc && dev->nr_free <= GC_RESERVE_BLOCKS))
+                continue;
+            blk = list_first_entry(&pl->free, struct ftl_block, list);
+            list_del_init(&blk->list);
+            dev->nr_free --;
+            blk->state = BLK_OPEN;
+            *front = blk;
+            trace_sftl_alloc_block(dev->sdk->gd->disk_name, dev->id, block_pbn(dev, blk),
+                    dev->nr_free, gc);
+        }
+        die->next[gc] = (p + 1) % dev->geo.nr_planes;
+
+        page = (block_pbn(dev, blk) << dev->geo.block_shift) + blk->next;
+        blk->next += unit_pages(dev);
+        *page_rmap(dev, page) = lpn;
+        if (dev->packs)
+            dev->packs[page] = lpn == RMAP_PACKED ? PACK_PAGE : 0;
+        blk->valid ++;
+        atomic_inc(&blk->writes);
+        if (blk->next == block_pages(dev)) {
+            blk->state = BLK_FULL;
+            *front = NULL;
+        }
+        return MAKE_PPN(dev->id, page);
+    }
+    return 0;
+}
+
+/*
+ * Take a unit of @dev for @lpn. Host units go to the dies in turn, gc
+ * moves stay on die @near if they can. Returns 0 if there is none.
+ */
+static pfn_t dev_alloc(struct ftl_dev * dev, pfn_t lpn, bool gc, unsigned int near)
+{
+    unsigned long flags;
+    unsigned int i, first;
+    bool opened;
+    u32 nr_free;
+    pfn_t ppn = 0;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    nr_free = dev->nr_free;
+    first = gc ? near : dev->next_die ++;
+    for (i = 0; i < dev->nr_dies && !ppn; i++)
+        ppn = die_alloc(dev, &dev->dies[(first + i) % dev->nr_dies], lpn, gc);
+    opened = dev->nr_free != nr_free;
+    nr_free = dev->nr_free;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if ((!ppn && !gc) || (opened && nr_free < dev->gc_low))
+        gc_kick(dev);
+    return ppn;
+}
+
+/* consecutive host units go to consecutive devices */
+static pfn_t vol_alloc(struct ftl_volume * vol, pfn_t lpn)
+{
+    unsigned int i, start = atomic_inc_return(&vol->next);
+    pfn_t ppn;
+
+    for (i = 0; i < vol->nr_devs; i++) {
+        ppn = dev_alloc(&vol->devs[(start + i) % vol->nr_devs], lpn, false, 0);
+        if (ppn)
+            return ppn;
+    }
+    return 0;
+}
+
+/* a peek without the locks, dev_alloc decides */
+static bool vol_has_space(struct ftl_volume * vol)
+{
+    struct ftl_dev * dev;
+    unsigned int i, j, p;
+
+    for (i = 0; i < vol->nr_devs; i++) {
+        dev = &vol->devs[i];
+        if (dev->nr_free > GC_RESERVE_BLOCKS)
+            return true;
+        for (j = 0; j < dev->nr_dies; j++) {
+            for (p = 0; p < dev->geo.nr_planes; p++) {
+                if (dev->dies[j].planes[p].host)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * The block map, see struct ftl_bmap. An entry changes under the mutex
+ * of its logical block, lookups take no lock. A unit is in the rmap
+ * before @filled covers it and what it supersedes is dropped after, a
+ * break sets the page entries before it clears @data and then @log.
+ * The data block under an open log is held open, gc would find its
+ * units in no mapping page.
+ */
+static inline pfn_t lpn_lbn(struct ftl_bmap * bm, pfn_t lpn)
+{
+    return lpn >> bm->shift;
+}
+
+static inline u32 lpn_off(struct ftl_bmap * bm, pfn_t lpn)
+{
+    return lpn & ((1U << bm->shift) - 1);
+}
+
+static inline struct mutex * lbn_lock(struct ftl_bmap * bm, pfn_t lbn)
+{
+    return &bm->locks[lbn % BMAP_LOCKS];
+}
+
+static void block_set_state(struct ssd_disk * sdk, pfn_t ppn, u8 state)
+{
+    struct ftl_dev * dev = ppn_dev(sdk, ppn);
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    ppn_block(sdk, ppn)->state = state;
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/* where the block map puts unit @lpn, 0 if it is page mapped */
+pfn_t ftl_block_ppn(struct ssd_disk * sdk, pfn_t lpn)
+{
+    struct ftl_bmap * bm = sdk->vol ? sdk->vol->bmap : NULL;
+    struct ftl_bmap_entry * e;
+    u32 off;
+    pfn_t ppn;
+
+    if (!bm || lpn_lbn(bm, lpn) >= bm->nr_lbns)
+        return 0;
+    e = &bm->ents[lpn_lbn(bm, lpn)];
+    off = lpn_off(bm, lpn);
+    ppn = ACCESS_ONCE(e->log);
+    smp_rmb();
+    if (!ppn || off >= ACCESS_ONCE(e->filled))
+        ppn = ACCESS_ONCE(e->data);
+    return ppn ? ppn + ((pfn_t)off << sdk->unit_shift) : 0;
+}
+
+/* count the units from @lpn, at most @max, the block map has none of */
+unsigned int ftl_block_unmapped(struct ssd_disk * sdk, pfn_t lpn, unsigned int max)
+{
+    struct ftl_bmap * bm = sdk->vol ? sdk->vol->bmap : NULL;
+    unsigned int n = 0;
+
+    if (!bm)
+        return max;
+    while (n < max) {
+        if (ftl_block_ppn(sdk, lpn + n))
+            break;
+        // nor of the rest of its logical block, past the fill point of its log
+        n += (1U << bm->shift) - lpn_off(bm, lpn + n);
+    }
+    return min(n, max);
+}
+
+/* give the log of @lbn a slot, taken from the log written to longest ago if none is free */
+static pfn_t log_claim(struct ftl_bmap * bm, pfn_t lbn)
+{
+    struct ftl_seq_log * log = NULL;
+    unsigned int i;
+    pfn_t old;
+
+    spin_lock(&bm->lock);
+    for (i = 0; i < BMAP_LOGS; i++) {
+        if (bm->logs[i].lbn == lbn) {
+            log = &bm->logs[i];
+            break;
+        }
+        if (!log || (log->lbn != BMAP_NO_LOG && (bm->logs[i].lbn == BMAP_NO_LOG ||
+                        time_before(bm->logs[i].last, log->last))))
+            log = &bm->logs[i];
+    }
+    old = log->lbn == lbn ? BMAP_NO_LOG : log->lbn;
+    log->lbn = lbn;
+    log->last = jiffies;
+    spin_unlock(&bm->lock);
+    return old;
+}
+
+static void log_release(struct ftl_bmap * bm, pfn_t lbn)
+{
+    unsigned int i;
+
+    spin_lock(&bm->lock);
+    for (i = 0; i < BMAP_LOGS; i++) {
+        if (bm->logs[i].lbn == lbn) {
+            bm->logs[i].lbn = BMAP_NO_LOG;
+            break;
+        }
+    }
+    spin_unlock(&bm->lock);
+}
+
+static void log_touch(struct ftl_bmap * bm, pfn_t lbn)
+{
+    unsigned int i;
+
+    spin_lock(&bm->lock);
+    for (i = 0; i < BMAP_LOGS; i++) {
+        if (bm->logs[i].lbn == lbn) {
+            bm->logs[i].last = jiffies;
+            break;
+        }
+    }
+    spin_unlock(&bm->lock);
+}
+
+/*
+ * Streams are told from random writes by the ends of the logical blocks
+ * they write. A write of the last unit of logical block @lbn makes the
+ * next one near a stream, sure if @lbn was written from its first unit
+ * on by the same stream or through a log.
+ */
+static void stream_end(struct ftl_bmap * bm, pfn_t lbn, bool logged)
+{
+    struct ftl_stream * st = NULL;
+    unsigned int i;
+
+    spin_lock(&bm->lock);
+    for (i = 0; i < BMAP_LOGS; i++) {
+        if (bm->streams[i].lbn == lbn) {
+            st = &bm->streams[i];
+            logged |= st->state == STREAM_IN;
+            break;
+        }
+    }
+    if (!st)
+        st = &bm->streams[bm->next_stream ++ % BMAP_LOGS];
+    st->lbn = lbn + 1;
+    st->state = logged ? STREAM_SURE : STREAM_NEAR;
+    spin_unlock(&bm->lock);
+}
+
+/* the first unit of @lbn is written, whether a sure stream has reached it */
+static bool stream_start(struct ftl_bmap * bm, pfn_t lbn)
+{
+    unsigned int i;
+    bool sure = false;
+
+    spin_lock(&bm->lock);
+    for (i = 0; i < BMAP_LOGS; i++) {
+        if (bm->streams[i].lbn == lbn) {
+            sure = bm->streams[i].state == STREAM_SURE;
+            if (sure)
+                bm->streams[i].lbn = BMAP_NO_LOG;
+            else
+                bm->streams[i].state = STREAM_IN;
+            break;
+        }
+    }
+    spin_unlock(&bm->lock);
+    return sure;
+}
+
+/*
+ * Put logical block @lbn back into the page map, under its mutex. Units
+ * a page write took since keep their new mapping. Its blocks are held
+ * open until the block map is gone. Returns whether it had an open log.
+ */
+static bool bmap_break(struct ssd_disk * sdk, pfn_t lbn)
+{
+    struct ftl_bmap * bm = sdk->vol->bmap;
+    struct ftl_bmap_entry * e = &bm->ents[lbn];
+    pfn_t lpn = lbn << bm->shift, log = e->log, data = e->data, ppn;
+    u32 i;
+    int err;
+
+    if (log)
+        block_set_state(sdk, log, BLK_OPEN);
+    if (data)
+        block_set_state(sdk, data, BLK_OPEN);
+
+    for (i = 0; i < (1U << bm->shift); i++) {
+        if (log && i < e->filled)
+            ppn = log + ((pfn_t)i << sdk->unit_shift);
+        else if (data)
+            ppn = data + ((pfn_t)i << sdk->unit_shift);
+        else
+            break;
+        err = 0;
+        if (cmpxchg_phys_ppn(sdk->gd, lpn + i, 0, ppn, &err))
+            ftl_invalidate_page(sdk, ppn);
+        else if (err)
+            printk(KERN_ERR "ftl: unit %x of %s lost its mapping, error %d\n", lpn + i,
+                    sdk->gd->disk_name, err);
+    }
+    smp_wmb();
+    e->data = 0;
+    smp_wmb();
+    e->log = 0;
+
+    if (log)
+        block_set_state(sdk, log, BLK_FULL);
+    if (data)
+        block_set_state(sdk, data, BLK_FULL);
+    ftl_stat_inc(sdk, FTL_STAT_BMAP_BREAKS);
+    return log != 0;
+}
+
+/* a newer stream took the slot of the log of @lbn */
+static void bmap_evict(struct ssd_disk * sdk, pfn_t lbn)
+{
+    struct ftl_bmap * bm = sdk->vol->bmap;
+
+    mutex_lock(lbn_lock(bm, lbn));
+    if (bm->ents[lbn].log)
+        bmap_break(sdk, lbn);
+    mutex_unlock(lbn_lock(bm, lbn));
+}
+
+/*
+ * Write unit @lpn as the next of the log of its logical block, under its
+ * mutex. The unit of the data block or the page entry it supersedes is
+ * dropped once the log covers it. A full log becomes the data block.
+ */
+static pfn_t log_append(struct ssd_disk * sdk, pfn_t lpn)
+{
+    struct ftl_bmap * bm = sdk->vol->bmap;
+    struct ftl_bmap_entry * e = &bm->ents[lpn_lbn(bm, lpn)];
+    u32 off = lpn_off(bm, lpn);
+    pfn_t ppn = e->log + ((pfn_t)off << sdk->unit_shift), data = e->data;
+    struct ftl_dev * dev = ppn_dev(sdk, ppn);
+    struct ftl_block * blk = ppn_block(sdk, ppn);
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    *page_rmap(dev, PPN_PAGE(ppn)) = lpn;
+    blk->valid ++;
+    blk->next += unit_pages(dev);
+    atomic_inc(&blk->writes);
+    if (blk->next == block_pages(dev))
+        blk->state = BLK_FULL;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    smp_wmb();
+    e->filled = off + 1;
+    smp_mb();
+    if (data)
+        ftl_invalidate_page(sdk, data + ((pfn_t)off << sdk->unit_shift));
+    else if (get_page_ppn(sdk->gd, lpn, 0, NULL))
+        ftl_invalidate_page(sdk, set_phys_ppn(sdk->gd, lpn, 0, NULL));
+
+    if (e->filled < (1U << bm->shift)) {
+        log_touch(bm, lpn_lbn(bm, lpn));
+        return ppn;
+    }
+
+    // a switch merge, the old data block holds nothing any more
+    e->data = e->log;
+    smp_wmb();
+    e->log = 0;
+    if (data)
+        block_set_state(sdk, data, BLK_FULL);
+    log_release(bm, lpn_lbn(bm, lpn));
+    ftl_stat_inc(sdk, FTL_STAT_BMAP_MERGES);
+    return ppn;
+}
+
+/*
+ * Open a log for the logical block of @lpn, its first unit, in a free
+ * block of the devices and dies in turn. Like the host frontiers it
+ * leaves the last GC_RESERVE_BLOCKS to gc. Returns 0 if there is no
+ * block to spare.
+ */
+static pfn_t log_open(struct ssd_disk * sdk, pfn_t lpn)
+{
+    struct ftl_volume * vol = sdk->vol;
+    struct ftl_bmap_entry * e = &vol->bmap->ents[lpn_lbn(vol->bmap, lpn)];
+    unsigned int i, j, p, start = atomic_inc_return(&vol->next);
+    struct ftl_block * blk = NULL;
+    struct ftl_plane * pl;
+    struct ftl_dev * dev;
+    struct ftl_die * die;
+    unsigned long flags;
+    u32 nr_free = 0;
+
+    for (i = 0; i < vol->nr_devs && !blk; i++) {
+        dev = &vol->devs[(start + i) % vol->nr_devs];
+        spin_lock_irqsave(&dev->lock, flags);
+        for (j = 0; j < dev->nr_dies && !blk && dev->nr_free > GC_RESERVE_BLOCKS; j++) {
+            die = &dev->dies[dev->next_die ++ % dev->nr_dies];
+            for (p = 0; p < dev->geo.nr_planes && !blk; p++) {
+                pl = &die->planes[p];
+                if (list_empty(&pl->free))
+                    continue;
+                blk = list_first_entry(&pl->free, struct ftl_block, list);
+                list_del_init(&blk->list);
+                dev->nr_free --;
+                blk->state = BLK_OPEN;
+                trace_sftl_alloc_block(sdk->gd->disk_name, dev->id, block_pbn(dev, blk),
+                        dev->nr_free, false);
+            }
+        }
+        nr_free = dev->nr_free;
+        spin_unlock_irqrestore(&dev->lock, flags);
+        if (!blk || nr_free < dev->gc_low)
+            gc_kick(dev);
+    }
+    if (!blk)
+        return 0;
+
+    if (e->data)
+        block_set_state(sdk, e->data, BLK_OPEN);
+    e->filled = 0;
+    smp_wmb();
+    e->log = MAKE_PPN(dev->id, block_pbn(dev, blk) << dev->geo.block_shift);
+    return log_append(sdk, lpn);
+}
+
+/*
+ * Write unit @lpn through the block map if it starts or continues the log
+ * of its logical block. Returns 0 if it is to be page mapped, its logical
+ * block was put back into the page map then if it had to be.
+ */
+static pfn_t bmap_write(struct ssd_disk * sdk, pfn_t lpn)
+{
+    struct ftl_bmap * bm = sdk->vol->bmap;
+    pfn_t lbn = lpn_lbn(bm, lpn), old, ppn = 0;
+    u32 off = lpn_off(bm, lpn);
+    struct ftl_bmap_entry * e;
+    bool open = false, start = false;
+
+    if (lbn >= bm->nr_lbns)
+        return 0;
+    e = &bm->ents[lbn];
+    // random writes do not open logs, they would be broken right away
+    if (!off)
+        start = stream_start(bm, lbn) || ACCESS_ONCE(e->data);
+    if (!start && !ACCESS_ONCE(e->log) && !ACCESS_ONCE(e->data)) {
+        if (off == (1U << bm->shift) - 1)
+            stream_end(bm, lbn, false);
+        return 0;
+    }
+
+    // never under the mutex of another logical block
+    if (start && (old = log_claim(bm, lbn)) != BMAP_NO_LOG)
+        bmap_evict(sdk, old);
+
+    mutex_lock(lbn_lock(bm, lbn));
+    if (e->log && off && off == e->filled) {
+        ppn = log_append(sdk, lpn);
+    } else {
+        // a new log goes over the data block, anything else ends the block map
+        if (e->log || (e->data && off))
+            open = bmap_break(sdk, lbn);
+        if (start)
+            ppn = log_open(sdk, lpn);
+        // the slot claimed above stays with the new log
+        if ((open && !start) || (start && !ppn))
+            log_release(bm, lbn);
+    }
+    mutex_unlock(lbn_lock(bm, lbn));
+    if (off == (1U << bm->shift) - 1)
+        stream_end(bm, lbn, ppn != 0);
+    return ppn;
+}
+
+/* a log may have been opened for the logical block of @lpn as it was page mapped */
+static void bmap_recheck(struct ssd_disk * sdk, pfn_t lpn)
+{
+    struct ftl_bmap * bm = sdk->vol->bmap;
+    pfn_t lbn = lpn_lbn(bm, lpn);
+    struct ftl_bmap_entry * e;
+
+    smp_mb();
+    if (lbn >= bm->nr_lbns)
+        return;
+    e = &bm->ents[lbn];
+    if (!ACCESS_ONCE(e->log) && !ACCESS_ONCE(e->data))
+        return;
+    mutex_lock(lbn_lock(bm, lbn));
+    if ((e->log || e->data) && bmap_break(sdk, lbn))
+        log_release(bm, lbn);
+    mutex_unlock(lbn_lock(bm, lbn));
+}
+
+/*
+ * Drop the block mappings of the @count units from @lpn, being discarded.
+ * A logical block discarded as a whole loses its blocks, one discarded in
+ * part is put back into the page map and discarded there.
+ */
+void ftl_bmap_discard(struct ssd_disk * sdk, pfn_t lpn, unsigned int count)
+{
+    struct ftl_bmap * bm = sdk->vol ? sdk->vol->bmap : NULL;
+    u64 end = (u64)lpn + count;
+    struct ftl_bmap_entry * e;
+    pfn_t lbn, log, data;
+    bool open;
+    u32 i;
+
+    if (!bm || !count)
+        return;
+    for (lbn = lpn_lbn(bm, lpn); lbn < bm->nr_lbns && ((u64)lbn << bm->shift) < end; lbn++) {
+        e = &bm->ents[lbn];
+        if (!ACCESS_ONCE(e->log) && !ACCESS_ONCE(e->data))
+            continue;
+        mutex_lock(lbn_lock(bm, lbn));
+        log = e->log;
+        data = e->data;
+        if (!log && !data) {
+            open = false;
+        } else if (((u64)lbn << bm->shift) < lpn || ((u64)(lbn + 1) << bm->shift) > end) {
+            open = bmap_break(sdk, lbn);
+        } else {
+            if (data)
+                block_set_state(sdk, data, BLK_OPEN);
+            e->data = 0;
+            smp_wmb();
+            e->log = 0;
+            smp_mb();
+            for (i = 0; i < (1U << bm->shift); i++) {
+                if (log && i < e->filled)
+                    ftl_invalidate_page(sdk, log + ((pfn_t)i << sdk->unit_shift));
+                if (data)
+                    ftl_invalidate_page(sdk, data + ((pfn_t)i << sdk->unit_shift));
+            }
+            if (log)
+                block_set_state(sdk, log, BLK_FULL);
+            if (data)
+                block_set_state(sdk, data, BLK_FULL);
+            open = log != 0;
+        }
+        if (open)
+            log_release(bm, lbn);
+        mutex_unlock(lbn_lock(bm, lbn));
+    }
+}
+
+/*
+ * Allocate a host unit for @lpn. With no free block on any device this
+ * waits for garbage collection and sets @stalled. Returns 0 if no block
+ * was freed within SSD_TIMEOUT.
+ */
+static pfn_t vol_alloc_wait(struct ssd_disk * sdk, pfn_t lpn, bool * stalled)
+{
+    struct ftl_volume * vol = sdk->vol;
+    unsigned long timeout = jiffies + SSD_TIMEOUT;
+    bool waited = false;
+    pfn_t ppn;
+
+    while (!(ppn = vol_alloc(vol, lpn))) {
+        if (!waited) {
+            ftl_stat_inc(sdk, FTL_STAT_GC_STALLS);
+            // gc stops giving way to reads and to its rate
+            atomic_inc(&vol->stalled);
+            wake_up_all(&sdk->qos.wait);
+            waited = true;
+        }
+        if (time_after(jiffies, timeout)) {
+            printk(KERN_ERR "ftl: no free block on %s\n", sdk->gd->disk_name);
+            break;
+        }
+        wait_event_timeout(vol->free_wait, vol_has_space(vol), HZ);
+    }
+
+    if (waited)
+        atomic_dec(&vol->stalled);
+    if (ppn && stalled && waited)
+        *stalled = true;
+    return ppn;
+}
+
+/* whether the unit at @ppn is a unit of @lpn alone, not packed nor shared */
+static bool unit_owned(struct ssd_disk * sdk, pfn_t ppn, pfn_t lpn)
+{
+    struct ftl_dev * dev;
+    unsigned long flags;
+    bool owned;
+
+    if (!ppn)
+        return false;
+    dev = ppn_dev(sdk, ppn);
+    spin_lock_irqsave(&dev->lock, flags);
+    owned = *page_rmap(dev, PPN_PAGE(ppn)) == lpn;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return owned;
+}
+
+/*
+ * the unit @lpn was mapped to at @old before a write, kept valid until
+ * ftl_map_done if the write can go back to it. Only a unit of @lpn alone
+ * can, on a volume that neither shares units nor maps blocks. *@old is 0
+ * if it is garbage already.
+ */
+static void unit_replaced(struct ssd_disk * sdk, pfn_t lpn, pfn_t * old)
+{
+    struct ftl_volume * vol = sdk->vol;
+
+    if (vol->bmap || vol->dedup || !unit_owned(sdk, *old, lpn)) {
+        ftl_invalidate_page(sdk, *old);
+        *old = 0;
+    }
+}
+
+/*
+ * Allocate the flash pages of a host write of unit @lpn and map @lpn to
+ * the first. The unit it was mapped to is returned in *@old for
+ * ftl_map_done, the caller calls it when the program completes. Returns
+ * 0 and sets *@err to -ENOSPC if there is no room, see vol_alloc_wait,
+ * or to the error of the mapping page of @lpn if it cannot be read.
+ */
+pfn_t ftl_map_write(struct ssd_disk * sdk, pfn_t lpn, pfn_t * old, bool * stalled, int * err)
+{
+    struct ftl_volume * vol = sdk->vol;
+    pfn_t ppn;
+    int error = 0;
+
+    *old = 0;
+    if (vol->bmap && (ppn = bmap_write(sdk, lpn)))
+        return ppn;
+
+    ppn = vol_alloc_wait(sdk, lpn, stalled);
+    if (!ppn) {
+        *err = -ENOSPC;
+        return 0;
+    }
+    *old = set_phys_ppn(sdk->gd, lpn, ppn, &error);
+    if (error) {
+        // @lpn still maps where it did, the new unit is never written
+        ftl_invalidate_page(sdk, ppn);
+        ftl_write_done(sdk, ppn);
+        *err = error;
+        return 0;
+    }
+    unit_replaced(sdk, lpn, old);
+    if (vol->bmap)
+        bmap_recheck(sdk, lpn);
+    return ppn;
+}
+
+/*
+ * Allocate a page for the @nr units of @lpns packed into it and map them
+ * all to it, see pack.h. The page stays valid until the last of them is
+ * overwritten or discarded. Their mapping pages are loaded first, if one
+ * cannot be read nothing is allocated, 0 is returned and *@err is set as
+ * by ftl_map_write. A unit whose page is dropped from the cmt and cannot
+ * be read again meanwhile is left out, *@err is set but the page is
+ * returned for the others. @olds are for ftl_map_done, as with
+ * ftl_map_write.
+ */
+pfn_t ftl_map_pack(struct ssd_disk * sdk, const pfn_t * lpns, unsigned int nr, pfn_t * olds,
+        bool * stalled, int * err)
+{
+    struct ftl_dev * dev;
+    unsigned long flags;
+    unsigned int i;
+    pfn_t ppn;
+    int error = 0;
+
+    memset(olds, 0, sizeof(pfn_t) * nr);
+    for (i = 0; i < nr && !error; i++)
+        get_page_ppn(sdk->gd, lpns[i], 1, &error);
+    if (error) {
+        *err = error;
+        return 0;
+    }
+
+    ppn = vol_alloc_wait(sdk, RMAP_PACKED, stalled);
+    if (!ppn) {
+        *err = -ENOSPC;
+        return 0;
+    }
+
+    // counted before any of them can be overwritten
+    dev = ppn_dev(sdk, ppn);
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->packs[PPN_PAGE(ppn)] = PACK_PAGE | nr;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    for (i = 0; i < nr; i++) {
+        olds[i] = set_phys_ppn(sdk->gd, lpns[i], ppn, &error);
+        if (error) {
+            // the page counts one unit less
+            ftl_invalidate_page(sdk, ppn);
+            *err = error;
+            error = 0;
+            continue;
+        }
+        unit_replaced(sdk, lpns[i], &olds[i]);
+        if (sdk->vol->bmap)
+            bmap_recheck(sdk, lpns[i]);
+    }
+    ftl_stat_add(sdk, FTL_STAT_PACKED_UNITS, nr);
+    ftl_stat_inc(sdk, FTL_STAT_PACKED_PAGES);
+    return ppn;
+}
+
+/*
+ * Keep the block of the unit at @ppn from being erased while it is read
+ * for no lpn, until ftl_read_put. Fails if the block has been erased
+ * since its erase count was @erase, or is being erased.
+ */
+static bool unit_hold(struct ssd_disk * sdk, pfn_t ppn, u32 erase)
+{
+    struct ftl_dev * dev = ppn_dev(sdk, ppn);
+    struct ftl_block * blk = ppn_block(sdk, ppn);
+    unsigned long flags;
+    bool held;
+
+    atomic_inc(&blk->reads);
+    atomic_inc(&ppn_die(sdk, ppn)->reads);
+    spin_lock_irqsave(&dev->lock, flags);
+    held = blk->erase_count == erase && (blk->state == BLK_OPEN || blk->state == BLK_FULL ||
+            blk->state == BLK_GC);
+    spin_unlock_irqrestore(&dev->lock, flags);
+    if (!held)
+        ftl_read_put(sdk, ppn);
+    return held;
+}
+
+/* drop the lpns of @du that have been mapped elsewhere since, under the mutex of dedup */
+static void unit_compact(struct ssd_disk * sdk, struct dedup_unit * du)
+{
+    unsigned int i, nr = 0;
+
+    for (i = 0; i < du->nr; i++) {
+        if (get_phys_ppn(sdk->gd, du->lpns[i], 0, NULL) == du->ppn)
+            du->lpns[nr ++] = du->lpns[i];
+    }
+    du->nr = nr;
+}
+
+/*
+ * Map @lpn to the unit at @ppn as well, unless gc is moving the unit,
+ * it is not mapped any more or shared by too many lpns already. gc moves
+ * a shared unit under the same mutex.
+ */
+static bool unit_share(struct ssd_disk * sdk, pfn_t ppn, pfn_t lpn)
+{
+    struct ftl_dedup * dd = sdk->vol->dedup;
+    struct ftl_dev * dev = ppn_dev(sdk, ppn);
+    struct ftl_block * blk = ppn_block(sdk, ppn);
+    pfn_t * rmap = page_rmap(dev, PPN_PAGE(ppn));
+    u16 * refs = page_refs(dev, PPN_PAGE(ppn));
+    pfn_t first = RMAP_INVALID, old = 0;
+    struct dedup_unit * du;
+    unsigned long flags;
+    bool shared;
+    int err = 0;
+
+    mutex_lock(&dd->mutex);
+    // the same data written again
+    if (get_phys_ppn(sdk->gd, lpn, 1, &err) == ppn) {
+        mutex_unlock(&dd->mutex);
+        return true;
+    }
+    // written as it is then, and fails the same way
+    if (err) {
+        mutex_unlock(&dd->mutex);
+        return false;
+    }
+    du = dedup_find(dd, ppn);
+    if (du && du->nr >= DEDUP_MAX_REFS - 1)
+        unit_compact(sdk, du);
+    du = dedup_get(dd, ppn, 2);
+    if (!du) {
+        mutex_unlock(&dd->mutex);
+        return false;
+    }
+
+    spin_lock_irqsave(&dev->lock, flags);
+    shared = blk->state != BLK_GC && *rmap != RMAP_INVALID && *rmap != RMAP_PACKED &&
+            du->nr < DEDUP_MAX_REFS - 1;
+    if (shared && *rmap != RMAP_SHARED) {
+        first = *rmap;
+        *rmap = RMAP_SHARED;
+        *refs = 1;
+    }
+    if (shared)
+        (*refs) ++;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if (shared) {
+        if (first != RMAP_INVALID)
+            du->lpns[du->nr ++] = first;
+        du->lpns[du->nr ++] = lpn;
+        old = set_phys_ppn(sdk->gd, lpn, ppn, NULL);
+    }
+    dedup_put(du);
+    mutex_unlock(&dd->mutex);
+
+    if (shared)
+        ftl_invalidate_page(sdk, old);
+    return shared;
+}
+
+/*
+ * Map unit @lpn to a copy of its data @unit already on the flash, found
+ * by its fingerprint @fp. The copy is read back and compared first. The
+ * unit it was mapped to becomes garbage. Returns false if there is no
+ * copy, @lpn is to be written then.
+ */
+bool ftl_map_dedup(struct ssd_disk * sdk, pfn_t lpn, const void * unit, u64 fp)
+{
+    struct ftl_dedup * dd = sdk->vol->dedup;
+    struct page * buf;
+    struct vol_io io;
+    bool same = false;
+    pfn_t ppn;
+    u32 erase;
+
+    ppn = dedup_lookup(dd, fp, &erase);
+    if (!ppn)
+        return false;
+    if (!unit_hold(sdk, ppn, erase)) {
+        dedup_remove(dd, fp, ppn);
+        return false;
+    }
+
+    buf = alloc_page(GFP_NOIO);
+    if (buf) {
+        vol_io_init(&io);
+        vol_io_submit(sdk, &io, READ, ppn, 1, &buf);
+        same = !vol_io_wait(&io) && scan_diff(page_address(buf), unit,
+                PHYS_PAGE_SIZE / sizeof(pfn_t)) == PHYS_PAGE_SIZE / sizeof(pfn_t);
+        if (!same) {
+            dedup_remove(dd, fp, ppn);
+            ftl_stat_inc(sdk, FTL_STAT_DEDUP_MISMATCHES);
+        }
+        __free_page(buf);
+    }
+    same = same && unit_share(sdk, ppn, lpn);
+    ftl_read_put(sdk, ppn);
+    if (!same)
+        return false;
+
+    if (sdk->vol->bmap)
+        bmap_recheck(sdk, lpn);
+    ftl_stat_inc(sdk, FTL_STAT_DEDUP_HITS);
+    return true;
+}
+
+/*
+ * the unit at @ppn was written with data of fingerprint @fp, before
+ * ftl_write_done so that its block is not erased meanwhile
+ */
+void ftl_dedup_add(struct ssd_disk * sdk, pfn_t ppn, u64 fp)
+{
+    dedup_insert(sdk->vol->dedup, fp, ppn, ppn_block(sdk, ppn)->erase_count);
+}
+
+/*
+ * The program of unit @lpn at @ppn, mapped by ftl_map_write or
+ * ftl_map_pack over the unit at @old, completed with @error. The old
+ * unit is garbage now, unless the program failed and @lpn was not
+ * written again meanwhile: @lpn goes back to it then. Called before
+ * ftl_write_done.
+ */
+void ftl_map_done(struct ssd_disk * sdk, pfn_t lpn, pfn_t ppn, pfn_t old, int error)
+{
+    if (error && old && cmpxchg_phys_ppn(sdk->gd, lpn, ppn, old, NULL) == ppn)
+        ftl_invalidate_page(sdk, ppn);
+    else
+        ftl_invalidate_page(sdk, old);
+}
+
+/* the program of @ppn completed, a full block can be collected after its last */
+void ftl_write_done(struct ssd_disk * sdk, pfn_t ppn)
+{
+    struct ftl_dev * dev = ppn_dev(sdk, ppn);
+
+    // unlocked, only a hint to start gc
+    if (atomic_dec_and_test(&ppn_block(sdk, ppn)->writes) && ACCESS_ONCE(dev->nr_free) < dev->gc_low)
+        gc_kick(dev);
+}
+
+/*
+ * Translate @lpn for a host read and keep the block it is on from being
+ * erased until ftl_read_put. The read counts on its die until then, the
+ * dispatcher holds programs back for it. Returns 0 if @lpn is unmapped,
+ * or if its mapping page cannot be read, *@err is set then.
+ */
+pfn_t ftl_read_get(struct ssd_disk * sdk, pfn_t lpn, int * err)
+{
+    pfn_t ppn;
+
+    for (;;) {
+        ppn = get_phys_ppn(sdk->gd, lpn, 0, err);
+        if (!ppn)
+            return 0;
+
+        // gc moves all the pages of a block before it looks at its reads
+        atomic_inc(&ppn_block(sdk, ppn)->reads);
+        atomic_inc(&ppn_die(sdk, ppn)->reads);
+        smp_mb();
+        if (get_phys_ppn(sdk->gd, lpn, 0, err) == ppn)
+            return ppn;
+        ftl_read_put(sdk, ppn);
+    }
+}
+
+void ftl_read_put(struct ssd_disk * sdk, pfn_t ppn)
+{
+    struct ftl_block * blk = ppn_block(sdk, ppn);
+    struct ftl_die * die = ppn_die(sdk, ppn);
+
+    if (atomic_dec_and_test(&die->reads))
+        die_kick(die);
+    if (atomic_dec_and_test(&blk->reads) && ACCESS_ONCE(blk->state) == BLK_ERASE)
+        gc_kick(ppn_dev(sdk, ppn));
+}
+
+/*
+ * the unit at @ppn holds no mapped data any more, or one less of them if
+ * it is a packed page or a shared unit
+ */
+void ftl_invalidate_page(struct ssd_disk * sdk, pfn_t ppn)
+{
+    struct ftl_dev * dev;
+    unsigned long flags;
+    pfn_t * rmap;
+    u32 page;
+
+    if (!ppn || !sdk->vol)
+        return;
+
+    dev = ppn_dev(sdk, ppn);
+    page = PPN_PAGE(ppn);
+    rmap = page_rmap(dev, page);
+    spin_lock_irqsave(&dev->lock, flags);
+    if (*rmap == RMAP_PACKED && (-- dev->packs[page] & ~PACK_PAGE)) {
+        // others of its units are still mapped
+    } else if (*rmap == RMAP_SHARED && -- *page_refs(dev, page)) {
+        // and other lpns to the shared unit
+    } else if (*rmap != RMAP_INVALID) {
+        *rmap = RMAP_INVALID;
+        dev->blocks[page >> dev->geo.block_shift].valid --;
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/* host writes wait for gc, or are about to */
+static inline bool gc_urgent(struct ftl_dev * dev)
+{
+    return atomic_read(&dev->sdk->vol->stalled) || ACCESS_ONCE(dev->nr_free) <= GC_RESERVE_BLOCKS;
+}
+
+/*
+ * Before each unit it moves and each block it erases, gc lets the host
+ * reads on the die go first, for at most QOS_GC_SUSPEND, and keeps to
+ * the rate of its class, @pages at a time. When it is urgent it does
+ * neither.
+ */
+static void gc_yield(struct ftl_dev * dev, struct ftl_die * die, unsigned int pages)
+{
+    struct ssd_disk * sdk = dev->sdk;
+    unsigned long delay;
+
+    if (gc_urgent(dev))
+        return;
+
+    if (atomic_read(&die->reads)) {
+        ftl_stat_inc(sdk, FTL_STAT_GC_SUSPENDS);
+        wait_event_timeout(die->wait, !atomic_read(&die->reads) || gc_urgent(dev), QOS_GC_SUSPEND);
+    }
+    while ((delay = ftl_qos_take(sdk, IO_GC, pages)) && !gc_urgent(dev))
+        wait_event_timeout(sdk->qos.wait, gc_urgent(dev), delay);
+}
+
+/*
+ * The full block with the fewest valid units, if moving them frees
+ * anything. Blocks with programs in flight are left for later.
+ */
+static struct ftl_block * gc_pick_victim(struct ftl_dev * dev)
+{
+    struct ftl_block * blk, * victim = NULL;
+    unsigned long flags;
+    u32 i;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    for (i = 0; i < dev->nr_blocks; i++) {
+        blk = &dev->blocks[i];
+        if (blk->state != BLK_FULL || atomic_read(&blk->writes))
+            continue;
+        if (!victim || blk->valid < victim->valid)
+            victim = blk;
+        if (!victim->valid)
+            break;
+    }
+    if (victim && victim->valid >= block_units(dev))
+        victim = NULL;
+    if (victim) {
+        victim->state = BLK_GC;
+        trace_sftl_gc_victim(dev->sdk->gd->disk_name, dev->id, block_pbn(dev, victim),
+                victim->valid);
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    return victim;
+}
+
+/*
+ * A packed page is moved as it is, its units are remapped one by one.
+ * Those overwritten since are in its table as well, they do not count
+ * on the new page. Neither do those whose mapping page cannot be read,
+ * they stay on the old page and the error is returned.
+ */
+static int gc_remap_pack(struct ftl_dev * dev, pfn_t old, pfn_t ppn, const pfn_t * lpns,
+        unsigned int nr)
+{
+    struct ssd_disk * sdk = dev->sdk;
+    unsigned int i;
+    int err = 0;
+
+    for (i = 0; i < nr; i++) {
+        if (cmpxchg_phys_ppn(sdk->gd, lpns[i], old, ppn, &err) == old)
+            ftl_invalidate_page(sdk, old);
+        else
+            ftl_invalidate_page(sdk, ppn);
+    }
+    return err;
+}
+
+/*
+ * A shared unit is moved once for all its lpns, under the mutex of dedup
+ * so that none is added meanwhile. Those overwritten since do not count
+ * on the new unit and are dropped from its list. Those whose mapping
+ * page cannot be read stay on the old unit, which keeps a list of them.
+ */
+static int gc_remap_shared(struct ftl_dev * dev, pfn_t old, pfn_t ppn)
+{
+    struct ssd_disk * sdk = dev->sdk;
+    struct ftl_dedup * dd = sdk->vol->dedup;
+    struct dedup_unit * du, * left;
+    unsigned long flags;
+    unsigned int i, nr = 0, nr_left = 0;
+    pfn_t * lpns = NULL;
+    int err = 0, error;
+
+    mutex_lock(&dd->mutex);
+    du = dedup_find(dd, old);
+    if (!du) {
+        mutex_unlock(&dd->mutex);
+        printk(KERN_ERR "ftl: shared unit %x of %s has no lpns\n", old, sdk->gd->disk_name);
+        return -EIO;
+    }
+    spin_lock_irqsave(&dev->lock, flags);
+    *page_refs(dev, PPN_PAGE(ppn)) = du->nr;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    for (i = 0; i < du->nr; i++) {
+        error = 0;
+        if (cmpxchg_phys_ppn(sdk->gd, du->lpns[i], old, ppn, &error) == old) {
+            ftl_invalidate_page(sdk, old);
+            du->lpns[nr ++] = du->lpns[i];
+            continue;
+        }
+        ftl_invalidate_page(sdk, ppn);
+        if (!error)
+            continue;
+        err = error;
+        if (!lpns)
+            lpns = kmalloc(sizeof(pfn_t) * du->nr, GFP_NOIO);
+        if (lpns)
+            lpns[nr_left ++] = du->lpns[i];
+    }
+    du->nr = nr;
+    if (nr)
+        dedup_rehash(dd, du, ppn);
+    else
+        dedup_put(du);
+    if (nr_left && (left = dedup_get(dd, old, nr_left))) {
+        memcpy(left->lpns, lpns, sizeof(pfn_t) * nr_left);
+        left->nr = nr_left;
+    }
+    kfree(lpns);
+    mutex_unlock(&dd->mutex);
+    return err;
+}
+
+/* the unit at @old no lpn is mapped to is collected, its list goes if it was shared */
+static void gc_forget_shared(struct ftl_dev * dev, pfn_t old)
+{
+    struct ftl_dedup * dd = dev->sdk->vol->dedup;
+    struct dedup_unit * du;
+
+    mutex_lock(&dd->mutex);
+    du = dedup_find(dd, old);
+    if (du) {
+        du->nr = 0;
+        dedup_put(du);
+    }
+    mutex_unlock(&dd->mutex);
+}
+
+/* copy the unit at page @page of @dev to the gc frontier and remap it */
+static int gc_move_unit(struct ftl_dev * dev, u32 page)
+{
+    struct ssd_disk * sdk = dev->sdk;
+    pfn_t lpn, ppn, old = MAKE_PPN(dev->id, page);
+    pfn_t lpns[PACK_MAX_UNITS];
+    unsigned int nr = 0;
+    struct vol_io io;
+    unsigned long flags;
+    int err;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    lpn = *page_rmap(dev, page);
+    spin_unlock_irqrestore(&dev->lock, flags);
+    if (lpn == RMAP_INVALID) {
+        if (dev->refs)
+            gc_forget_shared(dev, old);
+        return 0;
+    }
+
+    gc_yield(dev, pbn_die(dev, page >> dev->geo.block_shift), unit_pages(dev));
+    vol_io_init(&io);
+    vol_io_submit(sdk, &io, READ, old, unit_pages(dev), dev->gc_buf);
+    err = vol_io_wait(&io);
+    if (err)
+        return err;
+    if (lpn == RMAP_PACKED && !(nr = pack_units(page_address(dev->gc_buf[0]), lpns)))
+        return -EIO;
+
+    ppn = dev_alloc(dev, lpn, true, pbn_die(dev, page >> dev->geo.block_shift)->id);
+    if (!ppn)
+        return -ENOSPC;
+    if (nr || lpn == RMAP_SHARED) {
+        spin_lock_irqsave(&dev->lock, flags);
+        if (nr)
+            dev->packs[PPN_PAGE(ppn)] = PACK_PAGE | nr;
+        else
+            *page_refs(dev, PPN_PAGE(ppn)) = 1;     // until its lpns are counted
+        spin_unlock_irqrestore(&dev->lock, flags);
+    }
+
+    die_get(ppn_die(sdk, ppn), gc_urgent(dev));
+    vol_io_init(&io);
+    vol_io_submit(sdk, &io, WRITE, ppn, unit_pages(dev), dev->gc_buf);
+    err = vol_io_wait(&io);
+    die_put(ppn_die(sdk, ppn));
+    ftl_write_done(sdk, ppn);
+    if (err) {
+        // a packed page goes with the last of its units
+        while (nr --)
+            ftl_invalidate_page(sdk, ppn);
+        ftl_invalidate_page(sdk, ppn);
+        return err;
+    }
+
+    // the host may have written the unit meanwhile, its data is newer
+    if (lpn == RMAP_PACKED) {
+        err = gc_remap_pack(dev, old, ppn, lpns, nr);
+    } else if (lpn == RMAP_SHARED) {
+        err = gc_remap_shared(dev, old, ppn);
+    } else if (cmpxchg_phys_ppn(sdk->gd, lpn, old, ppn, &err) == old) {
+        ftl_invalidate_page(sdk, old);
+    } else {
+        ftl_invalidate_page(sdk, ppn);
+        // the write of @lpn over the unit may still go back to it, see ftl_map_done
+        if (!err && unit_owned(sdk, old, lpn))
+            err = -EBUSY;
+    }
+    // what could not be remapped keeps the block from being erased
+    if (err)
+        return err;
+    // a duplicate written later finds the unit where it is now
+    if (dev->refs)
+        dedup_move(sdk->vol->dedup, dedup_fp(page_address(dev->gc_buf[0]), PHYS_PAGE_SIZE),
+                old, ppn, ppn_block(sdk, ppn)->erase_count);
+    ftl_stat_add(sdk, FTL_STAT_GC_COPIES, unit_pages(dev));
+    return 0;
+}
+
+/*
+ * Move the valid units out of @blk and queue it for erase. On an error
+ * the block goes back to the full ones, with what is left on it, so does
+ * it with -EBUSY after the others are moved if a unit was being written
+ * over.
+ */
+static int gc_collect(struct ftl_dev * dev, struct ftl_block * blk)
+{
+    u32 i, nr = block_units(dev), first = block_pbn(dev, blk) << dev->geo.block_shift;
+    const pfn_t * rmap = page_rmap(dev, first);
+    unsigned long flags;
+    bool busy = false;
+    int err = 0;
+
+    for (i = 0; i < nr && !err; i++) {
+        /*
+         * a unit invalidated since stays so and is skipped, unless it
+         * was shared and its lpns are still to be forgotten
+         */
+        if (!dev->refs) {
+            spin_lock_irqsave(&dev->lock, flags);
+            i += scan_run(rmap + i, nr - i, RMAP_INVALID);
+            spin_unlock_irqrestore(&dev->lock, flags);
+            if (i == nr)
+                break;
+        }
+        err = gc_move_unit(dev, first + (i << dev->sdk->unit_shift));
+        if (err == -EBUSY) {
+            busy = true;
+            err = 0;
+        }
+    }
+    if (!err && busy)
+        err = -EBUSY;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    if (err) {
+        blk->state = BLK_FULL;
+    } else {
+        blk->state = BLK_ERASE;
+        blk->sync = atomic64_read(&dev->sdk->gmt.syncs);
+        list_add_tail(&blk->list, &dev->erase);
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if (err && err != -ENOSPC && err != -EBUSY)
+        printk(KERN_ERR "ftl: gc of block %u on device %u of %s failed %d\n",
+                block_pbn(dev, blk), dev->id, dev->sdk->gd->disk_name, err);
+    return err;
+}
+
+/*
+ * Erase the moved blocks no read is left on, once the mapping that moved
+ * their units is on the flash: a sync started after they were queued has
+ * completed, see ftl_map_sync. One is started if @sync, if the device is
+ * short of free blocks, or if GC_SYNC_BLOCKS wait for it or enough to
+ * reach gc_high. A block that fails to erase is not used again.
+ */
+static void gc_erase_blocks(struct ftl_dev * dev, bool sync)
+{
+    struct ssd_disk * sdk = dev->sdk;
+    struct ftl_block * blk, * victim;
+    struct ftl_die * die;
+    unsigned long flags;
+    bool freed = false, synced = false;
+    u32 pbn, waiting;
+    u64 gen;
+    int err;
+
+    // the pages were remapped before the reads are looked at
+    smp_mb();
+    for (;;) {
+        victim = NULL;
+        waiting = 0;
+        gen = atomic64_read(&sdk->gmt.synced);
+        spin_lock_irqsave(&dev->lock, flags);
+        list_for_each_entry(blk, &dev->erase, list) {
+            if (blk->sync >= gen) {
+                waiting ++;
+            } else if (!atomic_read(&blk->reads)) {
+                victim = blk;
+                list_del_init(&blk->list);
+                break;
+            }
+        }
+        spin_unlock_irqrestore(&dev->lock, flags);
+        if (!victim) {
+            if (!waiting || synced || !(sync || gc_urgent(dev) || waiting >= GC_SYNC_BLOCKS ||
+                    dev->nr_free + waiting >= dev->gc_high))
+                break;
+            synced = true;
+            if (ftl_map_sync(sdk))
+                break;
+            continue;
+        }
+
+        pbn = block_pbn(dev, victim);
+        die = pbn_die(dev, pbn);
+        gc_yield(dev, die, 1);
+        die_get(die, gc_urgent(dev));
+        err = ftl_io_erase(sdk, MAKE_PPN(dev->id, pbn << dev->geo.block_shift), block_pages(dev));
+        die_put(die);
+        trace_sftl_gc_erase(sdk->gd->disk_name, dev->id, pbn, err);
+
+        spin_lock_irqsave(&dev->lock, flags);
+        if (err) {
+            victim->state = BLK_BAD;
+        } else {
+            victim->state = BLK_FREE;
+            victim->valid = 0;
+            victim->next = 0;
+            victim->erase_count ++;
+            list_add_tail(&victim->list, &pbn_plane(dev, pbn)->free);
+            dev->nr_free ++;
+        }
+        spin_unlock_irqrestore(&dev->lock, flags);
+
+        if (err) {
+            printk(KERN_ERR "ftl: cannot erase block %u on device %u of %s, error %d\n",
+                    pbn, dev->id, sdk->gd->disk_name, err);
+            continue;
+        }
+        ftl_stat_inc(sdk, FTL_STAT_GC_ERASES);
+        freed = true;
+    }
+
+    if (freed)
+        wake_up_all(&sdk->vol->free_wait);
+}
+
+/* collect until the device has gc_high free blocks, or nothing to gain */
+static void gc_work(struct work_struct * work)
+{
+    struct ftl_dev * dev = container_of(work, struct ftl_dev, gc_work);
+    struct ftl_block * blk;
+
+    gc_erase_blocks(dev, false);
+    while (dev->nr_free < dev->gc_high) {
+        blk = gc_pick_victim(dev);
+        if (!blk || gc_collect(dev, blk)) {
+            // nothing more to move, what was is erased now
+            gc_erase_blocks(dev, true);
+            break;
+        }
+        gc_erase_blocks(dev, false);
+    }
+}
+
+/* flush the write caches of all the devices, in parallel */
+int ftl_vol_flush(struct ssd_disk * sdk)
+{
+    struct vol_io io;
+    unsigned int i;
+
+    vol_io_init(&io);
+    for (i = 0; i < sdk->vol->nr_devs; i++)
+        vol_io_submit(sdk, &io, WRITE | REQ_FLUSH, MAKE_PPN(i, 0), 0, NULL);
+    return vol_io_wait(&io);
+}
+
+/*
+ * stop the garbage collection and wait for what is queued on every device,
+ * gc kicks itself as it opens blocks. With the host io stopped the mapping
+ * stays as it is, a host write would wait for a free block for ever.
+ */
+void ftl_vol_quiesce(struct ssd_disk * sdk)
+{
+    unsigned int i;
+
+    sdk->vol->quiesced = true;
+    smp_mb();
+    for (i = 0; i < sdk->vol->nr_devs; i++)
+        flush_workqueue(sdk->vol->devs[i].gc_wq);
+}
+
+/* let gc go on after ftl_vol_quiesce, the volume is not removed after all */
+void ftl_vol_resume(struct ssd_disk * sdk)
+{
+    unsigned int i;
+
+    sdk->vol->quiesced = false;
+    smp_mb();
+    for (i = 0; i < sdk->vol->nr_devs; i++)
+        gc_kick(&sdk->vol->devs[i]);
+}
+
+/*
+ * Account unit @lpn at @ppn, from the mapping saved by the volume, before
+ * the disk is added. A unit outside the blocks the volume writes or found
+ * twice is an error.
+ */
+int ftl_vol_restore(struct ssd_disk * sdk, pfn_t lpn, pfn_t ppn)
+{
+    struct ftl_dev * dev;
+    struct ftl_block * blk;
+    pfn_t * rmap;
+    u32 page = PPN_PAGE(ppn);
+
+    if (PPN_DEV(ppn) >= sdk->vol->nr_devs)
+        return -EINVAL;
+    dev = ppn_dev(sdk, ppn);
+    if (page >= dev->nr_blocks << dev->geo.block_shift || (page & (unit_pages(dev) - 1)))
+        return -EINVAL;
+
+    blk = ppn_block(sdk, ppn);
+    rmap = page_rmap(dev, page);
+    if (blk->state != BLK_FREE || *rmap != RMAP_INVALID)
+        return -EINVAL;
+    *rmap = lpn;
+    blk->valid ++;
+    return 0;
+}
+
+/*
+ * The mapping has been restored: the blocks with units are full, and the
+ * others are erased, which of them were written is not kept. Neither are
+ * the erase counts.
+ */
+int ftl_vol_restored(struct ssd_disk * sdk)
+{
+    struct ftl_dev * dev;
+    struct ftl_block * blk;
+    unsigned int i;
+    u32 pbn;
+    int err;
+
+    for (i = 0; i < sdk->vol->nr_devs; i++) {
+        dev = &sdk->vol->devs[i];
+        for (pbn = 0; pbn < dev->nr_blocks; pbn++) {
+            blk = &dev->blocks[pbn];
+            if (blk->state != BLK_FREE)
+                continue;
+            if (blk->valid) {
+                list_del_init(&blk->list);
+                dev->nr_free --;
+                blk->state = BLK_FULL;
+                blk->next = block_pages(dev);
+                continue;
+            }
+            err = ftl_io_erase(sdk, MAKE_PPN(dev->id, pbn << dev->geo.block_shift),
+                    block_pages(dev));
+            if (err) {
+                printk(KERN_ERR "ftl: cannot erase block %u on device %u of %s, error %d\n",
+                        pbn, dev->id, sdk->gd->disk_name, err);
+                return err;
+            }
+        }
+    }
+    return 0;
+}
+
+static u32 vol_label_crc(const struct ftl_label * l)
+{
+    return ~crc32c(~0, &l->id, sizeof(struct ftl_label) - offsetof(struct ftl_label, id));
+}
+
+/* the label device @dev of volume @id has */
+static void vol_label(struct ftl_dev * dev, u64 id, struct ftl_label * l)
+{
+    memset(l, 0, sizeof(struct ftl_label));
+    l->magic = VOL_LABEL_MAGIC;
+    l->id = id;
+    l->dev = dev->id;
+    l->nr_devs = dev->sdk->vol->nr_devs;
+    l->nr_blocks = dev->nr_blocks;
+    l->unit_shift = dev->sdk->unit_shift;
+    l->block_shift = dev->geo.block_shift;
+    l->nr_channels = dev->geo.nr_channels;
+    l->nr_dies = dev->geo.nr_dies;
+    l->nr_planes = dev->geo.nr_planes;
+    l->modes = dev->sdk->vol->modes;
+    l->crc = vol_label_crc(l);
+}
+
+/* read or write the first page of every device, HW_TO_MEM_PAGE of @pages each */
+static int vol_label_io(struct ssd_disk * sdk, int rw, struct page ** pages)
+{
+    struct vol_io io;
+    unsigned int i;
+
+    vol_io_init(&io);
+    for (i = 0; i < sdk->vol->nr_devs; i++)
+        vol_io_submit(sdk, &io, rw, MAKE_PPN(i, 0), 1, &pages[i * HW_TO_MEM_PAGE]);
+    return vol_io_wait(&io);
+}
+
+/*
+ * Check the labels of the devices of @sdk, see struct ftl_label. *@blank
+ * is set if none has a label, the volume is new then. A device with a bad
+ * label, or that does not match the others or the volume being attached,
+ * fails it: a label is only written on a volume made from blank devices.
+ */
+static int vol_check_labels(struct ssd_disk * sdk, struct page ** pages, bool * blank)
+{
+    struct ftl_volume * vol = sdk->vol;
+    struct ftl_label * l, want;
+    unsigned int i, nr = 0;
+    int err;
+
+    err = vol_label_io(sdk, READ, pages);
+    if (err) {
+        printk(KERN_ERR "ftl: cannot read the labels of %s, error %d\n", sdk->gd->disk_name, err);
+        return err;
+    }
+
+    for (i = 0; i < vol->nr_devs; i++) {
+        l = page_address(pages[i * HW_TO_MEM_PAGE]);
+        if (l->magic != VOL_LABEL_MAGIC)
+            continue;
+        if (l->crc != vol_label_crc(l)) {
+            printk(KERN_ERR "ftl: device %u of %s has a bad label\n", i, sdk->gd->disk_name);
+            return -EIO;
+        }
+        nr ++;
+    }
+    *blank = !nr;
+    if (*blank)
+        return 0;
+
+    // the volume keeps the mapping unit it was made with
+    l = page_address(pages[0]);
+    if (l->magic == VOL_LABEL_MAGIC && l->unit_shift != sdk->unit_shift &&
+            l->unit_shift <= UNIT_MAX_SHIFT) {
+        printk(KERN_INFO "ftl: %s keeps its mapping units of %u pages\n", sdk->gd->disk_name,
+                1U << l->unit_shift);
+        sdk->unit_shift = l->unit_shift;
+    }
+
+    // nothing of these is saved, the volume would come back without its data
+    l = page_address(pages[0]);
+    if (l->magic == VOL_LABEL_MAGIC && l->modes) {
+        printk(KERN_ERR "ftl: %s was made with block mapping, packing or dedup, "
+                "it cannot be attached again\n", sdk->gd->disk_name);
+        return -EINVAL;
+    }
+    if (l->magic == VOL_LABEL_MAGIC && vol->modes) {
+        printk(KERN_ERR "ftl: %s was made without block mapping, packing or dedup, "
+                "it cannot be attached with them\n", sdk->gd->disk_name);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < vol->nr_devs; i++) {
+        l = page_address(pages[i * HW_TO_MEM_PAGE]);
+        vol_label(&vol->devs[i], ((struct ftl_label *)page_address(pages[0]))->id, &want);
+        if (l->magic != VOL_LABEL_MAGIC || l->id != want.id) {
+            printk(KERN_ERR "ftl: device %u of %s is not part of its volume\n", i,
+                    sdk->gd->disk_name);
+            return -EINVAL;
+        }
+        if (l->dev != i || l->nr_devs != want.nr_devs) {
+            printk(KERN_ERR "ftl: device %u of %s is device %u of %u of its volume\n", i,
+                    sdk->gd->disk_name, l->dev, l->nr_devs);
+            return -EINVAL;
+        }
+        if (memcmp(l, &want, sizeof(struct ftl_label))) {
+            printk(KERN_ERR "ftl: device %u of %s was made with %u blocks of %u pages, "
+                    "%u channels %u dies %u planes, units of %u pages\n", i, sdk->gd->disk_name,
+                    l->nr_blocks, 1U << l->block_shift, l->nr_channels, l->nr_dies,
+                    l->nr_planes, 1U << l->unit_shift);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/* label the blank devices of @sdk as a new volume */
+static int vol_write_labels(struct ssd_disk * sdk, struct page ** pages)
+{
+    struct ftl_volume * vol = sdk->vol;
+    unsigned int i, j;
+    u64 id;
+    int err;
+
+    get_random_bytes(&id, sizeof(id));
+    for (i = 0; i < vol->nr_devs; i++) {
+        err = ftl_io_erase(sdk, MAKE_PPN(i, 0), block_pages(&vol->devs[i]));
+        if (err)
+            return err;
+        for (j = 0; j < HW_TO_MEM_PAGE; j++)
+            memset(page_address(pages[i * HW_TO_MEM_PAGE + j]), 0, MEM_PAGE_SIZE);
+        vol_label(&vol->devs[i], id, page_address(pages[i * HW_TO_MEM_PAGE]));
+    }
+    err = vol_label_io(sdk, WRITE, pages);
+    if (!err)
+        err = ftl_vol_flush(sdk);
+    return err;
+}
+
+static int vol_init_dev(struct ftl_dev * dev)
+{
+    struct ftl_block * blk;
+    struct ftl_die * die;
+    unsigned int p;
+    u32 i, spare, meta = 0;
+
+    // every device keeps its first block for its label
+    meta = dev->id ? 1 : dev->sdk->vol->meta_pages >> dev->geo.block_shift;
+    if (meta >= dev->nr_blocks) {
+        printk(KERN_ERR "ftl: device %u of %s is too small, %u blocks\n", dev->id,
+                dev->sdk->gd->disk_name, dev->nr_blocks);
+        return -EINVAL;
+    }
+
+    dev->node = ftl_io_node(dev->bdev);
+    dev->blocks = vzalloc_node(sizeof(struct ftl_block) * dev->nr_blocks, dev->node);
+    dev->rmap = vmalloc_node(sizeof(pfn_t) * dev->nr_blocks * block_units(dev), dev->node);
+    dev->dies = kzalloc_node(sizeof(struct ftl_die) * dev->nr_dies, GFP_KERNEL, dev->node);
+    if (!dev->blocks || !dev->rmap || !dev->dies)
+        return -ENOMEM;
+    memset(dev->rmap, 0xff, sizeof(pfn_t) * dev->nr_blocks * block_units(dev));
+
+    for (i = 0; i < dev->nr_dies; i++) {
+        die = &dev->dies[i];
+        die->dev = dev;
+        die->id = i;
+        for (p = 0; p < GEO_MAX_PLANES; p++)
+            INIT_LIST_HEAD(&die->planes[p].free);
+        spin_lock_init(&die->lock);
+        atomic_set(&die->reads, 0);
+        bio_list_init(&die->queue);
+        init_waitqueue_head(&die->wait);
+        INIT_WORK(&die->work, die_dispatch);
+    }
+
+    for (i = 0; i < HW_TO_MEM_PAGE << dev->sdk->unit_shift; i++) {
+        dev->gc_buf[i] = alloc_pages_node(dev->node, GFP_KERNEL, 0);
+        if (!dev->gc_buf[i])
+            return -ENOMEM;
+    }
+
+    // one worker per device, the devices collect in parallel
+    dev->gc_wq = alloc_workqueue("ss_gc", WQ_NON_REENTRANT | WQ_MEM_RECLAIM, 1);
+    if (!dev->gc_wq)
+        return -ENOMEM;
+
+    for (i = 0; i < dev->nr_blocks; i++) {
+        blk = &dev->blocks[i];
+        INIT_LIST_HEAD(&blk->list);
+        atomic_set(&blk->writes, 0);
+        atomic_set(&blk->reads, 0);
+        // ppn 0 is an unmapped page, the first block of a device holds its
+        // label and the next ones of the first device keep the mapping
+        if (i < meta) {
+            blk->state = BLK_BAD;
+            continue;
+        }
+        blk->state = BLK_FREE;
+        list_add_tail(&blk->list, &pbn_plane(dev, i)->free);
+        dev->nr_free ++;
+    }
+
+    dev->gc_low = max_t(u32, dev->nr_blocks * GC_LOW_PERCENT / 100, GC_RESERVE_BLOCKS + 2);
+    dev->gc_high = max_t(u32, dev->nr_blocks * GC_HIGH_PERCENT / 100, dev->gc_low + 2);
+
+    // the spare blocks have to hold the free ones gc keeps and the frontiers
+    spare = dev->nr_free - dev->nr_free * (100 - VOL_OP_PERCENT) / 100;
+    if (spare < dev->gc_high + 2 * dev->nr_dies * dev->geo.nr_planes) {
+        printk(KERN_ERR "ftl: device %u of %s is too small, %u blocks\n", dev->id,
+                dev->sdk->gd->disk_name, dev->nr_blocks);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void free_label_pages(struct page ** pages, unsigned int nr_devs)
+{
+    unsigned int i;
+
+    for (i = 0; pages && i < nr_devs * HW_TO_MEM_PAGE; i++) {
+        if (pages[i])
+            __free_page(pages[i]);
+    }
+    kfree(pages);
+}
+
+/*
+ * Stripe @sdk over the @nr_devs devices in @bdevs, of @nr_pages flash
+ * pages each and all of geometry @geo. VOL_OP_PERCENT of every device is
+ * kept for garbage collection, the rest is the capacity of the disk, in
+ * mapping units of sdk->unit_shift that have to fit in a block. The
+ * devices are labelled as a volume if they are blank, or have to carry
+ * the labels of this one, see struct ftl_label, and sdk->unit_shift is
+ * then set to the unit the volume was made with. It maps with the VOL_*
+ * of @modes besides its pages.
+ */
+int ftl_vol_init(struct ssd_disk * sdk, struct block_device ** bdevs, u64 * nr_pages,
+        unsigned int nr_devs, const struct ftl_geo * geo, unsigned int modes)
+{
+    struct ftl_volume * vol;
+    struct ftl_dev * dev;
+    struct page ** labels = NULL;
+    u64 nr_lpns = 0;
+    u32 nr_maps, nr_dir, slot;
+    unsigned int i;
+    bool blank;
+    int err;
+
+    if (!nr_devs || nr_devs > VOL_MAX_DEVS)
+        return -EINVAL;
+    if (!geo->nr_channels || !geo->nr_dies || !geo->nr_planes || geo->nr_planes > GEO_MAX_PLANES ||
+            geo->block_shift > GEO_MAX_BLOCK_SHIFT) {
+        printk(KERN_ERR "ftl: bad geometry of %s, %u channels %u dies %u planes %u pages\n",
+                sdk->gd->disk_name, geo->nr_channels, geo->nr_dies, geo->nr_planes,
+                1U << geo->block_shift);
+        return -EINVAL;
+    }
+
+    vol = kzalloc(sizeof(struct ftl_volume) + sizeof(struct ftl_dev) * nr_devs, GFP_KERNEL);
+    if (!vol)
+        return -ENOMEM;
+
+    vol->nr_devs = nr_devs;
+    vol->modes = modes;
+    atomic_set(&vol->next, 0);
+    init_waitqueue_head(&vol->free_wait);
+    atomic_set(&vol->stalled, 0);
+    sdk->vol = vol;
+
+    vol->wq = alloc_workqueue("ss_dispatch", WQ_NON_REENTRANT | WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+    if (!vol->wq) {
+        err = -ENOMEM;
+        goto err_out;
+    }
+
+    for (i = 0; i < nr_devs; i++) {
+        dev = &vol->devs[i];
+        dev->sdk = sdk;
+        dev->bdev = bdevs[i];
+        dev->id = i;
+        dev->geo = *geo;
+        dev->nr_blocks = min_t(u64, nr_pages[i], PPN_PAGE_MASK + 1ULL) >> geo->block_shift;
+        dev->nr_dies = geo->nr_channels * geo->nr_dies;
+        spin_lock_init(&dev->lock);
+        INIT_LIST_HEAD(&dev->erase);
+        INIT_WORK(&dev->gc_work, gc_work);
+    }
+
+    labels = kzalloc(sizeof(struct page *) * nr_devs * HW_TO_MEM_PAGE, GFP_KERNEL);
+    if (!labels) {
+        err = -ENOMEM;
+        goto err_out;
+    }
+    for (i = 0; i < nr_devs * HW_TO_MEM_PAGE; i++) {
+        labels[i] = alloc_page(GFP_KERNEL);
+        if (!labels[i]) {
+            err = -ENOMEM;
+            goto err_out;
+        }
+    }
+    err = vol_check_labels(sdk, labels, &blank);
+    if (err)
+        goto err_out;
+    if (geo->block_shift < sdk->unit_shift) {
+        printk(KERN_ERR "ftl: units of %u pages do not fit in the blocks of %s\n",
+                1U << sdk->unit_shift, sdk->gd->disk_name);
+        err = -EINVAL;
+        goto err_out;
+    }
+
+    // the label block, then the slots of the mapping of as many units as the devices hold
+    for (i = 0; i < nr_devs; i++)
+        nr_lpns += min_t(u64, nr_pages[i], PPN_PAGE_MASK + 1ULL) >> sdk->unit_shift;
+    nr_lpns = min_t(u64, nr_lpns, RMAP_SHARED);
+    nr_maps = (nr_lpns + MDIR_ENTRIES - 1) >> MDIR_SHIFT;
+    nr_dir = (nr_lpns + GMD_PAGE_LPNS - 1) >> GMD_PAGE_LPN_SHIFT;
+    slot = DIV_ROUND_UP(nr_dir + nr_maps, (u32)MAP_HDRS_PER_PAGE) + nr_dir + nr_maps +
+            MAP_LOG_PAGES(nr_maps);
+    vol->meta_pages = (MAP_SLOTS * DIV_ROUND_UP(slot, 1U << geo->block_shift) + 1) <<
+            geo->block_shift;
+    nr_lpns = 0;
+
+    for (i = 0; i < nr_devs; i++) {
+        dev = &vol->devs[i];
+        err = vol_init_dev(dev);
+        if (err)
+            goto err_out;
+        nr_lpns += (u64)dev->nr_free * (100 - VOL_OP_PERCENT) / 100 * block_units(dev);
+    }
+
+    // an lpn is a pfn_t and RMAP_INVALID, RMAP_PACKED and RMAP_SHARED are not
+    nr_lpns = min_t(u64, nr_lpns, RMAP_SHARED);
+    sdk->capacity = lpn_to_sector(sdk, nr_lpns);
+
+    if (modes & VOL_BMAP)
+        err = ftl_bmap_init(sdk);
+    if (!err && (modes & VOL_PACK))
+        err = ftl_pack_init(sdk);
+    if (!err && (modes & VOL_DEDUP))
+        err = ftl_dedup_init(sdk);
+    if (err)
+        goto err_out;
+
+    // labelled last, devices a volume could not be made on stay blank
+    if (blank) {
+        err = vol_write_labels(sdk, labels);
+        if (err) {
+            printk(KERN_ERR "ftl: cannot label the devices of %s, error %d\n",
+                    sdk->gd->disk_name, err);
+            goto err_out;
+        }
+    }
+    free_label_pages(labels, nr_devs);
+    return 0;
+
+err_out:
+    free_label_pages(labels, nr_devs);
+    ftl_vol_exit(sdk);
+    return err;
+}
+
+/* map the logical blocks of volume @sdk written in order as a whole, see struct ftl_bmap */
+int ftl_bmap_init(struct ssd_disk * sdk)
+{
+    struct ftl_volume * vol = sdk->vol;
+    struct ftl_bmap * bm;
+    unsigned int i;
+
+    bm = kzalloc_node(sizeof(struct ftl_bmap), GFP_KERNEL, sdk->node);
+    if (!bm)
+        return -ENOMEM;
+    // a partial logical block at the end stays page mapped
+    bm->shift = vol->devs[0].geo.block_shift - sdk->unit_shift;
+    bm->nr_lbns = sector_to_lpn(sdk, sdk->capacity) >> bm->shift;
+    bm->ents = vzalloc_node(sizeof(struct ftl_bmap_entry) * max_t(u32, bm->nr_lbns, 1), sdk->node);
+    if (!bm->ents) {
+        kfree(bm);
+        return -ENOMEM;
+    }
+    spin_lock_init(&bm->lock);
+    for (i = 0; i < BMAP_LOGS; i++) {
+        bm->logs[i].lbn = BMAP_NO_LOG;
+        bm->streams[i].lbn = BMAP_NO_LOG;
+    }
+    for (i = 0; i < BMAP_LOCKS; i++)
+        mutex_init(&bm->locks[i]);
+    vol->bmap = bm;
+    return 0;
+}
+
+/* let volume @sdk pack compressed units into its pages, see pack.h */
+int ftl_pack_init(struct ssd_disk * sdk)
+{
+    struct ftl_dev * dev;
+    unsigned int i;
+
+    // a packed unit is a flash page, in one memory page
+    if (sdk->unit_shift || HW_TO_MEM_PAGE != 1) {
+        printk(KERN_ERR "ftl: %s cannot pack units of %u pages\n", sdk->gd->disk_name,
+                1U << sdk->unit_shift);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < sdk->vol->nr_devs; i++) {
+        dev = &sdk->vol->devs[i];
+        dev->packs = vzalloc_node(dev->nr_blocks * block_pages(dev), dev->node);
+        if (!dev->packs)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+/* let volume @sdk share the units written with the same data, see dedup.h */
+int ftl_dedup_init(struct ssd_disk * sdk)
+{
+    struct ftl_volume * vol = sdk->vol;
+    struct ftl_dev * dev;
+    unsigned int i;
+
+    // a shared unit is a flash page in one memory page, its data as it is
+    if (sdk->unit_shift || HW_TO_MEM_PAGE != 1 || vol->devs[0].packs) {
+        printk(KERN_ERR "ftl: %s cannot share units of %u pages%s\n", sdk->gd->disk_name,
+                1U << sdk->unit_shift, vol->devs[0].packs ? " packed" : "");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < vol->nr_devs; i++) {
+        dev = &vol->devs[i];
+        dev->refs = vzalloc_node(sizeof(u16) * dev->nr_blocks * block_units(dev), dev->node);
+        if (!dev->refs)
+            return -ENOMEM;
+    }
+    vol->dedup = dedup_alloc(sector_to_lpn(sdk, sdk->capacity), sdk->node);
+    return vol->dedup ? 0 : -ENOMEM;
+}
+
+void ftl_vol_exit(struct ssd_disk * sdk)
+{
+    struct ftl_volume * vol = sdk->vol;
+    struct ftl_dev * dev;
+    unsigned int i, j;
+
+    if (!vol)
+        return;
+
+    if (vol->wq)
+        destroy_workqueue(vol->wq);
+    for (i = 0; i < vol->nr_devs; i++) {
+        dev = &vol->devs[i];
+        if (dev->gc_wq)
+            destroy_workqueue(dev->gc_wq);
+        for (j = 0; j < ARRAY_SIZE(dev->gc_buf); j++) {
+            if (dev->gc_buf[j])
+                __free_page(dev->gc_buf[j]);
+        }
+        if (dev->rmap)
+            vfree(dev->rmap);
+        if (dev->packs)
+            vfree(dev->packs);
+        if (dev->refs)
+            vfree(dev->refs);
+        if (dev->blocks)
+            vfree(dev->blocks);
+        kfree(dev->dies);
+    }
+    if (vol->bmap) {
+        vfree(vol->bmap->ents);
+        kfree(vol->bmap);
+    }
+    if (vol->dedup)
+        dedup_free(vol->dedup);
+
+    sdk->vol = NULL;
+    kfree(vol);
+}
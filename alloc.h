@@ -0,0 +1,282 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  alloc.h
+ *
+ *    Description:  header for alloc.c, out of place page allocation and
+ *                  garbage collection on the flash devices of a volume
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#define VOL_MAX_DEVS        (1 << PPN_DEV_BITS)
+#define VOL_OP_PERCENT      10      /* blocks of every device kept out of the capacity */
+#define GC_RESERVE_BLOCKS   2       /* free blocks left to garbage collection only */
+#define GC_SYNC_BLOCKS      8       /* moved blocks that wait for a mapping sync at most */
+#define GC_LOW_PERCENT      2       /* free blocks below which gc starts */
+#define GC_HIGH_PERCENT     4       /* and above which it stops */
+#define RMAP_INVALID        ((pfn_t)~0)
+#define RMAP_PACKED         ((pfn_t)~1)     /* the unit is a page of packed units, see pack.h */
+#define RMAP_SHARED         ((pfn_t)~2)     /* several lpns are mapped to the unit, see dedup.h */
+#define PACK_PAGE           0x80    /* of dev->packs, with the units still mapped below */
+#define GEO_MAX_PLANES      4
+#define GEO_MAX_BLOCK_SHIFT 15      /* pages of a block are counted in a u16 */
+#define DIE_QUEUE_DEPTH     2       /* programs and erases given to an idle die at once */
+#define BMAP_LOGS           8       /* logical blocks written in order at once */
+#define BMAP_LOCKS          64      /* of the logical blocks, by lbn */
+#define BMAP_NO_LOG         ((pfn_t)~0)
+
+/*
+ * The geometry of a flash device behind a linear block device. Blocks
+ * are laid out die after die, the dies channel after channel, then plane
+ * after plane: block pbn is on die pbn % dies, counted with the channel
+ * first, and on plane (pbn / dies) % planes. Consecutive blocks are so
+ * on different channels, as open-channel devices number them.
+ */
+struct ftl_geo {
+    unsigned int nr_channels;
+    unsigned int nr_dies;           // per channel
+    unsigned int nr_planes;         // per die
+    unsigned int block_shift;       // pages of an erase block, log2
+};
+
+#define GEO_DEFAULT { \
+    .nr_channels = 1, \
+    .nr_dies = 1, \
+    .nr_planes = 1, \
+    .block_shift = PAGE_NUM_BLOCK_SHIFT, \
+}
+
+enum {
+    BLK_FREE,
+    BLK_OPEN,           // a write frontier
+    BLK_FULL,
+    BLK_GC,             // its valid pages are being moved
+    BLK_ERASE,          // moved, erased once the reads still on it are done
+    BLK_BAD,            // failed to erase, or reserved
+};
+
+struct ftl_block {
+    struct list_head list;  // free or erase list of the device
+    u16 valid;              // units still mapped
+    u16 next;               // next page to allocate
+    u8 state;
+    u32 erase_count;
+    atomic_t writes;        // programs in flight
+    atomic_t reads;         // host reads in flight
+    u64 sync;               // mapping syncs started when it was queued for erase
+};
+
+struct ftl_plane {
+    struct list_head free;      // erased blocks, the least recently erased first
+    struct ftl_block * host;    // write frontier of host data
+    struct ftl_block * gc;      // and of the pages moved by gc
+};
+
+/*
+ * A die programs one page at a time and a read waits behind whatever it
+ * was given before. Programs and erases go to it through its dispatcher:
+ * DIE_QUEUE_DEPTH at once, one while reads are on it, and the rest wait
+ * in order, host programs on @queue before gc on @wait. Reads are never
+ * held back.
+ */
+struct ftl_die {
+    struct ftl_dev * dev;
+    unsigned int id;
+    struct ftl_plane planes[GEO_MAX_PLANES];
+    unsigned int next[2];       // plane of the next host and gc page
+    spinlock_t lock;            // of the dispatcher
+    unsigned int busy;          // programs and erases at the device
+    atomic_t reads;             // reads at the device
+    struct bio_list queue;      // host programs waiting for the die
+    wait_queue_head_t wait;     // gc waiting for the die
+    struct work_struct work;
+};
+
+struct ftl_dev {
+    struct ssd_disk * sdk;
+    struct block_device * bdev;
+    unsigned int id;
+    int node;               // numa node of the device, its tables are there
+    struct ftl_geo geo;
+    u32 nr_blocks;
+    struct ftl_block * blocks;
+    pfn_t * rmap;           // lpn of each unit, RMAP_INVALID if it holds none
+    u8 * packs;             // of each page, PACK_PAGE if packed, NULL if none is
+    u16 * refs;             // lpns mapped to each unit if it is shared, NULL if none is
+    unsigned int nr_dies;   // of all channels
+    struct ftl_die * dies;
+    unsigned int next_die;  // of the next host page
+    spinlock_t lock;        // of the blocks, the planes and the rmap
+    struct list_head erase; // moved blocks waiting for their reads
+    u32 nr_free;
+    u32 gc_low, gc_high;
+    struct page * gc_buf[HW_TO_MEM_PAGE << UNIT_MAX_SHIFT];   // a unit
+    struct workqueue_struct * gc_wq;
+    struct work_struct gc_work;
+};
+
+/*
+ * Hybrid mapping of a volume. A logical block, the units an erase block
+ * holds, can be mapped by a single entry instead of the mapping pages. A
+ * write of its first unit opens a sequential log block for it if a
+ * stream has written the previous logical block from start to end, or
+ * if there is a data block to replace. The following units go to the log
+ * as long as they come in order, each one superseding its unit of the
+ * data block, and the full log becomes the data block (a switch merge).
+ * Any other write to the logical block, a partial discard or its log
+ * being given up for a newer stream puts its units back into the page
+ * map (a break), from then on they are written out of place like the
+ * rest and gc collects them.
+ */
+struct ftl_bmap_entry {
+    pfn_t data;         // first page of its data block, 0 if it has none
+    pfn_t log;          // and of its open log
+    u32 filled;         // units in the log, in order
+};
+
+struct ftl_seq_log {
+    pfn_t lbn;              // BMAP_NO_LOG if the slot is free
+    unsigned long last;     // jiffies of its last write
+};
+
+enum {
+    STREAM_NEAR,        // a write ended the logical block before
+    STREAM_IN,          // and went on into this one
+    STREAM_SURE,        // a stream wrote all of the one before
+};
+
+/* a logical block a stream may be writing */
+struct ftl_stream {
+    pfn_t lbn;              // BMAP_NO_LOG if the slot is free
+    unsigned int state;
+};
+
+struct ftl_bmap {
+    u32 nr_lbns;
+    unsigned int shift;     // units of a logical block, log2
+    struct ftl_bmap_entry * ents;
+    spinlock_t lock;        // of the logs and the streams
+    struct ftl_seq_log logs[BMAP_LOGS];
+    struct ftl_stream streams[BMAP_LOGS];
+    unsigned int next_stream;
+    struct mutex locks[BMAP_LOCKS];
+};
+
+struct ftl_dedup;
+
+#define VOL_LABEL_MAGIC     0x4c4f5653      /* "SVOL" */
+
+/* what a volume maps with besides its pages, its state is not saved */
+#define VOL_BMAP            0x1     /* blocks written in order as a whole */
+#define VOL_PACK            0x2     /* units packed compressed */
+#define VOL_DEDUP           0x4     /* units shared by their data */
+
+/*
+ * The format of a volume, in the first page of every one of its devices,
+ * their first block is kept for it. A volume is attached again only to
+ * the devices it was made of, in the same order, of the same size and
+ * with the same geometry and mapping unit. One made with any of VOL_BMAP,
+ * VOL_PACK or VOL_DEDUP is not attached again, its mapping is lost when
+ * it goes, and one made without them is not attached with them.
+ */
+struct ftl_label {
+    u32 magic;
+    u32 crc;                // crc32c of the label from @id on
+    u64 id;                 // of the volume, the same on all of its devices
+    u32 dev;                // index of the device in the volume
+    u32 nr_devs;
+    u32 nr_blocks;          // of the device
+    u32 unit_shift;
+    u32 block_shift;
+    u32 nr_channels;
+    u32 nr_dies;
+    u32 nr_planes;
+    u32 modes;              // VOL_* it was made with
+};
+
+/*
+ * Several flash devices as one disk. Host pages go round robin over the
+ * devices and within each over its dies and planes, every plane with its
+ * own write frontier, and every device collects its garbage with its own
+ * worker.
+ */
+struct ftl_volume {
+    unsigned int nr_devs;
+    atomic_t next;              // device of the next host page
+    wait_queue_head_t free_wait;    // host writes waiting for a free block
+    atomic_t stalled;               // how many, gc does not yield to reads then
+    struct workqueue_struct * wq;   // dispatchers of the dies
+    struct ftl_bmap * bmap;         // NULL if every unit is page mapped
+    struct ftl_dedup * dedup;       // NULL if units are not shared
+    u32 meta_pages;                 // at the start of device 0, its label then the mapping slots
+    unsigned int modes;             // VOL_*
+    bool quiesced;                  // gc is not queued any more, the volume is going away
+    struct ftl_dev devs[0];
+};
+
+static inline struct block_device * ppn_bdev(struct ssd_disk * sdk, pfn_t ppn)
+{
+    return sdk->vol ? sdk->vol->devs[PPN_DEV(ppn)].bdev : sdk->bdev;
+}
+
+static inline sector_t ppn_sector(struct ssd_disk * sdk, pfn_t ppn)
+{
+    return PAGE_TO_SECTOR((sector_t)(sdk->vol ? PPN_PAGE(ppn) : ppn));
+}
+
+/*
+ * whether the page at @ppn of a volume is packed. It is set when the page
+ * is allocated, a read holding the page finds it unchanged.
+ */
+static inline bool ppn_packed(struct ssd_disk * sdk, pfn_t ppn)
+{
+    struct ftl_dev * dev;
+
+    if (!sdk->vol)
+        return false;
+    dev = &sdk->vol->devs[PPN_DEV(ppn)];
+    return dev->packs && (ACCESS_ONCE(dev->packs[PPN_PAGE(ppn)]) & PACK_PAGE);
+}
+
+/* a disk written in place keeps unit @lpn at its own first page */
+static inline pfn_t inplace_ppn(struct ssd_disk * sdk, pfn_t lpn)
+{
+    return lpn << sdk->unit_shift;
+}
+
+extern int ftl_vol_init(struct ssd_disk * sdk, struct block_device ** bdevs, u64 * nr_pages,
+        unsigned int nr_devs, const struct ftl_geo * geo, unsigned int modes);
+extern void ftl_vol_exit(struct ssd_disk * sdk);
+extern int ftl_vol_flush(struct ssd_disk * sdk);
+extern void ftl_vol_quiesce(struct ssd_disk * sdk);
+extern void ftl_vol_resume(struct ssd_disk * sdk);
+extern int ftl_vol_restore(struct ssd_disk * sdk, pfn_t lpn, pfn_t ppn);
+extern int ftl_vol_restored(struct ssd_disk * sdk);
+extern pfn_t ftl_map_write(struct ssd_disk * sdk, pfn_t lpn, pfn_t * old, bool * stalled, int * err);
+extern pfn_t ftl_map_pack(struct ssd_disk * sdk, const pfn_t * lpns, unsigned int nr, pfn_t * olds,
+        bool * stalled, int * err);
+extern void ftl_map_done(struct ssd_disk * sdk, pfn_t lpn, pfn_t ppn, pfn_t old, int error);
+extern bool ftl_map_dedup(struct ssd_disk * sdk, pfn_t lpn, const void * unit, u64 fp);
+extern void ftl_dedup_add(struct ssd_disk * sdk, pfn_t ppn, u64 fp);
+extern void ftl_write_done(struct ssd_disk * sdk, pfn_t ppn);
+extern void ftl_submit_write(struct ssd_disk * sdk, pfn_t ppn, struct bio * bio);
+extern pfn_t ftl_read_get(struct ssd_disk * sdk, pfn_t lpn, int * err);
+extern void ftl_read_put(struct ssd_disk * sdk, pfn_t ppn);
+extern void ftl_invalidate_page(struct ssd_disk * sdk, pfn_t ppn);
+extern int ftl_bmap_init(struct ssd_disk * sdk);
+extern pfn_t ftl_block_ppn(struct ssd_disk * sdk, pfn_t lpn);
+extern unsigned int ftl_block_unmapped(struct ssd_disk * sdk, pfn_t lpn, unsigned int max);
+extern void ftl_bmap_discard(struct ssd_disk * sdk, pfn_t lpn, unsigned int count);
+extern int ftl_pack_init(struct ssd_disk * sdk);
+extern int ftl_dedup_init(struct ssd_disk * sdk);
+
+#endif
@@ -0,0 +1,612 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  clone.c
+ *
+ *    Description:  splitting the bios of the disk into page sized clones
+ *                  on the backing device, with the translation of each page.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+#include "alloc.h"
+#include "pack.h"
+#include "sftl_trace.h"
+
+static struct ss_io * alloc_io(struct ssd_disk * sdk)
+{
+    return mempool_alloc(sdk->io_pool, GFP_NOIO);
+}
+
+static void free_io(struct ssd_disk * sdk, struct ss_io * io)
+{
+    mempool_free(io, sdk->io_pool);
+}
+
+static void ss_bio_destructor(struct bio * bio)
+{
+    struct bio_set * bs = bio->bi_private;
+
+    bio_free(bio, bs);
+}
+
+/* flushes and fua writes both wait for the write buffer to drain */
+static void account_latency(struct ss_io * io)
+{
+    struct bio * bio = io->bio;
+    int op, stall;
+
+    if (bio->bi_rw & (REQ_FLUSH | REQ_FUA))
+        op = LAT_FLUSH;
+    else if (bio_data_dir(bio) == WRITE)
+        op = LAT_WRITE;
+    else
+        op = LAT_READ;
+
+    if (io->flags & SS_IO_GC_STALL)
+        stall = LAT_GC_STALL;
+    else if (io->flags & SS_IO_CMT_MISS)
+        stall = LAT_CMT_MISS;
+    else
+        stall = LAT_NO_STALL;
+
+    ftl_lat_record(io->sd, op, stall, ktime_to_ns(ktime_sub(ktime_get(), io->start_time)));
+}
+
+static void complete_io(struct ss_io * io, int error)
+{
+    struct bio * bio = io->bio;
+
+    account_latency(io);
+    free_io(io->sd, io);
+    bio_endio(bio, error);
+}
+
+static void fua_sync_work(struct work_struct * work)
+{
+    struct ss_io * io = container_of(work, struct ss_io, work);
+
+    complete_io(io, ftl_map_sync(io->sd));
+}
+
+static void dec_pending(struct ss_io * io, int error)
+{
+    unsigned long flags;
+    struct ssd_disk * sd = io->sd;
+    /*
+     * we are supposed to push back any error bio here
+     * should be added in the future
+     */
+    if (unlikely(error)) {
+        spin_lock_irqsave(&io->endio_lock, flags);
+        io->error = error;
+        spin_unlock_irqrestore(&io->endio_lock, flags);
+    }
+
+    if (!atomic_dec_and_test(&io->io_count))
+        return;
+    // the mapping of a fua write of a volume reaches the flash before it completes
+    if (!io->error && sd->vol && bio_data_dir(io->bio) == WRITE && (io->bio->bi_rw & REQ_FUA) &&
+            bio_sectors(io->bio)) {
+        INIT_WORK(&io->work, fua_sync_work);
+        queue_work(sd->cmt.wq ? sd->cmt.wq : system_wq, &io->work);
+        return;
+    }
+    complete_io(io, io->error);
+}
+
+static void clone_endio(struct bio * bio, int error)
+{
+    struct ss_io * sio = bio->bi_private;
+    struct ssd_disk * sd = sio->sd;
+
+    // the page of a volume is held by the clone until it completes
+    if (sd->vol) {
+        if (bio_data_dir(bio) == WRITE) {
+            ftl_map_done(sd, ss_clone(bio)->lpn, *clone_ppn(bio), ss_clone(bio)->old, error);
+            ftl_write_done(sd, *clone_ppn(bio));
+        } else
+            ftl_read_put(sd, *clone_ppn(bio));
+    }
+
+    bio->bi_private = sd->bs;
+    bio_put(bio);
+    dec_pending(sio, error);
+}
+
+/*
+ * clone a bio from existing bio, starting from @sector with @len sects
+ * bio_vec used starts from @idx in the bio_vec. @idx will be updated to
+ * be set to the uncloned entry with @offset also updated. 
+ */
+struct bio * clone_bio(struct bio * bio, sector_t sector, unsigned int * idx, sector_t * offset, sector_t len, struct bio_set * bs)
+{
+    struct bio * clone = NULL;
+    struct bio_vec * bv = bio->bi_io_vec + *idx, * nbv;
+    sector_t remaining = len;
+    clone = bio_alloc_bioset(GFP_NOIO, bio->bi_max_vecs, bs);
+
+    if (!clone)
+        return NULL;
+
+    nbv = clone->bi_io_vec;
+
+    for (; bv < bio->bi_io_vec + bio->bi_vcnt; bv ++) {
+        if (to_sector(bv->bv_len) - *offset > remaining)
+            break;
+        nbv->bv_page = bv->bv_page;
+        nbv->bv_offset = bv->bv_offset + to_bytes(*offset);
+        nbv->bv_len = bv->bv_len - to_bytes(*offset);
+        nbv ++;
+        remaining -= (to_sector(bv->bv_len) - *offset);
+        *offset = 0;
+    }
+
+    if (remaining) {
+        /*
+         *  if there is any io_vec left , 
+         *  we should not reach the end of the io vector list
+         */
+        BUG_ON(bv == bio->bi_io_vec + bio->bi_vcnt);
+
+        nbv->bv_page = bv->bv_page;
+        nbv->bv_offset = bv->bv_offset + to_bytes(*offset);
+        nbv->bv_len = to_bytes(remaining);
+        nbv ++;
+        *offset += remaining;
+    } else
+        *offset = 0;
+
+    clone->bi_vcnt = nbv - clone->bi_io_vec;
+    clone->bi_sector = sector;
+    clone->bi_size = to_bytes(len);
+    clone->bi_destructor = ss_bio_destructor;
+    clone->bi_bdev = bio->bi_bdev;
+    clone->bi_rw = bio->bi_rw;
+    clone->bi_idx = 0;
+    // we have no idea what flags we should use, should check in the future
+    clone->bi_flags = bio->bi_flags | (1 << BIO_CLONED);
+
+    *idx = bv - bio->bi_io_vec;
+
+    return clone;
+}
+
+/*
+ * copy @len sects of @bio, starting from bio_vec @idx at @offset, into @buf
+ * when @rw is WRITE or from @buf when @rw is READ. A NULL @buf zero-fills
+ * the bio. @idx and @offset are advanced the same way clone_bio does.
+ */
+void copy_bio_range(struct bio * bio, unsigned int * idx, sector_t * offset,
+        sector_t len, char * buf, int rw)
+{
+    struct bio_vec * bv = bio->bi_io_vec + *idx;
+    sector_t remaining = len, n;
+    unsigned long flags;
+    char * data;
+
+    for (; remaining && bv < bio->bi_io_vec + bio->bi_vcnt; bv ++) {
+        n = min_t(sector_t, to_sector(bv->bv_len) - *offset, remaining);
+        data = bvec_kmap_irq(bv, &flags) + to_bytes(*offset);
+        if (rw == WRITE)
+            memcpy(buf, data, to_bytes(n));
+        else if (buf)
+            memcpy(data, buf, to_bytes(n));
+        else
+            memset(data, 0, to_bytes(n));
+        if (rw != WRITE)
+            flush_dcache_page(bv->bv_page);
+        bvec_kunmap_irq(data - to_bytes(*offset), &flags);
+        if (buf)
+            buf += to_bytes(n);
+        remaining -= n;
+
+        if (*offset + n < to_sector(bv->bv_len)) {
+            *offset += n;
+            break;
+        }
+        *offset = 0;
+    }
+
+    *idx = bv - bio->bi_io_vec;
+}
+
+/*
+ * whether the @len bytes at @data, a multiple of 64, are all zeros. A
+ * cache line is or-ed together at a time, one branch for eight words and
+ * no fpu, so it runs in any context at about the speed of memory.
+ */
+bool zero_data(const void * data, size_t len)
+{
+    const u64 * p = data, * end = p + len / sizeof(u64);
+
+    for (; p < end; p += 8) {
+        if ((p[0] | p[1]) | (p[2] | p[3]) | (p[4] | p[5]) | (p[6] | p[7]))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * whether @len sects of @bio, starting from bio_vec @idx at @offset, are
+ * all zeros. @idx and @offset are advanced past them only if they are.
+ */
+bool zero_bio_range(struct bio * bio, unsigned int * idx, sector_t * offset, sector_t len)
+{
+    struct bio_vec * bv = bio->bi_io_vec + *idx;
+    sector_t remaining = len, off = *offset, n;
+    unsigned long flags;
+    char * data;
+    bool zero = true;
+
+    for (; zero && remaining && bv < bio->bi_io_vec + bio->bi_vcnt; bv ++) {
+        n = min_t(sector_t, to_sector(bv->bv_len) - off, remaining);
+        data = bvec_kmap_irq(bv, &flags);
+        zero = zero_data(data + to_bytes(off), to_bytes(n));
+        bvec_kunmap_irq(data, &flags);
+        remaining -= n;
+
+        if (off + n < to_sector(bv->bv_len)) {
+            off += n;
+            break;
+        }
+        off = 0;
+    }
+
+    if (zero) {
+        *idx = bv - bio->bi_io_vec;
+        *offset = off;
+    }
+    return zero;
+}
+
+static void map_bio(struct bio * clone, struct ss_io * sio)
+{
+    clone->bi_end_io = clone_endio;
+    clone->bi_private = sio;
+
+    ftl_stat_inc(sio->sd, FTL_STAT_CLONES);
+    ss_account_io(sio->sd, clone);
+    atomic_inc(&sio->io_count);
+    // programs of a volume wait for their die
+    if (sio->sd->vol && bio_data_dir(clone) == WRITE)
+        ftl_submit_write(sio->sd, *clone_ppn(clone), clone);
+    else
+        generic_make_request(clone);
+}
+
+/*
+ * a read of a unit packed into a flash page. The page is read into
+ * @pages[0] and the unit decompressed out of it into @pages[1] when the
+ * read completes, the clone only carries the part of the host bio.
+ */
+struct ss_unpack {
+    struct ss_io * io;
+    struct bio * clone;
+    unsigned int sect;      // of the unit the clone starts at
+    pfn_t lpn;
+    pfn_t ppn;
+    struct page * pages[2];
+};
+
+static void free_unpack(struct ss_unpack * up)
+{
+    if (up->pages[0])
+        __free_page(up->pages[0]);
+    if (up->pages[1])
+        __free_page(up->pages[1]);
+    kfree(up);
+}
+
+static void unpack_endio(void * priv, int error)
+{
+    struct ss_unpack * up = priv;
+    struct ssd_disk * sdk = up->io->sd;
+    struct ss_io * io = up->io;
+    sector_t offset = 0;
+    unsigned int idx = 0;
+
+    if (!error)
+        error = pack_unpack(page_address(up->pages[0]), up->lpn, page_address(up->pages[1]));
+    if (!error)
+        copy_bio_range(up->clone, &idx, &offset, bio_sectors(up->clone),
+                (char *)page_address(up->pages[1]) + to_bytes(up->sect), READ);
+    ftl_read_put(sdk, up->ppn);
+
+    up->clone->bi_private = sdk->bs;
+    bio_put(up->clone);
+    free_unpack(up);
+    dec_pending(io, error);
+}
+
+/* read @len sects of unit @lpn, packed at @ppn, the way map_bio does */
+static int map_packed(struct clone_info * ci, pfn_t lpn, pfn_t ppn, sector_t * offset,
+        sector_t len)
+{
+    struct ssd_disk * sdk = ci->io->sd;
+    struct ss_unpack * up = kzalloc(sizeof(struct ss_unpack), GFP_NOIO);
+
+    if (up) {
+        up->pages[0] = alloc_page(GFP_NOIO);
+        up->pages[1] = alloc_page(GFP_NOIO);
+        if (up->pages[0] && up->pages[1])
+            up->clone = clone_bio(ci->bio, ci->sector, &ci->idx, offset, len, sdk->bs);
+    }
+    if (!up || !up->clone) {
+        if (up)
+            free_unpack(up);
+        ftl_read_put(sdk, ppn);
+        return -ENOMEM;
+    }
+
+    up->io = ci->io;
+    up->sect = ci->sector & (unit_sectors(sdk) - 1);
+    up->lpn = lpn;
+    up->ppn = ppn;
+    ftl_stat_inc(sdk, FTL_STAT_CLONES);
+    atomic_inc(&ci->io->io_count);
+    if (ftl_submit_io(sdk, READ, ppn, 1, up->pages, NULL, unpack_endio, up))
+        unpack_endio(up, -ENOMEM);
+    return 0;
+}
+
+static int __clone_and_map(struct clone_info * ci)
+{
+    struct bio * clone, *bio = ci->bio;
+    struct ssd_disk * sdk = ci->io->sd;
+    struct bio_set * bs =  sdk->bs;
+    unsigned int unmapped = 0;
+    unsigned int clones = 0, zeroed = 0, buffered = 0;
+    sector_t start = ci->sector, count = ci->sector_count;
+    sector_t us = unit_sectors(sdk), ns, len, offset;
+    pfn_t lpn, first, last, ppn = 0, old = 0;
+    bool stalled = false;
+    int err = 0;
+
+    ns = (ci->sector + us) & ~(us - 1);
+    if (ns - ci->sector > ci->sector_count)
+        len = ci->sector_count;
+    else
+        len = ns - ci->sector;
+
+    first = sector_to_lpn(sdk, ci->sector);
+    last = sector_to_lpn(sdk, ci->sector + ci->sector_count - 1);
+    offset = 0;
+    while (ci->sector_count) {
+        lpn = sector_to_lpn(sdk, ci->sector);
+        ci->sector_count -= len;
+
+        // checked once per mapping page, it stalls on the first lpn of it
+        if (sdk->vol && (lpn == first || !LPN_TO_MOFF(lpn)) &&
+                !(ci->io->flags & SS_IO_CMT_MISS) && !mapping_in_memory(sdk->gd, lpn))
+            ci->io->flags |= SS_IO_CMT_MISS;
+
+        if (bio_data_dir(bio) == READ) {
+            /*
+             * a volume maps a buffered unit only when it is written
+             * back, so the buffer is looked at before the mapping
+             */
+            if (sdk->vol) {
+                err = wbuf_read(sdk, lpn, bio, &ci->idx, &offset, ci->sector & (us - 1), len);
+                if (!err) {
+                    buffered ++;
+                    if (unmapped)
+                        unmapped --;
+                    goto next;
+                }
+                // written back, the run counted before is stale
+                if (err == -EAGAIN)
+                    unmapped = 0;
+                err = 0;
+            }
+
+            /*
+             * unmapped units of a volume and discarded units of an
+             * in-place disk read as zeros, complete them here without
+             * sending anything to the device
+             */
+            if (!unmapped)
+                unmapped = get_unmapped_run(sdk->gd, lpn, last - lpn + 1);
+            if (unmapped) {
+                copy_bio_range(bio, &ci->idx, &offset, len, NULL, READ);
+                ftl_stat_inc(sdk, FTL_STAT_UNMAPPED_READS);
+                unmapped --;
+                zeroed ++;
+                goto next;
+            }
+            if (!sdk->vol && !wbuf_read(sdk, lpn, bio, &ci->idx, &offset, ci->sector & (us - 1), len)) {
+                buffered ++;
+                goto next;
+            }
+
+            if (sdk->vol) {
+                ppn = ftl_read_get(sdk, lpn, &err);
+                if (err)
+                    break;
+                // discarded since it was looked up
+                if (!ppn) {
+                    copy_bio_range(bio, &ci->idx, &offset, len, NULL, READ);
+                    zeroed ++;
+                    goto next;
+                }
+                if (ppn_packed(sdk, ppn)) {
+                    err = map_packed(ci, lpn, ppn, &offset, len);
+                    if (err)
+                        break;
+                    clones ++;
+                    goto next;
+                }
+            }
+        } else {
+            /*
+             * a whole unit of zeros written to a volume is only unmapped,
+             * it reads as zeros then the same as it would from the flash
+             */
+            if (sdk->vol && len == us && zero_bio_range(bio, &ci->idx, &offset, len)) {
+                wbuf_evict(sdk, lpn, true);
+                err = unmap_phys_range(sdk->gd, lpn, 1);
+                if (err)
+                    break;
+                ftl_stat_inc(sdk, FTL_STAT_ZERO_UNITS);
+                zeroed ++;
+                goto next;
+            }
+
+            /*
+             * sub-page writes go to the write buffer and are merged into
+             * full units there, unless they have to reach the flash now.
+             * A volume cannot write part of a unit out of place, so it
+             * buffers them all and writes a fua one back right away, and
+             * all its writes if it packs or shares them; in place, whole
+             * pages of a unit are written directly.
+             */
+            if (sdk->vol ? len < us || sdk->wb.pack || sdk->vol->dedup :
+                    ((ci->sector | len) & (PAGE_SECTOR - 1)) && !(bio->bi_rw & (REQ_FLUSH | REQ_FUA))) {
+                err = wbuf_write(sdk, lpn, bio, &ci->idx, &offset, ci->sector & (us - 1), len);
+                if (!err) {
+                    if (!sdk->vol)
+                        map_in_place(sdk->gd, lpn);
+                    else if (bio->bi_rw & REQ_FUA)
+                        wbuf_evict(sdk, lpn, false);
+                    buffered ++;
+                    goto next;
+                }
+                if (sdk->vol)
+                    break;
+                err = 0;
+            }
+            // a full unit overwrites anything buffered for it
+            wbuf_evict(sdk, lpn, len == us);
+
+            if (sdk->vol) {
+                ppn = ftl_map_write(sdk, lpn, &old, &stalled, &err);
+                if (stalled)
+                    ci->io->flags |= SS_IO_GC_STALL;
+                if (!ppn)
+                    break;
+            } else {
+                // data is written in place
+                map_in_place(sdk->gd, lpn);
+            }
+        }
+
+        clone = clone_bio(bio, ci->sector, &ci->idx, &offset, len, bs);
+        if (sdk->vol) {
+            *clone_ppn(clone) = ppn;
+            ss_clone(clone)->lpn = lpn;
+            ss_clone(clone)->old = old;
+            clone->bi_bdev = ppn_bdev(sdk, ppn);
+            clone->bi_sector = ppn_sector(sdk, ppn) + (ci->sector & (us - 1));
+        }
+        map_bio(clone, ci->io);
+        clones ++;
+
+next:
+        ci->sector += len;
+        if (ci->sector_count < us)
+            len = ci->sector_count;
+        else
+            len = us;
+    }
+
+    trace_sftl_bio_split(sdk->gd->disk_name, start, count, bio_data_dir(bio),
+            clones, zeroed, buffered);
+    return err;
+}
+
+static void map_io(struct ss_io * io);
+
+static void resume_io(struct map_waiter * w, int error)
+{
+    struct ss_io * io = container_of(w, struct ss_io, wait);
+
+    io->flags |= SS_IO_CMT_MISS;
+    if (error)
+        dec_pending(io, error);
+    else
+        map_io(io);
+}
+
+/*
+ * split the bio of @io into clones once the mapping pages it needs are in
+ * the cmt. A missing one parks it, and it comes back here from the cmt
+ * worker when the page has been read, so the submitter never waits.
+ */
+static void map_io(struct ss_io * io)
+{
+    struct bio * bio = io->bio;
+    struct clone_info ci;
+    pfn_t lpn, last;
+    int error;
+
+    // only a volume maps its units, an in-place disk never waits for it
+    if (io->sd->vol && bio_sectors(bio)) {
+        last = sector_to_lpn(io->sd, bio->bi_sector + bio_sectors(bio) - 1);
+        for (lpn = io->map_lpn; lpn <= last; lpn = io->map_lpn) {
+            /*
+             * @io belongs to the cmt worker once it is parked. It is not
+             * parked again on the same page, which may have been evicted
+             * by then, that one is looked up the usual way.
+             */
+            io->map_lpn = (LPN_TO_MDIR(lpn) + 1) << MDIR_SHIFT;
+            if (!wait_mapping_page(io->sd->gd, lpn, &io->wait))
+                return;
+        }
+    }
+
+    ci.bio = bio;
+    ci.io = io;
+    ci.sector = bio->bi_sector;
+    ci.idx = bio->bi_idx;
+    ci.sector_count = bio_sectors(bio);
+    error = __clone_and_map(&ci);
+
+    // bio split done, drop the extra ref count
+    dec_pending(io, error);
+}
+
+/*
+ * split a bio of the disk into unit sized clones and send them to the
+ * backing device, the bio completes with the last of them. Its latency
+ * is taken from @start.
+ */
+void __ss_map_request(struct ssd_disk * sdk, struct bio * bio, ktime_t start)
+{
+    struct ss_io * io = alloc_io(sdk);
+
+    io->sd = sdk;
+    io->bio = bio;
+    io->error = 0;
+    io->flags = 0;
+    io->start_time = start;
+    io->wait.fn = resume_io;
+    io->map_lpn = sector_to_lpn(sdk, bio->bi_sector);
+    atomic_set(&io->io_count, 1);
+    spin_lock_init(&io->endio_lock);
+    if (bio_data_dir(bio) == READ) {
+        ftl_stat_inc(sdk, FTL_STAT_HOST_READS);
+        ftl_stat_add(sdk, FTL_STAT_HOST_READ_BYTES, bio->bi_size);
+        // only a volume has mapping pages on the flash to prefetch
+        if (sdk->vol)
+            detect_seq_stream(sdk->gd, bio->bi_sector, bio_sectors(bio));
+    } else {
+        ftl_stat_inc(sdk, FTL_STAT_HOST_WRITES);
+        ftl_stat_add(sdk, FTL_STAT_HOST_WRITE_BYTES, bio->bi_size);
+    }
+    map_io(io);
+}
+
+void ss_map_request(struct ssd_disk * sdk, struct bio * bio)
+{
+    __ss_map_request(sdk, bio, ktime_get());
+}
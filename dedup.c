@@ -0,0 +1,243 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dedup.c
+ *
+ *    Description:  deduplication of the units of a volume. The units are
+ *                  found by the fingerprint of their data in a table of
+ *                  buckets, and the units several lpns are mapped to keep
+ *                  the list of them for gc. How they are shared is up to
+ *                  alloc.c.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "dedup.h"
+
+#define FP_MUL  0x9e3779b97f4a7c15ULL
+
+/*
+ * fingerprint of @len bytes at @data, a multiple of 8. It only has to
+ * spread the units over the buckets, duplicates are compared anyway.
+ * Four words are mixed at once so that the multiplies do not wait for
+ * each other.
+ */
+u64 dedup_fp(const void * data, size_t len)
+{
+    const u64 * p = data;
+    u64 h[4] = {len * FP_MUL, len, ~len, len << 32};
+    size_t i, j, n = len / sizeof(u64);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        for (j = 0; j < 4; j++) {
+            h[j] = (h[j] ^ p[i + j]) * FP_MUL;
+            h[j] ^= h[j] >> 29;
+        }
+    }
+    for (; i < n; i++)
+        h[0] = (h[0] ^ p[i]) * FP_MUL;
+    for (j = 1; j < 4; j++)
+        h[0] = (h[0] ^ h[j]) * FP_MUL;
+    h[0] ^= h[0] >> 32;
+    return h[0] * FP_MUL;
+}
+
+/* a table for about @nr_units units, on @node */
+struct ftl_dedup * dedup_alloc(u64 nr_units, int node)
+{
+    struct ftl_dedup * dd;
+    unsigned int i;
+
+    dd = kzalloc_node(sizeof(struct ftl_dedup), GFP_KERNEL, node);
+    if (!dd)
+        return NULL;
+    dd->nr_buckets = roundup_pow_of_two(clamp_t(u64, nr_units / DEDUP_WAYS, 1, DEDUP_MAX_BUCKETS));
+    dd->slots = vzalloc_node(sizeof(struct dedup_slot) * DEDUP_WAYS * dd->nr_buckets, node);
+    dd->hash = kmalloc_node(sizeof(struct list_head) * DEDUP_HASH_SIZE, GFP_KERNEL, node);
+    if (!dd->slots || !dd->hash) {
+        dedup_free(dd);
+        return NULL;
+    }
+    for (i = 0; i < DEDUP_HASH_SIZE; i++)
+        INIT_LIST_HEAD(&dd->hash[i]);
+    spin_lock_init(&dd->lock);
+    mutex_init(&dd->mutex);
+    return dd;
+}
+
+void dedup_free(struct ftl_dedup * dd)
+{
+    struct dedup_unit * du, * tmp;
+    unsigned int i;
+
+    if (dd->hash) {
+        for (i = 0; i < DEDUP_HASH_SIZE; i++) {
+            list_for_each_entry_safe(du, tmp, &dd->hash[i], hlist) {
+                kfree(du->lpns);
+                kfree(du);
+            }
+        }
+        kfree(dd->hash);
+    }
+    if (dd->slots)
+        vfree(dd->slots);
+    kfree(dd);
+}
+
+static inline struct dedup_slot * fp_bucket(struct ftl_dedup * dd, u64 fp)
+{
+    return &dd->slots[(fp & (dd->nr_buckets - 1)) * DEDUP_WAYS];
+}
+
+/* where a unit with fingerprint @fp was written, and the erase count of its block then */
+pfn_t dedup_lookup(struct ftl_dedup * dd, u64 fp, u32 * erase)
+{
+    struct dedup_slot * s = fp_bucket(dd, fp);
+    unsigned long flags;
+    pfn_t ppn = 0;
+    unsigned int i;
+
+    spin_lock_irqsave(&dd->lock, flags);
+    for (i = 0; i < DEDUP_WAYS; i++) {
+        if (s[i].ppn && s[i].fp == fp) {
+            ppn = s[i].ppn;
+            *erase = s[i].erase;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&dd->lock, flags);
+    return ppn;
+}
+
+/*
+ * A unit with fingerprint @fp is at @ppn. It replaces any other one of
+ * the fingerprint, or the oldest of the bucket.
+ */
+void dedup_insert(struct ftl_dedup * dd, u64 fp, pfn_t ppn, u32 erase)
+{
+    struct dedup_slot * s = fp_bucket(dd, fp);
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&dd->lock, flags);
+    for (i = 0; i < DEDUP_WAYS - 1; i++) {
+        if (!s[i].ppn || s[i].fp == fp)
+            break;
+    }
+    memmove(&s[1], &s[0], sizeof(struct dedup_slot) * i);
+    s[0].fp = fp;
+    s[0].ppn = ppn;
+    s[0].erase = erase;
+    spin_unlock_irqrestore(&dd->lock, flags);
+}
+
+/* the unit at @ppn turned out not to have fingerprint @fp any more */
+void dedup_remove(struct ftl_dedup * dd, u64 fp, pfn_t ppn)
+{
+    struct dedup_slot * s = fp_bucket(dd, fp);
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&dd->lock, flags);
+    for (i = 0; i < DEDUP_WAYS; i++) {
+        if (s[i].ppn == ppn && s[i].fp == fp) {
+            memmove(&s[i], &s[i + 1], sizeof(struct dedup_slot) * (DEDUP_WAYS - 1 - i));
+            memset(&s[DEDUP_WAYS - 1], 0, sizeof(struct dedup_slot));
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&dd->lock, flags);
+}
+
+/* gc moved the unit at @old to @ppn, if it is the one of fingerprint @fp it is found there */
+void dedup_move(struct ftl_dedup * dd, u64 fp, pfn_t old, pfn_t ppn, u32 erase)
+{
+    struct dedup_slot * s = fp_bucket(dd, fp);
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&dd->lock, flags);
+    for (i = 0; i < DEDUP_WAYS; i++) {
+        if (s[i].ppn == old && s[i].fp == fp) {
+            s[i].ppn = ppn;
+            s[i].erase = erase;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&dd->lock, flags);
+}
+
+static inline struct list_head * unit_chain(struct ftl_dedup * dd, pfn_t ppn)
+{
+    return &dd->hash[(u32)(ppn * (u32)FP_MUL) >> (32 - DEDUP_HASH_SHIFT)];
+}
+
+/* the shared unit at @ppn, NULL if it is not. Under the mutex */
+struct dedup_unit * dedup_find(struct ftl_dedup * dd, pfn_t ppn)
+{
+    struct dedup_unit * du;
+
+    list_for_each_entry(du, unit_chain(dd, ppn), hlist) {
+        if (du->ppn == ppn)
+            return du;
+    }
+    return NULL;
+}
+
+/*
+ * The shared unit at @ppn, with room for @room more lpns. It is created
+ * with none if the unit is not shared yet, dedup_put drops it again if
+ * none is added. Returns NULL without memory. Under the mutex.
+ */
+struct dedup_unit * dedup_get(struct ftl_dedup * dd, pfn_t ppn, unsigned int room)
+{
+    struct dedup_unit * du = dedup_find(dd, ppn);
+    unsigned int max;
+    pfn_t * lpns;
+
+    if (!du) {
+        du = kzalloc(sizeof(struct dedup_unit), GFP_NOIO);
+        if (!du)
+            return NULL;
+        du->ppn = ppn;
+        list_add(&du->hlist, unit_chain(dd, ppn));
+    }
+    if (du->nr + room <= du->max)
+        return du;
+
+    max = max(du->max * 2, du->nr + room);
+    lpns = krealloc(du->lpns, sizeof(pfn_t) * max, GFP_NOIO);
+    if (!lpns) {
+        dedup_put(du);
+        return NULL;
+    }
+    du->lpns = lpns;
+    du->max = max;
+    return du;
+}
+
+/* gc moved shared unit @du to @ppn. Under the mutex */
+void dedup_rehash(struct ftl_dedup * dd, struct dedup_unit * du, pfn_t ppn)
+{
+    list_del(&du->hlist);
+    du->ppn = ppn;
+    list_add(&du->hlist, unit_chain(dd, ppn));
+}
+
+/* free @du if no lpn is listed any more. Under the mutex */
+void dedup_put(struct dedup_unit * du)
+{
+    if (du->nr)
+        return;
+    list_del(&du->hlist);
+    kfree(du->lpns);
+    kfree(du);
+}
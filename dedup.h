@@ -0,0 +1,70 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  dedup.h
+ *
+ *    Description:  header for dedup.c, fingerprints of the units written to
+ *                  a volume and the lpns of the units shared by several
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#define DEDUP_WAYS          4           /* fingerprints of a bucket, the latest first */
+#define DEDUP_MAX_BUCKETS   (1 << 18)
+#define DEDUP_MAX_REFS      1024        /* lpns of a shared unit, a duplicate past them is written */
+#define DEDUP_HASH_SHIFT    10
+#define DEDUP_HASH_SIZE     (1 << DEDUP_HASH_SHIFT)
+
+/*
+ * A unit written to the flash is found by the fingerprint of its data.
+ * The fingerprint only points at it: a duplicate is read back and
+ * compared before it is shared, and the slot is stale once the block it
+ * was in has been erased since.
+ */
+struct dedup_slot {
+    u64 fp;
+    pfn_t ppn;              // 0 if the slot is free
+    u32 erase;              // erase count of its block when it was written
+};
+
+/*
+ * A unit several lpns are mapped to. Every lpn ever mapped to it is in
+ * @lpns, those overwritten since too, so that gc can remap them all.
+ */
+struct dedup_unit {
+    struct list_head hlist; // hash chain, by ppn
+    pfn_t ppn;
+    unsigned int nr;
+    unsigned int max;
+    pfn_t * lpns;
+};
+
+struct ftl_dedup {
+    spinlock_t lock;            // of the slots, they are added as writes complete
+    u32 nr_buckets;             // a power of two
+    struct dedup_slot * slots;  // DEDUP_WAYS per bucket
+    struct mutex mutex;         // of the shared units and of mapping lpns to them
+    struct list_head * hash;
+};
+
+extern u64 dedup_fp(const void * data, size_t len);
+extern struct ftl_dedup * dedup_alloc(u64 nr_units, int node);
+extern void dedup_free(struct ftl_dedup * dd);
+extern pfn_t dedup_lookup(struct ftl_dedup * dd, u64 fp, u32 * erase);
+extern void dedup_insert(struct ftl_dedup * dd, u64 fp, pfn_t ppn, u32 erase);
+extern void dedup_remove(struct ftl_dedup * dd, u64 fp, pfn_t ppn);
+extern void dedup_move(struct ftl_dedup * dd, u64 fp, pfn_t old, pfn_t ppn, u32 erase);
+extern struct dedup_unit * dedup_find(struct ftl_dedup * dd, pfn_t ppn);
+extern struct dedup_unit * dedup_get(struct ftl_dedup * dd, pfn_t ppn, unsigned int room);
+extern void dedup_rehash(struct ftl_dedup * dd, struct dedup_unit * du, pfn_t ppn);
+extern void dedup_put(struct dedup_unit * du);
+
+#endif
@@ -16,88 +16,44 @@
  * =====================================================================================
  */
 
-#include <linux/list.h>
-#include <linux/module.h>
-#include <linux/init.h>
-
-#include <linux/kernel.h>
-#include <linux/slab.h>
-#include <linux/errno.h>
-#include <linux/fs.h>
-#include <linux/blkdev.h>
-#include <linux/mempool.h>
-#include <linux/rwsem.h>
+#include "ftl_compat.h"
 
 #include "ftl.h"
+#include "wbuf.h"
 #include "ssd.h"
+#include "alloc.h"
+#include "scan.h"
+#include "sftl_trace.h"
 
-static void ftl_bio_destructor(struct bio * bio)
+static void read_endio(void * priv, int error)
 {
-    struct bio_set * bs = bio->bi_private;
-
-    bio_free(bio, bs);
-}
-
-static void read_endio(struct bio * bio, int error)
-{
-    struct phys_page * page = bio->bi_private;
-    struct ssd_disk * sdk = ssd_disk(page->disk);
+    struct phys_page * page = priv;
 
+    page->retval = error;
     up_write(&page->rw_sem);
-    bio->bi_private = sdk->bs;
-    bio_put(bio);
 }
 
 /* read a single page from the disk
  * @page: user should allocate buffer for the phys_page struct 
  * and initiate the block number and page offset
  */
-static void read_phys_page(struct phys_page * page, bio_end_io_t bio_end)
+static void read_phys_page(struct phys_page * page, ftl_io_done_t * done)
 {
-    struct gendisk * disk = page->disk;
-    struct ssd_disk * sdk = ssd_disk(disk);
-    struct bio * bio = bio_alloc_bioset(GFP_NOIO, PHYS_PAGE_SIZE / MEM_PAGE_SIZE, sdk->bs);
-    int i;
-
-    if (!bio) {
-        page->retval = -NO_BIO_RESOURCE;
-        return;
-    }
-
-    bio->bi_sector = PAGE_TO_SECTOR(page->ppn);
-    bio->bi_size = PHYS_PAGE_SIZE;
-    bio->bi_vcnt = PHYS_PAGE_SIZE / MEM_PAGE_SIZE;
+    struct ssd_disk * sdk = ssd_disk(page->disk);
+    int err;
 
-    if (!page->data || bio->bi_vcnt > page->nents) {
+    if (!page->data || HW_TO_MEM_PAGE > page->nents) {
         page->retval = - NOT_ENOUGH_MEM;
         return;
     }
 
-    for (i = 0; i < bio->bi_vcnt; i++) {
-        bio->bi_io_vec[i].bv_page = page->data[i];
-        bio->bi_io_vec[i].bv_offset = 0;
-        bio->bi_io_vec[i].bv_len = MEM_PAGE_SIZE;
-    }
-
-    bio->bi_bdev = sdk->bdev;
-
-    /*if (!bio->bi_bdev || !bio->bi_bdev->bd_disk) {
-        page->retval = - NO_BLK_DEV;
-        if (!bio->bi_bdev->bd_disk)
-        printk(KERN_ERR "ftl: no block device can be found on bdev part %d\n", i);
-        return;
-    }*/
-
-    bio->bi_idx = 0;
-    bio->bi_destructor = ftl_bio_destructor;
-
-    bio->bi_end_io = bio_end;
-    bio->bi_private = page;
-    bio->bi_flags |= (1 << BIO_CLONED);
-
     down_write(&page->rw_sem);
 
-    generic_make_request(bio);
+    err = ftl_submit_io(sdk, READ, page->ppn, 1, page->data, page->oob, done, page);
+    if (err) {
+        page->retval = err;
+        up_write(&page->rw_sem);
+    }
 }
 
 /*static void read_phys_block(struct gendisk * disk, struct phys_block * block) {
@@ -107,16 +63,17 @@ static void read_phys_area(struct gendisk * disk, unsigned int start,
         unsigned int count, struct phys_page * pages) {
 }*/
 
-static struct phys_page * alloc_phys_page(void)
+static struct phys_page * alloc_phys_page(gfp_t gfp, int node)
 {
-    struct phys_page * page = kmalloc(sizeof(struct phys_page), GFP_KERNEL);
+    struct phys_page * page = kmalloc_node(sizeof(struct phys_page), gfp, node);
     int i;
 
     if (!page)
         return NULL;
     init_rwsem(&page->rw_sem);
+    page->retval = 0;
 
-    page->data = kmalloc(sizeof(struct page *) * HW_TO_MEM_PAGE, GFP_KERNEL);
+    page->data = kzalloc_node(sizeof(struct page *) * HW_TO_MEM_PAGE, gfp, node);
 
     if (!page->data) {
         printk(KERN_ERR "ftl: not enough memory\n");
@@ -125,13 +82,13 @@ static struct phys_page * alloc_phys_page(void)
     }
 
     for (i = 0; i < HW_TO_MEM_PAGE; i ++) {
-        page->data[i] = alloc_page(GFP_KERNEL);
+        page->data[i] = alloc_pages_node(node, gfp, 0);
         if (!page->data[i])
             goto err_out;
     }
     page->nents = HW_TO_MEM_PAGE;
 
-    page->oob = kmalloc(PHYS_OOB_SIZE, GFP_KERNEL);
+    page->oob = kzalloc_node(PHYS_OOB_SIZE, gfp, node);
     if (!page->oob)
         goto err_out;
 
@@ -142,6 +99,7 @@ err_out:
         if (page->data[i])
             __free_page(page->data[i]);
     }
+    kfree(page->data);
     kfree(page);
     return NULL;
 }
@@ -153,10 +111,54 @@ static void free_phys_page(struct phys_page * page)
         if (page->data[i])
             __free_page(page->data[i]);
     }
+    kfree(page->data);
     kfree(page->oob);
     kfree(page);
 }
 
+/* the crc32c of the flash page in @pages and of @hdr up to its crc */
+static u32 map_page_crc(struct page ** pages, const struct map_page_hdr * hdr)
+{
+    u32 crc = ~0;
+    int i;
+
+    for (i = 0; i < HW_TO_MEM_PAGE; i++)
+        crc = crc32c(crc, page_address(pages[i]), MEM_PAGE_SIZE);
+    return ~crc32c(crc, hdr, offsetof(struct map_page_hdr, crc));
+}
+
+/* write the header @hdr of page @lpdn of kind @magic, as it is in @pages */
+static void seal_map_page(struct ssd_disk * sdk, struct page ** pages, struct map_page_hdr * hdr,
+        u32 magic, pfn_t lpdn)
+{
+    hdr->magic = magic;
+    hdr->lpdn = lpdn;
+    hdr->seq = atomic64_inc_return(&sdk->gmt.seq);
+    hdr->rsvd = 0;
+    hdr->crc = map_page_crc(pages, hdr);
+}
+
+/* check page @lpdn of kind @magic read from @ppn against its header @hdr */
+static int verify_map_page(struct ssd_disk * sdk, struct page ** pages,
+        const struct map_page_hdr * hdr, u32 magic, pfn_t lpdn, pfn_t ppn)
+{
+    if (hdr->magic == magic && hdr->lpdn == lpdn && hdr->crc == map_page_crc(pages, hdr))
+        return 0;
+
+    ftl_stat_inc(sdk, FTL_STAT_MAP_CRC_ERRORS);
+    printk(KERN_ERR "ftl: bad %s page %u at ppn %u: magic %x, page %u, seq %llu\n",
+            magic == DIR_HDR_MAGIC ? "directory" : "mapping", lpdn, ppn,
+            hdr->magic, hdr->lpdn, (unsigned long long)hdr->seq);
+    return -EIO;
+}
+
+/* raise the sequence of the disk to @seq, found on the flash */
+static void seen_seq(struct ssd_disk * sdk, u64 seq)
+{
+    if (seq > atomic64_read(&sdk->gmt.seq))
+        atomic64_set(&sdk->gmt.seq, seq);
+}
+
 static void add_page_to_block(struct phys_page * page, struct phys_block * block)
 {
     list_add(&page->list, &block->plist);
@@ -167,50 +169,175 @@ static void add_page_to_block(struct phys_page * page, struct phys_block * block
     block->pbn = pbn;
 }*/
 
+/* the copy of the directory on the node of this cpu, if it has one */
+static inline pfn_t * local_page_dir(struct global_mapping_dir * gmt)
+{
+    pfn_t * dir;
+
+    if (gmt->replicas && (dir = gmt->replicas[numa_node_id()]))
+        return dir;
+    return gmt->dir;
+}
+
 pfn_t get_page_dir(struct ssd_disk * sdk, pfn_t lpn)
 {
-    unsigned int idx, offset;
-    struct gdir_entry * entry;
-    pfn_t * pdir;
+    pfn_t * dir = local_page_dir(&sdk->gmt);
+    unsigned int seq;
     pfn_t ret;
 
-    idx = LPN_TO_MDIR(lpn) >> 10;
-    offset = LPN_TO_MDIR(lpn) & 0x3ff;
-    entry = &sdk->gmt.el[idx];
-    down_read(&entry->hw_page->rw_sem);
-    pdir = page_address(entry->page);
-    ret = pdir[offset];
-    up_read(&entry->hw_page->rw_sem);
+    do {
+        seq = read_seqbegin(&sdk->gmt.lock);
+        ret = dir[LPN_TO_MDIR(lpn)];
+    } while (read_seqretry(&sdk->gmt.lock, seq));
 
     return ret;
 }
 
 /*
- * This two functions assume that the appropriated lock in cmt entry
+ * Point the directory entry of mapping page @lpdn at @ppn, once the
+ * mapping page has been written there. Every copy is updated.
+ */
+void set_page_dir(struct ssd_disk * sdk, pfn_t lpdn, pfn_t ppn)
+{
+    struct global_mapping_dir * gmt = &sdk->gmt;
+    int node;
+
+    write_seqlock(&gmt->lock);
+    gmt->dir[lpdn] = ppn;
+    for (node = 0; gmt->replicas && node < nr_node_ids; node++) {
+        if (gmt->replicas[node])
+            gmt->replicas[node][lpdn] = ppn;
+    }
+    write_sequnlock(&gmt->lock);
+}
+
+/*
+ * A volume with all of its units page mapped keeps its mapping on its
+ * first device after the label block, in MAP_SLOTS slots. A slot starts
+ * with a checkpoint of the mapping: the header pages, with the header of
+ * every page after them, the directory pages, and mapping page n at
+ * maps + n if it maps any unit. Its log follows, see MAP_LOG_SEG_PAGES,
+ * with the mapping pages written since. The header of directory page 0
+ * is written last, once the rest is on the flash, and the newest slot
+ * that has it is loaded. A checkpoint goes into the other slot, so the
+ * last one stays whole until the new one is sealed.
+ */
+struct map_area {
+    pfn_t start;            // first header page
+    pfn_t dir;              // first directory page, after the header pages
+    pfn_t maps;             // mapping page 0
+    pfn_t log;              // first page of the log
+    pfn_t end;
+};
+
+/* where @sdk keeps slot @slot of its mapping, false if it does not keep it */
+static bool map_area(struct ssd_disk * sdk, unsigned int slot, struct map_area * ma)
+{
+    struct ftl_volume * vol = sdk->vol;
+    u32 block = vol ? 1U << vol->devs[0].geo.block_shift : 0;
+    u32 size = vol ? (vol->meta_pages - block) / MAP_SLOTS : 0;
+
+    ma->start = block + slot * size;
+    ma->dir = ma->start + DIV_ROUND_UP(sdk->gmt.nr_pages + sdk->gmt.nents, (u32)MAP_HDRS_PER_PAGE);
+    ma->maps = ma->dir + sdk->gmt.nr_pages;
+    ma->log = ma->maps + sdk->gmt.nents;
+    ma->end = ma->start + size;
+    return vol && !vol->bmap && !vol->dedup && !vol->devs[0].packs &&
+            ma->log + MAP_LOG_PAGES(sdk->gmt.nents) / 2 <= ma->end;
+}
+
+/* the slot mapping page @ppn of a volume that keeps its mapping is in */
+static inline unsigned int map_slot(struct ssd_disk * sdk, pfn_t ppn)
+{
+    struct map_area ma;
+
+    map_area(sdk, 0, &ma);
+    return (ppn - ma.start) / (ma.end - ma.start);
+}
+
+/*
+ * The directory entry of @lpn, for a read of its mapping page. The slot
+ * it is in is not erased until map_read_put, a checkpoint points the
+ * directory at the other one before it waits for the reads.
+ */
+static pfn_t map_read_get(struct ssd_disk * sdk, pfn_t lpn)
+{
+    atomic_t * reads;
+    pfn_t dir;
+
+    for (;;) {
+        dir = get_page_dir(sdk, lpn);
+        if (!dir)
+            return 0;
+        reads = &sdk->gmt.reads[map_slot(sdk, dir)];
+        atomic_inc(reads);
+        smp_mb();
+        if (get_page_dir(sdk, lpn) == dir)
+            return dir;
+        if (atomic_dec_and_test(reads))
+            wake_up_all(&sdk->gmt.wait);
+    }
+}
+
+static void map_read_put(struct ssd_disk * sdk, pfn_t dir)
+{
+    if (dir && atomic_dec_and_test(&sdk->gmt.reads[map_slot(sdk, dir)]))
+        wake_up_all(&sdk->gmt.wait);
+}
+
+/* the shard of the cmt that caches mapping page @lpdn, and its bucket */
+static inline struct cmt_shard * cmt_shard(struct ssd_disk * sdk, pfn_t lpdn)
+{
+    return &sdk->cmt.shards[lpdn >> sdk->cmt.shard_shift];
+}
+
+static inline struct cmt_entry * cmt_entry(struct ssd_disk * sdk, pfn_t lpdn)
+{
+    return &cmt_shard(sdk, lpdn)->el[lpdn & sdk->cmt.bucket_mask];
+}
+
+/*
+ * These functions assume that the appropriated lock in cmt entry
  * is acquired and should not sleep.
  */
-static inline pfn_t search_hash_mapping(pfn_t lpn, struct cmt_entry * ent)
+static inline struct global_mapping_page * search_hash_page(pfn_t lpdn, struct cmt_entry * ent)
 {
-    pfn_t lpdn,lpdo, ret = 0;
     struct global_mapping_page * mpage = NULL;
 
-    lpdn = LPN_TO_MDIR(lpn);
-    lpdo = LPN_TO_MOFF(lpn);
-
-    if (!list_empty(&ent->hlist)) {
-        list_for_each_entry(mpage, &ent->hlist, next) {
-            if (mpage->lpdn == lpdn) {
-                //ret = mpage->mlist[lpdo];
-                ret = PAGE_PFN_ENTRY(mpage->pg, lpdo);
-                return ret;
-            }
-        }
+    list_for_each_entry(mpage, &ent->hlist, next) {
+        if (mpage->lpdn == lpdn)
+            return mpage;
     }
 
-    return 0;
+    return NULL;
+}
+
+/*
+ * Return true if the mapping page of @lpn is cached, with the mapping
+ * entry (zero if the page is unmapped) stored in @ppn.
+ */
+static inline bool search_hash_mapping(pfn_t lpn, struct cmt_entry * ent, pfn_t * ppn)
+{
+    struct global_mapping_page * mpage;
+
+    mpage = search_hash_page(LPN_TO_MDIR(lpn), ent);
+    if (!mpage)
+        return false;
+
+    // racy under the read lock, every reader sets the same bit
+    if (!(mpage->mflags & MPAGE_REF))
+        mpage->mflags |= MPAGE_REF;
+    //*ppn = mpage->mlist[LPN_TO_MOFF(lpn)];
+    *ppn = PAGE_PFN_ENTRY(mpage->pg, LPN_TO_MOFF(lpn));
+    return true;
 }
 
-static inline bool search_set_hash_mapping(pfn_t lpn, pfn_t ppn, struct cmt_entry * ent)
+/*
+ * Point @lpn at @ppn, only if it points at *@old when @cmp is set. *@old
+ * is set to what it pointed at before.
+ */
+static inline bool search_set_hash_mapping(pfn_t lpn, pfn_t ppn, struct cmt_entry * ent,
+        pfn_t * old, bool cmp)
 {
     pfn_t lpdn,lpdo;
     struct global_mapping_page * mpage = NULL;
@@ -218,258 +345,2094 @@ static inline bool search_set_hash_mapping(pfn_t lpn, pfn_t ppn, struct cmt_entr
     lpdn = LPN_TO_MDIR(lpn);
     lpdo = LPN_TO_MOFF(lpn);
 
-    if (!list_empty(&ent->hlist)) {
-        list_for_each_entry(mpage, &ent->hlist, next) {
-            if (mpage->lpdn == lpdn) {
-                //mpage->mlist[lpdo] = ppn;
-                PAGE_PFN_ENTRY(mpage->pg, lpdo) = ppn;
-                if (!mpage->dirty) {
-                    mpage->dirty = true;
-                    ent->dirty ++;
-                }
-                return true;
+    mpage = search_hash_page(lpdn, ent);
+    if (!mpage)
+        return false;
+
+    mpage->mflags |= MPAGE_REF;
+    if (cmp && PAGE_PFN_ENTRY(mpage->pg, lpdo) != *old) {
+        *old = PAGE_PFN_ENTRY(mpage->pg, lpdo);
+        return true;
+    }
+
+    //mpage->mlist[lpdo] = ppn;
+    *old = PAGE_PFN_ENTRY(mpage->pg, lpdo);
+    PAGE_PFN_ENTRY(mpage->pg, lpdo) = ppn;
+    if (!mpage->dirty) {
+        mpage->dirty = true;
+        ent->dirty ++;
+    }
+    return true;
+}
+
+/*
+ * Allocate a mapping page for @lpdn to be read from @dir, its mappings
+ * empty if the page has never been written.
+ */
+static struct global_mapping_page * alloc_mapping_page(struct gendisk * disk, pfn_t lpdn,
+        pfn_t dir, gfp_t gfp)
+{
+    struct global_mapping_page * mpage;
+    int node = cmt_shard(ssd_disk(disk), lpdn)->node;
+    int i;
+
+    mpage = kmalloc_node(sizeof(struct global_mapping_page), gfp, node);
+    if (!mpage)
+        return NULL;
+
+    mpage->pg = alloc_phys_page(gfp, node);
+    if (!mpage->pg) {
+        kfree(mpage);
+        return NULL;
+    }
+
+    INIT_LIST_HEAD(&mpage->list);
+    mpage->lpdn = lpdn;
+    mpage->dirty = false;
+    mpage->pg->ppn = dir;
+    mpage->pg->disk = disk;
+
+    if (!dir) {
+        for (i = 0; i < mpage->pg->nents; i++)
+            memset(page_address(mpage->pg->data[i]), 0, MEM_PAGE_SIZE);
+    }
+    return mpage;
+}
+
+static void free_mapping_page(struct global_mapping_page * mpage)
+{
+    free_phys_page(mpage->pg);
+    kfree(mpage);
+}
+
+static bool map_page_empty(struct page ** pages)
+{
+    int i;
+
+    for (i = 0; i < HW_TO_MEM_PAGE; i++) {
+        if (!zero_data(page_address(pages[i]), MEM_PAGE_SIZE))
+            return false;
+    }
+    return true;
+}
+
+/* cache @mpage read or created for bucket @ent, which is write locked */
+static void cmt_add_page(struct ssd_disk * sdk, struct cmt_entry * ent,
+        struct global_mapping_page * mpage)
+{
+    mpage->mflags = MPAGE_REF;
+    list_add(&mpage->next, &ent->hlist);
+    atomic_inc(&cmt_shard(sdk, mpage->lpdn)->pages);
+    ftl_stat_inc(sdk, FTL_STAT_CMT_PAGES);
+}
+
+/*
+ * Whether @mpage can leave the cmt, its bucket write locked: it is clean
+ * and the directory has it where it was read from or last written, or it
+ * was never written and maps nothing.
+ */
+static bool cmt_evictable(struct ssd_disk * sdk, struct global_mapping_page * mpage)
+{
+    pfn_t dir;
+
+    if (mpage->dirty || !list_empty(&mpage->list))
+        return false;
+    dir = get_page_dir(sdk, mpage->lpdn << MDIR_SHIFT);
+    if (dir)
+        return mpage->pg->ppn == dir;
+    return !mpage->pg->ppn && map_page_empty(mpage->pg->data);
+}
+
+/*
+ * Bring the shard of mapping page @lpdn back under its limit. The clock
+ * goes round its buckets, a page looked up since it last passed is
+ * spared once. The dirty pages stay until they are written back, which
+ * is kicked off if the clock went round twice without enough clean ones.
+ */
+static void cmt_shrink(struct ssd_disk * sdk, pfn_t lpdn)
+{
+    struct cmt_shard * shard = cmt_shard(sdk, lpdn);
+    struct global_mapping_page * mpage, * n;
+    struct cmt_entry * ent;
+    struct map_area ma;
+    unsigned long flags;
+    unsigned int i;
+    LIST_HEAD(victims);
+
+    for (i = 0; i < 2 * (sdk->cmt.bucket_mask + 1); i++) {
+        if (atomic_read(&shard->pages) <= shard->max_pages)
+            break;
+        ent = &shard->el[atomic_inc_return(&shard->hand) & sdk->cmt.bucket_mask];
+        write_lock_irqsave(&ent->rw_lock, flags);
+        list_for_each_entry_safe(mpage, n, &ent->hlist, next) {
+            if (mpage->mflags & MPAGE_REF) {
+                mpage->mflags &= ~MPAGE_REF;
+                continue;
             }
+            if (!cmt_evictable(sdk, mpage))
+                continue;
+            list_move(&mpage->next, &victims);
+            if (atomic_dec_return(&shard->pages) <= shard->max_pages)
+                break;
         }
+        write_unlock_irqrestore(&ent->rw_lock, flags);
     }
-    return false;
+
+    // not once the volume is going away, see save_mapping_dir
+    if (atomic_read(&shard->pages) > shard->max_pages && sdk->cmt.wq && map_area(sdk, 0, &ma) &&
+            !ACCESS_ONCE(sdk->vol->quiesced))
+        queue_work(sdk->cmt.wq, &sdk->cmt.sync_work);
+
+    list_for_each_entry_safe(mpage, n, &victims, next) {
+        trace_sftl_cmt_evict(sdk->gd->disk_name, mpage->lpdn, mpage->pg->ppn);
+        ftl_stat_inc(sdk, FTL_STAT_CMT_EVICTIONS);
+        free_mapping_page(mpage);
+    }
+}
+
+/*
+ * Allocate a mapping page for @lpdn and fill it from @dir, taken with
+ * map_read_get, or with empty mappings if the page has never been
+ * written. The caller waits for the read, bios of the host are parked
+ * instead by wait_mapping_page. Returns NULL and sets *@err if the page
+ * cannot be allocated or read.
+ */
+static struct global_mapping_page * load_mapping_page(struct gendisk * disk, pfn_t lpdn, pfn_t dir,
+        int * err)
+{
+    struct global_mapping_page * mpage;
+
+    mpage = alloc_mapping_page(disk, lpdn, dir, GFP_NOIO);
+    if (!mpage) {
+        map_read_put(ssd_disk(disk), dir);
+        *err = -ENOMEM;
+    }
+    if (!mpage || !dir)
+        return mpage;
+
+    trace_sftl_map_read(disk->disk_name, lpdn, dir, 0);
+    read_phys_page(mpage->pg, read_endio);
+
+    /* read_endio releases the page once the mapping read completes */
+    down_read(&mpage->pg->rw_sem);
+    up_read(&mpage->pg->rw_sem);
+    map_read_put(ssd_disk(disk), dir);
+
+    trace_sftl_map_read_done(disk->disk_name, lpdn, dir, mpage->pg->retval);
+    if (mpage->pg->retval) {
+        printk(KERN_ERR "ftl: cannot read mapping page %x of %s, error %d\n", lpdn,
+                disk->disk_name, mpage->pg->retval);
+        *err = mpage->pg->retval;
+        free_mapping_page(mpage);
+        return NULL;
+    }
+
+    ftl_stat_inc(ssd_disk(disk), FTL_STAT_MAP_READS);
+    return mpage;
 }
 
 /*
  * Translate the logical page number in @disk into physcial page number
- * The mapping page may not exist, thus if @create is greater than zero,
- * the function will allocate memory mapping page and update the gmt.
- *
- * Return: zero when mapping does not exist (either no mapping page or
- * the related entry in the mapping page is empty) and the corresponding
- * ppn.
+ * through the mapping pages only, see get_phys_ppn.
  */
-pfn_t get_phys_ppn(struct gendisk * disk, pfn_t lpn, int create)
+pfn_t get_page_ppn(struct gendisk * disk, pfn_t lpn, int create, int * err)
 {
     struct ssd_disk * sdk = ssd_disk(disk);
-    pfn_t lpdn,lpdo,hidx,dir,ret = 0;
+    pfn_t lpdn,lpdo,dir,ret = 0;
     struct cmt_entry * ent;
     struct global_mapping_page * mpage = NULL;
     unsigned long flags;
+    int error = 0;
+    bool found;
 
     lpdn = LPN_TO_MDIR(lpn);
     lpdo = LPN_TO_MOFF(lpn);
-    hidx = CMT_HASH_MASK(lpdn);
-    ent = &sdk->cmt.el[hidx];
-
-    dir = get_page_dir(sdk, lpn);
-    if (!dir && !create)
-        return 0;
+    ent = cmt_entry(sdk, lpdn);
 
     /*
      * seems that we don't need to disable interrupts
      */
     read_lock_irqsave(&ent->rw_lock, flags);
-    ret = search_hash_mapping(lpn, ent);
+    found = search_hash_mapping(lpn, ent, &ret);
     read_unlock_irqrestore(&ent->rw_lock, flags);
-    if (ret)
+    trace_sftl_cmt_lookup(disk->disk_name, lpn, false, found);
+    if (found) {
+        ftl_stat_inc(sdk, FTL_STAT_CMT_HITS);
         return ret;
+    }
+    ftl_stat_inc(sdk, FTL_STAT_CMT_MISSES);
 
-    mpage = kmalloc(sizeof(struct global_mapping_page), GFP_KERNEL);
-    mpage->pg =  alloc_phys_page();
-    mpage->lpdn = lpdn;
-    mpage->dirty = false;
-    mpage->pg->ppn = dir;
-    mpage->pg->disk = disk;
-    read_phys_page(mpage->pg, read_endio);
+again:
+    /*
+     * a mapping page created in memory is not in the directory until it
+     * is flushed, so only give up after the cmt has been searched.
+     */
+    dir = map_read_get(sdk, lpn);
+    if (!dir && !create)
+        return 0;
+
+    mpage = load_mapping_page(disk, lpdn, dir, &error);
+    if (!mpage) {
+        if (err)
+            *err = error;
+        return 0;
+    }
 
     /*
      * cmt may be updated when reading mapping pages. so before we add the mapping page,
      * check whether the cmt contains the requested page.
      */
     write_lock_irqsave(&ent->rw_lock, flags);
-    ret = search_hash_mapping(lpn, ent);
-    if (ret) {
+    found = search_hash_mapping(lpn, ent, &ret);
+    if (found) {
         write_unlock_irqrestore(&ent->rw_lock, flags);
-        free_phys_page(mpage->pg);
-        kfree(mpage);
+        free_mapping_page(mpage);
         return ret;
     }
+    // it was loaded, written back and evicted meanwhile, what was read is stale
+    if (get_page_dir(sdk, lpn) != dir) {
+        write_unlock_irqrestore(&ent->rw_lock, flags);
+        free_mapping_page(mpage);
+        goto again;
+    }
 
-    list_add(&mpage->next, &ent->hlist);
+    cmt_add_page(sdk, ent, mpage);
     //ret = mpage->mlist[lpdo];
     ret = PAGE_PFN_ENTRY(mpage->pg, lpdo);
 
     write_unlock_irqrestore(&ent->rw_lock, flags);
+    cmt_shrink(sdk, lpdn);
 
     return ret;
 }
 
-void set_phys_ppn(struct gendisk * disk, pfn_t lpn, pfn_t ppn)
+/*
+ * Translate the logical page number in @disk into physcial page number
+ * The mapping page may not exist, thus if @create is greater than zero,
+ * the function will allocate memory mapping page and update the gmt.
+ * A logical block of a volume mapped as a whole has no entries there.
+ *
+ * Return: zero when mapping does not exist (either no mapping page or
+ * the related entry in the mapping page is empty) and the corresponding
+ * ppn. Zero as well if the mapping page cannot be read, *@err is set
+ * then unless @err is NULL, the caller has to tell it from unmapped.
+ */
+pfn_t get_phys_ppn(struct gendisk * disk, pfn_t lpn, int create, int * err)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    pfn_t ppn;
+
+    if ((ppn = ftl_block_ppn(sdk, lpn)))
+        return ppn;
+    ppn = get_page_ppn(disk, lpn, create, err);
+    // a log may have taken the unit meanwhile and cleared its entry
+    if (!ppn)
+        ppn = ftl_block_ppn(sdk, lpn);
+    return ppn;
+}
+
+static int __set_phys_ppn(struct gendisk * disk, pfn_t lpn, pfn_t ppn, pfn_t * old, bool cmp)
 {
     struct ssd_disk * sdk = ssd_disk(disk);
-    pfn_t lpdn,lpdo,hidx,dir;
+    pfn_t lpdn,dir;
     struct cmt_entry * ent;
     struct global_mapping_page * mpage = NULL;
     unsigned long flags;
+    int err = 0;
     bool ret;
 
     lpdn = LPN_TO_MDIR(lpn);
-    lpdo = LPN_TO_MOFF(lpn);
-    hidx = CMT_HASH_MASK(lpdn);
-    ent = &sdk->cmt.el[hidx];
-
-    dir = get_page_dir(sdk, lpn);
+    ent = cmt_entry(sdk, lpdn);
 
-    if (dir) {
-        write_lock_irqsave(&ent->rw_lock, flags);
-        ret = search_set_hash_mapping(lpn, ppn, ent);
-        write_unlock_irqrestore(&ent->rw_lock, flags);
-        if (ret)
-            return;
+    write_lock_irqsave(&ent->rw_lock, flags);
+    ret = search_set_hash_mapping(lpn, ppn, ent, old, cmp);
+    write_unlock_irqrestore(&ent->rw_lock, flags);
+    trace_sftl_cmt_lookup(disk->disk_name, lpn, true, ret);
+    if (ret) {
+        ftl_stat_inc(sdk, FTL_STAT_CMT_HITS);
+        return 0;
+    }
+    ftl_stat_inc(sdk, FTL_STAT_CMT_MISSES);
+
+again:
+    dir = map_read_get(sdk, lpn);
+    mpage = load_mapping_page(disk, lpdn, dir, &err);
+    if (!mpage) {
+        *old = 0;
+        return err;
     }
-
-    mpage = kmalloc(sizeof(struct global_mapping_page), GFP_KERNEL);
-    mpage->pg = alloc_phys_page();
-    mpage->lpdn = lpdn;
-    mpage->dirty = true;
-    mpage->pg->ppn = dir;
-    mpage->pg->disk = disk;
-    if (dir)
-        read_phys_page(mpage->pg, read_endio);
 
     /*
      * cmt may be updated when reading mapping pages. so before we add the mapping page,
      * check whether the cmt contains the requested page.
      */
     write_lock_irqsave(&ent->rw_lock, flags);
-    ret = search_set_hash_mapping(lpn, ppn, ent);
+    ret = search_set_hash_mapping(lpn, ppn, ent, old, cmp);
     if (ret) {
         write_unlock_irqrestore(&ent->rw_lock, flags);
-        free_phys_page(mpage->pg);
-        kfree(mpage);
-        return;
+        free_mapping_page(mpage);
+        return 0;
+    }
+    if (get_page_dir(sdk, lpn) != dir) {
+        write_unlock_irqrestore(&ent->rw_lock, flags);
+        free_mapping_page(mpage);
+        goto again;
     }
 
-    list_add(&mpage->next, &ent->hlist);
-    PAGE_PFN_ENTRY(mpage->pg, lpdo) = ppn;
-    ent->dirty ++;
+    cmt_add_page(sdk, ent, mpage);
+    search_set_hash_mapping(lpn, ppn, ent, old, cmp);
 
     write_unlock_irqrestore(&ent->rw_lock, flags);
+    cmt_shrink(sdk, lpdn);
+    return 0;
 }
 
-void flush_mapping_pages(struct gendisk * disk)
+/*
+ * map @lpn to @ppn, returns the ppn it was mapped to. If its mapping page
+ * cannot be read @lpn is left as it is, 0 is returned and *@err is set
+ * unless @err is NULL.
+ */
+pfn_t set_phys_ppn(struct gendisk * disk, pfn_t lpn, pfn_t ppn, int * err)
 {
-    int i;
-    unsigned long flags;
-    struct cmt_entry * ent;
-    struct ssd_disk * sdk = ssd_disk(disk);
-    struct global_mapping_page * mpage = NULL;
-
-    /* TODO:
-     * We should prevent the data updating ops to update the mapping entries
-     * before the flush opertations finished
-     */
+    pfn_t old = 0;
+    int error;
 
-    /*
-     * Add dirty pages to flush list, clear the dirty flag
-     */
-    for (i = 0; i < CMT_ENTRY_SIZE; i++) {
-        ent = &sdk->cmt.el[i];
-        if (ent->dirty) {
-            write_lock_irqsave(&ent->rw_lock, flags);
-            if (!list_empty(&ent->hlist)) {
-                list_for_each_entry(mpage, &ent->hlist, next) {
-                    if (mpage->dirty) {
-                        list_add(&mpage->list, &sdk->mflush_list);
-                        mpage->dirty = false;
-                    }
-                }
-            }
-            ent->dirty = 0;
-            write_unlock_irqrestore(&ent->rw_lock, flags);
-        }
-    }
+    error = __set_phys_ppn(disk, lpn, ppn, &old, false);
+    if (error && err)
+        *err = error;
+    return old;
 }
 
-void init_mapping_dir(struct gendisk * disk)
+/*
+ * map @lpn to @ppn if it is still mapped to @old, used to move a page
+ * that the host may overwrite meanwhile. Returns the ppn it was mapped
+ * to, the mapping changed if that is @old. It did not if its mapping
+ * page cannot be read, 0 is returned and *@err set as by set_phys_ppn.
+ */
+pfn_t cmpxchg_phys_ppn(struct gendisk * disk, pfn_t lpn, pfn_t old, pfn_t ppn, int * err)
 {
-    struct ssd_disk * sdk = ssd_disk(disk);
-    u32 i, pi;
-    int err;
-    u64 nr_pages = sdk->capacity / (PAGE_SECTOR * PHYS_PAGE_SIZE / sizeof(void *));
-    struct blk_plug plug;
+    int error;
 
-    nr_pages /= (PHYS_PAGE_SIZE / sizeof(void *));
-    SDEBUG("GMT: %llx pages, with capacity %llx sectors\n", nr_pages, sdk->capacity);
+    error = __set_phys_ppn(disk, lpn, ppn, &old, true);
+    if (error && err)
+        *err = error;
+    return old;
+}
 
-    sdk->gmt.el = vmalloc(sizeof(struct gdir_entry) * nr_pages * HW_TO_MEM_PAGE);
-    sdk->cmt.el = vmalloc(sizeof(struct cmt_entry) * CMT_ENTRY_SIZE);
+static bool cmt_cached(struct ssd_disk * sdk, pfn_t lpn)
+{
+    struct cmt_entry * ent = cmt_entry(sdk, LPN_TO_MDIR(lpn));
+    unsigned long flags;
+    bool cached;
 
-    if (!sdk->gmt.el) {
-        printk(KERN_ERR "ftl: cannot vmalloc gmt entries!\n");
-        return;
-    }
+    read_lock_irqsave(&ent->rw_lock, flags);
+    cached = search_hash_page(LPN_TO_MDIR(lpn), ent) != NULL;
+    read_unlock_irqrestore(&ent->rw_lock, flags);
 
-    if (!sdk->cmt.el) {
-        printk(KERN_ERR "ftl: cannot vmalloc cmt entries\n");
-        return;
-    }
+    return cached;
+}
 
-    memset(sdk->cmt.el, 0, sizeof(struct cmt_entry) * CMT_ENTRY_SIZE);
-    for (i = 0; i < CMT_ENTRY_SIZE; i++) {
-        INIT_LIST_HEAD(&sdk->cmt.el[i].hlist);
-        rwlock_init(&sdk->cmt.el[i].rw_lock);
+/*
+ * The read of a mapping page the bios parked on it wait for is done: the
+ * page goes into the cmt, unless a synchronous miss put it there first,
+ * and the bios are resumed in the order they came.
+ */
+static void map_pending_work(struct work_struct * work)
+{
+    struct map_pending * mp = container_of(work, struct map_pending, work);
+    struct global_mapping_page * mpage = mp->mpage;
+    struct gendisk * disk = mpage->pg->disk;
+    struct ssd_disk * sdk = ssd_disk(disk);
+    struct cmt_entry * ent = cmt_entry(sdk, mpage->lpdn);
+    struct map_waiter * w, * next;
+    int error = mpage->pg->retval;
+    pfn_t lpdn = mpage->lpdn;
+    unsigned long flags;
+
+    trace_sftl_map_read_done(disk->disk_name, mpage->lpdn, mpage->pg->ppn, error);
+    if (!error)
+        ftl_stat_inc(sdk, FTL_STAT_MAP_READS);
+
+    write_lock_irqsave(&ent->rw_lock, flags);
+    list_del(&mp->list);
+    // a stale copy is dropped, the waiters then look the page up the usual way
+    if (!error && !search_hash_page(mpage->lpdn, ent) &&
+            get_page_dir(sdk, mpage->lpdn << MDIR_SHIFT) == mpage->pg->ppn) {
+        cmt_add_page(sdk, ent, mpage);
+        mpage = NULL;
+    }
+    write_unlock_irqrestore(&ent->rw_lock, flags);
+
+    if (mpage)
+        free_mapping_page(mpage);
+    else
+        cmt_shrink(sdk, lpdn);
+
+    // nobody can join once it is off the pending list
+    for (w = mp->waiters; w; w = next) {
+        next = w->next;
+        w->fn(w, error);
+    }
+    kfree(mp);
+}
+
+static void map_pending_endio(void * priv, int error)
+{
+    struct map_pending * mp = priv;
+
+    map_read_put(ssd_disk(mp->mpage->pg->disk), mp->mpage->pg->ppn);
+    mp->mpage->pg->retval = error;
+    queue_work(ssd_disk(mp->mpage->pg->disk)->cmt.wq, &mp->work);
+}
+
+/*
+ * Park @w on the read of mapping page @lpdn if one is in flight. Returns
+ * 1 if the page is cached, 0 if @w was parked and -1 otherwise. The
+ * entry is write locked.
+ */
+static int park_on_pending(struct cmt_entry * ent, pfn_t lpdn, struct map_waiter * w)
+{
+    struct map_pending * mp;
+
+    if (search_hash_page(lpdn, ent))
+        return 1;
+
+    list_for_each_entry(mp, &ent->pending, list) {
+        if (mp->mpage->lpdn == lpdn) {
+            w->next = NULL;
+            *mp->tail = w;
+            mp->tail = &w->next;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Make sure the mapping of @lpn is in memory without sleeping on io.
+ * Returns true if it is, or if it cannot be read asynchronously and the
+ * caller has to look it up the usual way. Otherwise the read of its page
+ * is started, or joined if one is in flight, and @w is called back from
+ * the cmt worker when it completes.
+ */
+bool wait_mapping_page(struct gendisk * disk, pfn_t lpn, struct map_waiter * w)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    pfn_t lpdn = LPN_TO_MDIR(lpn), dir;
+    struct cmt_entry * ent = cmt_entry(sdk, lpdn);
+    struct map_pending * mp;
+    unsigned long flags;
+    int ret, err;
+
+    if (cmt_cached(sdk, lpn))
+        return true;
+    // a page never written is created in memory without any io
+    if (!get_page_dir(sdk, lpn) || !sdk->cmt.wq)
+        return true;
+
+    write_lock_irqsave(&ent->rw_lock, flags);
+    ret = park_on_pending(ent, lpdn, w);
+    write_unlock_irqrestore(&ent->rw_lock, flags);
+    if (ret >= 0) {
+        if (!ret)
+            ftl_stat_inc(sdk, FTL_STAT_CMT_MISSES);
+        return ret;
+    }
+
+    mp = kmalloc(sizeof(struct map_pending), GFP_NOWAIT | __GFP_NOWARN);
+    if (!mp)
+        return true;
+    dir = map_read_get(sdk, lpn);
+    mp->mpage = dir ? alloc_mapping_page(disk, lpdn, dir, GFP_NOWAIT | __GFP_NOWARN) : NULL;
+    if (!mp->mpage) {
+        map_read_put(sdk, dir);
+        kfree(mp);
+        return true;
+    }
+    INIT_WORK(&mp->work, map_pending_work);
+    mp->waiters = NULL;
+    mp->tail = &mp->waiters;
+
+    // the page may have been loaded or its read started meanwhile
+    write_lock_irqsave(&ent->rw_lock, flags);
+    ret = park_on_pending(ent, lpdn, w);
+    if (ret < 0) {
+        w->next = NULL;
+        mp->waiters = w;
+        mp->tail = &w->next;
+        list_add(&mp->list, &ent->pending);
+    }
+    write_unlock_irqrestore(&ent->rw_lock, flags);
+    if (ret >= 0) {
+        map_read_put(sdk, dir);
+        free_mapping_page(mp->mpage);
+        kfree(mp);
+        if (!ret)
+            ftl_stat_inc(sdk, FTL_STAT_CMT_MISSES);
+        return ret;
     }
 
-    sdk->bdev = bdget_disk(disk, 0);
-    if (!sdk->bdev) {
-        printk(KERN_ERR "ftl: cannot get bdev from gendisk!\n");
+    ftl_stat_inc(sdk, FTL_STAT_CMT_MISSES);
+    trace_sftl_map_read(disk->disk_name, lpdn, dir, 0);
+    err = ftl_submit_io(sdk, READ, dir, 1, mp->mpage->pg->data, mp->mpage->pg->oob,
+            map_pending_endio, mp);
+    if (err)
+        map_pending_endio(mp, err);
+    return false;
+}
+
+/*
+ * Whether the mapping of @lpn is known without reading a mapping page:
+ * its page is in the cmt or it has none on the flash.
+ */
+bool mapping_in_memory(struct gendisk * disk, pfn_t lpn)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+
+    return cmt_cached(sdk, lpn) || !get_page_dir(sdk, lpn);
+}
+
+/*
+ * An in-place disk has no mapping on the flash, a unit is read from where
+ * it was written. The units discarded since the disk was attached are kept
+ * in a bitmap and read as zeros until they are written again. Without the
+ * bitmap, every unit is read from the device.
+ */
+static unsigned int discarded_run(struct ssd_disk * sdk, pfn_t lpn, unsigned int max)
+{
+    unsigned long end = sdk->capacity >> unit_sector_shift(sdk);
+
+    if (!sdk->discarded || lpn >= end)
+        return 0;
+
+    end = min_t(unsigned long, end, (unsigned long)lpn + max);
+    return find_next_zero_bit(sdk->discarded, end, lpn) - lpn;
+}
+
+static void discard_in_place(struct ssd_disk * sdk, pfn_t lpn, unsigned int count)
+{
+    unsigned long end = sdk->capacity >> unit_sector_shift(sdk);
+    unsigned long flags;
+
+    if (!sdk->discarded || lpn >= end)
+        return;
+
+    spin_lock_irqsave(&sdk->discard_lock, flags);
+    bitmap_set(sdk->discarded, lpn, min_t(unsigned long, count, end - lpn));
+    spin_unlock_irqrestore(&sdk->discard_lock, flags);
+}
+
+/* Unit @lpn is written in place, it reads from the device again. */
+void map_in_place(struct gendisk * disk, pfn_t lpn)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    unsigned long flags;
+
+    if (!sdk->discarded || lpn >= (sdk->capacity >> unit_sector_shift(sdk)) ||
+            !test_bit(lpn, sdk->discarded))
         return;
+
+    spin_lock_irqsave(&sdk->discard_lock, flags);
+    __clear_bit(lpn, sdk->discarded);
+    spin_unlock_irqrestore(&sdk->discard_lock, flags);
+}
+
+/*
+ * Count the entries from @lpn, at most @max and within its mapping page,
+ * that are unmapped in the page. Returns -1 if the page is not cached.
+ */
+static int cached_unmapped_run(struct ssd_disk * sdk, pfn_t lpn, unsigned int max)
+{
+    struct cmt_entry * ent = cmt_entry(sdk, LPN_TO_MDIR(lpn));
+    struct global_mapping_page * mpage;
+    unsigned long flags;
+    int run = -1;
+
+    max = min_t(unsigned int, max, MDIR_ENTRIES - LPN_TO_MOFF(lpn));
+    read_lock_irqsave(&ent->rw_lock, flags);
+    mpage = search_hash_page(LPN_TO_MDIR(lpn), ent);
+    if (mpage)
+        run = scan_run(&PAGE_PFN_ENTRY(mpage->pg, LPN_TO_MOFF(lpn)), max, 0);
+    read_unlock_irqrestore(&ent->rw_lock, flags);
+    if (mpage)
+        ftl_stat_inc(sdk, FTL_STAT_CMT_HITS);
+    return run;
+}
+
+/*
+ * Count the pages starting from @lpn (at most @max) that have no mapping.
+ * A mapping page that is neither in the directory nor in the cmt makes
+ * its whole range unmapped, which is answered without any io, and a
+ * cached one is scanned at once. A volume keeps ppn 0 out of its
+ * allocator, so an entry of 0 is unmapped. A page that cannot be read
+ * ends the run, the lookup of the caller fails on it then.
+ */
+unsigned int get_unmapped_run(struct gendisk * disk, pfn_t lpn, unsigned int max)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    unsigned int n = 0, step;
+    int run, err = 0;
+
+    if (!sdk->vol)
+        return discarded_run(sdk, lpn, max);
+
+    while (n < max) {
+        if (!cmt_cached(sdk, lpn) && !get_page_dir(sdk, lpn)) {
+            // unless the block map has some of them
+            step = ftl_block_unmapped(sdk, lpn, MDIR_ENTRIES - LPN_TO_MOFF(lpn));
+            if (!step)
+                break;
+            n += step;
+            lpn += step;
+            continue;
+        }
+
+        run = cached_unmapped_run(sdk, lpn, max - n);
+        if (run < 0) {
+            // loads the page for the next ones
+            if (get_phys_ppn(disk, lpn, 0, &err) || err)
+                break;
+            n ++;
+            lpn ++;
+            continue;
+        }
+        step = ftl_block_unmapped(sdk, lpn, run);
+        n += step;
+        lpn += step;
+        if (!step || step < run)
+            break;
+    }
+
+    return min(n, max);
+}
+
+/*
+ * Drop the mappings of @count pages starting from @lpn, used by discard.
+ * Ranges that are already unmapped are skipped without creating mapping
+ * pages for them. On a volume the flash pages become garbage. Returns
+ * the error of a mapping page that cannot be read, its units are left
+ * mapped and the rest are still dropped.
+ */
+int unmap_phys_range(struct gendisk * disk, pfn_t lpn, unsigned int count)
+{
+    unsigned int run;
+    int err = 0;
+
+    if (!ssd_disk(disk)->vol) {
+        discard_in_place(ssd_disk(disk), lpn, count);
+        return 0;
+    }
+
+    ftl_bmap_discard(ssd_disk(disk), lpn, count);
+    while (count) {
+        run = get_unmapped_run(disk, lpn, count);
+        if (!run) {
+            ftl_invalidate_page(ssd_disk(disk), set_phys_ppn(disk, lpn, 0, &err));
+            run = 1;
+        }
+        lpn += run;
+        count -= run;
+    }
+    return err;
+}
+
+static void prefetch_work(struct work_struct * work)
+{
+    struct mapping_prefetch * mpf = container_of(work, struct mapping_prefetch, work);
+    struct ssd_disk * sdk = container_of(mpf, struct ssd_disk, mpf);
+    pfn_t lpn, max = sector_to_lpn(sdk, sdk->capacity);
+    unsigned long flags;
+
+    for (;;) {
+        spin_lock_irqsave(&mpf->lock, flags);
+        if (mpf->head == mpf->tail) {
+            spin_unlock_irqrestore(&mpf->lock, flags);
+            break;
+        }
+        lpn = mpf->queue[mpf->head++ % MAP_PREFETCH_QUEUE] << MDIR_SHIFT;
+        spin_unlock_irqrestore(&mpf->lock, flags);
+
+        if (lpn >= max)
+            continue;
+        // read ahead is the first to give way, the stream reads the page itself then
+        if (!mapping_in_memory(sdk->gd, lpn) && ftl_qos_take(sdk, IO_MAP, 1))
+            continue;
+        // loads the mapping page into the cmt if it is on the flash
+        get_phys_ppn(sdk->gd, lpn, 0, NULL);
     }
+}
+
+/*
+ * Track sequential read streams and read the mapping pages ahead of them,
+ * so that a stream crossing a mapping page boundary finds the page in the
+ * cmt instead of stalling on the mapping read. The reads are done by a
+ * worker, the caller never waits.
+ */
+void detect_seq_stream(struct gendisk * disk, sector_t sector, unsigned int nr_sects)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    struct mapping_prefetch * mpf = &sdk->mpf;
+    struct seq_stream * s, * victim = &mpf->streams[0];
+    pfn_t lpn = sector_to_lpn(sdk, sector), target;
+    unsigned long flags;
+    bool queued = false;
+    int i;
 
-    err = blkdev_get(sdk->bdev, FMODE_READ, NULL);
-    if (err < 0) {
-        sdk->bdev_err = err;
-        printk(KERN_ERR "ftl: cannot get block device!\n");
+    if (!mpf->wq)
         return;
+
+    spin_lock_irqsave(&mpf->lock, flags);
+    for (i = 0; i < MAP_STREAMS; i++) {
+        s = &mpf->streams[i];
+        if (s->seq && s->next == lpn)
+            break;
+        if (time_before(s->last, victim->last))
+            victim = s;
     }
 
-    blk_start_plug(&plug);
-    INIT_LIST_HEAD(&sdk->gmt.list);
-    for (i = 0; i < nr_pages; i++) {
-        struct phys_page * page = alloc_phys_page();
-        list_add(&page->list, &sdk->gmt.list);
-        for (pi = i * HW_TO_MEM_PAGE; pi < (i + 1) * HW_TO_MEM_PAGE; pi ++) {
-            sdk->gmt.el[pi].hw_page = page;
-            sdk->gmt.el[pi].page = page->data[pi - i * HW_TO_MEM_PAGE];
-            sdk->gmt.el[pi].dirty = 0;
+    if (i == MAP_STREAMS) {
+        s = victim;
+        s->seq = 0;
+        s->ahead = LPN_TO_MDIR(lpn);
+    }
+    s->seq ++;
+    s->next = sector_to_lpn(sdk, sector + nr_sects);
+    s->last = jiffies;
+
+    if (s->seq >= MAP_STREAM_SEQ) {
+        target = LPN_TO_MDIR(s->next + MAP_PREFETCH_DIST) + MAP_PREFETCH_DEPTH - 1;
+        while (s->ahead < target && mpf->tail - mpf->head < MAP_PREFETCH_QUEUE) {
+            mpf->queue[mpf->tail++ % MAP_PREFETCH_QUEUE] = ++s->ahead;
+            queued = true;
+        }
+    }
+    spin_unlock_irqrestore(&mpf->lock, flags);
+
+    if (queued)
+        queue_work(mpf->wq, &mpf->work);
+}
+
+void flush_mapping_pages(struct gendisk * disk)
+{
+    unsigned int i, j;
+    unsigned int queued = 0;
+    unsigned long flags;
+    struct cmt_entry * ent;
+    struct cmt_shard * shard;
+    struct ssd_disk * sdk = ssd_disk(disk);
+    struct global_mapping_page * mpage = NULL;
+
+    /* TODO:
+     * We should prevent the data updating ops to update the mapping entries
+     * before the flush opertations finished
+     */
+
+    /*
+     * Add dirty pages to the flush list of their shard, clear the dirty
+     * flag. A page dirtied again before it was written back is already on
+     * the list. ftl_map_sync writes them back.
+     */
+    for (i = 0; i < sdk->cmt.nr_shards; i++) {
+        shard = &sdk->cmt.shards[i];
+        for (j = 0; j <= sdk->cmt.bucket_mask; j++) {
+            ent = &shard->el[j];
+            if (!ent->dirty)
+                continue;
+            write_lock_irqsave(&ent->rw_lock, flags);
+            spin_lock(&shard->lock);
+            list_for_each_entry(mpage, &ent->hlist, next) {
+                if (mpage->dirty) {
+                    if (list_empty(&mpage->list))
+                        list_add(&mpage->list, &shard->flush);
+                    mpage->dirty = false;
+                    ftl_stat_inc(sdk, FTL_STAT_MAP_QUEUED);
+                    trace_sftl_map_queue(disk->disk_name, mpage->lpdn,
+                            mpage->pg->ppn, 0);
+                    queued ++;
+                }
+            }
+            spin_unlock(&shard->lock);
+            ent->dirty = 0;
+            write_unlock_irqrestore(&ent->rw_lock, flags);
+        }
+    }
+    trace_sftl_flush(disk->disk_name, SFTL_FLUSH_MAPPING, queued, 0);
+}
+
+/* the load of the directory, or any io on the mapping a volume saves */
+struct gmd_load {
+    struct gendisk * disk;
+    atomic_t pending;       // ios in flight, plus one held by the submitter
+    int error;
+    pfn_t base;             // ppn of directory page 0
+    struct completion done;
+};
+
+struct gmd_loader {
+    struct work_struct work;
+    struct gmd_load * load;
+    u32 start, end;         // directory pages read by this worker
+};
+
+static void gmd_io_endio(void * priv, int error)
+{
+    struct gmd_load * load = priv;
+
+    if (error)
+        load->error = error;
+
+    if (atomic_dec_and_test(&load->pending))
+        complete(&load->done);
+}
+
+static void gmd_io_init(struct gmd_load * load, struct gendisk * disk, pfn_t base)
+{
+    load->disk = disk;
+    load->error = 0;
+    load->base = base;
+    atomic_set(&load->pending, 1);
+    init_completion(&load->done);
+}
+
+static void gmd_io_submit(struct gmd_load * load, int rw, pfn_t ppn, unsigned int nr,
+        struct page ** pages)
+{
+    atomic_inc(&load->pending);
+    if (ftl_submit_io(ssd_disk(load->disk), rw, ppn, nr, pages, NULL, gmd_io_endio, load))
+        gmd_io_endio(load, -ENOMEM);
+}
+
+/* wait for the ios submitted, @load can be used again after */
+static int gmd_io_wait(struct gmd_load * load)
+{
+    int err;
+
+    if (!atomic_dec_and_test(&load->pending))
+        wait_for_completion(&load->done);
+    err = load->error;
+    gmd_io_init(load, load->disk, load->base);
+    return err;
+}
+
+/*
+ * The directory array is physically contiguous when the buddy allocator
+ * can give it in one piece, up to 4MB, which covers 16TB of disk. It is
+ * then in the linear mapping of the kernel and so under its huge pages,
+ * and a lookup costs no tlb miss of its own. Larger ones are vmalloced.
+ */
+static pfn_t * alloc_dir_array(size_t size, int node)
+{
+    void * addr = NULL;
+
+    if (size <= (PAGE_SIZE << (MAX_ORDER - 1)))
+        addr = alloc_pages_exact_nid(node, size, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+    if (!addr)
+        addr = vzalloc_node(size, node);
+    return addr;
+}
+
+static void free_dir_array(pfn_t * dir, size_t size)
+{
+    if (is_vmalloc_addr(dir))
+        vfree(dir);
+    else
+        free_pages_exact(dir, size);
+}
+
+static inline struct page * dir_array_page(void * addr)
+{
+    return is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+}
+
+/* the memory pages of flash pages [@first, @first + @nr) of @buf */
+static void dir_array_pages(void * buf, u32 first, u32 nr, struct page ** pages)
+{
+    char * addr = (char *)buf + (size_t)first * PHYS_PAGE_SIZE;
+    u32 i;
+
+    for (i = 0; i < nr * HW_TO_MEM_PAGE; i++)
+        pages[i] = dir_array_page(addr + i * MEM_PAGE_SIZE);
+}
+
+/*
+ * The directory is read on every cmt miss and written only when a
+ * mapping page is, so with several nodes each gets a copy of its own to
+ * read from. The copy of the node of the device is the directory itself.
+ */
+static void init_dir_replicas(struct ssd_disk * sdk)
+{
+    struct global_mapping_dir * gmt = &sdk->gmt;
+    size_t size = (size_t)gmt->nr_pages * PHYS_PAGE_SIZE;
+    int node;
+
+    if (num_online_nodes() < 2)
+        return;
+
+    gmt->replicas = kzalloc(sizeof(pfn_t *) * nr_node_ids, GFP_KERNEL);
+    if (!gmt->replicas)
+        return;
+
+    for_each_online_node(node) {
+        if (node == sdk->node) {
+            gmt->replicas[node] = gmt->dir;
+            continue;
         }
-        page->disk = disk;
-        page->ppn = i;
-        read_phys_page(page, read_endio);
+        gmt->replicas[node] = alloc_dir_array(size, node);
+        // the nodes without a copy read the directory itself
+        if (!gmt->replicas[node]) {
+            printk(KERN_ERR "ftl: no copy of the mapping dir on node %d\n", node);
+            continue;
+        }
+        memcpy(gmt->replicas[node], gmt->dir, size);
+    }
+}
+
+static void exit_dir_replicas(struct ssd_disk * sdk)
+{
+    struct global_mapping_dir * gmt = &sdk->gmt;
+    int node;
+
+    if (!gmt->replicas)
+        return;
+
+    for (node = 0; node < nr_node_ids; node++) {
+        if (gmt->replicas[node] && gmt->replicas[node] != gmt->dir)
+            free_dir_array(gmt->replicas[node], (size_t)gmt->nr_pages * PHYS_PAGE_SIZE);
+    }
+    kfree(gmt->replicas);
+    gmt->replicas = NULL;
+}
+
+/*
+ * read directory pages [@first, @first + @nr) with one request, straight
+ * into the directory array. The pages are laid out from load->base.
+ */
+static void read_gmd_pages(struct gmd_load * load, struct page ** pages, u32 first, u32 nr)
+{
+    dir_array_pages(ssd_disk(load->disk)->gmt.dir, first, nr, pages);
+    gmd_io_submit(load, READ, load->base + first, nr, pages);
+}
+
+/*
+ * Check the directory pages just loaded from @base against their headers
+ * @hdrs. The directory is sealed after the mapping pages it points at, so
+ * the highest sequence among its pages, in *@seq, is that of the
+ * checkpoint. A bad page fails the checkpoint rather than have its
+ * mapping pages trusted.
+ */
+static int verify_gmd_pages(struct ssd_disk * sdk, const struct map_page_hdr * hdrs, pfn_t base,
+        u64 * seq)
+{
+    struct page * pages[HW_TO_MEM_PAGE];
+    u32 i, bad = 0;
+
+    *seq = 0;
+    for (i = 0; i < sdk->gmt.nr_pages; i++) {
+        dir_array_pages(sdk->gmt.dir, i, 1, pages);
+        if (verify_map_page(sdk, pages, &hdrs[i], DIR_HDR_MAGIC, i, base + i))
+            bad ++;
+        else
+            *seq = max_t(u64, *seq, hdrs[i].seq);
+    }
+    seen_seq(sdk, *seq);
+
+    if (bad) {
+        printk(KERN_ERR "ftl: %u of %u mapping dir pages are bad\n", bad, sdk->gmt.nr_pages);
+        return -EIO;
     }
+    return 0;
+}
+
+static void gmd_load_work(struct work_struct * work)
+{
+    struct gmd_loader * ld = container_of(work, struct gmd_loader, work);
+    struct gmd_load * load = ld->load;
+    struct page ** pages;
+    struct blk_plug plug;
+    u32 i, nr;
 
+    pages = kmalloc(sizeof(struct page *) * GMD_LOAD_BATCH * HW_TO_MEM_PAGE, GFP_KERNEL);
+    if (!pages) {
+        load->error = -ENOMEM;
+        return;
+    }
+
+    blk_start_plug(&plug);
+    for (i = ld->start; i < ld->end; i += nr) {
+        nr = min_t(u32, ld->end - i, GMD_LOAD_BATCH);
+        read_gmd_pages(load, pages, i, nr);
+    }
     blk_finish_plug(&plug);
 
-    if (sdk->bdev && !(sdk->bdev_err < 0)) {
-        SDEBUG("put blk device\n");
-        blkdev_put(sdk->bdev, FMODE_READ);
+    kfree(pages);
+}
+
+/*
+ * Split the cmt into nr_shards lpn ranges, one per online cpu unless it
+ * was set, and the CMT_ENTRY_SIZE buckets among them. The shards go
+ * round robin over the online nodes.
+ */
+static int init_cmt_shards(struct ssd_disk * sdk)
+{
+    struct cached_mapping_table * cmt = &sdk->cmt;
+    unsigned int nr = cmt->nr_shards, nr_buckets, max_pages, i, j;
+    struct cmt_shard * shard;
+    int node = first_online_node;
+
+    if (!nr)
+        nr = num_online_cpus();
+    nr = roundup_pow_of_two(clamp_t(unsigned int, nr, 1, CMT_MAX_SHARDS));
+    // no more shards than mapping pages
+    while (nr > 1 && (nr >> 1) >= sdk->gmt.nents)
+        nr >>= 1;
+
+    cmt->shard_shift = 0;
+    if (sdk->gmt.nents > nr)
+        cmt->shard_shift = ilog2(roundup_pow_of_two(DIV_ROUND_UP(sdk->gmt.nents, nr)));
+    nr_buckets = max_t(unsigned int, CMT_ENTRY_SIZE / nr, CMT_SHARD_MIN_BUCKETS);
+    cmt->bucket_mask = nr_buckets - 1;
+
+    // exit_mapping_dir walks the cmt, so it is only set once initialized
+    cmt->shards = kzalloc_node(sizeof(struct cmt_shard) * nr, GFP_KERNEL, sdk->node);
+    if (!cmt->shards) {
+        printk(KERN_ERR "ftl: cannot allocate cmt shards\n");
+        return -ENOMEM;
+    }
+    cmt->nr_shards = nr;
+    if (!cmt->max_pages)
+        cmt->max_pages = CMT_DEFAULT_PAGES;
+    max_pages = max_t(unsigned int, DIV_ROUND_UP(cmt->max_pages, nr), CMT_SHARD_MIN_PAGES);
+
+    for (i = 0; i < nr; i++) {
+        shard = &cmt->shards[i];
+        shard->node = node;
+        spin_lock_init(&shard->lock);
+        INIT_LIST_HEAD(&shard->flush);
+        atomic_set(&shard->pages, 0);
+        shard->max_pages = max_pages;
+        atomic_set(&shard->hand, 0);
+        shard->el = vzalloc_node(sizeof(struct cmt_entry) * nr_buckets, node);
+        if (!shard->el) {
+            printk(KERN_ERR "ftl: cannot vmalloc cmt entries\n");
+            return -ENOMEM;
+        }
+        for (j = 0; j < nr_buckets; j++) {
+            INIT_LIST_HEAD(&shard->el[j].hlist);
+            INIT_LIST_HEAD(&shard->el[j].pending);
+            rwlock_init(&shard->el[j].rw_lock);
+        }
+
+        node = next_online_node(node);
+        if (node == MAX_NUMNODES)
+            node = first_online_node;
     }
 
-    /*if (sdk->bdev)
-        bdput(sdk->bdev);*/
+    return 0;
+}
+
+/* read or write the @nr flash pages of @buf, vmalloced or a directory array, at @ppn */
+static int map_area_io(struct ssd_disk * sdk, int rw, pfn_t ppn, void * buf, u32 nr)
+{
+    struct gmd_load io;
+    struct page ** pages;
+    u32 i, n;
+
+    pages = kmalloc(sizeof(struct page *) * GMD_LOAD_BATCH * HW_TO_MEM_PAGE, GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+
+    gmd_io_init(&io, sdk->gd, 0);
+    for (i = 0; i < nr; i += n) {
+        n = min_t(u32, nr - i, GMD_LOAD_BATCH);
+        dir_array_pages(buf, i, n, pages);
+        gmd_io_submit(&io, rw, ppn + i, n, pages);
+    }
+    kfree(pages);
+    return gmd_io_wait(&io);
+}
+
+/*
+ * Erase the mapping slots. The first header page of each is written
+ * blank as well, a block device may not read a discarded page as zeros.
+ */
+static int clear_map_area(struct ssd_disk * sdk)
+{
+    struct map_area ma;
+    unsigned int s;
+    void * blank;
+    int err;
+
+    map_area(sdk, 0, &ma);
+    err = ftl_io_erase(sdk, ma.start, sdk->vol->meta_pages - ma.start);
+    if (err)
+        return err;
+
+    blank = vzalloc(PHYS_PAGE_SIZE);
+    if (!blank)
+        return -ENOMEM;
+    for (s = 0; s < MAP_SLOTS && !err; s++) {
+        map_area(sdk, s, &ma);
+        err = map_area_io(sdk, WRITE, ma.start, blank, 1);
+    }
+    vfree(blank);
+    return err;
+}
+
+static void copy_map_data(struct page ** dst, struct page ** src)
+{
+    int i;
+
+    for (i = 0; i < HW_TO_MEM_PAGE; i++)
+        memcpy(page_address(dst[i]), page_address(src[i]), MEM_PAGE_SIZE);
+}
+
+/* the crc32c of the headers of a log segment, the first one up to its crc */
+static u32 log_seg_crc(const struct map_page_hdr * hdrs)
+{
+    u32 crc = crc32c(~0, &hdrs[1], sizeof(struct map_page_hdr) * hdrs[0].lpdn);
+
+    return ~crc32c(crc, hdrs, offsetof(struct map_page_hdr, crc));
+}
+
+/* mapping pages written in batches of consecutive flash pages */
+struct map_batch {
+    struct gmd_load io;
+    struct page ** pages;       // GMD_LOAD_BATCH flash pages
+    pfn_t ppn;                  // where the first one goes
+    u32 n;
+};
+
+static int map_batch_init(struct map_batch * b, struct gendisk * disk)
+{
+    u32 i;
+
+    gmd_io_init(&b->io, disk, 0);
+    b->n = 0;
+    b->pages = kzalloc(sizeof(struct page *) * GMD_LOAD_BATCH * HW_TO_MEM_PAGE, GFP_NOIO);
+    if (!b->pages)
+        return -ENOMEM;
+    for (i = 0; i < GMD_LOAD_BATCH * HW_TO_MEM_PAGE; i++) {
+        b->pages[i] = alloc_page(GFP_NOIO);
+        if (!b->pages[i])
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+static void map_batch_exit(struct map_batch * b)
+{
+    u32 i;
+
+    for (i = 0; b->pages && i < GMD_LOAD_BATCH * HW_TO_MEM_PAGE; i++) {
+        if (b->pages[i])
+            __free_page(b->pages[i]);
+    }
+    kfree(b->pages);
+}
+
+/* write the pages batched and wait for them */
+static int map_batch_flush(struct map_batch * b)
+{
+    if (b->n)
+        gmd_io_submit(&b->io, WRITE, b->ppn, b->n, b->pages);
+    b->n = 0;
+    return gmd_io_wait(&b->io);
+}
+
+/*
+ * the memory pages to fill with the flash page to write at @ppn. The
+ * batch is written first if @ppn does not follow it or it is full, NULL
+ * is returned and *@err set if that fails.
+ */
+static struct page ** map_batch_page(struct map_batch * b, pfn_t ppn, int * err)
+{
+    if (b->n && (b->n == GMD_LOAD_BATCH || ppn != b->ppn + b->n)) {
+        *err = map_batch_flush(b);
+        if (*err)
+            return NULL;
+    }
+    if (!b->n)
+        b->ppn = ppn;
+    return &b->pages[b->n++ * HW_TO_MEM_PAGE];
+}
+
+/* the log of a slot being written, see MAP_LOG_SEG_PAGES */
+struct map_log {
+    struct map_batch b;
+    struct map_page_hdr * hdrs;     // of the segment being filled, a flash page
+    pfn_t seg;                      // its header page
+    u32 nr;                         // its pages
+    pfn_t next, end;
+};
+
+static int map_log_init(struct map_log * log, struct gendisk * disk, pfn_t next, pfn_t end)
+{
+    int err;
+
+    log->nr = 0;
+    log->next = next;
+    log->end = end;
+    log->hdrs = kzalloc(PHYS_PAGE_SIZE, GFP_NOIO);
+    err = map_batch_init(&log->b, disk);
+    return log->hdrs ? err : -ENOMEM;
+}
+
+static void map_log_exit(struct map_log * log)
+{
+    map_batch_exit(&log->b);
+    kfree(log->hdrs);
+}
+
+/* the pages @nr mapping pages take in the log */
+static inline u32 map_log_pages(u32 nr)
+{
+    return nr + DIV_ROUND_UP(nr, (u32)MAP_LOG_SEG_PAGES);
+}
+
+/* close the segment being filled, its header goes after its pages */
+static int map_log_seal(struct ssd_disk * sdk, struct map_log * log)
+{
+    struct page ** dst;
+    int i, err = 0;
+
+    if (!log->nr)
+        return 0;
+    log->hdrs[0].magic = LOG_HDR_MAGIC;
+    log->hdrs[0].lpdn = log->nr;
+    log->hdrs[0].seq = atomic64_inc_return(&sdk->gmt.seq);
+    log->hdrs[0].rsvd = 0;
+    log->hdrs[0].crc = log_seg_crc(log->hdrs);
+    dst = map_batch_page(&log->b, log->seg, &err);
+    for (i = 0; dst && i < HW_TO_MEM_PAGE; i++)
+        memcpy(page_address(dst[i]), (char *)log->hdrs + i * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+    memset(log->hdrs, 0, PHYS_PAGE_SIZE);
+    log->nr = 0;
+    return err;
+}
+
+/* add mapping page @lpdn, as it is in @src, to the log, *@ppn is where it goes */
+static int map_log_add(struct ssd_disk * sdk, struct map_log * log, pfn_t lpdn,
+        struct page ** src, pfn_t * ppn)
+{
+    struct page ** dst;
+    int err = 0;
+
+    if (log->nr == MAP_LOG_SEG_PAGES) {
+        err = map_log_seal(sdk, log);
+        if (err)
+            return err;
+    }
+    if (!log->nr) {
+        if (log->end - log->next < 2)
+            return -ENOSPC;
+        log->seg = log->next++;
+    }
+    dst = map_batch_page(&log->b, log->next, &err);
+    if (!dst)
+        return err;
+    copy_map_data(dst, src);
+    log->nr ++;
+    seal_map_page(sdk, dst, &log->hdrs[log->nr], MAP_HDR_MAGIC, lpdn);
+    trace_sftl_map_write(sdk->gd->disk_name, lpdn, log->next, 0);
+    *ppn = log->next++;
+    return 0;
+}
+
+/* seal the last segment and wait for all of the log */
+static int map_log_flush(struct ssd_disk * sdk, struct map_log * log)
+{
+    int err = map_log_seal(sdk, log), ret;
+
+    ret = map_batch_flush(&log->b);
+    return err ? err : ret;
+}
+
+/* read flash page @ppn into @pages and wait for it */
+static int read_map_page(struct ssd_disk * sdk, pfn_t ppn, struct page ** pages)
+{
+    struct gmd_load io;
+
+    gmd_io_init(&io, sdk->gd, 0);
+    gmd_io_submit(&io, READ, ppn, 1, pages);
+    return gmd_io_wait(&io);
+}
+
+/*
+ * Copy mapping page @lpdn into @pages, from the cmt or else from where
+ * the directory has it, and take it off the flush list. *@dirty tells
+ * whether it changed since it was last written, its ppn is 0 then until
+ * it is written again. -ENOENT if the page was never written.
+ */
+static int copy_map_page(struct ssd_disk * sdk, pfn_t lpdn, struct page ** pages, bool * dirty)
+{
+    struct cmt_entry * ent = cmt_entry(sdk, lpdn);
+    struct cmt_shard * shard = cmt_shard(sdk, lpdn);
+    struct global_mapping_page * mpage;
+    unsigned long flags;
+    pfn_t dir;
+
+    write_lock_irqsave(&ent->rw_lock, flags);
+    mpage = search_hash_page(lpdn, ent);
+    if (mpage) {
+        copy_map_data(pages, mpage->pg->data);
+        spin_lock(&shard->lock);
+        *dirty = mpage->dirty || !list_empty(&mpage->list);
+        list_del_init(&mpage->list);
+        spin_unlock(&shard->lock);
+        if (mpage->dirty) {
+            mpage->dirty = false;
+            ent->dirty --;
+        }
+        if (*dirty)
+            mpage->pg->ppn = 0;
+    }
+    write_unlock_irqrestore(&ent->rw_lock, flags);
+    if (mpage)
+        return 0;
+
+    *dirty = false;
+    dir = get_page_dir(sdk, lpdn << MDIR_SHIFT);
+    if (!dir)
+        return -ENOENT;
+    return read_map_page(sdk, dir, pages);
+}
+
+/* mark the cached pages of @lpdns dirty again, they were not written */
+static void redirty_map_pages(struct ssd_disk * sdk, const unsigned long * lpdns)
+{
+    struct global_mapping_page * mpage;
+    struct cmt_entry * ent;
+    unsigned long flags;
+    pfn_t lpdn;
+
+    for (lpdn = 0; lpdn < sdk->gmt.nents; lpdn++) {
+        if (!test_bit(lpdn, lpdns))
+            continue;
+        ent = cmt_entry(sdk, lpdn);
+        write_lock_irqsave(&ent->rw_lock, flags);
+        mpage = search_hash_page(lpdn, ent);
+        if (mpage && !mpage->dirty) {
+            mpage->dirty = true;
+            ent->dirty ++;
+        }
+        write_unlock_irqrestore(&ent->rw_lock, flags);
+    }
+}
+
+/*
+ * Point the directory at @dir, the checkpoint written with it is sealed,
+ * and the cached pages at where they are in it.
+ */
+static void switch_page_dir(struct ssd_disk * sdk, const pfn_t * dir)
+{
+    struct global_mapping_page * mpage;
+    struct cmt_entry * ent;
+    unsigned long flags;
+    pfn_t lpdn;
+
+    for (lpdn = 0; lpdn < sdk->gmt.nents; lpdn++) {
+        ent = cmt_entry(sdk, lpdn);
+        write_lock_irqsave(&ent->rw_lock, flags);
+        set_page_dir(sdk, lpdn, dir[lpdn]);
+        mpage = search_hash_page(lpdn, ent);
+        if (mpage)
+            mpage->pg->ppn = dir[lpdn];
+        write_unlock_irqrestore(&ent->rw_lock, flags);
+    }
+}
+
+/*
+ * Write a checkpoint of the mapping into slot @slot and go on with its
+ * log, see struct map_area. The log starts with the pages that changed
+ * since they were last written, read back from the checkpoint: with
+ * them the checkpoint before and its log are the same mapping, which
+ * the load falls back on if a page of this one is bad. Its segments are
+ * newer than the checkpoint, which tells them from those of a slot
+ * written before. The pages not written are dirty again on error.
+ */
+static int write_checkpoint(struct ssd_disk * sdk, unsigned int slot)
+{
+    struct gendisk * disk = sdk->gd;
+    struct global_mapping_dir * gmt = &sdk->gmt;
+    size_t size = (size_t)gmt->nr_pages * PHYS_PAGE_SIZE;
+    struct page * buf[HW_TO_MEM_PAGE], * dir_pages[HW_TO_MEM_PAGE], ** dst;
+    struct map_page_hdr * hdrs;
+    unsigned long * dirty;
+    struct map_batch cp;
+    struct map_log log;
+    struct map_area ma;
+    pfn_t * dir, lpdn, ppn;
+    bool changed;
+    u32 i;
+    int err, ret;
+
+    map_area(sdk, slot, &ma);
+    memset(buf, 0, sizeof(buf));
+    dir = alloc_dir_array(size, sdk->node);
+    hdrs = vzalloc((size_t)(ma.dir - ma.start) * PHYS_PAGE_SIZE);
+    dirty = vzalloc(BITS_TO_LONGS(gmt->nents) * sizeof(long));
+    err = map_batch_init(&cp, disk);
+    ret = map_log_init(&log, disk, ma.log, ma.end);
+    if (!err)
+        err = ret;
+    for (i = 0; i < HW_TO_MEM_PAGE; i++) {
+        buf[i] = alloc_page(GFP_KERNEL);
+        if (!buf[i])
+            err = -ENOMEM;
+    }
+    if (!dir || !hdrs || !dirty)
+        err = -ENOMEM;
+    // the directory has left the slot, reads started before may still be on it
+    smp_mb();
+    wait_event(gmt->wait, !atomic_read(&gmt->reads[slot]));
+    if (!err)
+        err = ftl_io_erase(sdk, ma.start, ma.end - ma.start);
+
+    for (lpdn = 0; lpdn < gmt->nents && !err; lpdn++) {
+        err = copy_map_page(sdk, lpdn, buf, &changed);
+        if (err == -ENOENT) {
+            err = 0;
+            continue;
+        }
+        if (changed)
+            __set_bit(lpdn, dirty);
+        if (err || map_page_empty(buf))
+            continue;
+        ppn = ma.maps + lpdn;
+        dst = map_batch_page(&cp, ppn, &err);
+        if (!dst)
+            break;
+        copy_map_data(dst, buf);
+        seal_map_page(sdk, dst, &hdrs[ppn - ma.dir], MAP_HDR_MAGIC, lpdn);
+        dir[lpdn] = ppn;
+        trace_sftl_map_write(disk->disk_name, lpdn, ppn, 0);
+    }
+    ret = map_batch_flush(&cp);
+    if (!err)
+        err = ret;
+
+    // the directory after the mapping pages, then the log
+    for (i = 0; i < gmt->nr_pages && !err; i++) {
+        dir_array_pages(dir, i, 1, dir_pages);
+        seal_map_page(sdk, dir_pages, &hdrs[i], DIR_HDR_MAGIC, i);
+    }
+    if (!err)
+        err = map_area_io(sdk, WRITE, ma.dir, dir, gmt->nr_pages);
+    if (!err && ma.dir - ma.start > 1)
+        err = map_area_io(sdk, WRITE, ma.start + 1, (char *)hdrs + PHYS_PAGE_SIZE,
+                ma.dir - ma.start - 1);
+    for (lpdn = 0; lpdn < gmt->nents && !err; lpdn++) {
+        if (!test_bit(lpdn, dirty))
+            continue;
+        if (dir[lpdn])
+            err = read_map_page(sdk, dir[lpdn], buf);
+        else
+            for (i = 0; i < HW_TO_MEM_PAGE; i++)
+                memset(page_address(buf[i]), 0, MEM_PAGE_SIZE);
+        if (!err)
+            err = map_log_add(sdk, &log, lpdn, buf, &ppn);
+    }
+    ret = map_log_flush(sdk, &log);
+    if (!err)
+        err = ret;
+
+    // the first header after everything
+    if (!err)
+        err = ftl_vol_flush(sdk);
+    if (!err)
+        err = map_area_io(sdk, WRITE, ma.start, hdrs, 1);
+    if (!err)
+        err = ftl_vol_flush(sdk);
+
+    if (!err) {
+        switch_page_dir(sdk, dir);
+        gmt->slot = slot;
+        gmt->log = log.next;
+    } else if (dirty) {
+        redirty_map_pages(sdk, dirty);
+    }
+
+    for (i = 0; i < HW_TO_MEM_PAGE; i++) {
+        if (buf[i])
+            __free_page(buf[i]);
+    }
+    map_log_exit(&log);
+    map_batch_exit(&cp);
+    vfree(dirty);
+    vfree(hdrs);
+    if (dir)
+        free_dir_array(dir, size);
+    return err;
+}
+
+/* read directory pages from @base into the directory, split among the workers */
+static int load_gmd_pages(struct gendisk * disk, pfn_t base)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    u32 nr_pages = sdk->gmt.nr_pages;
+    struct gmd_loader * ld;
+    struct gmd_load load;
+    u32 i, nr_threads, step;
+
+    nr_threads = min_t(u32, GMD_LOAD_THREADS, num_online_cpus());
+    nr_threads = max_t(u32, min_t(u32, nr_threads, nr_pages), 1);
+    step = DIV_ROUND_UP(nr_pages, nr_threads);
+
+    ld = kmalloc(sizeof(struct gmd_loader) * nr_threads, GFP_KERNEL);
+    if (!ld)
+        return -ENOMEM;
+
+    gmd_io_init(&load, disk, base);
+    for (i = 0; i < nr_threads; i++) {
+        INIT_WORK(&ld[i].work, gmd_load_work);
+        ld[i].load = &load;
+        ld[i].start = min_t(u32, i * step, nr_pages);
+        ld[i].end = min_t(u32, (i + 1) * step, nr_pages);
+        queue_work(system_unbound_wq, &ld[i].work);
+    }
+
+    for (i = 0; i < nr_threads; i++)
+        flush_work(&ld[i].work);
+    kfree(ld);
+
+    return gmd_io_wait(&load);
+}
+
+static void free_loaded_maps(struct ssd_disk * sdk, struct global_mapping_page ** maps)
+{
+    pfn_t lpdn;
+
+    for (lpdn = 0; lpdn < sdk->gmt.nents; lpdn++) {
+        if (maps[lpdn])
+            free_mapping_page(maps[lpdn]);
+        maps[lpdn] = NULL;
+    }
+}
+
+/*
+ * Read the checkpoint of slot @ma: its directory, then the mapping pages
+ * it points at into @maps by lpdn, each checked against its header.
+ * *@seq is the last sequence it was sealed with.
+ */
+static int read_checkpoint(struct gendisk * disk, const struct map_area * ma,
+        struct global_mapping_page ** maps, u64 * seq)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    struct map_page_hdr * hdrs;
+    struct gmd_load io;
+    pfn_t lpdn, ppn;
+    int err, ret;
+
+    hdrs = vzalloc((size_t)(ma->dir - ma->start) * PHYS_PAGE_SIZE);
+    if (!hdrs)
+        return -ENOMEM;
+    err = map_area_io(sdk, READ, ma->start, hdrs, ma->dir - ma->start);
+    if (!err)
+        err = load_gmd_pages(disk, ma->dir);
+    if (!err)
+        err = verify_gmd_pages(sdk, hdrs, ma->dir, seq);
+    if (err)
+        goto out;
+
+    gmd_io_init(&io, disk, ma->dir);
+    for (lpdn = 0; lpdn < sdk->gmt.nents; lpdn++) {
+        ppn = sdk->gmt.dir[lpdn];
+        if (!ppn)
+            continue;
+        if (ppn != ma->maps + lpdn) {
+            printk(KERN_ERR "ftl: mapping page %u of %s saved at bad ppn %u\n", lpdn,
+                    disk->disk_name, ppn);
+            err = -EIO;
+            break;
+        }
+        maps[lpdn] = alloc_mapping_page(disk, lpdn, ppn, GFP_KERNEL);
+        if (!maps[lpdn]) {
+            err = -ENOMEM;
+            break;
+        }
+        gmd_io_submit(&io, READ, ppn, 1, maps[lpdn]->pg->data);
+    }
+    ret = gmd_io_wait(&io);
+    if (!err)
+        err = ret;
+
+    for (lpdn = 0; lpdn < sdk->gmt.nents && !err; lpdn++) {
+        ppn = sdk->gmt.dir[lpdn];
+        if (ppn)
+            err = verify_map_page(sdk, maps[lpdn]->pg->data, &hdrs[ppn - ma->dir],
+                    MAP_HDR_MAGIC, lpdn, ppn);
+    }
+out:
+    vfree(hdrs);
+    return err;
+}
+
+/*
+ * Replay the log of slot @ma over @maps, up to the first segment that is
+ * not whole or not newer than *@seq, the sequence of the last segment
+ * replayed then. The log of the slot goes on from *@end.
+ */
+static int replay_log(struct gendisk * disk, const struct map_area * ma,
+        struct global_mapping_page ** maps, u64 * seq, pfn_t * end)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    struct global_mapping_page ** seg;
+    struct map_page_hdr * hdrs;
+    struct gmd_load io;
+    pfn_t ppn = ma->log, lpdn;
+    u32 i, j, nr;
+    int err = 0, bad;
+
+    hdrs = vmalloc(PHYS_PAGE_SIZE);
+    seg = kmalloc(sizeof(struct global_mapping_page *) * MAP_LOG_SEG_PAGES, GFP_KERNEL);
+    if (!hdrs || !seg) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    while (ma->end - ppn >= 2) {
+        bad = map_area_io(sdk, READ, ppn, hdrs, 1);
+        nr = hdrs[0].lpdn;
+        if (bad || hdrs[0].magic != LOG_HDR_MAGIC || !nr || nr > MAP_LOG_SEG_PAGES ||
+                nr >= ma->end - ppn || hdrs[0].seq <= *seq || hdrs[0].crc != log_seg_crc(hdrs))
+            break;
+
+        gmd_io_init(&io, disk, 0);
+        for (i = 0; i < nr; i++) {
+            lpdn = hdrs[i + 1].lpdn;
+            seg[i] = lpdn < sdk->gmt.nents ?
+                    alloc_mapping_page(disk, lpdn, ppn + 1 + i, GFP_KERNEL) : NULL;
+            if (!seg[i])
+                break;
+            gmd_io_submit(&io, READ, ppn + 1 + i, 1, seg[i]->pg->data);
+        }
+        bad = gmd_io_wait(&io);
+        if (i < nr && hdrs[i + 1].lpdn < sdk->gmt.nents)
+            err = -ENOMEM;
+        for (j = 0; j < i && !bad && !err; j++)
+            bad = verify_map_page(sdk, seg[j]->pg->data, &hdrs[j + 1], MAP_HDR_MAGIC,
+                    seg[j]->lpdn, ppn + 1 + j);
+        if (i < nr || bad) {
+            for (j = 0; j < i; j++)
+                free_mapping_page(seg[j]);
+            break;
+        }
+
+        for (j = 0; j < nr; j++) {
+            lpdn = seg[j]->lpdn;
+            if (maps[lpdn])
+                free_mapping_page(maps[lpdn]);
+            maps[lpdn] = seg[j];
+            sdk->gmt.dir[lpdn] = ppn + 1 + j;
+        }
+        *seq = hdrs[0].seq;
+        seen_seq(sdk, *seq);
+        ppn += nr + 1;
+    }
+    *end = ppn;
+out:
+    kfree(seg);
+    vfree(hdrs);
+    return err;
+}
+
+/* account the units the pages in @maps map in the volume and put the pages in the cmt */
+static int restore_maps(struct gendisk * disk, struct global_mapping_page ** maps)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    u64 nr_lpns = sdk->capacity >> unit_sector_shift(sdk);
+    struct global_mapping_page * mpage;
+    pfn_t lpdn, lpn, ppn;
+    u32 i;
+    int err = 0;
+
+    for (lpdn = 0; lpdn < sdk->gmt.nents && !err; lpdn++) {
+        mpage = maps[lpdn];
+        if (!mpage)
+            continue;
+        for (i = 0; i < MDIR_ENTRIES && !err; i++) {
+            lpn = (lpdn << MDIR_SHIFT) + i;
+            ppn = PAGE_PFN_ENTRY(mpage->pg, i);
+            if (ppn && (lpn >= nr_lpns || ftl_vol_restore(sdk, lpn, ppn))) {
+                printk(KERN_ERR "ftl: unit %u of %s saved at bad ppn %u\n", lpn,
+                        disk->disk_name, ppn);
+                err = -EINVAL;
+            }
+        }
+        if (err)
+            break;
+        maps[lpdn] = NULL;
+        cmt_add_page(sdk, cmt_entry(sdk, lpdn), mpage);
+        ftl_stat_inc(sdk, FTL_STAT_MAP_READS);
+    }
+    return err;
+}
+
+/*
+ * Load the mapping volume @disk keeps, see struct map_area: the newest
+ * checkpoint and its log. If that checkpoint is bad, the one before is
+ * loaded with its log and then the log of the newer one. The units are
+ * accounted in the volume, and a checkpoint of the mapping goes into
+ * the slot not loaded from. A volume that does not keep its mapping
+ * erases one left by another.
+ */
+static int load_saved_mapping(struct gendisk * disk)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    struct global_mapping_page ** maps = NULL;
+    struct map_area ma[MAP_SLOTS];
+    struct map_page_hdr * hdr;
+    u64 seqs[MAP_SLOTS], seq = 0;
+    unsigned int s, newest, base;
+    bool keep = map_area(sdk, 0, &ma[0]);
+    pfn_t end;
+    int err = 0;
+
+    map_area(sdk, 1, &ma[1]);
+    hdr = vmalloc(PHYS_PAGE_SIZE);
+    if (!hdr)
+        return -ENOMEM;
+    for (s = 0; s < MAP_SLOTS && !err; s++) {
+        err = map_area_io(sdk, READ, ma[s].start, hdr, 1);
+        // nothing saved, or the checkpoint did not complete
+        seqs[s] = hdr->magic == DIR_HDR_MAGIC ? hdr->seq : 0;
+        seen_seq(sdk, seqs[s]);
+    }
+    vfree(hdr);
+    if (err)
+        goto out;
+    newest = base = seqs[1] > seqs[0];
+
+    if (!keep) {
+        // the blocks without units are erased, the saving volume may have written them
+        if (seqs[newest])
+            err = ftl_vol_restored(sdk);
+        if (!err && seqs[newest])
+            err = clear_map_area(sdk);
+        goto out;
+    }
+
+    maps = vzalloc(sizeof(struct global_mapping_page *) * sdk->gmt.nents);
+    if (!maps) {
+        err = -ENOMEM;
+        goto out;
+    }
+    if (seqs[newest]) {
+        err = read_checkpoint(disk, &ma[newest], maps, &seq);
+        if (!err)
+            err = replay_log(disk, &ma[newest], maps, &seq, &end);
+        if (err && seqs[!newest]) {
+            printk(KERN_ERR "ftl: falling back on the mapping of %s checkpointed before\n",
+                    disk->disk_name);
+            free_loaded_maps(sdk, maps);
+            base = !newest;
+            seq = 0;
+            err = read_checkpoint(disk, &ma[base], maps, &seq);
+            if (!err)
+                err = replay_log(disk, &ma[base], maps, &seq, &end);
+            if (!err)
+                err = replay_log(disk, &ma[newest], maps, &seq, &end);
+        }
+        if (!err)
+            err = restore_maps(disk, maps);
+        if (!err)
+            err = ftl_vol_restored(sdk);
+    }
+    if (!err)
+        err = write_checkpoint(sdk, !base);
+    // the restored pages the cmt cannot keep are read again when used
+    for (s = 0; !err && s < sdk->cmt.nr_shards; s++)
+        cmt_shrink(sdk, s << sdk->cmt.shard_shift);
+
+out:
+    if (maps) {
+        free_loaded_maps(sdk, maps);
+        vfree(maps);
+    }
+    if (err)
+        printk(KERN_ERR "ftl: cannot load the mapping of %s, error %d\n", disk->disk_name, err);
+    return err;
+}
+
+/* a shard is full of dirty pages, write them back so that they can go */
+static void cmt_sync_work(struct work_struct * work)
+{
+    struct ssd_disk * sdk = container_of(work, struct ssd_disk, cmt.sync_work);
+
+    ftl_map_sync(sdk);
+}
+
+/*
+ * Allocate the global mapping directory and the cmt. A volume loads the
+ * mapping it saved, its directory pages split among up to
+ * GMD_LOAD_THREADS workers, each reading GMD_LOAD_BATCH pages per
+ * request, and all reads have completed when this returns, so the disk
+ * can be added right after.
+ */
+int init_mapping_dir(struct gendisk * disk)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    int err;
+    u64 nr_lpns = sdk->capacity >> unit_sector_shift(sdk);
+    u64 nr_pages = (nr_lpns + GMD_PAGE_LPNS - 1) >> GMD_PAGE_LPN_SHIFT;
+
+    SDEBUG("GMT: %llx pages, with capacity %llx sectors\n", nr_pages, sdk->capacity);
+
+    // the metadata is kept next to the adapter of the device
+    sdk->node = ftl_io_node(sdk->bdev);
+    seqlock_init(&sdk->gmt.lock);
+    atomic64_set(&sdk->gmt.seq, 0);
+    sdk->gmt.slot = 0;
+    sdk->gmt.log = 0;
+    mutex_init(&sdk->gmt.sync_lock);
+    atomic64_set(&sdk->gmt.syncs, 0);
+    atomic64_set(&sdk->gmt.synced, 0);
+    atomic_set(&sdk->gmt.reads[0], 0);
+    atomic_set(&sdk->gmt.reads[1], 0);
+    init_waitqueue_head(&sdk->gmt.wait);
+    sdk->gmt.nr_pages = nr_pages;
+    sdk->gmt.nents = (nr_lpns + MDIR_ENTRIES - 1) >> MDIR_SHIFT;
+    sdk->gmt.dir = alloc_dir_array(nr_pages * PHYS_PAGE_SIZE, sdk->node);
+
+    if (!sdk->gmt.dir) {
+        printk(KERN_ERR "ftl: cannot allocate gmt entries!\n");
+        return -ENOMEM;
+    }
+
+    err = init_cmt_shards(sdk);
+    if (err)
+        return err;
+
+    // in place only, not fatal, discarded units are then read from the device
+    if (!sdk->vol)
+        sdk->discarded = vzalloc_node(BITS_TO_LONGS(nr_lpns) * sizeof(long), sdk->node);
+    spin_lock_init(&sdk->discard_lock);
+
+    // the parked bios go on from here and may wait for free blocks
+    sdk->cmt.wq = alloc_workqueue("ss_cmt", WQ_MEM_RECLAIM, 0);
+    INIT_WORK(&sdk->cmt.sync_work, cmt_sync_work);
+    if (!sdk->cmt.wq)
+        printk(KERN_ERR "ftl: cannot create cmt workqueue, cmt misses wait in the submitter\n");
+
+    memset(&sdk->mpf, 0, sizeof(struct mapping_prefetch));
+    spin_lock_init(&sdk->mpf.lock);
+    INIT_WORK(&sdk->mpf.work, prefetch_work);
+    sdk->mpf.wq = alloc_workqueue("ss_mpf", WQ_MEM_RECLAIM, 1);
+    if (!sdk->mpf.wq)
+        printk(KERN_ERR "ftl: cannot create prefetch workqueue, no mapping prefetch\n");
+
+    // a disk written in place keeps its units where their lpn says, it has no mapping
+    if (!sdk->vol)
+        return 0;
+
+    sdk->gmt.sync_map = vzalloc(BITS_TO_LONGS(sdk->gmt.nents) * sizeof(long));
+    if (!sdk->gmt.sync_map)
+        return -ENOMEM;
+
+    err = load_saved_mapping(disk);
+    if (err)
+        return err;
+
+    init_dir_replicas(sdk);
+    return 0;
 }
 
 void exit_mapping_dir(struct gendisk * disk)
 {
     struct ssd_disk * sdk = ssd_disk(disk);
-    struct list_head * ptr, * next;
-    struct phys_page * page = NULL;
+    struct global_mapping_page * mpage, * n;
+    struct cmt_shard * shard;
+    unsigned int i, j;
     SDEBUG("GMT: exit mapping dir\n");
-    
-    list_for_each_safe(ptr, next, &sdk->gmt.list) {
-        page = list_entry(ptr, typeof(*page), list);
-        free_phys_page(page);
+
+    if (sdk->mpf.wq)
+        destroy_workqueue(sdk->mpf.wq);
+    if (sdk->cmt.wq)
+        destroy_workqueue(sdk->cmt.wq);
+
+    for (i = 0; sdk->cmt.shards && i < sdk->cmt.nr_shards; i++) {
+        shard = &sdk->cmt.shards[i];
+        if (!shard->el)
+            continue;
+        for (j = 0; j <= sdk->cmt.bucket_mask; j++) {
+            list_for_each_entry_safe(mpage, n, &shard->el[j].hlist, next)
+                free_mapping_page(mpage);
+        }
+        vfree(shard->el);
     }
+    kfree(sdk->cmt.shards);
+    sdk->cmt.shards = NULL;
 
-    if (sdk->cmt.el)
-        vfree(sdk->cmt.el);
+    exit_dir_replicas(sdk);
+    if (sdk->gmt.dir)
+        free_dir_array(sdk->gmt.dir, (size_t)sdk->gmt.nr_pages * PHYS_PAGE_SIZE);
 
-    if (sdk->gmt.el)
-        vfree(sdk->gmt.el);
+    if (sdk->gmt.sync_map)
+        vfree(sdk->gmt.sync_map);
+    if (sdk->discarded)
+        vfree(sdk->discarded);
+    if (sdk->bdev && !(sdk->bdev_err < 0)) {
+        ftl_io_close(sdk);
+        sdk->bdev = NULL;
+    }
+}
+
+/* append the mapping pages of gmt.sync_map to the log of the slot in use */
+static int sync_map_log(struct ssd_disk * sdk, u32 nr, const struct map_area * ma)
+{
+    struct global_mapping_dir * gmt = &sdk->gmt;
+    struct global_mapping_page * mpage;
+    struct page * buf[HW_TO_MEM_PAGE];
+    struct cmt_entry * ent;
+    struct map_log log;
+    unsigned long flags;
+    pfn_t lpdn, * ppns;
+    bool changed;
+    u32 i, n = 0;
+    int err, ret;
+
+    memset(buf, 0, sizeof(buf));
+    ppns = kmalloc(sizeof(pfn_t) * nr, GFP_NOIO);
+    err = map_log_init(&log, sdk->gd, gmt->log, ma->end);
+    for (i = 0; i < HW_TO_MEM_PAGE; i++) {
+        buf[i] = alloc_page(GFP_NOIO);
+        if (!buf[i])
+            err = -ENOMEM;
+    }
+    if (!ppns)
+        err = -ENOMEM;
+
+    for (lpdn = 0; lpdn < gmt->nents && n < nr && !err; lpdn++) {
+        if (!test_bit(lpdn, gmt->sync_map))
+            continue;
+        err = copy_map_page(sdk, lpdn, buf, &changed);
+        if (!err && changed)
+            err = map_log_add(sdk, &log, lpdn, buf, &ppns[n]);
+        if (!err && !changed)
+            __clear_bit(lpdn, gmt->sync_map);
+        else if (!err)
+            n ++;
+    }
+    ret = map_log_flush(sdk, &log);
+    if (!err)
+        err = ret;
+    if (!err)
+        err = ftl_vol_flush(sdk);
+
+    // the pages are found in the log from now on
+    for (lpdn = 0, i = 0; lpdn < gmt->nents && i < n && !err; lpdn++) {
+        if (!test_bit(lpdn, gmt->sync_map))
+            continue;
+        ent = cmt_entry(sdk, lpdn);
+        write_lock_irqsave(&ent->rw_lock, flags);
+        set_page_dir(sdk, lpdn, ppns[i]);
+        mpage = search_hash_page(lpdn, ent);
+        if (mpage)
+            mpage->pg->ppn = ppns[i];
+        write_unlock_irqrestore(&ent->rw_lock, flags);
+        i ++;
+    }
+    if (!err)
+        gmt->log = log.next;
+
+    for (i = 0; i < HW_TO_MEM_PAGE; i++) {
+        if (buf[i])
+            __free_page(buf[i]);
+    }
+    map_log_exit(&log);
+    kfree(ppns);
+    return err;
+}
+
+/*
+ * Write the mapping pages changed since the last sync to the log of the
+ * slot in use, or a checkpoint into the other slot once the log is full,
+ * see struct map_area, and flush the devices. What was mapped when this
+ * is called is on the flash once it returns 0, so are the units written
+ * before, and a sync started meanwhile is enough for it. The pages not
+ * written are dirty again on error. A volume that does not keep its
+ * mapping only flushes its devices.
+ */
+int ftl_map_sync(struct ssd_disk * sdk)
+{
+    struct global_mapping_dir * gmt = &sdk->gmt;
+    struct global_mapping_page * mpage;
+    struct cmt_shard * shard;
+    struct map_area ma;
+    u64 gen = atomic64_read(&gmt->syncs);
+    unsigned long flags;
+    u32 i, nr = 0;
+    int err;
+
+    mutex_lock(&gmt->sync_lock);
+    if (atomic64_read(&gmt->synced) > gen) {
+        mutex_unlock(&gmt->sync_lock);
+        return 0;
+    }
+    gen = atomic64_inc_return(&gmt->syncs);
+    if (!map_area(sdk, gmt->slot, &ma)) {
+        err = ftl_vol_flush(sdk);
+        goto out;
+    }
+
+    flush_mapping_pages(sdk->gd);
+    for (i = 0; i < sdk->cmt.nr_shards; i++) {
+        shard = &sdk->cmt.shards[i];
+        spin_lock_irqsave(&shard->lock, flags);
+        list_for_each_entry(mpage, &shard->flush, list) {
+            __set_bit(mpage->lpdn, gmt->sync_map);
+            nr ++;
+        }
+        spin_unlock_irqrestore(&shard->lock, flags);
+    }
+
+    if (map_log_pages(nr) > ma.end - gmt->log)
+        err = write_checkpoint(sdk, !gmt->slot);
+    else if (nr)
+        err = sync_map_log(sdk, nr, &ma);
+    else
+        err = ftl_vol_flush(sdk);
+    if (err)
+        redirty_map_pages(sdk, gmt->sync_map);
+    memset(gmt->sync_map, 0, BITS_TO_LONGS(gmt->nents) * sizeof(long));
+
+out:
+    if (!err)
+        atomic64_set(&gmt->synced, gen);
+    mutex_unlock(&gmt->sync_lock);
+    if (err)
+        printk(KERN_ERR "ftl: cannot sync the mapping of %s, error %d\n", sdk->gd->disk_name, err);
+    return err;
+}
+
+/* whether @sdk keeps its mapping on the flash, for ftl_map_sync to write */
+bool ftl_map_kept(struct ssd_disk * sdk)
+{
+    struct map_area ma;
+
+    return map_area(sdk, 0, &ma);
+}
+
+/*
+ * Save the mapping of a volume being removed, see ftl_map_sync. The host
+ * io has stopped and gc is waited for, so the mapping does not change
+ * meanwhile. If it cannot be saved gc goes on, the volume is not to be
+ * removed then.
+ */
+int save_mapping_dir(struct gendisk * disk)
+{
+    struct ssd_disk * sdk = ssd_disk(disk);
+    int err;
+
+    ftl_vol_quiesce(sdk);
+    // a sync queued by a full cmt would outlive the volume
+    if (sdk->mpf.wq)
+        flush_workqueue(sdk->mpf.wq);
+    cancel_work_sync(&sdk->cmt.sync_work);
+    err = ftl_map_sync(sdk);
+    if (err) {
+        printk(KERN_ERR "ftl: cannot save the mapping of %s, error %d\n", disk->disk_name, err);
+        ftl_vol_resume(sdk);
+    }
+    return err;
 }
@@ -26,7 +26,10 @@
 #define PHYS_PAGE_SIZE 4096
 #define PHYS_OOB_SIZE  16*8
 #define PAGE_SECTOR (PHYS_PAGE_SIZE >> 9)
+#define PAGE_SECTOR_SHIFT 3
 #define PAGE_SECTOR_MASK ~0x7L
+#define UNIT_MAX_SHIFT 4        /* flash pages of a mapping unit, log2: 4KB to 64KB */
+#define UNIT_MAX_SECTORS (PAGE_SECTOR << UNIT_MAX_SHIFT)
 #define MAP_REGION_LIST_SIZE 64
 #define BLOCK_BITMAP_SIZE PAGE_NUM_BLOCK/8
 #define GMT_START  1
@@ -37,28 +40,85 @@
 #define PAGE_NUM_BLOCK_SHIFT 7
 #define PAGE_NUM_BLOCK  (1 << PAGE_NUM_BLOCK_SHIFT)
 
-#define PAGE_TO_SECTOR(p)   (p << 3)
+#define PAGE_TO_SECTOR(p)   ((p) << 3)
 #define PAGE_TO_BLOCK(p)    (p >> PAGE_NUM_BLOCK_SHIFT)
 #define PAGE_BLK_IDX(p)     (P & (PAGE_NUM_BLOCK - 1))
 
 #define MDIR_SHIFT 10
-#define LPN_TO_MDIR(lpn)    (lpn >> MDIR_SHIFT)
-#define LPN_TO_MOFF(lpn)    (lpn & 0x3ff);
+#define MDIR_ENTRIES        (1 << MDIR_SHIFT)
+#define LPN_TO_MDIR(lpn)    ((lpn) >> MDIR_SHIFT)
+#define LPN_TO_MOFF(lpn)    ((lpn) & 0x3ff)
+
+#define GMD_PAGE_ENTRIES    (PHYS_PAGE_SIZE / sizeof(pfn_t))
+#define GMD_PAGE_LPN_SHIFT  (MDIR_SHIFT + 10)     /* lpns covered by a directory page */
+#define GMD_PAGE_LPNS       (1ULL << GMD_PAGE_LPN_SHIFT)
+#define GMD_LOAD_THREADS    4                       /* workers reading the directory */
+#define GMD_LOAD_BATCH      (BIO_MAX_PAGES / HW_TO_MEM_PAGE) /* directory pages per bio */
 
 #define CMT_ENTRY_SHIFT 10
-#define CMT_ENTRY_SIZE (1 << (CMT_ENTRY_SHIFT))
-#define CMT_HASH_MASK(pfn)  (pfn & 0x3ff)
+#define CMT_ENTRY_SIZE (1 << (CMT_ENTRY_SHIFT))     /* buckets of all the shards */
+#define CMT_MAX_SHARDS          64
+#define CMT_SHARD_MIN_BUCKETS   64
+#define CMT_DEFAULT_PAGES       4096    /* mapping pages cached by a disk */
+#define CMT_SHARD_MIN_PAGES     8
 
 //#define PAGE_TO_SECTOR(block, offset) (((sector_t)block) * PAGE_NUM_BLOCK * PAGE_SECTOR + (offset) * PAGE_SECTOR )
 
 #define PAGE_PFN_ENTRY(page, idx) ((pfn_t * )page_address((page)->data[(idx) >> 10]))[(idx) & 0x3ff]
 
+/*
+ * Each mapping page and directory page a volume saves has this header,
+ * in the header pages saved in front of them. Its crc32c covers the page
+ * and the header up to it, so a torn page, a stale one or one of another
+ * page is caught when it is read back.
+ */
+#define MAP_HDR_MAGIC   0x4d415047      /* "MAPG" */
+#define DIR_HDR_MAGIC   0x44495247      /* "DIRG" */
+
+struct map_page_hdr {
+    u32 magic;      // a mapping or a directory page
+    u32 lpdn;       // the mapping page, or the directory page, it holds
+    u64 seq;        // of the seal, from the sequence of the disk
+    u32 crc;
+    u32 rsvd;
+};
+
+#define MAP_HDRS_PER_PAGE   (PHYS_PAGE_SIZE / sizeof(struct map_page_hdr))
+
+/*
+ * The mapping pages written since a checkpoint go to its log in
+ * segments, a header page then up to MAP_LOG_SEG_PAGES pages. The first
+ * header of the header page is that of the segment, LOG_HDR_MAGIC with
+ * the number of pages in place of the lpdn, and its crc covers the
+ * headers of the pages after it as well.
+ */
+#define LOG_HDR_MAGIC       0x4c4f4747      /* "LOGG" */
+#define MAP_SLOTS           2
+#define MAP_LOG_SEG_PAGES   (MAP_HDRS_PER_PAGE - 1)
+/* the log of a slot, room for all of @nr_maps pages twice */
+#define MAP_LOG_PAGES(nr_maps) \
+    (2 * ((nr_maps) + DIV_ROUND_UP(nr_maps, (u32)MAP_LOG_SEG_PAGES)))
+
 #define NO_BIO_RESOURCE 1
 #define NOT_ENOUGH_MEM  2
 #define NO_BLK_DEV      3
 
 typedef u32 pfn_t;
 
+/*
+ * On a volume of several flash devices the top bits of a ppn are the
+ * device and the rest the page on it. A single device disk uses the
+ * whole ppn as its page.
+ */
+#define PPN_DEV_BITS        4
+#define PPN_DEV_SHIFT       (32 - PPN_DEV_BITS)
+#define PPN_PAGE_MASK       ((1U << PPN_DEV_SHIFT) - 1)
+#define PPN_DEV(ppn)        ((ppn) >> PPN_DEV_SHIFT)
+#define PPN_PAGE(ppn)       ((ppn) & PPN_PAGE_MASK)
+#define MAKE_PPN(dev, page) (((pfn_t)(dev) << PPN_DEV_SHIFT) | (page))
+
+struct ssd_disk;
+
 struct phys_page {
     struct list_head list;  // pages in the same block
     struct page ** data;    // page data
@@ -89,16 +149,26 @@ struct block_container {
     u32 nents;
 };
 
-struct gdir_entry {
-    struct phys_page * hw_page;  // page of mapping dir in hardware
-    bool dirty;             // write back flag
-    struct page * page;     // mem page
-};
-
+/*
+ * The directory is read-mostly and kept as one flat array of the ppn of
+ * every mapping page (0 if the page was never written), so a lookup is a
+ * single load. Updates go under the seqlock.
+ */
 struct global_mapping_dir {
-    struct list_head list;
-    struct gdir_entry * el;
-    unsigned int nents;
+    pfn_t * dir;            // nr_pages directory pages long, on the node of the device
+    pfn_t ** replicas;      // a copy of dir per online node, NULL with a single node
+    seqlock_t lock;
+    atomic64_t seq;         // of the last page sealed, the highest saved at load
+    unsigned int slot;      // of the last checkpoint, see struct map_area
+    pfn_t log;              // next page of its log
+    struct mutex sync_lock; // one sync or checkpoint at a time
+    atomic64_t syncs;       // syncs started, see ftl_map_sync
+    atomic64_t synced;      // the last of them that completed
+    unsigned long * sync_map;   // mapping pages being synced
+    atomic_t reads[MAP_SLOTS];  // mapping pages being read from each slot
+    wait_queue_head_t wait;     // for the reads of a slot about to be erased
+    unsigned int nents;     // number of mapping pages
+    unsigned int nr_pages;  // directory pages on the flash
 };
 
 struct global_mapping_page {
@@ -106,6 +176,7 @@ struct global_mapping_page {
     struct list_head next;  // list used by hash table
     unsigned int lpdn;      // logical page directory number , index in global dir
     u32 mflags;             // flags
+#define MPAGE_REF   0x1     // looked up since the clock of its shard last passed
     struct phys_page * pg;    // physical page
     bool dirty;
     pfn_t * mlist;          // mappings
@@ -122,12 +193,176 @@ struct global_mapping_block {
 
 struct cmt_entry {
     struct list_head hlist;
+    struct list_head pending;   // mapping pages being read for parked bios
     u16 dirty;
     rwlock_t rw_lock;  // rw_sem for gdir memory entry access
 };
 
-struct cached_mapping_table {
+/*
+ * The cmt is split by lpn range into shards, each with its own buckets
+ * on a numa node of its own and its own list of dirty pages, so cores
+ * working on different parts of the disk share none of its lines.
+ */
+struct cmt_shard {
     struct cmt_entry * el;
+    int node;                   // of the buckets and the mapping pages
+    spinlock_t lock;            // of the flush list
+    struct list_head flush;     // dirty mapping pages queued for write back
+    atomic_t pages;             // mapping pages cached
+    unsigned int max_pages;     // before clean ones are evicted
+    atomic_t hand;              // bucket the eviction clock is at
+};
+
+struct cached_mapping_table {
+    struct cmt_shard * shards;
+    unsigned int nr_shards;         // a power of two, 0 picks one per cpu
+    unsigned int shard_shift;       // mapping pages of a shard, log2
+    unsigned int bucket_mask;       // buckets of a shard, less one
+    unsigned int max_pages;         // cached by all the shards, 0 for CMT_DEFAULT_PAGES
+    struct workqueue_struct * wq;   // resumes the bios parked on mapping reads
+    struct work_struct sync_work;   // writes back the dirty pages of a full cmt
+};
+
+/*
+ * A bio that missed the cmt does not wait for the mapping read in its
+ * submitter. It is parked on the read of the page, and @fn is called
+ * from the cmt worker once the page is in the cmt or failed to load.
+ */
+struct map_waiter {
+    struct map_waiter * next;
+    void (* fn)(struct map_waiter * w, int error);
+};
+
+struct map_pending {
+    struct list_head list;      // reads of the cmt entry
+    struct global_mapping_page * mpage;
+    struct map_waiter * waiters, ** tail;   // in the order they came
+    struct work_struct work;
+};
+
+#define MAP_STREAMS         8       /* sequential streams tracked per disk */
+#define MAP_STREAM_SEQ      4       /* sequential requests before a stream prefetches */
+#define MAP_PREFETCH_DIST   256     /* lpns before the next mapping page to go one further */
+#define MAP_PREFETCH_DEPTH  2       /* mapping pages kept ahead of a stream */
+#define MAP_PREFETCH_QUEUE  16
+
+struct seq_stream {
+    pfn_t next;             // lpn the stream is expected to read next
+    pfn_t ahead;            // last mapping page prefetched for the stream
+    unsigned int seq;       // sequential requests seen
+    unsigned long last;     // jiffies of the last request, to recycle streams
+};
+
+struct mapping_prefetch {
+    spinlock_t lock;
+    struct seq_stream streams[MAP_STREAMS];
+    pfn_t queue[MAP_PREFETCH_QUEUE];    // mapping pages to read
+    unsigned int head, tail;
+    struct workqueue_struct * wq;
+    struct work_struct work;
+};
+
+/*
+ * ftl event counters of a disk, kept per cpu and summed when read
+ */
+enum {
+    FTL_STAT_CMT_HITS,          // translations served from the cmt
+    FTL_STAT_CMT_MISSES,        // translations that went to the directory
+    FTL_STAT_CMT_PAGES,         // mapping pages loaded into the cmt
+    FTL_STAT_CMT_EVICTIONS,     // clean mapping pages dropped from the cmt
+    FTL_STAT_MAP_READS,         // mapping pages read from the flash
+    FTL_STAT_MAP_QUEUED,        // dirty mapping pages queued for write back
+    FTL_STAT_HOST_READS,        // bios read by the host
+    FTL_STAT_HOST_WRITES,       // bios written by the host
+    FTL_STAT_HOST_READ_BYTES,
+    FTL_STAT_HOST_WRITE_BYTES,
+    FTL_STAT_CLONES,            // bios sent to the device for host bios
+    FTL_STAT_UNMAPPED_READS,    // pages read as zeros without any io
+    FTL_STAT_FLASH_READ_BYTES,  // everything read from the device
+    FTL_STAT_FLASH_WRITE_BYTES, // everything written to the device
+    FTL_STAT_FLUSHES,           // flush requests of the host
+    FTL_STAT_FLUSH_NS,          // time spent draining the write buffer for them
+    FTL_STAT_GC_COPIES,         // valid pages moved by garbage collection
+    FTL_STAT_GC_ERASES,         // blocks erased by garbage collection
+    FTL_STAT_GC_STALLS,         // page writes that waited for a free block
+    FTL_STAT_DIE_WAITS,         // page programs queued behind a busy die
+    FTL_STAT_GC_SUSPENDS,       // gc waits for the host reads on a die
+    FTL_STAT_QOS_THROTTLES,     // background ios delayed or dropped by their rate
+    FTL_STAT_BMAP_MERGES,       // logical blocks of a volume mapped as a whole
+    FTL_STAT_BMAP_BREAKS,       // and put back into the page map
+    FTL_STAT_PACKED_UNITS,      // units of a volume compressed and packed
+    FTL_STAT_PACKED_PAGES,      // pages they were packed into
+    FTL_STAT_DEDUP_HITS,        // units of a volume mapped to a copy already on the flash
+    FTL_STAT_DEDUP_MISMATCHES,  // copies found by fingerprint that were not the same
+    FTL_STAT_ZERO_UNITS,        // units of a volume written as zeros, unmapped instead
+    FTL_STAT_MAP_CRC_ERRORS,    // mapping and directory pages that failed their check
+    FTL_STAT_NR,
+};
+
+struct ftl_stats {
+    u64 cnt[FTL_STAT_NR];
+};
+
+#define ftl_stat_add(sdk, item, n)  this_cpu_add((sdk)->stats->cnt[item], n)
+#define ftl_stat_inc(sdk, item)     ftl_stat_add(sdk, item, 1)
+
+/*
+ * latency histograms of host io, per cpu and split by the kind of
+ * request and whether it stalled in the ftl. The buckets are log-linear:
+ * 8 linear steps per power of two of 64ns units, 12.5% apart at most,
+ * up to about 18 minutes.
+ */
+#define LAT_UNIT_SHIFT  6
+#define LAT_SUB_SHIFT   3
+#define LAT_BUCKETS     256
+
+enum {
+    LAT_READ,
+    LAT_WRITE,
+    LAT_FLUSH,
+    LAT_OPS,
+};
+
+enum {
+    LAT_NO_STALL,
+    LAT_CMT_MISS,               // waited for a mapping page read
+    LAT_GC_STALL,               // waited for garbage collection to free a block
+    LAT_STALLS,
+};
+
+struct ftl_lat_hist {
+    u64 sum_ns;
+    u64 buckets[LAT_BUCKETS];
+};
+
+struct ftl_latency {
+    struct ftl_lat_hist h[LAT_OPS][LAT_STALLS];
+};
+
+/*
+ * background io classes of a disk, each limited to a rate with a token
+ * bucket: a page costs 1s / rate of credit, which builds up with time to
+ * QOS_BURST_NS. Host io has no class, it is never held back here.
+ */
+enum {
+    IO_MAP,                     // mapping pages read ahead
+    IO_GC,                      // pages moved and blocks erased by gc
+    IO_CLASSES,
+};
+
+#define QOS_BURST_NS        (100 * 1000000ULL)
+#define QOS_GC_SUSPEND      (HZ / 100)      /* longest gc waits for reads, per page */
+
+struct ftl_bucket {
+    spinlock_t lock;
+    u64 cost_ns;                // of a page, 0 for no limit
+    u64 credit_ns;
+    u64 last_ns;                // of the last refill
+};
+
+struct ftl_qos {
+    struct ftl_bucket bucket[IO_CLASSES];
+    wait_queue_head_t wait;     // background io waiting for credit
 };
 
 struct meta_root {
@@ -141,7 +376,56 @@ struct hw_meta_root {
     struct meta_root * mroot;
 };
 
-extern void init_mapping_dir(struct gendisk * disk);
+/*
+ * Flash io, on the backing block device in the module (ftl_io.c) and on
+ * the simulated flash in the userspace build (sim/nand.c). ftl_io_node is
+ * the numa node the metadata of a device is best kept on. @done is
+ * called once the io has completed, possibly from interrupt context or
+ * before ftl_submit_io returns. A non-zero return means nothing was
+ * submitted and @done will not be called. ftl_io_erase erases whole
+ * blocks and returns once it is done.
+ */
+typedef void (ftl_io_done_t)(void * priv, int error);
+
+extern int ftl_io_node(struct block_device * bdev);
+extern int ftl_io_open(struct ssd_disk * sdk);
+extern void ftl_io_close(struct ssd_disk * sdk);
+extern int ftl_submit_io(struct ssd_disk * sdk, int rw, pfn_t ppn, unsigned int nr,
+        struct page ** pages, u8 * oob, ftl_io_done_t * done, void * priv);
+extern int ftl_io_erase(struct ssd_disk * sdk, pfn_t ppn, unsigned int nr);
+
+extern int init_mapping_dir(struct gendisk * disk);
 extern void exit_mapping_dir(struct gendisk * disk);
+extern int save_mapping_dir(struct gendisk * disk);
+extern int ftl_map_sync(struct ssd_disk * sdk);
+extern bool ftl_map_kept(struct ssd_disk * sdk);
+extern void set_page_dir(struct ssd_disk * sdk, pfn_t lpdn, pfn_t ppn);
+extern pfn_t get_phys_ppn(struct gendisk * disk, pfn_t lpn, int create, int * err);
+extern pfn_t get_page_ppn(struct gendisk * disk, pfn_t lpn, int create, int * err);
+extern bool wait_mapping_page(struct gendisk * disk, pfn_t lpn, struct map_waiter * w);
+extern pfn_t set_phys_ppn(struct gendisk * disk, pfn_t lpn, pfn_t ppn, int * err);
+extern pfn_t cmpxchg_phys_ppn(struct gendisk * disk, pfn_t lpn, pfn_t old, pfn_t ppn, int * err);
+extern unsigned int get_unmapped_run(struct gendisk * disk, pfn_t lpn, unsigned int max);
+extern int unmap_phys_range(struct gendisk * disk, pfn_t lpn, unsigned int count);
+extern void map_in_place(struct gendisk * disk, pfn_t lpn);
+extern void detect_seq_stream(struct gendisk * disk, sector_t sector, unsigned int nr_sects);
+extern bool mapping_in_memory(struct gendisk * disk, pfn_t lpn);
+extern void flush_mapping_pages(struct gendisk * disk);
+
+extern const char * const ftl_stat_names[FTL_STAT_NR];
+extern int ftl_stats_init(struct ssd_disk * sdk);
+extern void ftl_stats_exit(struct ssd_disk * sdk);
+extern u64 ftl_stat_read(struct ssd_disk * sdk, int item);
+
+extern void ftl_qos_init(struct ssd_disk * sdk);
+extern void ftl_qos_set_rate(struct ssd_disk * sdk, int class, unsigned int rate);
+extern unsigned long ftl_qos_take(struct ssd_disk * sdk, int class, unsigned int nr);
+
+extern const char * const ftl_lat_op_names[LAT_OPS];
+extern const char * const ftl_lat_stall_names[LAT_STALLS];
+extern void ftl_lat_record(struct ssd_disk * sdk, int op, int stall, u64 ns);
+extern void ftl_lat_read(struct ssd_disk * sdk, int op, int stall, struct ftl_lat_hist * sum);
+extern u64 ftl_lat_bucket_ns(unsigned int b);
+extern u64 ftl_lat_percentile(const struct ftl_lat_hist * h, unsigned int permyriad);
 
 #endif
@@ -0,0 +1,65 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  ftl_compat.h
+ *
+ *    Description:  the kernel interfaces used by the ftl core. In the module
+ *                  these are the kernel headers, in the userspace build
+ *                  sim/usys.h provides them on top of libc and pthreads.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _FTL_COMPAT_H_
+#define _FTL_COMPAT_H_
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/init.h>
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/mempool.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/completion.h>
+#include <linux/vmalloc.h>
+#include <linux/cpumask.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/numa.h>
+#include <linux/nodemask.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/lzo.h>
+#include <linux/crc32c.h>
+#include <linux/random.h>
+
+#ifndef NUMA_NO_NODE
+#define NUMA_NO_NODE    (-1)
+#endif
+
+#else
+
+#include "sim/usys.h"
+
+#endif
+
+#endif
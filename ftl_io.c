@@ -0,0 +1,139 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  ftl_io.c
+ *
+ *    Description:  flash io of the ftl core, done with bios on the backing
+ *                  block device. The userspace build does it on the
+ *                  simulated flash of sim/nand.c instead.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+#include "alloc.h"
+
+struct ftl_io {
+    struct ssd_disk * sdk;
+    ftl_io_done_t * done;
+    void * priv;
+};
+
+static void ftl_bio_destructor(struct bio * bio)
+{
+    struct bio_set * bs = bio->bi_private;
+
+    bio_free(bio, bs);
+}
+
+static void ftl_io_endio(struct bio * bio, int error)
+{
+    struct ftl_io * io = bio->bi_private;
+    ftl_io_done_t * done = io->done;
+    void * priv = io->priv;
+
+    bio->bi_private = io->sdk->bs;
+    bio_put(bio);
+    kfree(io);
+
+    done(priv, error);
+}
+
+/*
+ * the node of the host adapter of @bdev: the disk device itself has
+ * none, the first of its parents that has one is taken
+ */
+int ftl_io_node(struct block_device * bdev)
+{
+    struct device * dev;
+
+    for (dev = disk_to_dev(bdev->bd_disk); dev; dev = dev->parent) {
+        if (dev_to_node(dev) != NUMA_NO_NODE)
+            return dev_to_node(dev);
+    }
+    return NUMA_NO_NODE;
+}
+
+/*
+ * the ftl does its io on the backing device, not through our disk, and
+ * keeps it open as long as it uses it
+ */
+int ftl_io_open(struct ssd_disk * sdk)
+{
+    return blkdev_get(sdk->bdev, FMODE_READ | FMODE_WRITE, NULL);
+}
+
+void ftl_io_close(struct ssd_disk * sdk)
+{
+    blkdev_put(sdk->bdev, FMODE_READ | FMODE_WRITE);
+}
+
+/*
+ * Read or write @nr flash pages from @ppn with one bio. @pages holds the
+ * HW_TO_MEM_PAGE memory pages of every flash page and is not used once
+ * this returns. A block device has no spare area, @oob is ignored.
+ */
+int ftl_submit_io(struct ssd_disk * sdk, int rw, pfn_t ppn, unsigned int nr,
+        struct page ** pages, u8 * oob, ftl_io_done_t * done, void * priv)
+{
+    struct ftl_io * io;
+    struct bio * bio;
+    unsigned int i;
+
+    io = kmalloc(sizeof(struct ftl_io), GFP_NOIO);
+    if (!io)
+        return -NOT_ENOUGH_MEM;
+
+    bio = bio_alloc_bioset(GFP_NOIO, nr * HW_TO_MEM_PAGE, sdk->bs);
+    if (!bio) {
+        kfree(io);
+        return -NO_BIO_RESOURCE;
+    }
+
+    io->sdk = sdk;
+    io->done = done;
+    io->priv = priv;
+
+    bio->bi_sector = ppn_sector(sdk, ppn);
+    bio->bi_size = nr * PHYS_PAGE_SIZE;
+    bio->bi_vcnt = nr * HW_TO_MEM_PAGE;
+    for (i = 0; i < bio->bi_vcnt; i++) {
+        bio->bi_io_vec[i].bv_page = pages[i];
+        bio->bi_io_vec[i].bv_offset = 0;
+        bio->bi_io_vec[i].bv_len = MEM_PAGE_SIZE;
+    }
+
+    bio->bi_bdev = ppn_bdev(sdk, ppn);
+    bio->bi_rw = rw;
+    bio->bi_idx = 0;
+    bio->bi_destructor = ftl_bio_destructor;
+    bio->bi_end_io = ftl_io_endio;
+    bio->bi_private = io;
+    bio->bi_flags |= (1 << BIO_CLONED);
+
+    submit_sync_bio(sdk, bio);
+
+    return 0;
+}
+
+/*
+ * A block device has no erase. The pages are discarded instead, so the
+ * device can reclaim them if it supports that.
+ */
+int ftl_io_erase(struct ssd_disk * sdk, pfn_t ppn, unsigned int nr)
+{
+    int err;
+
+    err = blkdev_issue_discard(ppn_bdev(sdk, ppn), ppn_sector(sdk, ppn),
+            PAGE_TO_SECTOR((sector_t)nr), GFP_NOIO, 0);
+    return err == -EOPNOTSUPP ? 0 : err;
+}
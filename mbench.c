@@ -0,0 +1,379 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  mbench.c
+ *
+ *    Description:  microbenchmarks of the hot paths of the ftl. Every test
+ *                  runs one operation in a loop on a number of threads that
+ *                  start together, the time of each thread is taken around
+ *                  its loop only.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+#include "scan.h"
+#include "mbench.h"
+
+struct mbench;
+
+struct mbench_thread {
+    struct mbench * mb;
+    u64 seed;
+    s64 ns;
+    int error;
+    struct bio * bio;           // for the bio tests
+    struct completion io_done;
+};
+
+struct mbench_test {
+    const char * name;
+    int (*op)(struct mbench_thread * t);
+    bool bio;                   // needs a bio
+    bool single;                // cannot run on more than one thread
+    bool kept;                  // needs a volume that keeps its mapping
+};
+
+struct mbench {
+    struct ssd_disk * sdk;
+    const struct mbench_test * test;
+    unsigned long ops;
+    pfn_t window;
+    atomic_t ready;             // threads not yet waiting for the start
+    atomic_t running;           // threads not yet finished
+    struct completion all_ready;
+    struct completion start;
+    struct completion done;
+};
+
+static u64 mbench_rand(struct mbench_thread * t)
+{
+    u64 x = t->seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    t->seed = x;
+    return x;
+}
+
+static pfn_t mbench_lpn(struct mbench_thread * t)
+{
+    return mbench_rand(t) % t->mb->window;
+}
+
+/* the first page of a random bio sized run of the window */
+static pfn_t mbench_bio_lpn(struct mbench_thread * t)
+{
+    return (mbench_rand(t) % (t->mb->window / MBENCH_BIO_PAGES)) * MBENCH_BIO_PAGES;
+}
+
+static int mbench_get_ppn(struct mbench_thread * t)
+{
+    int err = 0;
+
+    get_phys_ppn(t->mb->sdk->gd, mbench_lpn(t), 0, &err);
+    return err;
+}
+
+static int mbench_set_ppn(struct mbench_thread * t)
+{
+    pfn_t lpn = mbench_lpn(t);
+    int err = 0;
+
+    set_phys_ppn(t->mb->sdk->gd, lpn, lpn, &err);
+    return err;
+}
+
+static int mbench_clone_bio(struct mbench_thread * t)
+{
+    struct bio_set * bs = t->mb->sdk->bs;
+    struct bio * bio = t->bio, * clone;
+    sector_t sector = PAGE_TO_SECTOR((sector_t)mbench_bio_lpn(t)), offset = 0;
+    unsigned int idx = 0, i;
+
+    for (i = 0; i < bio_sectors(bio) / PAGE_SECTOR; i++) {
+        clone = clone_bio(bio, sector + i * PAGE_SECTOR, &idx, &offset, PAGE_SECTOR, bs);
+        if (!clone)
+            return -ENOMEM;
+        clone->bi_private = bs;
+        bio_put(clone);
+    }
+    return 0;
+}
+
+static void mbench_endio(struct bio * bio, int error)
+{
+    struct mbench_thread * t = bio->bi_private;
+
+    t->error = error;
+    complete(&t->io_done);
+}
+
+static int mbench_map(struct mbench_thread * t, int rw)
+{
+    struct bio * bio = t->bio;
+
+    bio->bi_sector = PAGE_TO_SECTOR((sector_t)mbench_bio_lpn(t));
+    bio->bi_bdev = t->mb->sdk->bdev;
+    bio->bi_rw = rw;
+    bio->bi_idx = 0;
+    bio->bi_size = bio->bi_vcnt * PAGE_SIZE;
+    bio->bi_flags |= 1 << BIO_UPTODATE;
+    bio->bi_end_io = mbench_endio;
+    bio->bi_private = t;
+
+    init_completion(&t->io_done);
+    ss_map_request(t->mb->sdk, bio);
+    wait_for_completion(&t->io_done);
+    return t->error;
+}
+
+static int mbench_map_read(struct mbench_thread * t)
+{
+    return mbench_map(t, READ);
+}
+
+static int mbench_map_write(struct mbench_thread * t)
+{
+    return mbench_map(t, WRITE);
+}
+
+/* a sync of the mapping with every mapping page of the window changed */
+static int mbench_flush(struct mbench_thread * t)
+{
+    struct gendisk * gd = t->mb->sdk->gd;
+    pfn_t lpn;
+    int err = 0;
+
+    for (lpn = 0; lpn < t->mb->window && !err; lpn += MDIR_ENTRIES)
+        set_phys_ppn(gd, lpn, lpn, &err);
+    return err ? err : ftl_map_sync(t->mb->sdk);
+}
+
+/* the check of a unit of zeros written to a volume, over the whole page */
+static int mbench_zero_page(struct mbench_thread * t)
+{
+    return zero_data(page_address(t->bio->bi_io_vec[0].bv_page), PAGE_SIZE) ? 0 : -EINVAL;
+}
+
+/* a scan of an unmapped mapping page to its end */
+static int mbench_scan_run(struct mbench_thread * t)
+{
+    const pfn_t * p = page_address(t->bio->bi_io_vec[0].bv_page);
+
+    return scan_run(p, MDIR_ENTRIES, 0) == MDIR_ENTRIES ? 0 : -EINVAL;
+}
+
+/* a comparison of two equal pages */
+static int mbench_scan_diff(struct mbench_thread * t)
+{
+    const pfn_t * a = page_address(t->bio->bi_io_vec[0].bv_page);
+    const pfn_t * b = page_address(t->bio->bi_io_vec[1].bv_page);
+    unsigned int n = PAGE_SIZE / sizeof(pfn_t);
+
+    return scan_diff(a, b, n) == n ? 0 : -EINVAL;
+}
+
+/* the crc32c a mapping page is sealed and checked with */
+static int mbench_map_crc(struct mbench_thread * t)
+{
+    u32 crc = crc32c(~0, page_address(t->bio->bi_io_vec[0].bv_page), PAGE_SIZE);
+
+    return crc != ~0U ? 0 : -EINVAL;
+}
+
+static const struct mbench_test mbench_table[] = {
+    { "get_ppn",    mbench_get_ppn,     false,  false,  false },
+    { "set_ppn",    mbench_set_ppn,     false,  false,  false },
+    { "clone_bio",  mbench_clone_bio,   true,   false,  false },
+    { "map_read",   mbench_map_read,    true,   false,  false },
+    { "map_write",  mbench_map_write,   true,   false,  false },
+    { "flush",      mbench_flush,       false,  true,   true },
+    { "zero_page",  mbench_zero_page,   true,   false,  false },
+    { "scan_run",   mbench_scan_run,    true,   false,  false },
+    { "scan_diff",  mbench_scan_diff,   true,   false,  false },
+    { "map_crc",    mbench_map_crc,     true,   false,  false },
+};
+
+const char * mbench_test_name(unsigned int i)
+{
+    return i < ARRAY_SIZE(mbench_table) ? mbench_table[i].name : NULL;
+}
+
+static void mbench_bio_destructor(struct bio * bio)
+{
+    struct bio_set * bs = bio->bi_private;
+
+    bio_free(bio, bs);
+}
+
+static void mbench_free_bio(struct ssd_disk * sdk, struct bio * bio)
+{
+    unsigned int i;
+
+    for (i = 0; i < bio->bi_vcnt; i++)
+        __free_page(bio->bi_io_vec[i].bv_page);
+    bio->bi_private = sdk->bs;
+    bio_put(bio);
+}
+
+static struct bio * mbench_alloc_bio(struct ssd_disk * sdk)
+{
+    struct bio * bio;
+    struct page * page;
+
+    bio = bio_alloc_bioset(GFP_KERNEL, MBENCH_BIO_PAGES, sdk->bs);
+    if (!bio)
+        return NULL;
+    bio->bi_destructor = mbench_bio_destructor;
+
+    for (bio->bi_vcnt = 0; bio->bi_vcnt < MBENCH_BIO_PAGES; bio->bi_vcnt ++) {
+        page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!page) {
+            mbench_free_bio(sdk, bio);
+            return NULL;
+        }
+        bio->bi_io_vec[bio->bi_vcnt].bv_page = page;
+        bio->bi_io_vec[bio->bi_vcnt].bv_offset = 0;
+        bio->bi_io_vec[bio->bi_vcnt].bv_len = PAGE_SIZE;
+    }
+    bio->bi_size = bio->bi_vcnt * PAGE_SIZE;
+
+    return bio;
+}
+
+static int mbench_thread(void * data)
+{
+    struct mbench_thread * t = data;
+    struct mbench * mb = t->mb;
+    unsigned long i;
+    ktime_t start;
+
+    if (atomic_dec_and_test(&mb->ready))
+        complete(&mb->all_ready);
+    wait_for_completion(&mb->start);
+
+    start = ktime_get();
+    for (i = 0; i < mb->ops && !t->error; i++) {
+        t->error = mb->test->op(t);
+        if (!(i & 1023))
+            cond_resched();
+    }
+    t->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    if (atomic_dec_and_test(&mb->running))
+        complete(&mb->done);
+    return 0;
+}
+
+int mbench_run(struct ssd_disk * sdk, const char * test, unsigned int threads,
+        unsigned long ops, struct mbench_result * res)
+{
+    struct mbench_thread * t;
+    struct task_struct * task;
+    struct mbench mb;
+    unsigned int i, started;
+    ktime_t start;
+    u64 ns = 0;
+    pfn_t lpn;
+    int error = 0;
+
+    memset(&mb, 0, sizeof(mb));
+    for (i = 0; i < ARRAY_SIZE(mbench_table); i++) {
+        if (!strcmp(mbench_table[i].name, test))
+            mb.test = &mbench_table[i];
+    }
+    if (!mb.test || !threads || threads > MBENCH_THREADS || !ops)
+        return -EINVAL;
+    if (mb.test->single && threads > 1)
+        return -EINVAL;
+    if (mb.test->kept && !ftl_map_kept(sdk))
+        return -EOPNOTSUPP;
+
+    mb.sdk = sdk;
+    mb.ops = ops;
+    mb.window = min_t(u64, MBENCH_WINDOW, sdk->capacity >> PAGE_SECTOR_SHIFT);
+    mb.window -= mb.window % MBENCH_BIO_PAGES;
+    if (!mb.window)
+        return -ENOSPC;
+
+    t = kzalloc(sizeof(struct mbench_thread) * threads, GFP_KERNEL);
+    if (!t)
+        return -ENOMEM;
+
+    for (i = 0; i < threads; i++) {
+        t[i].mb = &mb;
+        t[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (mb.test->bio) {
+            t[i].bio = mbench_alloc_bio(sdk);
+            if (!t[i].bio) {
+                error = -ENOMEM;
+                goto out;
+            }
+        }
+    }
+
+    // every test runs on mapped and cached pages
+    for (lpn = 0; lpn < mb.window; lpn++)
+        set_phys_ppn(sdk->gd, lpn, lpn, NULL);
+
+    atomic_set(&mb.ready, threads);
+    atomic_set(&mb.running, threads);
+    init_completion(&mb.all_ready);
+    init_completion(&mb.start);
+    init_completion(&mb.done);
+
+    for (started = 0; started < threads; started++) {
+        task = kthread_run(mbench_thread, &t[started], "ss_mbench/%u", started);
+        if (IS_ERR(task)) {
+            error = PTR_ERR(task);
+            break;
+        }
+    }
+    if (started < threads) {
+        // let the started threads go through without doing anything
+        mb.ops = 0;
+        atomic_sub(threads - started, &mb.ready);
+        atomic_sub(threads - started, &mb.running);
+        if (!started)
+            goto out;
+        complete_all(&mb.start);
+        wait_for_completion(&mb.done);
+        goto out;
+    }
+
+    wait_for_completion(&mb.all_ready);
+    start = ktime_get();
+    complete_all(&mb.start);
+    wait_for_completion(&mb.done);
+
+    res->test = mb.test->name;
+    res->threads = threads;
+    res->ops = (u64)ops * threads;
+    res->wall_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    for (i = 0; i < threads; i++) {
+        ns += t[i].ns;
+        if (t[i].error && !error)
+            error = t[i].error;
+    }
+    res->ns_per_op = div64_u64(ns, res->ops);
+    res->kops = res->wall_ns ? div64_u64(res->ops * 1000000, res->wall_ns) : 0;
+
+out:
+    for (i = 0; i < threads; i++) {
+        if (t[i].bio)
+            mbench_free_bio(sdk, t[i].bio);
+    }
+    kfree(t);
+    return error;
+}
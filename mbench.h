@@ -0,0 +1,60 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  mbench.h
+ *
+ *    Description:  microbenchmarks of the hot paths of the ftl: the mapping
+ *                  lookup and update, bio splitting and the mapping flush.
+ *                  The same tests run in the module self test and in the
+ *                  userspace build.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _MBENCH_H_
+#define _MBENCH_H_
+
+#define MBENCH_WINDOW   65536   /* logical pages the tests run on */
+#define MBENCH_BIO_PAGES 32     /* pages of the bios split by the tests */
+#define MBENCH_THREADS  64
+
+struct ssd_disk;
+
+struct mbench_result {
+    const char * test;
+    unsigned int threads;
+    u64 ops;            // operations done by all threads
+    u64 wall_ns;        // from the start to the last thread finished
+    u64 ns_per_op;      // mean time of an operation in one thread
+    u64 kops;           // operations per millisecond over all threads
+};
+
+/*
+ * name of test @i, NULL past the last one:
+ *  get_ppn     lookup of a random cached mapping
+ *  set_ppn     update of a random cached mapping
+ *  clone_bio   split of a bio into page clones, without submitting them
+ *  map_read    a bio read through the whole split and translation path
+ *  map_write   the same for a write of full pages
+ *  flush       sync of the mapping pages of the window to the flash, one
+ *              thread, on a volume that keeps its mapping
+ *  zero_page   check of a page of zeros for a write
+ *  scan_run    scan of an unmapped mapping page for its first mapping
+ *  scan_diff   comparison of two equal pages, as dedup does
+ */
+extern const char * mbench_test_name(unsigned int i);
+
+/*
+ * Run @test on @threads threads doing @ops operations each. The first
+ * MBENCH_WINDOW pages of @sdk are mapped and overwritten. -EOPNOTSUPP if
+ * @test needs a volume that keeps its mapping and @sdk is not one.
+ */
+extern int mbench_run(struct ssd_disk * sdk, const char * test, unsigned int threads,
+        unsigned long ops, struct mbench_result * res);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  pack.c
+ *
+ *    Description:  compressed units packed into flash pages. The write
+ *                  buffer compresses the units it writes back with lzo and
+ *                  puts as many as fit into one page, a read decompresses
+ *                  its unit out of it.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "pack.h"
+
+/* the compressor state of one writer */
+struct pack_wrk {
+    u8 lzo[LZO1X_1_MEM_COMPRESS];
+    u8 buf[lzo1x_worst_compress(PHYS_PAGE_SIZE)];
+};
+
+struct pack_wrk * pack_alloc_wrk(void)
+{
+    return vmalloc(sizeof(struct pack_wrk));
+}
+
+void pack_free_wrk(struct pack_wrk * wrk)
+{
+    vfree(wrk);
+}
+
+/*
+ * Compress the unit at @unit. Returns the compressed data, kept in @wrk
+ * until the next call, and sets @len, or NULL if the unit does not shrink
+ * to PACK_MAX_LEN and is written as it is.
+ */
+const void * pack_compress(struct pack_wrk * wrk, const void * unit, unsigned int * len)
+{
+    size_t n = sizeof(wrk->buf);
+
+    if (lzo1x_1_compress(unit, PHYS_PAGE_SIZE, wrk->buf, &n, wrk->lzo) != LZO_E_OK ||
+            n > PACK_MAX_LEN)
+        return NULL;
+    *len = n;
+    return wrk->buf;
+}
+
+/* an empty pack in @page */
+void pack_start(void * page)
+{
+    struct pack_header * h = page;
+
+    memset(page, 0, PHYS_PAGE_SIZE);
+    h->magic = PACK_MAGIC;
+}
+
+/* append unit @lpn compressed into @len bytes at @data, false if the page is full */
+bool pack_add(void * page, pfn_t lpn, const void * data, unsigned int len)
+{
+    struct pack_header * h = page;
+    struct pack_slot * s = &h->slots[h->nr];
+    unsigned int off = sizeof(struct pack_header);
+
+    if (h->nr == PACK_MAX_UNITS)
+        return false;
+    if (h->nr)
+        off = s[-1].off + s[-1].len;
+    if (off + len > PHYS_PAGE_SIZE)
+        return false;
+
+    memcpy((u8 *)page + off, data, len);
+    s->lpn = lpn;
+    s->off = off;
+    s->len = len;
+    h->nr ++;
+    return true;
+}
+
+static const struct pack_header * pack_header(const void * page)
+{
+    const struct pack_header * h = page;
+
+    return h->magic == PACK_MAGIC && h->nr <= PACK_MAX_UNITS ? h : NULL;
+}
+
+/* the units packed into @page, into @lpns. Returns 0 if it is no pack */
+unsigned int pack_units(const void * page, pfn_t * lpns)
+{
+    const struct pack_header * h = pack_header(page);
+    unsigned int i;
+
+    if (!h)
+        return 0;
+    for (i = 0; i < h->nr; i++)
+        lpns[i] = h->slots[i].lpn;
+    return h->nr;
+}
+
+/* decompress unit @lpn out of @page into @unit */
+int pack_unpack(const void * page, pfn_t lpn, void * unit)
+{
+    const struct pack_header * h = pack_header(page);
+    const struct pack_slot * s;
+    size_t n = PHYS_PAGE_SIZE;
+    unsigned int i;
+
+    for (i = 0; h && i < h->nr; i++) {
+        s = &h->slots[i];
+        if (s->lpn != lpn)
+            continue;
+        if (s->off < sizeof(struct pack_header) || s->off + s->len > PHYS_PAGE_SIZE ||
+                lzo1x_decompress_safe((const u8 *)page + s->off, s->len, unit, &n) != LZO_E_OK ||
+                n != PHYS_PAGE_SIZE)
+            break;
+        return 0;
+    }
+
+    printk(KERN_ERR "ftl: cannot unpack unit %x\n", lpn);
+    return -EIO;
+}
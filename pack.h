@@ -0,0 +1,52 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  pack.h
+ *
+ *    Description:  header for pack.c, compressed units packed into flash pages
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#define PACK_MAGIC      0x4b50      /* "PK" */
+#define PACK_MAX_UNITS  16          /* compressed units in a flash page */
+
+/*
+ * A flash page of packed units starts with their table, the device has
+ * no spare area to keep it in. Every unit of the page is mapped to the
+ * page itself, a read finds its unit by the lpn in the table.
+ */
+struct pack_slot {
+    u32 lpn;
+    u16 off;            // of the compressed unit in the page
+    u16 len;
+};
+
+struct pack_header {
+    u16 magic;
+    u16 nr;
+    struct pack_slot slots[PACK_MAX_UNITS];
+};
+
+/* a unit is only packed if two of it fit in a page */
+#define PACK_MAX_LEN    ((PHYS_PAGE_SIZE - sizeof(struct pack_header)) / 2)
+
+struct pack_wrk;
+
+extern struct pack_wrk * pack_alloc_wrk(void);
+extern void pack_free_wrk(struct pack_wrk * wrk);
+extern const void * pack_compress(struct pack_wrk * wrk, const void * unit, unsigned int * len);
+extern void pack_start(void * page);
+extern bool pack_add(void * page, pfn_t lpn, const void * data, unsigned int len);
+extern unsigned int pack_units(const void * page, pfn_t * lpns);
+extern int pack_unpack(const void * page, pfn_t lpn, void * unit);
+
+#endif
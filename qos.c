@@ -0,0 +1,80 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  qos.c
+ *
+ *    Description:  rate limits of the background io of a disk. Garbage
+ *                  collection and mapping read ahead take credit from a
+ *                  token bucket of their class before they go to the
+ *                  flash, so that they leave the device to host io.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+
+/* every class of @sdk without a limit */
+void ftl_qos_init(struct ssd_disk * sdk)
+{
+    struct ftl_qos * qos = &sdk->qos;
+    int i;
+
+    for (i = 0; i < IO_CLASSES; i++) {
+        spin_lock_init(&qos->bucket[i].lock);
+        qos->bucket[i].cost_ns = 0;
+        qos->bucket[i].credit_ns = QOS_BURST_NS;
+        qos->bucket[i].last_ns = ktime_to_ns(ktime_get());
+    }
+    init_waitqueue_head(&qos->wait);
+}
+
+/* limit @class to @rate pages a second, 0 for no limit */
+void ftl_qos_set_rate(struct ssd_disk * sdk, int class, unsigned int rate)
+{
+    struct ftl_bucket * b = &sdk->qos.bucket[class];
+    unsigned long flags;
+
+    spin_lock_irqsave(&b->lock, flags);
+    b->cost_ns = rate ? div64_u64(1000000000ULL, rate) : 0;
+    spin_unlock_irqrestore(&b->lock, flags);
+    wake_up_all(&sdk->qos.wait);
+}
+
+/*
+ * Take the credit of @nr pages of @class. Returns 0 if it was there, or
+ * the jiffies until it will be, and then nothing is taken.
+ */
+unsigned long ftl_qos_take(struct ssd_disk * sdk, int class, unsigned int nr)
+{
+    struct ftl_bucket * b = &sdk->qos.bucket[class];
+    u64 now, cost, short_ns = 0;
+    unsigned long flags;
+
+    if (!ACCESS_ONCE(b->cost_ns))
+        return 0;
+
+    now = ktime_to_ns(ktime_get());
+    spin_lock_irqsave(&b->lock, flags);
+    b->credit_ns = min_t(u64, b->credit_ns + now - b->last_ns, QOS_BURST_NS);
+    b->last_ns = now;
+    cost = b->cost_ns * nr;
+    if (b->credit_ns >= cost)
+        b->credit_ns -= cost;
+    else
+        short_ns = cost - b->credit_ns;
+    spin_unlock_irqrestore(&b->lock, flags);
+
+    if (!short_ns)
+        return 0;
+    ftl_stat_inc(sdk, FTL_STAT_QOS_THROTTLES);
+    return max_t(unsigned long, usecs_to_jiffies(div64_u64(short_ns, 1000) + 1), 1);
+}
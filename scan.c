@@ -0,0 +1,81 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  scan.c
+ *
+ *    Description:  scans of pfn_t arrays: runs of one value in the mapping
+ *                  pages and the rmap, and the first difference of two
+ *                  pages. Long scans go to the vector loops of scan_vec.c
+ *                  with the fpu saved, the rest and the tails are done
+ *                  here an entry at a time.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "scan.h"
+
+#if defined(__KERNEL__) && defined(SCAN_VEC)
+#include <asm/i387.h>
+#endif
+
+/* whether the vector loops are used, a module parameter */
+bool scan_simd = true;
+
+/*
+ * whether @n entries are scanned with the vector loops, the fpu is saved
+ * then until scan_end. Not in an interrupt that came in while the fpu
+ * was in use.
+ */
+static inline bool scan_begin(unsigned int n)
+{
+#ifdef SCAN_VEC
+    if (n >= SCAN_VEC_MIN && ACCESS_ONCE(scan_simd) && irq_fpu_usable()) {
+        kernel_fpu_begin();
+        return true;
+    }
+#endif
+    return false;
+}
+
+static inline void scan_end(void)
+{
+#ifdef SCAN_VEC
+    kernel_fpu_end();
+#endif
+}
+
+/* how many of the @n entries at @p are @v before the first that is not */
+unsigned int scan_run(const pfn_t * p, unsigned int n, pfn_t v)
+{
+    unsigned int i = 0;
+
+    if (scan_begin(n)) {
+        i = scan_run_vec(p, n & ~(SCAN_VEC_ENTRIES - 1), v);
+        scan_end();
+    }
+    while (i < n && p[i] == v)
+        i ++;
+    return i;
+}
+
+/* the first of @n entries that differs between @a and @b, @n if none does */
+unsigned int scan_diff(const pfn_t * a, const pfn_t * b, unsigned int n)
+{
+    unsigned int i = 0;
+
+    if (scan_begin(n)) {
+        i = scan_diff_vec(a, b, n & ~(SCAN_VEC_ENTRIES - 1));
+        scan_end();
+    }
+    while (i < n && a[i] == b[i])
+        i ++;
+    return i;
+}
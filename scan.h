@@ -0,0 +1,41 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  scan.h
+ *
+ *    Description:  header for scan.c, scans of the mapping pages and the
+ *                  rmap of the flash devices, with vector loops where the
+ *                  fpu may be used
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+/*
+ * The vector loops are built from scan_vec.c, with sse2 in the module on
+ * x86_64 and with whatever the compiler targets in the userspace build.
+ */
+#if !defined(__KERNEL__) || defined(CONFIG_X86_64)
+#define SCAN_VEC
+#endif
+
+#define SCAN_VEC_ENTRIES    32      /* entries a vector loop takes at once, two cache lines */
+#define SCAN_VEC_MIN        128     /* below which saving the fpu costs more than it gains */
+
+extern bool scan_simd;
+
+extern unsigned int scan_run(const pfn_t * p, unsigned int n, pfn_t v);
+extern unsigned int scan_diff(const pfn_t * a, const pfn_t * b, unsigned int n);
+
+/* the vector loops, only between kernel_fpu_begin and kernel_fpu_end */
+extern unsigned int scan_run_vec(const pfn_t * p, unsigned int n, pfn_t v);
+extern unsigned int scan_diff_vec(const pfn_t * a, const pfn_t * b, unsigned int n);
+
+#endif
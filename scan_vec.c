@@ -0,0 +1,68 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  scan_vec.c
+ *
+ *    Description:  the vector loops of scan.c, written with the vector
+ *                  extension of gcc. The module builds this file alone
+ *                  with sse2, nothing else in it may touch the fpu.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "scan.h"
+
+#ifdef SCAN_VEC
+
+/* four entries, loaded from any pfn_t array */
+typedef u32 scan_v4 __attribute__((vector_size(16), aligned(4), __may_alias__));
+typedef u64 scan_v2 __attribute__((vector_size(16)));
+
+static inline bool scan_any(scan_v4 x)
+{
+    scan_v2 w = (scan_v2)x;
+
+    return (w[0] | w[1]) != 0;
+}
+
+/*
+ * The loops take SCAN_VEC_ENTRIES entries at a time, @n is a multiple of
+ * it. They return where the block they stopped in starts, the caller
+ * finds the entry in it.
+ */
+unsigned int scan_run_vec(const pfn_t * p, unsigned int n, pfn_t v)
+{
+    const scan_v4 * q = (const scan_v4 *)p;
+    scan_v4 x = { v, v, v, v };
+    unsigned int i;
+
+    for (i = 0; i < n; i += SCAN_VEC_ENTRIES, q += 8) {
+        if (scan_any(((q[0] ^ x) | (q[1] ^ x)) | ((q[2] ^ x) | (q[3] ^ x)) |
+                ((q[4] ^ x) | (q[5] ^ x)) | ((q[6] ^ x) | (q[7] ^ x))))
+            break;
+    }
+    return i;
+}
+
+unsigned int scan_diff_vec(const pfn_t * a, const pfn_t * b, unsigned int n)
+{
+    const scan_v4 * qa = (const scan_v4 *)a, * qb = (const scan_v4 *)b;
+    unsigned int i;
+
+    for (i = 0; i < n; i += SCAN_VEC_ENTRIES, qa += 8, qb += 8) {
+        if (scan_any(((qa[0] ^ qb[0]) | (qa[1] ^ qb[1])) | ((qa[2] ^ qb[2]) | (qa[3] ^ qb[3])) |
+                ((qa[4] ^ qb[4]) | (qa[5] ^ qb[5])) | ((qa[6] ^ qb[6]) | (qa[7] ^ qb[7]))))
+            break;
+    }
+    return i;
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  selftest.c
+ *
+ *    Description:  self test of the module. The microbenchmarks of mbench.c
+ *                  run on a disk set up on any block device, a ram disk
+ *                  (brd) or null_blk keeps the device out of the numbers.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+#include "mbench.h"
+
+#define SELFTEST_MODE (FMODE_READ | FMODE_WRITE)
+
+static void selftest_run(struct ssd_disk * sdk, unsigned long ops, unsigned int max_threads)
+{
+    struct mbench_result res;
+    unsigned int i, threads;
+    const char * name;
+    int err;
+
+    for (i = 0; (name = mbench_test_name(i)); i++) {
+        for (threads = 1; ; threads = min(threads * 2, max_threads)) {
+            err = mbench_run(sdk, name, threads, ops, &res);
+            if (err == -EINVAL && threads > 1)
+                break;
+            if (err == -EOPNOTSUPP) {
+                printk(KERN_INFO "ss: self test %s skipped, it needs a volume\n", name);
+                break;
+            }
+            if (err) {
+                printk(KERN_ERR "ss: self test %s on %u threads failed, error %d\n",
+                        name, threads, err);
+                break;
+            }
+            printk(KERN_INFO "ss: %-10s %3u threads %10llu ops %8llu ns/op %8llu kops/s\n",
+                    res.test, res.threads, res.ops, res.ns_per_op, res.kops);
+            if (threads == max_threads)
+                break;
+        }
+    }
+}
+
+/*
+ * Run the microbenchmarks on a disk on block device @path, with @ops
+ * operations per thread and up to @max_threads threads (0 for every cpu).
+ * The disk only lives for the test and is never added. The data on the
+ * device is overwritten.
+ */
+int ss_selftest(const char * path, struct kmem_cache * io_cache, unsigned long ops,
+        unsigned int max_threads)
+{
+    struct block_device * bdev;
+    struct ssd_disk * sdk;
+    struct gendisk * gd;
+    int err;
+
+    if (!max_threads)
+        max_threads = num_online_cpus();
+    max_threads = min_t(unsigned int, max_threads, MBENCH_THREADS);
+
+    bdev = blkdev_get_by_path(path, SELFTEST_MODE, NULL);
+    if (IS_ERR(bdev)) {
+        printk(KERN_ERR "ss: self test cannot open %s\n", path);
+        return PTR_ERR(bdev);
+    }
+
+    err = -ENOMEM;
+    sdk = kzalloc(sizeof(struct ssd_disk), GFP_KERNEL);
+    if (!sdk)
+        goto out_bdev;
+    gd = alloc_disk(1);
+    if (!gd)
+        goto out_sdk;
+
+    INIT_LIST_HEAD(&sdk->list);
+    snprintf(gd->disk_name, DISK_NAME_LEN, "ss_selftest");
+    gd->private_data = &sdk->list;
+    sdk->gd = gd;
+    sdk->name = path;
+    sdk->capacity = i_size_read(bdev->bd_inode) >> SECTOR_SHIFT;
+    sdk->old_make_request_fn = bdev_get_queue(bdev)->make_request_fn;
+
+    sdk->bs = bioset_create(MEMPOOL_SIZE, SS_BIO_PAD);
+    sdk->io_pool = mempool_create_slab_pool(MEMPOOL_SIZE, io_cache);
+    if (!sdk->bs || !sdk->io_pool)
+        goto out_pool;
+
+    err = ftl_stats_init(sdk);
+    if (err)
+        goto out_pool;
+    ftl_qos_init(sdk);
+
+    err = wbuf_init(sdk);
+    if (err)
+        goto out_pool;
+
+    // the ftl opens the device once more for its own io
+    sdk->bdev = bdgrab(bdev);
+    err = init_mapping_dir(gd);
+    if (!err) {
+        printk(KERN_INFO "ss: self test on %s, %llu sectors, %lu ops per thread\n",
+                path, (unsigned long long)sdk->capacity, ops);
+        selftest_run(sdk, ops, max_threads);
+    }
+
+    wbuf_exit(sdk);
+    exit_mapping_dir(gd);
+out_pool:
+    ftl_stats_exit(sdk);
+    if (sdk->io_pool)
+        mempool_destroy(sdk->io_pool);
+    if (sdk->bs)
+        bioset_free(sdk->bs);
+    put_disk(gd);
+out_sdk:
+    kfree(sdk);
+out_bdev:
+    blkdev_put(bdev, SELFTEST_MODE);
+    return err;
+}
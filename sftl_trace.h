@@ -0,0 +1,259 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  sftl_trace.h
+ *
+ *    Description:  tracepoints at the decisions of the ftl, under
+ *                  events/sftl/ for ftrace, perf and bpf. They cost a
+ *                  static branch when disabled. The userspace build has
+ *                  them as empty functions.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sftl
+
+#if !defined(_SFTL_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SFTL_TRACE_H_
+
+#ifdef __KERNEL__
+#include <linux/tracepoint.h>
+#endif
+
+/* a translation, @hit when its mapping page was in the cmt */
+TRACE_EVENT(sftl_cmt_lookup,
+    TP_PROTO(const char * disk, u64 lpn, bool update, bool hit),
+    TP_ARGS(disk, lpn, update, hit),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(u64, lpn)
+        __field(bool, update)
+        __field(bool, hit)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->lpn = lpn;
+        __entry->update = update;
+        __entry->hit = hit;
+    ),
+    TP_printk("%s lpn %llu %s %s", __get_str(disk), __entry->lpn,
+            __entry->update ? "set" : "get", __entry->hit ? "hit" : "miss")
+);
+
+/* a mapping page read from the flash, @error is set on its completion, or written */
+DECLARE_EVENT_CLASS(sftl_map_io,
+    TP_PROTO(const char * disk, u64 lpdn, u64 ppn, int error),
+    TP_ARGS(disk, lpdn, ppn, error),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(u64, lpdn)
+        __field(u64, ppn)
+        __field(int, error)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->lpdn = lpdn;
+        __entry->ppn = ppn;
+        __entry->error = error;
+    ),
+    TP_printk("%s mapping page %llu at ppn %llu error %d", __get_str(disk),
+            __entry->lpdn, __entry->ppn, __entry->error)
+);
+
+DEFINE_EVENT(sftl_map_io, sftl_map_read,
+    TP_PROTO(const char * disk, u64 lpdn, u64 ppn, int error),
+    TP_ARGS(disk, lpdn, ppn, error)
+);
+
+DEFINE_EVENT(sftl_map_io, sftl_map_read_done,
+    TP_PROTO(const char * disk, u64 lpdn, u64 ppn, int error),
+    TP_ARGS(disk, lpdn, ppn, error)
+);
+
+/* a dirty mapping page queued for write back, @ppn is its current place */
+DEFINE_EVENT(sftl_map_io, sftl_map_queue,
+    TP_PROTO(const char * disk, u64 lpdn, u64 ppn, int error),
+    TP_ARGS(disk, lpdn, ppn, error)
+);
+
+/* a mapping page written at @ppn by a sync or a checkpoint */
+DEFINE_EVENT(sftl_map_io, sftl_map_write,
+    TP_PROTO(const char * disk, u64 lpdn, u64 ppn, int error),
+    TP_ARGS(disk, lpdn, ppn, error)
+);
+
+/* a clean mapping page dropped from the cmt, @ppn is where it is reread from */
+TRACE_EVENT(sftl_cmt_evict,
+    TP_PROTO(const char * disk, u64 lpdn, u64 ppn),
+    TP_ARGS(disk, lpdn, ppn),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(u64, lpdn)
+        __field(u64, ppn)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->lpdn = lpdn;
+        __entry->ppn = ppn;
+    ),
+    TP_printk("%s mapping page %llu at ppn %llu", __get_str(disk), __entry->lpdn,
+            __entry->ppn)
+);
+
+/*
+ * a host bio split into @clones bios to the device, @unmapped pages read
+ * or written as zeros and @buffered pages served by the write buffer
+ */
+TRACE_EVENT(sftl_bio_split,
+    TP_PROTO(const char * disk, u64 sector, unsigned int sectors, int rw,
+        unsigned int clones, unsigned int unmapped, unsigned int buffered),
+    TP_ARGS(disk, sector, sectors, rw, clones, unmapped, buffered),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(u64, sector)
+        __field(unsigned int, sectors)
+        __field(int, rw)
+        __field(unsigned int, clones)
+        __field(unsigned int, unmapped)
+        __field(unsigned int, buffered)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->sector = sector;
+        __entry->sectors = sectors;
+        __entry->rw = rw;
+        __entry->clones = clones;
+        __entry->unmapped = unmapped;
+        __entry->buffered = buffered;
+    ),
+    TP_printk("%s %s %llu + %u clones %u unmapped %u buffered %u", __get_str(disk),
+            __entry->rw == WRITE ? "W" : "R", __entry->sector, __entry->sectors,
+            __entry->clones, __entry->unmapped, __entry->buffered)
+);
+
+/* a unit of the write buffer written to the flash, @valid of its sectors buffered */
+TRACE_EVENT(sftl_wbuf_writeback,
+    TP_PROTO(const char * disk, u64 lpn, unsigned int valid),
+    TP_ARGS(disk, lpn, valid),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(u64, lpn)
+        __field(unsigned int, valid)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->lpn = lpn;
+        __entry->valid = valid;
+    ),
+    TP_printk("%s lpn %llu valid %u", __get_str(disk), __entry->lpn, __entry->valid)
+);
+
+/*
+ * the phases of a host flush: it starts and the write buffer is drained
+ * (@count the sectors of data it carries), and the mapping pages are
+ * flushed (@count the pages queued)
+ */
+#define SFTL_FLUSH_START    0
+#define SFTL_FLUSH_DRAINED  1
+#define SFTL_FLUSH_MAPPING  2
+
+TRACE_EVENT(sftl_flush,
+    TP_PROTO(const char * disk, int phase, unsigned int count, int error),
+    TP_ARGS(disk, phase, count, error),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(int, phase)
+        __field(unsigned int, count)
+        __field(int, error)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->phase = phase;
+        __entry->count = count;
+        __entry->error = error;
+    ),
+    TP_printk("%s %s count %u error %d", __get_str(disk),
+            __print_symbolic(__entry->phase,
+                { SFTL_FLUSH_START, "start" },
+                { SFTL_FLUSH_DRAINED, "drained" },
+                { SFTL_FLUSH_MAPPING, "mapping" }),
+            __entry->count, __entry->error)
+);
+
+/* block @pbn of device @dev opened as a write frontier, @free blocks left */
+TRACE_EVENT(sftl_alloc_block,
+    TP_PROTO(const char * disk, unsigned int dev, u32 pbn, u32 free, bool gc),
+    TP_ARGS(disk, dev, pbn, free, gc),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(unsigned int, dev)
+        __field(u32, pbn)
+        __field(u32, free)
+        __field(bool, gc)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->dev = dev;
+        __entry->pbn = pbn;
+        __entry->free = free;
+        __entry->gc = gc;
+    ),
+    TP_printk("%s dev %u block %u free %u for %s", __get_str(disk), __entry->dev,
+            __entry->pbn, __entry->free, __entry->gc ? "gc" : "host")
+);
+
+/* garbage collection picked block @pbn with @valid pages to move */
+TRACE_EVENT(sftl_gc_victim,
+    TP_PROTO(const char * disk, unsigned int dev, u32 pbn, unsigned int valid),
+    TP_ARGS(disk, dev, pbn, valid),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(unsigned int, dev)
+        __field(u32, pbn)
+        __field(unsigned int, valid)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->dev = dev;
+        __entry->pbn = pbn;
+        __entry->valid = valid;
+    ),
+    TP_printk("%s dev %u block %u valid %u", __get_str(disk), __entry->dev,
+            __entry->pbn, __entry->valid)
+);
+
+TRACE_EVENT(sftl_gc_erase,
+    TP_PROTO(const char * disk, unsigned int dev, u32 pbn, int error),
+    TP_ARGS(disk, dev, pbn, error),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(unsigned int, dev)
+        __field(u32, pbn)
+        __field(int, error)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->dev = dev;
+        __entry->pbn = pbn;
+        __entry->error = error;
+    ),
+    TP_printk("%s dev %u block %u error %d", __get_str(disk), __entry->dev,
+            __entry->pbn, __entry->error)
+);
+
+#endif
+
+#ifdef __KERNEL__
+/* the header is not under include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sftl_trace
+#include <trace/define_trace.h>
+#endif
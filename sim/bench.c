@@ -0,0 +1,976 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench.c
+ *
+ *    Description:  trace driven simulator of the ftl core. Replays block
+ *                  traces (blkparse, MSR Cambridge, SPC) or synthetic
+ *                  workloads against a disk on the simulated flash, going
+ *                  through the ftl like the make_request path of ssd.c,
+ *                  and reports throughput, cmt and flash statistics.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <strings.h>
+
+#include "sftl.h"
+#include "pack.h"
+#include "dedup.h"
+#include "scan.h"
+
+enum {
+    W_UNIFORM,
+    W_ZIPF,
+    W_SEQ,
+    W_MIXED,
+    W_TRACE,
+};
+
+enum {
+    T_BLKPARSE,
+    T_MSR,
+    T_SPC,
+};
+
+enum {
+    BR_READ,
+    BR_WRITE,
+    BR_DISCARD,
+    BR_FLUSH,
+};
+
+static const char * workloads[] = { "uniform", "zipf", "seq", "mixed", "trace" };
+static const char * formats[] = { "blkparse", "msr", "spc" };
+
+struct bench_req {
+    int type;
+    sector_t sector;
+    unsigned int nr_sects;
+};
+
+struct bench_opts {
+    int workload;
+    int format;
+    const char * trace;
+    u64 nr_reqs;            // synthetic requests, over all threads
+    unsigned int req_pages; // synthetic request size
+    unsigned int reads;     // percent of synthetic requests that read
+    double theta;           // zipf skew
+    unsigned int threads;
+    unsigned int flush;     // host page writes between mapping flushes, 0 never
+    unsigned int devs;      // devices of a striped volume, 0 for one written in place
+    unsigned int gc_rate;   // pages a second, 0 for no limit
+    unsigned int map_rate;
+    unsigned int compress;  // the data written compresses that much, 0 if units are not packed
+    unsigned int dedup;     // percent of the units written that are one of DUP_CONTENTS, 0 if not shared
+    unsigned int zeros;     // percent of the whole units written to a volume that are zeros
+    u64 seed;
+    bool reload;            // remove the volume at the end and add it again
+    bool csv;
+};
+
+/*
+ * zipf over [0, n) after Gray et al., "Quickly generating billion-record
+ * synthetic databases". Ranks are scattered over the device by a hash,
+ * so the hot pages do not all share a few mapping pages.
+ */
+struct zipf {
+    u64 n;
+    double theta, alpha, zetan, eta, zeta2;
+};
+
+struct bench_counters {
+    u64 reqs;
+    u64 read_pages;
+    u64 write_pages;
+    u64 unmapped_pages;     // reads answered without flash io
+    u64 discard_pages;
+    u64 flushes;
+    u64 errors;
+};
+
+struct bench_thread {
+    struct bench_opts * opts;
+    struct ssd_disk * sdk;
+    struct zipf * zipf;
+    pthread_t tid;
+    u64 rnd;
+    u64 nr_reqs;            // synthetic requests left
+    u64 next;               // next page of the sequential stream
+    FILE * trace;
+    u64 unflushed;          // page writes since the last flush
+    u8 * data;              // what every write writes
+    struct pack_wrk * pack_wrk;
+    u8 * pack;              // the page being packed, NULL if units are not
+    pfn_t pack_lpns[PACK_MAX_UNITS];
+    unsigned int pack_nr;
+    struct bench_counters c;
+};
+
+#define DUP_CONTENTS    64      /* the data of the duplicate units written */
+
+static u64 nr_pages;         // host pages of the disk
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;  // one flusher at a time
+
+static u64 xorshift(u64 * s)
+{
+    u64 x = *s;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double rnd_unit(u64 * s)
+{
+    return (xorshift(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static u64 scatter(u64 x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static void zipf_init(struct zipf * z, u64 n, double theta)
+{
+    u64 i;
+
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (i = 1; i <= n; i++)
+        z->zetan += 1.0 / pow((double)i, theta);
+    z->zeta2 = 1.0 + pow(0.5, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - z->zeta2 / z->zetan);
+}
+
+static u64 zipf_next(struct zipf * z, u64 * s)
+{
+    double u = rnd_unit(s), uz = u * z->zetan;
+    u64 rank;
+
+    if (uz < 1.0)
+        rank = 0;
+    else if (uz < z->zeta2)
+        rank = 1;
+    else
+        rank = (u64)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+
+    // the hottest page is not lpn 0, which is never unmapped
+    return scatter(min(rank, z->n - 1) + 1) % z->n;
+}
+
+/* split @line in place into at most @max fields separated by @sep */
+static int split(char * line, const char * sep, char ** f, int max)
+{
+    int n = 0;
+    char * tok;
+
+    while (n < max && (tok = strsep(&line, sep))) {
+        if (*tok)
+            f[n++] = tok;
+    }
+    return n;
+}
+
+/*
+ * blkparse default output, queue events only:
+ *   8,0  3  1  0.000000000  697  Q  WS 223490 + 8 [kjournald]
+ *   8,0  3  2  0.000000100  697  Q FWS [kjournald]
+ */
+static int parse_blkparse(char * line, struct bench_req * req)
+{
+    char * f[10];
+    int n = split(line, " \t\n", f, 10);
+
+    if (n < 7 || strcmp(f[5], "Q"))
+        return -1;
+
+    if (n < 10 || strcmp(f[8], "+")) {
+        if (!strchr(f[6], 'F'))
+            return -1;
+        req->type = BR_FLUSH;
+        req->sector = 0;
+        req->nr_sects = 0;
+        return 0;
+    }
+
+    if (strchr(f[6], 'D'))
+        req->type = BR_DISCARD;
+    else if (strchr(f[6], 'W'))
+        req->type = BR_WRITE;
+    else if (strchr(f[6], 'R'))
+        req->type = BR_READ;
+    else if (strchr(f[6], 'F'))
+        req->type = BR_FLUSH;
+    else
+        return -1;
+
+    req->sector = strtoull(f[7], NULL, 10);
+    req->nr_sects = strtoul(f[9], NULL, 10);
+    return 0;
+}
+
+/*
+ * MSR Cambridge, byte offsets and sizes:
+ *   Timestamp,Hostname,DiskNumber,Type,Offset,Size,ResponseTime
+ */
+static int parse_msr(char * line, struct bench_req * req)
+{
+    char * f[7];
+
+    if (split(line, ",\r\n", f, 7) < 6)
+        return -1;
+
+    if (!strcasecmp(f[3], "Write"))
+        req->type = BR_WRITE;
+    else if (!strcasecmp(f[3], "Read"))
+        req->type = BR_READ;
+    else
+        return -1;
+
+    req->sector = strtoull(f[4], NULL, 10) >> 9;
+    req->nr_sects = (strtoull(f[5], NULL, 10) + 511) >> 9;
+    return 0;
+}
+
+/*
+ * SPC (UMass trace repository), lba in sectors and size in bytes:
+ *   ASU,LBA,Size,Opcode,Timestamp
+ */
+static int parse_spc(char * line, struct bench_req * req)
+{
+    char * f[5];
+
+    if (split(line, ",\r\n", f, 5) < 4)
+        return -1;
+
+    if (f[3][0] == 'w' || f[3][0] == 'W')
+        req->type = BR_WRITE;
+    else if (f[3][0] == 'r' || f[3][0] == 'R')
+        req->type = BR_READ;
+    else
+        return -1;
+
+    req->sector = strtoull(f[1], NULL, 10);
+    req->nr_sects = (strtoull(f[2], NULL, 10) + 511) >> 9;
+    return 0;
+}
+
+static bool next_trace_req(struct bench_thread * t, struct bench_req * req)
+{
+    static int (* const parse[])(char *, struct bench_req *) = {
+        [T_BLKPARSE] = parse_blkparse,
+        [T_MSR] = parse_msr,
+        [T_SPC] = parse_spc,
+    };
+    char line[512];
+
+    while (fgets(line, sizeof(line), t->trace)) {
+        if (!parse[t->opts->format](line, req) && (req->nr_sects || req->type == BR_FLUSH)) {
+            // a trace of a larger device wraps around ours
+            req->sector %= nr_pages << PAGE_SECTOR_SHIFT;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool next_synthetic_req(struct bench_thread * t, struct bench_req * req)
+{
+    struct bench_opts * o = t->opts;
+    u64 lpn, span = nr_pages - o->req_pages + 1;
+    int workload = o->workload;
+
+    if (!t->nr_reqs)
+        return false;
+    t->nr_reqs --;
+
+    if (workload == W_MIXED)
+        workload = xorshift(&t->rnd) & 1 ? W_SEQ : W_UNIFORM;
+
+    switch (workload) {
+    case W_ZIPF:
+        lpn = zipf_next(t->zipf, &t->rnd) % span;
+        break;
+    case W_SEQ:
+        if (t->next >= span)
+            t->next = 0;
+        lpn = t->next;
+        t->next += o->req_pages;
+        break;
+    default:
+        lpn = xorshift(&t->rnd) % span;
+        break;
+    }
+
+    req->type = xorshift(&t->rnd) % 100 < o->reads ? BR_READ : BR_WRITE;
+    req->sector = lpn << PAGE_SECTOR_SHIFT;
+    req->nr_sects = o->req_pages << PAGE_SECTOR_SHIFT;
+    return true;
+}
+
+static int nand_pages_io(struct block_device * nand, int rw, u64 page, unsigned int nr, u8 * buf)
+{
+    unsigned int i;
+    int err = 0;
+
+    for (i = 0; i < nr && !err; i++)
+        err = rw == WRITE ? nand_program(nand, page + i, buf, NULL) : nand_read(nand, page + i, NULL, NULL);
+    return err;
+}
+
+/* @nr pages of a host unit of a volume, from @ppn where the allocator put it */
+static int vol_page_io(struct ssd_disk * sdk, int rw, pfn_t ppn, unsigned int nr, u8 * buf)
+{
+    return nand_pages_io(ppn_bdev(sdk, ppn), rw, ppn_sector(sdk, ppn) >> PAGE_SECTOR_SHIFT, nr, buf);
+}
+
+/* @nr pages from @off of the unit at @ppn, a packed one is read with its whole page */
+static int vol_read_unit(struct ssd_disk * sdk, pfn_t ppn, unsigned int off, unsigned int nr)
+{
+    if (ppn_packed(sdk, ppn))
+        return vol_page_io(sdk, READ, ppn, 1, NULL);
+    return vol_page_io(sdk, READ, ppn + off, nr, NULL);
+}
+
+/* program the page being packed, a single unit in it is written as it is */
+static void pack_flush(struct bench_thread * t)
+{
+    struct ssd_disk * sdk = t->sdk;
+    pfn_t ppn, olds[PACK_MAX_UNITS];
+    unsigned int i;
+    int err = 0, error = 0;
+
+    if (!t->pack_nr)
+        return;
+    if (t->pack_nr == 1)
+        ppn = ftl_map_write(sdk, t->pack_lpns[0], &olds[0], NULL, &err);
+    else
+        ppn = ftl_map_pack(sdk, t->pack_lpns, t->pack_nr, olds, NULL, &err);
+    if (ppn)
+        error = vol_page_io(sdk, WRITE, ppn, 1, t->pack_nr == 1 ? t->data : t->pack);
+    if (err || !ppn || error)
+        t->c.errors ++;
+    if (ppn) {
+        for (i = 0; i < t->pack_nr; i++)
+            ftl_map_done(sdk, t->pack_lpns[i], ppn, olds[i], error);
+        ftl_write_done(sdk, ppn);
+    }
+    t->pack_nr = 0;
+    pack_start(t->pack);
+}
+
+/*
+ * what the write buffer of a volume that packs its units does with unit
+ * @lpn: it goes into the page being packed if it compresses, the page is
+ * programmed once the next one does not fit. Returns false if the unit
+ * is to be written as it is.
+ */
+static bool pack_unit(struct bench_thread * t, pfn_t lpn)
+{
+    const void * data;
+    unsigned int i, len;
+
+    data = pack_compress(t->pack_wrk, t->data, &len);
+    if (!data)
+        return false;
+    // a page holds a unit once, the buffer merges rewrites
+    for (i = 0; i < t->pack_nr && t->pack_lpns[i] != lpn; i++)
+        ;
+    if (i < t->pack_nr || !pack_add(t->pack, lpn, data, len)) {
+        pack_flush(t);
+        pack_add(t->pack, lpn, data, len);
+    }
+    t->pack_lpns[t->pack_nr ++] = lpn;
+    return true;
+}
+
+/*
+ * what the write buffer of a volume that shares units does with unit
+ * @lpn. Its data is stamped at the start, a duplicate with one of
+ * DUP_CONTENTS and any other write with a random number. Returns true if
+ * it was mapped to a copy on the flash, sets @fp otherwise.
+ */
+static bool share_unit(struct bench_thread * t, pfn_t lpn, u64 * fp)
+{
+    u64 * stamp = (u64 *)t->data;
+
+    if (xorshift(&t->rnd) % 100 < t->opts->dedup)
+        *stamp = xorshift(&t->rnd) % DUP_CONTENTS;
+    else
+        *stamp = xorshift(&t->rnd) | (1ULL << 63);
+    *fp = dedup_fp(t->data, PHYS_PAGE_SIZE);
+    return ftl_map_dedup(t->sdk, lpn, t->data, *fp);
+}
+
+/* whether the next whole unit a volume writes is zeros, __clone_and_map only unmaps it */
+static bool zero_unit(struct bench_thread * t)
+{
+    return t->opts->zeros && xorshift(&t->rnd) % 100 < t->opts->zeros;
+}
+
+/* the pages of [@first, @end) in units [@lpn, @lpn + @nr) */
+static unsigned int unit_span(struct ssd_disk * sdk, pfn_t lpn, unsigned int nr, u64 first, u64 end)
+{
+    u64 lo = max_t(u64, (u64)lpn << sdk->unit_shift, first);
+    u64 hi = min_t(u64, (u64)(lpn + nr) << sdk->unit_shift, end);
+
+    return hi > lo ? hi - lo : 0;
+}
+
+/*
+ * a flush of the host: a volume syncs its mapping to the flash as the
+ * flush of the disk does, an in-place disk only queues its dirty pages
+ */
+static void flush_mapping(struct bench_thread * t)
+{
+    struct ssd_disk * sdk = t->sdk;
+
+    pthread_mutex_lock(&flush_lock);
+    if (!sdk->vol)
+        flush_mapping_pages(sdk->gd);
+    else if (ftl_map_sync(sdk))
+        t->c.errors ++;
+    pthread_mutex_unlock(&flush_lock);
+    t->c.flushes ++;
+    t->unflushed = 0;
+}
+
+/*
+ * what ss_make_request_fn and __clone_and_map do for a request: reads
+ * skip unmapped runs, discarded ones in place, and read the other units.
+ * Writes program the units in place, or on a volume out of place. A
+ * volume writes whole mapping units, the part of one a request does not
+ * cover is read from where the unit was, as the write buffer does.
+ */
+static void do_req(struct bench_thread * t, struct bench_req * req)
+{
+    struct ssd_disk * sdk = t->sdk;
+    struct gendisk * gd = sdk->gd;
+    struct block_device * nand = sdk->bdev;
+    unsigned int shift = sdk->unit_shift, upages = 1U << shift;
+    u64 first = req->sector >> PAGE_SECTOR_SHIFT;
+    u64 end = (req->sector + req->nr_sects + PAGE_SECTOR - 1) >> PAGE_SECTOR_SHIFT;
+    pfn_t lpn = first >> shift, last;
+    ktime_t start = ktime_get();
+    unsigned int run, n, off;
+    pfn_t ppn, old;
+    u64 fp = 0;
+    int err = 0;
+
+    t->c.reqs ++;
+    end = min_t(u64, end, nr_pages);
+    last = (end + upages - 1) >> shift;
+
+    switch (req->type) {
+    case BR_READ:
+        if (sdk->vol)
+            detect_seq_stream(gd, req->sector, req->nr_sects);
+        while (lpn < last) {
+            run = get_unmapped_run(gd, lpn, last - lpn);
+            if (run) {
+                n = unit_span(sdk, lpn, run, first, end);
+                t->c.unmapped_pages += n;
+                t->c.read_pages += n;
+                lpn += run;
+                continue;
+            }
+            n = unit_span(sdk, lpn, 1, first, end);
+            off = lpn == first >> shift ? first & (upages - 1) : 0;
+            if (sdk->vol) {
+                err = 0;
+                ppn = ftl_read_get(sdk, lpn, &err);
+                if (err || (ppn && vol_read_unit(sdk, ppn, off, n)))
+                    t->c.errors ++;
+                if (ppn)
+                    ftl_read_put(sdk, ppn);
+            } else {
+                if (nand_pages_io(nand, READ, inplace_ppn(sdk, lpn) + off, n, NULL))
+                    t->c.errors ++;
+            }
+            t->c.read_pages += n;
+            lpn ++;
+        }
+        ftl_lat_record(sdk, LAT_READ, LAT_NO_STALL, ktime_to_ns(ktime_sub(ktime_get(), start)));
+        break;
+
+    case BR_WRITE:
+        for (; lpn < last; lpn++) {
+            n = unit_span(sdk, lpn, 1, first, end);
+            off = lpn == first >> shift ? first & (upages - 1) : 0;
+            if (sdk->vol && n == upages && zero_unit(t)) {
+                if (unmap_phys_range(gd, lpn, 1))
+                    t->c.errors ++;
+                ftl_stat_inc(sdk, FTL_STAT_ZERO_UNITS);
+            } else if (sdk->vol) {
+                err = 0;
+                if (n < upages && (old = ftl_read_get(sdk, lpn, &err))) {
+                    if (vol_read_unit(sdk, old, 0, upages - n))
+                        t->c.errors ++;
+                    ftl_read_put(sdk, old);
+                } else if (err)
+                    t->c.errors ++;
+                if (t->pack ? !pack_unit(t, lpn) : !sdk->vol->dedup || !share_unit(t, lpn, &fp)) {
+                    ppn = ftl_map_write(sdk, lpn, &old, NULL, &err);
+                    err = ppn ? vol_page_io(sdk, WRITE, ppn, upages, t->data) : -ENOSPC;
+                    if (err)
+                        t->c.errors ++;
+                    else if (sdk->vol->dedup)
+                        ftl_dedup_add(sdk, ppn, fp);
+                    if (ppn) {
+                        ftl_map_done(sdk, lpn, ppn, old, err);
+                        ftl_write_done(sdk, ppn);
+                    }
+                }
+            } else {
+                map_in_place(gd, lpn);
+                if (nand_pages_io(nand, WRITE, inplace_ppn(sdk, lpn) + off, n, t->data))
+                    t->c.errors ++;
+            }
+            t->c.write_pages += n;
+            t->unflushed += n;
+            if (t->opts->flush && t->unflushed >= t->opts->flush)
+                flush_mapping(t);
+        }
+        ftl_lat_record(sdk, LAT_WRITE, LAT_NO_STALL, ktime_to_ns(ktime_sub(ktime_get(), start)));
+        break;
+
+    case BR_DISCARD:
+        // only whole units lose their mapping
+        lpn = (first + upages - 1) >> shift;
+        last = end >> shift;
+        if (last > lpn) {
+            if (unmap_phys_range(gd, lpn, last - lpn))
+                t->c.errors ++;
+            t->c.discard_pages += (u64)(last - lpn) << shift;
+        }
+        break;
+
+    case BR_FLUSH:
+        flush_mapping(t);
+        break;
+    }
+}
+
+static void * bench_thread_fn(void * arg)
+{
+    struct bench_thread * t = arg;
+    struct bench_req req;
+
+    if (t->trace) {
+        while (next_trace_req(t, &req))
+            do_req(t, &req);
+    } else {
+        while (next_synthetic_req(t, &req))
+            do_req(t, &req);
+    }
+    if (t->pack)
+        pack_flush(t);
+
+    return NULL;
+}
+
+/*
+ * the data of the writes of a thread: random bytes for 1 / @ratio of the
+ * page and a repeated line of text for the rest, the unit compresses
+ * about @ratio to 1. 0 writes zeros.
+ */
+static int bench_thread_init(struct bench_thread * t, unsigned int ratio)
+{
+    static const char line[] = "GET /index.html HTTP/1.1 200 ok\n";
+    unsigned int i, rnd = ratio ? PHYS_PAGE_SIZE / ratio : 0;
+
+    t->data = calloc(1, PHYS_PAGE_SIZE);
+    if (!t->data)
+        return -ENOMEM;
+    for (i = 0; ratio && i < PHYS_PAGE_SIZE; i++)
+        t->data[i] = i < rnd ? xorshift(&t->rnd) : line[i % (sizeof(line) - 1)];
+    if (!t->sdk->wb.pack)
+        return 0;
+
+    t->pack_wrk = pack_alloc_wrk();
+    t->pack = malloc(PHYS_PAGE_SIZE);
+    if (!t->pack_wrk || !t->pack)
+        return -ENOMEM;
+    pack_start(t->pack);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double ratio(u64 a, u64 b)
+{
+    return b ? (double)a / b : 0;
+}
+
+static void report(struct bench_opts * o, struct nand_config * cfg, struct ssd_disk * sdk,
+        struct bench_counters * c, double secs)
+{
+    u64 hits = ftl_stat_read(sdk, FTL_STAT_CMT_HITS);
+    u64 misses = ftl_stat_read(sdk, FTL_STAT_CMT_MISSES);
+    u64 map_reads = ftl_stat_read(sdk, FTL_STAT_MAP_READS);
+    u64 map_queued = ftl_stat_read(sdk, FTL_STAT_MAP_QUEUED);
+    u64 cmt_pages = ftl_stat_read(sdk, FTL_STAT_CMT_PAGES);
+    u64 host_pages = c->read_pages + c->write_pages, gc_copies;
+    struct ftl_lat_hist rl, wl;
+    struct nand_stats ns;
+    double mib = (double)host_pages * PHYS_PAGE_SIZE / (1 << 20);
+
+    sim_nand_stats(sdk, &ns);
+    ftl_lat_read(sdk, LAT_READ, LAT_NO_STALL, &rl);
+    ftl_lat_read(sdk, LAT_WRITE, LAT_NO_STALL, &wl);
+
+    // the rest of the programs are host data and mapping pages
+    gc_copies = ftl_stat_read(sdk, FTL_STAT_GC_COPIES);
+
+    if (o->csv) {
+        printf("workload,requests,read_pages,write_pages,unmapped_pages,seconds,req_per_s,mib_per_s,"
+                "busy_s,die_busy_s,cmt_hits,cmt_misses,cmt_hit_ratio,cmt_pages,map_reads,map_queued,"
+                "flash_reads,flash_programs,flash_erases,gc_copies,write_amp,read_p50_us,read_p99_us,"
+                "write_p99_us,errors\n");
+        printf("%s,%llu,%llu,%llu,%llu,%.3f,%.0f,%.1f,%.3f,%.3f,%llu,%llu,%.4f,%llu,%llu,%llu,"
+                "%llu,%llu,%llu,%llu,%.3f,%.1f,%.1f,%.1f,%llu\n",
+                o->workload == W_TRACE ? o->trace : workloads[o->workload],
+                c->reqs, c->read_pages, c->write_pages, c->unmapped_pages,
+                secs, c->reqs / secs, mib / secs, ns.busy_ns * 1e-9, ns.die_busy_ns * 1e-9,
+                hits, misses, ratio(hits, hits + misses), cmt_pages, map_reads, map_queued,
+                ns.reads, ns.programs, ns.erases, gc_copies,
+                ratio(ns.programs, c->write_pages), ftl_lat_percentile(&rl, 5000) * 1e-3,
+                ftl_lat_percentile(&rl, 9900) * 1e-3, ftl_lat_percentile(&wl, 9900) * 1e-3,
+                c->errors + ns.errors);
+        return;
+    }
+
+    if (o->workload == W_TRACE)
+        printf("workload     %s trace %s\n", formats[o->format], o->trace);
+    else
+        printf("workload     %s, %llu requests of %u pages, %u%% reads, %u threads\n",
+                workloads[o->workload], o->nr_reqs, o->req_pages, o->reads, o->threads);
+    printf("device       %u blocks x %u pages of %u bytes, %.1f GiB, mapped in units of %u pages",
+            cfg->nr_blocks, cfg->pages_per_block, PHYS_PAGE_SIZE,
+            (double)nr_pages * PHYS_PAGE_SIZE / (1 << 30), cfg->map_pages);
+    if (o->devs)
+        printf(", striped over %u devices", o->devs);
+    printf("\n");
+    printf("dies         %u channels x %u dies x %u planes per device\n",
+            cfg->nr_channels, cfg->nr_dies, cfg->nr_planes);
+    printf("elapsed      %.3f s, flash busy %.3f s, %.3f s on the busiest die\n", secs,
+            ns.busy_ns * 1e-9, ns.die_busy_ns * 1e-9);
+    printf("throughput   %.0f req/s, %.1f MiB/s\n", c->reqs / secs, mib / secs);
+    printf("host         %llu requests, %llu pages read (%llu unmapped), %llu written, "
+            "%llu discarded, %llu flushes\n",
+            c->reqs, c->read_pages, c->unmapped_pages, c->write_pages, c->discard_pages,
+            c->flushes);
+    printf("cmt          %llu hits, %llu misses, hit ratio %.2f%%, %llu pages cached\n",
+            hits, misses, 100 * ratio(hits, hits + misses), cmt_pages);
+    printf("mapping      %llu pages read, %llu queued for write back", map_reads, map_queued);
+    if (cfg->block_map)
+        printf(", %llu blocks mapped whole, %llu broken", ftl_stat_read(sdk, FTL_STAT_BMAP_MERGES),
+                ftl_stat_read(sdk, FTL_STAT_BMAP_BREAKS));
+    printf("\n");
+    printf("flash        %llu reads, %llu programs, %llu erases\n",
+            ns.reads, ns.programs, ns.erases);
+    printf("gc           %llu pages copied, %llu writes stalled, %llu waits for reads, "
+            "%llu throttled\n", gc_copies, ftl_stat_read(sdk, FTL_STAT_GC_STALLS),
+            ftl_stat_read(sdk, FTL_STAT_GC_SUSPENDS), ftl_stat_read(sdk, FTL_STAT_QOS_THROTTLES));
+    printf("latency      read p50 %.1f us, p99 %.1f us, write p99 %.1f us\n",
+            ftl_lat_percentile(&rl, 5000) * 1e-3, ftl_lat_percentile(&rl, 9900) * 1e-3,
+            ftl_lat_percentile(&wl, 9900) * 1e-3);
+    if (cfg->compress)
+        printf("compression  %llu units packed into %llu pages\n",
+                ftl_stat_read(sdk, FTL_STAT_PACKED_UNITS), ftl_stat_read(sdk, FTL_STAT_PACKED_PAGES));
+    if (cfg->dedup)
+        printf("dedup        %llu units shared, %llu fingerprints mismatched\n",
+                ftl_stat_read(sdk, FTL_STAT_DEDUP_HITS), ftl_stat_read(sdk, FTL_STAT_DEDUP_MISMATCHES));
+    if (o->zeros)
+        printf("zeros        %llu units unmapped\n", ftl_stat_read(sdk, FTL_STAT_ZERO_UNITS));
+    printf("write amp    %.3f\n", ratio(ns.programs, c->write_pages));
+    if (c->errors + ns.errors)
+        printf("errors       %llu\n", c->errors + ns.errors);
+}
+
+static void usage(const char * prog)
+{
+    fprintf(stderr,
+        "usage: %s [options] uniform|zipf|seq|mixed\n"
+        "       %s [options] -f blkparse|msr|spc TRACE\n"
+        "\n"
+        "synthetic workloads:\n"
+        "  -n REQS      requests (1000000)\n"
+        "  -s PAGES     pages per request (1)\n"
+        "  -r PERCENT   reads (50)\n"
+        "  -z THETA     zipf skew (0.99)\n"
+        "  -j THREADS   submitting threads (1)\n"
+        "  -S SEED      random seed\n"
+        "\n"
+        "device:\n"
+        "  -B BLOCKS    erase blocks (8192)\n"
+        "  -P PAGES     pages per block (%u)\n"
+        "  -L R,P,E     read, program and erase latency in us (50,500,3000)\n"
+        "  -G C,D,P     channels, dies per channel and planes per die (1,1,1)\n"
+        "  -d           spend the flash latencies in real time\n"
+        "  -m DEVS      stripe a volume over DEVS devices, written out of place\n"
+        "  -Q GC,MAP    pages a second gc and mapping read ahead may do (0,0 no limit)\n"
+        "  -U PAGES     pages of a mapping unit, a power of two up to %u (1)\n"
+        "  -H           map blocks of a volume written in order as a whole\n"
+        "  -Z RATIO     pack units of a volume compressed, the data compresses RATIO to 1\n"
+        "  -D PERCENT   share the units of a volume written with the same data, PERCENT\n"
+        "               of those written are duplicates\n"
+        "  -E PERCENT   whole units written to a volume that are zeros, they are unmapped\n"
+        "  -V           scan mapping pages and the rmap with the scalar loops only\n"
+        "\n"
+        "  -F PAGES     flush the mapping every PAGES page writes (never)\n"
+        "  -R           remove the volume at the end, add it again and check its mapping\n"
+        "  -c           print one csv record\n",
+        prog, prog, PAGE_NUM_BLOCK, 1 << UNIT_MAX_SHIFT);
+    exit(1);
+}
+
+/*
+ * remove the volume and add it again on the same flash, it must load the
+ * mapping it saved. Returns the disk added, NULL if it could not be or
+ * the mapping changed.
+ */
+static struct ssd_disk * reload(struct ssd_disk * sdk, struct bench_opts * o)
+{
+    struct block_device * nands[VOL_MAX_DEVS];
+    pfn_t lpn, nr_lpns = nr_pages >> sdk->unit_shift, * ppns;
+    unsigned int nr;
+    u64 mapped = 0, bad = 0;
+
+    ppns = malloc(sizeof(pfn_t) * nr_lpns);
+    if (!ppns) {
+        sim_disk_destroy(sdk);
+        return NULL;
+    }
+    // gc still moving units would change the mapping after it is read
+    ftl_vol_quiesce(sdk);
+    for (lpn = 0; lpn < nr_lpns; lpn++)
+        ppns[lpn] = get_phys_ppn(sdk->gd, lpn, 0, NULL);
+
+    nr = sim_disk_close(sdk, nands);
+    if (!nr) {
+        free(ppns);
+        sim_disk_destroy(sdk);
+        return NULL;
+    }
+    sdk = sim_volume_open(nands, nr);
+    if (!sdk) {
+        free(ppns);
+        return NULL;
+    }
+    for (lpn = 0; lpn < nr_lpns; lpn++) {
+        mapped += ppns[lpn] != 0;
+        bad += get_phys_ppn(sdk->gd, lpn, 0, NULL) != ppns[lpn];
+    }
+    free(ppns);
+
+    if (!o->csv)
+        printf("reload       %llu units mapped, %llu changed\n", mapped, bad);
+    if (bad) {
+        sim_disk_destroy(sdk);
+        return NULL;
+    }
+    return sdk;
+}
+
+static int lookup(const char * name, const char ** names, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!strcmp(name, names[i]))
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char ** argv)
+{
+    struct nand_config cfg = NAND_DEFAULT_CONFIG;
+    struct bench_opts o = {
+        .nr_reqs = 1000000,
+        .req_pages = 1,
+        .reads = 50,
+        .theta = 0.99,
+        .threads = 1,
+        .seed = 0x5eed,
+    };
+    struct bench_counters total = { 0 };
+    struct bench_thread * th;
+    struct ssd_disk * sdk;
+    struct zipf zipf;
+    unsigned int r, p, e, i;
+    double start, secs;
+    int opt;
+
+    o.workload = -1;
+    o.format = -1;
+    while ((opt = getopt(argc, argv, "n:s:r:z:j:S:B:P:L:G:dm:Q:U:HZ:D:E:VF:Rf:c")) != -1) {
+        switch (opt) {
+        case 'n': o.nr_reqs = strtoull(optarg, NULL, 0); break;
+        case 's': o.req_pages = strtoul(optarg, NULL, 0); break;
+        case 'r': o.reads = min(strtoul(optarg, NULL, 0), 100UL); break;
+        case 'z': o.theta = strtod(optarg, NULL); break;
+        case 'j': o.threads = strtoul(optarg, NULL, 0); break;
+        case 'S': o.seed = strtoull(optarg, NULL, 0); break;
+        case 'B': cfg.nr_blocks = strtoul(optarg, NULL, 0); break;
+        case 'P': cfg.pages_per_block = strtoul(optarg, NULL, 0); break;
+        case 'L':
+            if (sscanf(optarg, "%u,%u,%u", &r, &p, &e) != 3)
+                usage(argv[0]);
+            cfg.t_read = r * 1000;
+            cfg.t_prog = p * 1000;
+            cfg.t_erase = e * 1000;
+            break;
+        case 'G':
+            if (sscanf(optarg, "%u,%u,%u", &r, &p, &e) != 3)
+                usage(argv[0]);
+            cfg.nr_channels = r;
+            cfg.nr_dies = p;
+            cfg.nr_planes = e;
+            break;
+        case 'd': cfg.delay = true; break;
+        case 'm': o.devs = strtoul(optarg, NULL, 0); break;
+        case 'Q':
+            if (sscanf(optarg, "%u,%u", &o.gc_rate, &o.map_rate) != 2)
+                usage(argv[0]);
+            break;
+        case 'U': cfg.map_pages = strtoul(optarg, NULL, 0); break;
+        case 'H': cfg.block_map = true; break;
+        case 'Z': o.compress = strtoul(optarg, NULL, 0); break;
+        case 'D': o.dedup = min(strtoul(optarg, NULL, 0), 100UL); cfg.dedup = true; break;
+        case 'E': o.zeros = min(strtoul(optarg, NULL, 0), 100UL); break;
+        case 'V': scan_simd = false; break;
+        case 'F': o.flush = strtoul(optarg, NULL, 0); break;
+        case 'R': o.reload = true; break;
+        case 'f':
+            o.format = lookup(optarg, formats, ARRAY_SIZE(formats));
+            if (o.format < 0)
+                usage(argv[0]);
+            break;
+        case 'c': o.csv = true; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if (o.format >= 0) {
+        o.workload = W_TRACE;
+        o.trace = argv[optind];
+        o.threads = 1;
+    } else {
+        o.workload = lookup(argv[optind], workloads, W_TRACE);
+        if (o.workload < 0)
+            usage(argv[0]);
+    }
+
+    if (!o.threads || !o.req_pages || o.theta <= 0 || o.theta >= 1 ||
+            ((o.compress || cfg.dedup || o.zeros) && !o.devs) ||
+            // only a volume mapped page by page saves its mapping
+            (o.reload && (!o.devs || cfg.block_map || o.compress || cfg.dedup))) {
+        fprintf(stderr, "bad options\n");
+        return 1;
+    }
+
+    // data written in place overwrites flash pages, a volume erases first
+    cfg.overwrite = !o.devs;
+    cfg.compress = o.compress != 0;
+    sdk = o.devs ? sim_volume_create(&cfg, o.devs) : sim_disk_create(&cfg);
+    if (!sdk)
+        return 1;
+    ftl_qos_set_rate(sdk, IO_GC, o.gc_rate);
+    ftl_qos_set_rate(sdk, IO_MAP, o.map_rate);
+    nr_pages = sdk->capacity >> PAGE_SECTOR_SHIFT;
+    if (o.req_pages > nr_pages) {
+        fprintf(stderr, "request larger than the device\n");
+        return 1;
+    }
+
+    if (o.workload == W_ZIPF)
+        zipf_init(&zipf, nr_pages, o.theta);
+
+    th = calloc(o.threads, sizeof(struct bench_thread));
+    if (!th)
+        return 1;
+
+    for (i = 0; i < o.threads; i++) {
+        th[i].opts = &o;
+        th[i].sdk = sdk;
+        th[i].zipf = &zipf;
+        th[i].rnd = scatter(o.seed + i) | 1;
+        th[i].nr_reqs = o.nr_reqs / o.threads + (i < o.nr_reqs % o.threads);
+        th[i].next = nr_pages / o.threads * i;
+        if (bench_thread_init(&th[i], o.compress)) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        if (o.trace) {
+            th[i].trace = fopen(o.trace, "r");
+            if (!th[i].trace) {
+                perror(o.trace);
+                return 1;
+            }
+        }
+    }
+
+    start = now();
+    for (i = 0; i < o.threads; i++) {
+        if (pthread_create(&th[i].tid, NULL, bench_thread_fn, &th[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (i = 0; i < o.threads; i++)
+        pthread_join(th[i].tid, NULL);
+    secs = now() - start;
+
+    for (i = 0; i < o.threads; i++) {
+        total.reqs += th[i].c.reqs;
+        total.read_pages += th[i].c.read_pages;
+        total.write_pages += th[i].c.write_pages;
+        total.unmapped_pages += th[i].c.unmapped_pages;
+        total.discard_pages += th[i].c.discard_pages;
+        total.flushes += th[i].c.flushes;
+        total.errors += th[i].c.errors;
+        if (th[i].trace)
+            fclose(th[i].trace);
+    }
+
+    report(&o, &cfg, sdk, &total, secs);
+
+    free(th);
+    if (o.reload) {
+        sdk = reload(sdk, &o);
+        if (!sdk)
+            return 1;
+    }
+    sim_disk_destroy(sdk);
+    return 0;
+}
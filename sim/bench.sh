@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# run the standard workloads through sftl-bench and print one csv record
+# each. Traces given as FORMAT:FILE (blkparse, msr or spc) are replayed
+# after them. Extra sftl-bench options come from $BENCH_OPTS.
+#
+#   ./bench.sh msr:prxy_0.csv spc:Financial1.spc
+#
+
+BENCH=${BENCH:-$(dirname "$0")/sftl-bench}
+REQS=${REQS:-1000000}
+
+run() {
+    $BENCH -c $BENCH_OPTS "$@" | if [ -n "$header" ]; then tail -n 1; else cat; fi
+    header=1
+}
+
+header=
+for w in uniform zipf seq mixed; do
+    for r in 0 50 100; do
+        run -n $REQS -r $r $w
+    done
+done
+
+for t in "$@"; do
+    run -f "${t%%:*}" "${t#*:}"
+done
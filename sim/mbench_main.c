@@ -0,0 +1,146 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  mbench_main.c
+ *
+ *    Description:  runs the microbenchmarks of mbench.c on a disk on the
+ *                  simulated flash, scaling each test from one thread to the
+ *                  number of cpus. The flash completes requests without
+ *                  moving data, like null_blk, unless asked to. The mapping
+ *                  sync is timed on a volume of its own, which keeps it.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include <getopt.h>
+
+#include "sftl.h"
+#include "scan.h"
+#include "mbench.h"
+
+/* operations per thread of each test, unless given */
+static unsigned long default_ops(const char * test)
+{
+    if (!strcmp(test, "get_ppn") || !strcmp(test, "set_ppn") || !strncmp(test, "scan_", 5) ||
+            !strcmp(test, "zero_page") || !strcmp(test, "map_crc"))
+        return 2000000;
+    if (!strcmp(test, "flush"))
+        return 2000;
+    return 20000;
+}
+
+static void usage(const char * prog)
+{
+    const char * name;
+    unsigned int i;
+
+    fprintf(stderr,
+        "usage: %s [options] [TEST...]\n"
+        "\n"
+        "  -n OPS       operations per thread (per test default)\n"
+        "  -j THREADS   most threads to scale to (%u)\n"
+        "  -D           move the data of block requests\n"
+        "  -V           scan with the scalar loops only\n"
+        "  -c           print csv records\n"
+        "\n"
+        "tests:",
+        prog, num_online_cpus());
+    for (i = 0; (name = mbench_test_name(i)); i++)
+        fprintf(stderr, " %s", name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static int run_test(struct ssd_disk * sdk, struct ssd_disk * vol, const char * test,
+        unsigned int max_threads, unsigned long ops, bool csv)
+{
+    struct mbench_result res;
+    unsigned int threads;
+    int err;
+
+    for (threads = 1; ; threads = min(threads * 2, max_threads)) {
+        err = mbench_run(sdk, test, threads, ops ? ops : default_ops(test), &res);
+        if (err == -EOPNOTSUPP && sdk != vol) {
+            sdk = vol;
+            err = mbench_run(sdk, test, threads, ops ? ops : default_ops(test), &res);
+        }
+        if (err == -EINVAL && threads > 1)
+            break;
+        if (err) {
+            fprintf(stderr, "%s on %u threads: error %d\n", test, threads, err);
+            return err;
+        }
+
+        if (csv)
+            printf("%s,%u,%llu,%llu,%llu,%llu\n", res.test, res.threads,
+                    res.ops, res.wall_ns, res.ns_per_op, res.kops);
+        else
+            printf("%-10s %3u threads %10llu ops %10.3f ms %8llu ns/op %10.3f Mops/s\n",
+                    res.test, res.threads, res.ops, res.wall_ns / 1e6,
+                    res.ns_per_op, res.kops / 1e3);
+        fflush(stdout);
+
+        if (threads == max_threads)
+            break;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    struct nand_config cfg = NAND_DEFAULT_CONFIG, vcfg;
+    unsigned int max_threads = num_online_cpus();
+    unsigned long ops = 0;
+    struct ssd_disk * sdk, * vol;
+    const char * name;
+    bool csv = false;
+    unsigned int i;
+    int opt, err = 0;
+
+    cfg.overwrite = true;
+    cfg.nodata = true;
+
+    while ((opt = getopt(argc, argv, "n:j:DVc")) != -1) {
+        switch (opt) {
+        case 'n': ops = strtoul(optarg, NULL, 0); break;
+        case 'j': max_threads = strtoul(optarg, NULL, 0); break;
+        case 'D': cfg.nodata = false; break;
+        case 'V': scan_simd = false; break;
+        case 'c': csv = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!max_threads || max_threads > MBENCH_THREADS)
+        usage(argv[0]);
+
+    sdk = sim_disk_create(&cfg);
+    if (!sdk)
+        return 1;
+    // its mapping pages are read back by the checkpoints
+    vcfg = cfg;
+    vcfg.nodata = false;
+    vol = sim_volume_create(&vcfg, 1);
+    if (!vol) {
+        sim_disk_destroy(sdk);
+        return 1;
+    }
+
+    if (csv)
+        printf("test,threads,ops,wall_ns,ns_per_op,kops_per_ms\n");
+    if (optind < argc) {
+        for (i = optind; i < argc && !err; i++)
+            err = run_test(sdk, vol, argv[i], max_threads, ops, csv);
+    } else {
+        for (i = 0; (name = mbench_test_name(i)) && !err; i++)
+            err = run_test(sdk, vol, name, max_threads, ops, csv);
+    }
+
+    sim_disk_destroy(vol);
+    sim_disk_destroy(sdk);
+    return err ? 1 : 0;
+}
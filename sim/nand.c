@@ -0,0 +1,328 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  nand.c
+ *
+ *    Description:  simulated nand flash, and the flash io of the ftl core on
+ *                  top of it for the userspace build
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include <time.h>
+
+#include "ftl_compat.h"
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+#include "alloc.h"
+#include "nand.h"
+
+#define NAND_LOCK(nand, pbn) (&(nand)->locks[(pbn) % NAND_LOCKS])
+
+/* the operation of block @pbn keeps its die busy for @ns */
+static void nand_spend(struct block_device * nand, u32 pbn, unsigned int ns)
+{
+    struct timespec start, now;
+
+    atomic64_add(ns, &nand->busy_ns);
+    atomic64_add(ns, &nand->die_busy_ns[pbn % nand->nr_dies]);
+    if (!nand->cfg.delay || !ns)
+        return;
+
+    // busy wait, sleeping is far too coarse for flash latencies
+    pthread_mutex_lock(&nand->die_locks[pbn % nand->nr_dies]);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000LL + now.tv_nsec - start.tv_nsec < ns);
+    pthread_mutex_unlock(&nand->die_locks[pbn % nand->nr_dies]);
+}
+
+struct block_device * nand_create(const struct nand_config * cfg)
+{
+    struct block_device * nand;
+    int i;
+
+    if (!cfg->pages_per_block || !cfg->nr_blocks || !cfg->nr_channels || !cfg->nr_dies ||
+            !cfg->nr_planes) {
+        printk(KERN_ERR "nand: bad geometry\n");
+        return NULL;
+    }
+
+    nand = kzalloc(sizeof(struct block_device), GFP_KERNEL);
+    if (!nand)
+        return NULL;
+
+    nand->cfg = *cfg;
+    nand->nr_pages = (u64)cfg->pages_per_block * cfg->nr_blocks;
+    nand->pages = calloc(nand->nr_pages, sizeof(u8 *));
+    nand->erase_count = calloc(cfg->nr_blocks, sizeof(u32));
+    nand->nr_dies = cfg->nr_channels * cfg->nr_dies;
+    nand->die_busy_ns = calloc(nand->nr_dies, sizeof(atomic64_t));
+    nand->die_locks = calloc(nand->nr_dies, sizeof(pthread_mutex_t));
+    if (!nand->pages || !nand->erase_count || !nand->die_busy_ns || !nand->die_locks) {
+        printk(KERN_ERR "nand: not enough memory for %llu pages\n",
+                (unsigned long long)nand->nr_pages);
+        nand_destroy(nand);
+        return NULL;
+    }
+
+    for (i = 0; i < NAND_LOCKS; i++)
+        pthread_mutex_init(&nand->locks[i], NULL);
+    for (i = 0; i < nand->nr_dies; i++)
+        pthread_mutex_init(&nand->die_locks[i], NULL);
+
+    return nand;
+}
+
+void nand_destroy(struct block_device * nand)
+{
+    u64 i;
+
+    if (nand->pages) {
+        for (i = 0; i < nand->nr_pages; i++)
+            free(nand->pages[i]);
+        free(nand->pages);
+    }
+    free(nand->erase_count);
+    free(nand->die_busy_ns);
+    free(nand->die_locks);
+    kfree(nand);
+}
+
+/* read page @ppn into @buf and its spare area into @oob, either may be NULL */
+int nand_read(struct block_device * nand, u64 ppn, void * buf, void * oob)
+{
+    u32 pbn = ppn / nand->cfg.pages_per_block;
+    u8 * data;
+
+    if (ppn >= nand->nr_pages) {
+        atomic64_inc(&nand->errors);
+        return -EIO;
+    }
+
+    pthread_mutex_lock(NAND_LOCK(nand, pbn));
+    data = nand->pages[ppn];
+    if (buf) {
+        if (data)
+            memcpy(buf, data, PHYS_PAGE_SIZE);
+        else
+            memset(buf, 0, PHYS_PAGE_SIZE);
+    }
+    if (oob) {
+        if (data)
+            memcpy(oob, data + PHYS_PAGE_SIZE, nand->cfg.oob_size);
+        else
+            memset(oob, 0, nand->cfg.oob_size);
+    }
+    pthread_mutex_unlock(NAND_LOCK(nand, pbn));
+
+    atomic64_inc(&nand->reads);
+    nand_spend(nand, pbn, nand->cfg.t_read);
+    return 0;
+}
+
+/*
+ * program page @ppn. A programmed page has to be erased first unless
+ * the device allows overwrites, which an in-place ftl needs.
+ */
+int nand_program(struct block_device * nand, u64 ppn, const void * buf, const void * oob)
+{
+    u32 pbn = ppn / nand->cfg.pages_per_block;
+    u8 * data;
+
+    if (ppn >= nand->nr_pages) {
+        atomic64_inc(&nand->errors);
+        return -EIO;
+    }
+
+    pthread_mutex_lock(NAND_LOCK(nand, pbn));
+    data = nand->pages[ppn];
+    if (data && !nand->cfg.overwrite) {
+        pthread_mutex_unlock(NAND_LOCK(nand, pbn));
+        printk(KERN_ERR "nand: program of programmed page %llu\n", (unsigned long long)ppn);
+        atomic64_inc(&nand->errors);
+        return -EIO;
+    }
+
+    if (!data) {
+        data = malloc(PHYS_PAGE_SIZE + nand->cfg.oob_size);
+        if (!data) {
+            pthread_mutex_unlock(NAND_LOCK(nand, pbn));
+            atomic64_inc(&nand->errors);
+            return -ENOMEM;
+        }
+        nand->pages[ppn] = data;
+    }
+
+    if (buf)
+        memcpy(data, buf, PHYS_PAGE_SIZE);
+    else
+        memset(data, 0, PHYS_PAGE_SIZE);
+    if (oob)
+        memcpy(data + PHYS_PAGE_SIZE, oob, nand->cfg.oob_size);
+    else
+        memset(data + PHYS_PAGE_SIZE, 0, nand->cfg.oob_size);
+    pthread_mutex_unlock(NAND_LOCK(nand, pbn));
+
+    atomic64_inc(&nand->programs);
+    nand_spend(nand, pbn, nand->cfg.t_prog);
+    return 0;
+}
+
+int nand_erase(struct block_device * nand, u32 pbn)
+{
+    u64 ppn, end;
+
+    if (pbn >= nand->cfg.nr_blocks) {
+        atomic64_inc(&nand->errors);
+        return -EIO;
+    }
+
+    ppn = (u64)pbn * nand->cfg.pages_per_block;
+    end = ppn + nand->cfg.pages_per_block;
+
+    pthread_mutex_lock(NAND_LOCK(nand, pbn));
+    for (; ppn < end; ppn++) {
+        free(nand->pages[ppn]);
+        nand->pages[ppn] = NULL;
+    }
+    nand->erase_count[pbn] ++;
+    pthread_mutex_unlock(NAND_LOCK(nand, pbn));
+
+    atomic64_inc(&nand->erases);
+    nand_spend(nand, pbn, nand->cfg.t_erase);
+    return 0;
+}
+
+/*
+ * the flash as the backing block device of the disk. Requests are sector
+ * granular, a partial page is read, modified and programmed again. Like
+ * null_blk, a nodata device completes everything without doing it.
+ */
+void generic_make_request(struct bio * bio)
+{
+    struct block_device * nand = bio->bi_bdev;
+    struct bio_vec * bv = bio->bi_io_vec + bio->bi_idx;
+    u8 buf[PHYS_PAGE_SIZE];
+    sector_t sector = bio->bi_sector;
+    unsigned int done = 0, n, off, bvoff = 0;
+    int rw = bio_data_dir(bio), err = 0;
+    u64 ppn;
+
+    if (nand->cfg.nodata || (bio->bi_rw & REQ_DISCARD)) {
+        bio_endio(bio, 0);
+        return;
+    }
+
+    while (done < bio->bi_size && !err) {
+        ppn = sector >> PAGE_SECTOR_SHIFT;
+        off = (sector & (PAGE_SECTOR - 1)) << 9;
+        n = min_t(unsigned int, PHYS_PAGE_SIZE - off, bio->bi_size - done);
+
+        if (rw == READ || n < PHYS_PAGE_SIZE)
+            err = nand_read(nand, ppn, buf, NULL);
+        for (done += n; n && !err; ) {
+            unsigned int len = min(n, bv->bv_len - bvoff);
+            u8 * data = (u8 *)page_address(bv->bv_page) + bv->bv_offset + bvoff;
+
+            if (rw == WRITE)
+                memcpy(buf + off, data, len);
+            else
+                memcpy(data, buf + off, len);
+            off += len;
+            n -= len;
+            bvoff += len;
+            if (bvoff == bv->bv_len) {
+                bv ++;
+                bvoff = 0;
+            }
+        }
+        if (rw == WRITE && !err)
+            err = nand_program(nand, ppn, buf, NULL);
+        sector = (ppn + 1) << PAGE_SECTOR_SHIFT;
+    }
+
+    bio_endio(bio, err);
+}
+
+void nand_get_stats(struct block_device * nand, struct nand_stats * stats)
+{
+    unsigned int i;
+
+    stats->reads = atomic64_read(&nand->reads);
+    stats->programs = atomic64_read(&nand->programs);
+    stats->erases = atomic64_read(&nand->erases);
+    stats->busy_ns = atomic64_read(&nand->busy_ns);
+    stats->die_busy_ns = 0;
+    for (i = 0; i < nand->nr_dies; i++)
+        stats->die_busy_ns = max_t(u64, stats->die_busy_ns, atomic64_read(&nand->die_busy_ns[i]));
+    stats->errors = atomic64_read(&nand->errors);
+}
+
+/*
+ * flash io of the ftl core. The simulated flash completes every request
+ * before returning, so @done runs in the caller's context.
+ */
+int ftl_io_node(struct block_device * bdev)
+{
+    return NUMA_NO_NODE;
+}
+
+int ftl_io_open(struct ssd_disk * sdk)
+{
+    return sdk->bdev ? 0 : -ENODEV;
+}
+
+void ftl_io_close(struct ssd_disk * sdk)
+{
+}
+
+int ftl_submit_io(struct ssd_disk * sdk, int rw, pfn_t ppn, unsigned int nr,
+        struct page ** pages, u8 * oob, ftl_io_done_t * done, void * priv)
+{
+    struct block_device * nand = ppn_bdev(sdk, ppn);
+    u64 page = ppn_sector(sdk, ppn) >> PAGE_SECTOR_SHIFT;
+    u8 buf[PHYS_PAGE_SIZE];
+    unsigned int i, j;
+    int err = 0;
+
+    ftl_stat_add(sdk, rw == WRITE ? FTL_STAT_FLASH_WRITE_BYTES : FTL_STAT_FLASH_READ_BYTES,
+            nr * PHYS_PAGE_SIZE);
+    for (i = 0; i < nr && !err; i++) {
+        u8 * spare = oob ? oob + i * nand->cfg.oob_size : NULL;
+
+        if (rw == WRITE) {
+            for (j = 0; j < HW_TO_MEM_PAGE; j++)
+                memcpy(buf + j * MEM_PAGE_SIZE, page_address(pages[i * HW_TO_MEM_PAGE + j]),
+                        MEM_PAGE_SIZE);
+            err = nand_program(nand, page + i, buf, spare);
+        } else {
+            err = nand_read(nand, page + i, buf, spare);
+            for (j = 0; j < HW_TO_MEM_PAGE && !err; j++)
+                memcpy(page_address(pages[i * HW_TO_MEM_PAGE + j]), buf + j * MEM_PAGE_SIZE,
+                        MEM_PAGE_SIZE);
+        }
+    }
+
+    done(priv, err);
+    return 0;
+}
+
+/* a volume erases whole blocks of the ftl, a number of nand blocks each */
+int ftl_io_erase(struct ssd_disk * sdk, pfn_t ppn, unsigned int nr)
+{
+    struct block_device * nand = ppn_bdev(sdk, ppn);
+    u64 page = ppn_sector(sdk, ppn) >> PAGE_SECTOR_SHIFT, end = page + nr;
+    int err = 0;
+
+    for (; page < end && !err; page += nand->cfg.pages_per_block)
+        err = nand_erase(nand, page / nand->cfg.pages_per_block);
+    return err;
+}
@@ -0,0 +1,108 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  nand.h
+ *
+ *    Description:  simulated nand flash device for the userspace build. It
+ *                  stands in for the backing block device of the module and
+ *                  serves the flash io of the ftl core.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _NAND_H_
+#define _NAND_H_
+
+#include "usys.h"
+#include "ftl.h"
+
+/*
+ * The page size is PHYS_PAGE_SIZE of the ftl, everything else is set per
+ * device. Latencies are in nanoseconds.
+ */
+struct nand_config {
+    unsigned int pages_per_block;   // pages in an erase block
+    unsigned int nr_blocks;         // erase blocks in the device
+    unsigned int nr_channels;       // the dies, laid out as struct ftl_geo says
+    unsigned int nr_dies;           // per channel
+    unsigned int nr_planes;         // per die
+    unsigned int oob_size;          // spare bytes of a page
+    unsigned int t_read;            // page read
+    unsigned int t_prog;            // page program
+    unsigned int t_erase;           // block erase
+    bool delay;                     // spend the latencies in real time, a die at a time
+    bool overwrite;                 // allow programming a programmed page
+    bool nodata;                    // complete block requests without doing them
+    unsigned int map_pages;         // of a mapping unit of the disk formatted on it
+    bool block_map;                 // a volume maps blocks written in order as a whole
+    bool compress;                  // a volume packs its units compressed
+    bool dedup;                     // a volume shares the units written with the same data
+    unsigned int cmt_pages;         // mapping pages the cmt keeps at most, 0 for the default
+};
+
+#define NAND_DEFAULT_CONFIG { \
+    .pages_per_block = PAGE_NUM_BLOCK, \
+    .nr_blocks = 8192, \
+    .nr_channels = 1, \
+    .nr_dies = 1, \
+    .nr_planes = 1, \
+    .oob_size = PHYS_OOB_SIZE, \
+    .t_read = 50000, \
+    .t_prog = 500000, \
+    .t_erase = 3000000, \
+    .delay = false, \
+    .overwrite = false, \
+    .nodata = false, \
+    .map_pages = 1, \
+    .block_map = false, \
+    .compress = false, \
+    .dedup = false, \
+    .cmt_pages = 0, \
+}
+
+struct nand_stats {
+    u64 reads;              // pages read
+    u64 programs;           // pages programmed
+    u64 erases;             // blocks erased
+    u64 busy_ns;            // simulated time spent in flash operations
+    u64 die_busy_ns;        // and by the busiest die, a bound of the elapsed time
+    u64 errors;             // rejected operations
+};
+
+#define NAND_LOCKS 64
+
+/*
+ * the simulated flash. Pages hold no memory until they are programmed,
+ * an erased page reads as zeros like a trimmed block device, so a new
+ * device has an empty mapping directory.
+ */
+struct block_device {
+    struct nand_config cfg;
+    u64 nr_pages;
+    u8 ** pages;            // data and oob of each programmed page
+    u32 * erase_count;      // per block
+    unsigned int nr_dies;   // of all channels
+    atomic64_t * die_busy_ns;
+    pthread_mutex_t * die_locks;    // held for the latency of an operation
+    pthread_mutex_t locks[NAND_LOCKS];  // by block
+    atomic64_t reads, programs, erases, busy_ns, errors;
+};
+
+extern struct block_device * nand_create(const struct nand_config * cfg);
+extern void nand_destroy(struct block_device * nand);
+extern int nand_read(struct block_device * nand, u64 ppn, void * buf, void * oob);
+extern int nand_program(struct block_device * nand, u64 ppn, const void * buf, const void * oob);
+extern int nand_erase(struct block_device * nand, u32 pbn);
+extern void nand_get_stats(struct block_device * nand, struct nand_stats * stats);
+
+static inline sector_t nand_capacity(struct block_device * nand)
+{
+    return nand->nr_pages * (PHYS_PAGE_SIZE >> 9);
+}
+
+#endif
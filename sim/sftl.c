@@ -0,0 +1,224 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  sftl.c
+ *
+ *    Description:  disks of the userspace ftl build, the part of ssd.c that
+ *                  sets up a disk for the ftl
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "sftl.h"
+
+static atomic_t sim_disks = ATOMIC_INIT(0);
+
+static void sim_destroy_nands(struct block_device ** nands, unsigned int nr)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        if (nands[i])
+            nand_destroy(nands[i]);
+    }
+}
+
+/*
+ * a disk on @nr_devs flash devices, a volume over them if @vol is set.
+ * They are @given if it is set, new ones otherwise.
+ */
+static struct ssd_disk * sim_create(const struct nand_config * cfg, struct block_device ** given,
+        unsigned int nr_devs, bool vol)
+{
+    struct block_device * nands[VOL_MAX_DEVS] = { NULL, };
+    struct ftl_geo geo = {
+        .nr_channels = cfg->nr_channels,
+        .nr_dies = cfg->nr_dies,
+        .nr_planes = cfg->nr_planes,
+        .block_shift = ilog2(cfg->pages_per_block),
+    };
+    u64 nr_pages[VOL_MAX_DEVS];
+    struct ssd_disk * sdk;
+    struct gendisk * gd;
+    unsigned int i;
+    int err;
+
+    if (!nr_devs || nr_devs > VOL_MAX_DEVS || (vol && !is_power_of_2(cfg->pages_per_block))) {
+        printk(KERN_ERR "ss: a volume has 1 to %u devices of blocks of a power of two pages\n",
+                VOL_MAX_DEVS);
+        return NULL;
+    }
+    if (!is_power_of_2(cfg->map_pages) || ilog2(cfg->map_pages) > UNIT_MAX_SHIFT) {
+        printk(KERN_ERR "ss: a mapping unit is a power of two up to %u pages\n", 1 << UNIT_MAX_SHIFT);
+        return NULL;
+    }
+
+    sdk = kzalloc(sizeof(struct ssd_disk), GFP_KERNEL);
+    gd = kzalloc(sizeof(struct gendisk), GFP_KERNEL);
+    if (!sdk || !gd)
+        goto err_out;
+
+    for (i = 0; i < nr_devs; i++) {
+        nands[i] = given ? given[i] : nand_create(cfg);
+        if (!nands[i])
+            goto err_out;
+        nr_pages[i] = nands[i]->nr_pages;
+    }
+
+    snprintf(gd->disk_name, sizeof(gd->disk_name), "ss%c",
+            'a' + atomic_inc_return(&sim_disks) - 1);
+    gd->private_data = &sdk->list;
+
+    INIT_LIST_HEAD(&sdk->list);
+    sdk->gd = gd;
+    sdk->name = gd->disk_name;
+    sdk->bdev = nands[0];
+    sdk->unit_shift = ilog2(cfg->map_pages);
+    sdk->capacity = nand_capacity(nands[0]) & ~(unit_sectors(sdk) - 1);
+
+    sdk->bs = bioset_create(MEMPOOL_SIZE, SS_BIO_PAD);
+    sdk->io_pool = mempool_create_kmalloc_pool(MEMPOOL_SIZE, sizeof(struct ss_io));
+    if (!sdk->bs || !sdk->io_pool)
+        goto err_out;
+
+    err = ftl_stats_init(sdk);
+    if (err)
+        goto err_out;
+    ftl_qos_init(sdk);
+
+    sdk->bdev_err = ftl_io_open(sdk);
+    if (sdk->bdev_err < 0)
+        goto err_out;
+
+    if (vol) {
+        err = ftl_vol_init(sdk, nands, nr_pages, nr_devs, &geo, (cfg->block_map ? VOL_BMAP : 0) |
+                (cfg->compress ? VOL_PACK : 0) | (cfg->dedup ? VOL_DEDUP : 0));
+        if (err) {
+            printk(KERN_ERR "ss: cannot stripe %s over %u devices, error %d\n",
+                    gd->disk_name, nr_devs, err);
+            goto err_out;
+        }
+    }
+
+    err = wbuf_init(sdk);
+    if (err) {
+        printk(KERN_ERR "ss: cannot init write buffer of %s, error %d\n", gd->disk_name, err);
+        goto err_out;
+    }
+
+    sdk->cmt.max_pages = cfg->cmt_pages;
+    err = init_mapping_dir(gd);
+    if (err) {
+        printk(KERN_ERR "ss: cannot init mapping dir of %s, error %d\n", gd->disk_name, err);
+        wbuf_exit(sdk);
+        ftl_vol_exit(sdk);
+        exit_mapping_dir(gd);
+        goto err_out;
+    }
+
+    return sdk;
+
+err_out:
+    if (sdk) {
+        ftl_vol_exit(sdk);
+        ftl_stats_exit(sdk);
+    }
+    if (sdk && sdk->io_pool)
+        mempool_destroy(sdk->io_pool);
+    if (sdk && sdk->bs)
+        bioset_free(sdk->bs);
+    if (!given)
+        sim_destroy_nands(nands, nr_devs);
+    kfree(gd);
+    kfree(sdk);
+    return NULL;
+}
+
+struct ssd_disk * sim_disk_create(const struct nand_config * cfg)
+{
+    return sim_create(cfg, NULL, 1, false);
+}
+
+struct ssd_disk * sim_volume_create(const struct nand_config * cfg, unsigned int nr_devs)
+{
+    return sim_create(cfg, NULL, nr_devs, true);
+}
+
+struct ssd_disk * sim_volume_open(struct block_device ** nands, unsigned int nr_devs)
+{
+    return sim_create(&nands[0]->cfg, nands, nr_devs, true);
+}
+
+/* as ss_remove_disk, a volume whose mapping cannot be saved stays unless @force */
+static unsigned int sim_remove(struct ssd_disk * sdk, struct block_device ** nands, bool force)
+{
+    unsigned int i, nr = 1;
+    int err;
+
+    if (sdk->vol) {
+        err = wbuf_drain(sdk);
+        if (!err)
+            err = save_mapping_dir(sdk->gd);
+        if (err && !force)
+            return 0;
+    }
+
+    nands[0] = sdk->bdev;
+    if (sdk->vol) {
+        nr = sdk->vol->nr_devs;
+        for (i = 0; i < nr; i++)
+            nands[i] = sdk->vol->devs[i].bdev;
+    }
+
+    wbuf_exit(sdk);
+    ftl_vol_exit(sdk);
+    exit_mapping_dir(sdk->gd);
+    ftl_stats_exit(sdk);
+    mempool_destroy(sdk->io_pool);
+    bioset_free(sdk->bs);
+    kfree(sdk->gd);
+    kfree(sdk);
+    return nr;
+}
+
+unsigned int sim_disk_close(struct ssd_disk * sdk, struct block_device ** nands)
+{
+    return sim_remove(sdk, nands, false);
+}
+
+void sim_disk_destroy(struct ssd_disk * sdk)
+{
+    struct block_device * nands[VOL_MAX_DEVS];
+    unsigned int nr;
+
+    nr = sim_remove(sdk, nands, true);
+    sim_destroy_nands(nands, nr);
+}
+
+/* the flash statistics of the disk, summed over the devices of a volume */
+void sim_nand_stats(struct ssd_disk * sdk, struct nand_stats * stats)
+{
+    struct nand_stats ns;
+    unsigned int i;
+
+    if (!sdk->vol) {
+        nand_get_stats(sdk->bdev, stats);
+        return;
+    }
+
+    memset(stats, 0, sizeof(struct nand_stats));
+    for (i = 0; i < sdk->vol->nr_devs; i++) {
+        nand_get_stats(sdk->vol->devs[i].bdev, &ns);
+        stats->reads += ns.reads;
+        stats->programs += ns.programs;
+        stats->erases += ns.erases;
+        stats->busy_ns += ns.busy_ns;
+        stats->die_busy_ns = max(stats->die_busy_ns, ns.die_busy_ns);
+        stats->errors += ns.errors;
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  sftl.h
+ *
+ *    Description:  userspace build of the ftl core (libsftl.a): a disk on
+ *                  the simulated flash, driven through the interface of
+ *                  ftl.h exactly like the module drives it.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _SFTL_H_
+#define _SFTL_H_
+
+#include "ftl_compat.h"
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+#include "alloc.h"
+#include "nand.h"
+
+/*
+ * Create a disk on a new simulated flash of geometry @cfg and load its
+ * mapping directory. Returns NULL on failure.
+ */
+extern struct ssd_disk * sim_disk_create(const struct nand_config * cfg);
+extern void sim_disk_destroy(struct ssd_disk * sdk);
+
+/*
+ * Create a volume striped over @nr_devs new simulated flash devices of
+ * geometry @cfg, written out of place with garbage collection.
+ */
+extern struct ssd_disk * sim_volume_create(const struct nand_config * cfg, unsigned int nr_devs);
+
+/*
+ * Remove a disk and keep its flash devices, stored in @nands, for
+ * sim_volume_open to add a volume on them again. A volume saves its
+ * mapping and loads it back, one made with block_map, compress or dedup
+ * is not opened again. Returns the number of devices, 0 if the mapping
+ * cannot be saved and the volume is left as it is.
+ */
+extern unsigned int sim_disk_close(struct ssd_disk * sdk, struct block_device ** nands);
+extern struct ssd_disk * sim_volume_open(struct block_device ** nands, unsigned int nr_devs);
+
+extern void sim_nand_stats(struct ssd_disk * sdk, struct nand_stats * stats);
+
+#endif
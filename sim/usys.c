@@ -0,0 +1,711 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  usys.c
+ *
+ *    Description:  userspace implementation of the kernel interfaces in usys.h
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usys.h"
+
+int usys_loglevel = 4;
+
+int printk(const char * fmt, ...)
+{
+    va_list args;
+    int level = 4, ret;
+
+    if (fmt[0] == KERN_SOH[0] && fmt[1]) {
+        level = fmt[1] - '0';
+        fmt += 2;
+    }
+    if (level > usys_loglevel)
+        return 0;
+
+    va_start(args, fmt);
+    ret = vfprintf(stderr, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+void * vmalloc(unsigned long size)
+{
+    return aligned_alloc(PAGE_SIZE, (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+void * vzalloc(unsigned long size)
+{
+    void * addr = vmalloc(size);
+
+    if (addr)
+        memset(addr, 0, size);
+    return addr;
+}
+
+__thread int usys_cpu = -1;
+
+int usys_assign_cpu(void)
+{
+    static atomic_t next = ATOMIC_INIT(0);
+
+    return (atomic_inc_return(&next) - 1) % NR_CPUS;
+}
+
+void * __alloc_percpu(size_t size)
+{
+    if (size > PERCPU_UNIT) {
+        printk(KERN_ERR "usys: per cpu allocation of %zu bytes\n", size);
+        return NULL;
+    }
+    return calloc(NR_CPUS, PERCPU_UNIT);
+}
+
+void init_rwsem(struct rw_semaphore * sem)
+{
+    pthread_mutex_init(&sem->lock, NULL);
+    pthread_cond_init(&sem->wait, NULL);
+    sem->count = 0;
+}
+
+void down_read(struct rw_semaphore * sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    while (sem->count < 0)
+        pthread_cond_wait(&sem->wait, &sem->lock);
+    sem->count ++;
+    pthread_mutex_unlock(&sem->lock);
+}
+
+void up_read(struct rw_semaphore * sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    if (!--sem->count)
+        pthread_cond_broadcast(&sem->wait);
+    pthread_mutex_unlock(&sem->lock);
+}
+
+void down_write(struct rw_semaphore * sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    while (sem->count)
+        pthread_cond_wait(&sem->wait, &sem->lock);
+    sem->count = -1;
+    pthread_mutex_unlock(&sem->lock);
+}
+
+void up_write(struct rw_semaphore * sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    sem->count = 0;
+    pthread_cond_broadcast(&sem->wait);
+    pthread_mutex_unlock(&sem->lock);
+}
+
+void init_completion(struct completion * x)
+{
+    pthread_mutex_init(&x->lock, NULL);
+    pthread_cond_init(&x->wait, NULL);
+    x->done = 0;
+}
+
+void complete(struct completion * x)
+{
+    pthread_mutex_lock(&x->lock);
+    x->done ++;
+    pthread_cond_signal(&x->wait);
+    pthread_mutex_unlock(&x->lock);
+}
+
+void complete_all(struct completion * x)
+{
+    pthread_mutex_lock(&x->lock);
+    x->done = ~0U >> 1;
+    pthread_cond_broadcast(&x->wait);
+    pthread_mutex_unlock(&x->lock);
+}
+
+void wait_for_completion(struct completion * x)
+{
+    pthread_mutex_lock(&x->lock);
+    while (!x->done)
+        pthread_cond_wait(&x->wait, &x->lock);
+    x->done --;
+    pthread_mutex_unlock(&x->lock);
+}
+
+void init_waitqueue_head(wait_queue_head_t * q)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wait, NULL);
+}
+
+void wake_up(wait_queue_head_t * q)
+{
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->wait);
+    pthread_mutex_unlock(&q->lock);
+}
+
+struct workqueue_struct {
+    pthread_mutex_t lock;
+    pthread_cond_t more;        // work queued or the queue is going away
+    pthread_cond_t idle;        // a work item finished
+    struct list_head works;
+    bool dying;
+    int running;                // works being run
+    int nr_threads;
+    pthread_t * threads;
+    struct work_struct ** current;  // work run by each thread, it may free it
+    char name[32];
+};
+
+struct workqueue_struct * system_wq;
+struct workqueue_struct * system_unbound_wq;
+
+struct worker {
+    struct workqueue_struct * wq;
+    int id;
+};
+
+static void * worker_thread(void * arg)
+{
+    struct worker * w = arg;
+    struct workqueue_struct * wq = w->wq;
+    struct work_struct * work;
+    int id = w->id;
+
+    free(w);
+    pthread_mutex_lock(&wq->lock);
+    for (;;) {
+        while (list_empty(&wq->works) && !wq->dying)
+            pthread_cond_wait(&wq->more, &wq->lock);
+        if (list_empty(&wq->works))
+            break;
+
+        work = list_first_entry(&wq->works, struct work_struct, entry);
+        list_del_init(&work->entry);
+        work->state &= ~WORK_PENDING;
+        wq->current[id] = work;
+        wq->running ++;
+        pthread_mutex_unlock(&wq->lock);
+
+        work->func(work);
+
+        pthread_mutex_lock(&wq->lock);
+        wq->current[id] = NULL;
+        wq->running --;
+        pthread_cond_broadcast(&wq->idle);
+    }
+    pthread_mutex_unlock(&wq->lock);
+
+    return NULL;
+}
+
+struct workqueue_struct * alloc_workqueue(const char * name, unsigned int flags,
+        int max_active)
+{
+    struct workqueue_struct * wq = calloc(1, sizeof(struct workqueue_struct));
+    int i;
+
+    if (!wq)
+        return NULL;
+
+    if (max_active <= 0)
+        max_active = num_online_cpus();
+
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->more, NULL);
+    pthread_cond_init(&wq->idle, NULL);
+    INIT_LIST_HEAD(&wq->works);
+    snprintf(wq->name, sizeof(wq->name), "%s", name);
+
+    wq->threads = calloc(max_active, sizeof(pthread_t));
+    wq->current = calloc(max_active, sizeof(struct work_struct *));
+    if (!wq->threads || !wq->current)
+        goto err_out;
+
+    for (i = 0; i < max_active; i++) {
+        struct worker * w = malloc(sizeof(struct worker));
+
+        if (!w)
+            break;
+        w->wq = wq;
+        w->id = i;
+        if (pthread_create(&wq->threads[i], NULL, worker_thread, w)) {
+            free(w);
+            break;
+        }
+        wq->nr_threads ++;
+    }
+
+    if (!wq->nr_threads)
+        goto err_out;
+
+    return wq;
+
+err_out:
+    free(wq->current);
+    free(wq->threads);
+    free(wq);
+    return NULL;
+}
+
+static bool work_running(struct workqueue_struct * wq, struct work_struct * work)
+{
+    int i;
+
+    for (i = 0; i < wq->nr_threads; i++) {
+        if (wq->current[i] == work)
+            return true;
+    }
+    return false;
+}
+
+/* runs the queued works, then stops the threads */
+void destroy_workqueue(struct workqueue_struct * wq)
+{
+    int i;
+
+    pthread_mutex_lock(&wq->lock);
+    wq->dying = true;
+    pthread_cond_broadcast(&wq->more);
+    pthread_mutex_unlock(&wq->lock);
+
+    for (i = 0; i < wq->nr_threads; i++)
+        pthread_join(wq->threads[i], NULL);
+
+    free(wq->current);
+    free(wq->threads);
+    free(wq);
+}
+
+bool queue_work(struct workqueue_struct * wq, struct work_struct * work)
+{
+    bool queued = false;
+
+    pthread_mutex_lock(&wq->lock);
+    if (!(work->state & WORK_PENDING)) {
+        work->state |= WORK_PENDING;
+        work->wq = wq;
+        list_add_tail(&work->entry, &wq->works);
+        pthread_cond_signal(&wq->more);
+        queued = true;
+    }
+    pthread_mutex_unlock(&wq->lock);
+
+    return queued;
+}
+
+bool flush_work(struct work_struct * work)
+{
+    struct workqueue_struct * wq = work->wq;
+    bool waited = false;
+
+    if (!wq)
+        return false;
+
+    pthread_mutex_lock(&wq->lock);
+    while ((work->state & WORK_PENDING) || work_running(wq, work)) {
+        pthread_cond_wait(&wq->idle, &wq->lock);
+        waited = true;
+    }
+    pthread_mutex_unlock(&wq->lock);
+
+    return waited;
+}
+
+/* takes @work off its queue if it has not started, and waits for it if it has */
+bool cancel_work_sync(struct work_struct * work)
+{
+    struct workqueue_struct * wq = work->wq;
+    bool pending = false;
+
+    if (!wq)
+        return false;
+
+    pthread_mutex_lock(&wq->lock);
+    if (work->state & WORK_PENDING) {
+        list_del_init(&work->entry);
+        work->state &= ~WORK_PENDING;
+        pending = true;
+    }
+    while (work_running(wq, work))
+        pthread_cond_wait(&wq->idle, &wq->lock);
+    pthread_mutex_unlock(&wq->lock);
+
+    return pending;
+}
+
+/* waits until every work queued so far has run */
+void flush_workqueue(struct workqueue_struct * wq)
+{
+    pthread_mutex_lock(&wq->lock);
+    while (!list_empty(&wq->works) || wq->running)
+        pthread_cond_wait(&wq->idle, &wq->lock);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+unsigned long usys_jiffies(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * HZ + ts.tv_nsec / (1000000000 / HZ);
+}
+
+/* the CLOCK_REALTIME time @timeout jiffies from now, for pthread_cond_timedwait */
+void usys_deadline(struct timespec * ts, long timeout)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += timeout / HZ;
+    ts->tv_nsec += (timeout % HZ) * (1000000000 / HZ);
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec ++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+unsigned int num_online_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? n : 1;
+}
+
+ktime_t ktime_get(void)
+{
+    struct timespec ts;
+    ktime_t kt;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    kt.tv64 = (s64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return kt;
+}
+
+void get_random_bytes(void * buf, int nbytes)
+{
+    FILE * f = fopen("/dev/urandom", "r");
+    unsigned char * p = buf;
+    s64 t;
+    int i;
+
+    if (f && fread(buf, 1, nbytes, f) == (size_t)nbytes) {
+        fclose(f);
+        return;
+    }
+    if (f)
+        fclose(f);
+    t = ktime_get().tv64 ^ getpid();
+    for (i = 0; i < nbytes; i++, t = t * 6364136223846793005LL + 1)
+        p[i] = t >> 33;
+}
+
+struct kthread {
+    int (*fn)(void * data);
+    void * data;
+};
+
+static void * kthread_main(void * arg)
+{
+    struct kthread kt = *(struct kthread *)arg;
+
+    free(arg);
+    kt.fn(kt.data);
+    return NULL;
+}
+
+/* the threads are detached, they report their end themselves */
+struct task_struct * kthread_run(int (*threadfn)(void * data), void * data,
+        const char * namefmt, ...)
+{
+    struct kthread * kt = malloc(sizeof(struct kthread));
+    pthread_t tid;
+
+    if (!kt)
+        return ERR_PTR(-ENOMEM);
+    kt->fn = threadfn;
+    kt->data = data;
+    if (pthread_create(&tid, NULL, kthread_main, kt)) {
+        free(kt);
+        return ERR_PTR(-EAGAIN);
+    }
+    pthread_detach(tid);
+    return (struct task_struct *)kt;
+}
+
+/*
+ * bios
+ */
+struct bio_set * bioset_create(unsigned int pool_size, unsigned int front_pad)
+{
+    struct bio_set * bs = calloc(1, sizeof(struct bio_set));
+
+    if (bs)
+        bs->front_pad = front_pad;
+    return bs;
+}
+
+void bioset_free(struct bio_set * bs)
+{
+    free(bs);
+}
+
+struct bio * bio_alloc_bioset(gfp_t gfp_mask, int nr_iovecs, struct bio_set * bs)
+{
+    struct bio * bio;
+    char * p;
+
+    p = calloc(1, bs->front_pad + sizeof(struct bio) + nr_iovecs * sizeof(struct bio_vec));
+    if (!p)
+        return NULL;
+    bio = (struct bio *)(p + bs->front_pad);
+    bio->bi_flags = 1UL << BIO_UPTODATE;
+    bio->bi_max_vecs = nr_iovecs;
+    bio->bi_io_vec = bio->bi_inline_vecs;
+    atomic_set(&bio->bi_cnt, 1);
+    return bio;
+}
+
+void bio_free(struct bio * bio, struct bio_set * bs)
+{
+    free((char *)bio - bs->front_pad);
+}
+
+void bio_put(struct bio * bio)
+{
+    if (atomic_dec_and_test(&bio->bi_cnt)) {
+        if (bio->bi_destructor)
+            bio->bi_destructor(bio);
+        else
+            free(bio);
+    }
+}
+
+void bio_endio(struct bio * bio, int error)
+{
+    if (error)
+        bio->bi_flags &= ~(1UL << BIO_UPTODATE);
+    if (bio->bi_end_io)
+        bio->bi_end_io(bio, error);
+}
+
+/*
+ * The compressor behind the lzo interface. A sequence is a token with
+ * the literal length in its high nibble and the match length less
+ * LZ_MIN_MATCH in the low one, 15 continued in bytes until one is not
+ * 255, then the literals and the 16 bit offset of the match. The last
+ * sequence has only literals.
+ */
+#define LZ_HASH_BITS    12
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   0xffff
+
+static inline u32 lz_read32(const unsigned char * p)
+{
+    u32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u32 lz_hash(u32 v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char * lz_put_len(unsigned char * op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static unsigned char * lz_put_seq(unsigned char * op, const unsigned char * lit, size_t nlit,
+        size_t off, size_t mlen)
+{
+    unsigned char * token = op++;
+
+    *token = min_t(size_t, nlit, 15) << 4;
+    if (nlit >= 15)
+        op = lz_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+        return op;
+
+    *token |= min_t(size_t, mlen - LZ_MIN_MATCH, 15);
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    if (mlen - LZ_MIN_MATCH >= 15)
+        op = lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+    return op;
+}
+
+int lzo1x_1_compress(const unsigned char * src, size_t src_len, unsigned char * dst,
+        size_t * dst_len, void * wrkmem)
+{
+    const unsigned char * ip = src, * anchor = src, * end = src + src_len, * ref;
+    const unsigned char * limit = src_len > LZ_MIN_MATCH ? end - LZ_MIN_MATCH : src;
+    unsigned char * op = dst;
+    u32 * table = wrkmem;
+    size_t mlen;
+    u32 h;
+
+    memset(table, 0, sizeof(u32) << LZ_HASH_BITS);
+    while (ip < limit) {
+        h = lz_hash(lz_read32(ip));
+        ref = src + table[h];
+        table[h] = ip - src;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != lz_read32(ip)) {
+            ip ++;
+            continue;
+        }
+        for (mlen = LZ_MIN_MATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++)
+            ;
+        op = lz_put_seq(op, anchor, ip - anchor, ip - ref, mlen);
+        ip += mlen;
+        anchor = ip;
+    }
+    op = lz_put_seq(op, anchor, end - anchor, 0, 0);
+
+    *dst_len = op - dst;
+    return LZO_E_OK;
+}
+
+/* a length continued in bytes, @len is 15 so far */
+static bool lz_get_len(const unsigned char ** ip, const unsigned char * end, size_t * len)
+{
+    unsigned char b;
+
+    do {
+        if (*ip >= end)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+int lzo1x_decompress_safe(const unsigned char * src, size_t src_len, unsigned char * dst,
+        size_t * dst_len)
+{
+    const unsigned char * ip = src, * end = src + src_len;
+    unsigned char * op = dst, * oend = dst + *dst_len;
+    size_t nlit, mlen, off;
+    unsigned char token;
+
+    while (ip < end) {
+        token = *ip++;
+        nlit = token >> 4;
+        if (nlit == 15 && !lz_get_len(&ip, end, &nlit))
+            return LZO_E_INPUT_OVERRUN;
+        if (nlit > (size_t)(end - ip))
+            return LZO_E_INPUT_OVERRUN;
+        if (nlit > (size_t)(oend - op))
+            return LZO_E_OUTPUT_OVERRUN;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return LZO_E_INPUT_OVERRUN;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15 && !lz_get_len(&ip, end, &mlen))
+            return LZO_E_INPUT_OVERRUN;
+        mlen += LZ_MIN_MATCH;
+        if (!off || off > (size_t)(op - dst))
+            return LZO_E_LOOKBEHIND_OVERRUN;
+        if (mlen > (size_t)(oend - op))
+            return LZO_E_OUTPUT_OVERRUN;
+        // the match may overlap what it writes
+        for (; mlen; mlen--, op++)
+            *op = op[-off];
+    }
+
+    *dst_len = op - dst;
+    return LZO_E_OK;
+}
+
+/*
+ * crc32c, reflected polynomial 0x82f63b78. Without sse4.2 it goes a byte
+ * at a time through a table built at startup.
+ */
+#define CRC32C_POLY     0x82f63b78
+
+static u32 crc32c_table[256];
+
+static u32 crc32c_sw(u32 crc, const unsigned char * p, size_t len)
+{
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u32 crc32c_hw(u32 crc, const unsigned char * p, size_t len)
+{
+    u64 c = crc, w;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    crc = c;
+    for (; len; len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+static bool crc32c_has_hw;
+
+u32 crc32c(u32 crc, const void * address, unsigned int length)
+{
+#if defined(__x86_64__)
+    if (crc32c_has_hw)
+        return crc32c_hw(crc, address, length);
+#endif
+    return crc32c_sw(crc, address, length);
+}
+
+static void crc32c_init(void)
+{
+    u32 i, j, c;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i, j = 0; j < 8; j++)
+            c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+        crc32c_table[i] = c;
+    }
+#if defined(__x86_64__)
+    crc32c_has_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+__attribute__((constructor)) static void usys_init(void)
+{
+    crc32c_init();
+    system_wq = alloc_workqueue("events", 0, 0);
+    system_unbound_wq = alloc_workqueue("events_unbound", WQ_UNBOUND, 0);
+    if (!system_wq || !system_unbound_wq) {
+        fprintf(stderr, "usys: cannot create the system workqueues\n");
+        abort();
+    }
+}
@@ -0,0 +1,873 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  usys.h
+ *
+ *    Description:  userspace stand-ins for the kernel interfaces used by the
+ *                  ftl core: lists, allocation, atomics, locks, completions,
+ *                  workqueues, bios and the few other block layer types it
+ *                  refers to. Only what the core needs is provided, with
+ *                  kernel semantics.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _USYS_H_
+#define _USYS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int32_t s32;
+typedef long long s64;
+typedef u64 sector_t;
+typedef unsigned int gfp_t;
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(x, y)           ((x) < (y) ? (x) : (y))
+#define max(x, y)           ((x) > (y) ? (x) : (y))
+#define min_t(type, x, y)   ({ type __x = (x); type __y = (y); __x < __y ? __x : __y; })
+#define max_t(type, x, y)   ({ type __x = (x); type __y = (y); __x > __y ? __x : __y; })
+#define clamp_t(type, v, lo, hi)    min_t(type, max_t(type, v, lo), hi)
+#define DIV_ROUND_UP(n, d)  (((n) + (d) - 1) / (d))
+#define div64_u64(a, b)     ((u64)(a) / (u64)(b))
+#define fls64(x)            ((x) ? 64 - __builtin_clzll(x) : 0)
+#define ilog2(n)            (fls64(n) - 1)
+#define is_power_of_2(n)    ((n) != 0 && !((n) & ((n) - 1)))
+#define roundup_pow_of_two(n)   (1UL << fls64((u64)(n) - 1))
+#define ARRAY_SIZE(a)       (sizeof(a) / sizeof((a)[0]))
+
+#define MAX_ERRNO           4095
+#define IS_ERR_VALUE(x)     unlikely((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+#define ERR_PTR(err)        ((void *)(long)(err))
+#define PTR_ERR(ptr)        ((long)(ptr))
+#define IS_ERR(ptr)         IS_ERR_VALUE((unsigned long)(ptr))
+
+#define BUG_ON(cond) do { \
+    if (unlikely(cond)) { \
+        fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__); \
+        abort(); \
+    } \
+} while (0)
+
+/*
+ * printk: the level is the leading "\001<n>" like in the kernel, messages
+ * above usys_loglevel are dropped (errors and warnings by default).
+ */
+#define KERN_SOH        "\001"
+#define KERN_ERR        KERN_SOH "3"
+#define KERN_WARNING    KERN_SOH "4"
+#define KERN_NOTICE     KERN_SOH "5"
+#define KERN_INFO       KERN_SOH "6"
+#define KERN_DEBUG      KERN_SOH "7"
+
+extern int usys_loglevel;
+extern int printk(const char * fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/*
+ * lists
+ */
+struct list_head {
+    struct list_head * next, * prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head * list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add(struct list_head * new, struct list_head * prev,
+        struct list_head * next)
+{
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+static inline void list_add(struct list_head * new, struct list_head * head)
+{
+    __list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head * new, struct list_head * head)
+{
+    __list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head * entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head * entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move(struct list_head * list, struct list_head * head)
+{
+    list_del(list);
+    list_add(list, head);
+}
+
+static inline void list_move_tail(struct list_head * list, struct list_head * head)
+{
+    list_del(list);
+    list_add_tail(list, head);
+}
+
+static inline int list_empty(const struct list_head * head)
+{
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member)       container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+
+#define list_for_each(pos, head) \
+    for (pos = (head)->next; pos != (head); pos = pos->next)
+
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = list_entry(pos->member.next, __typeof__(*pos), member))
+
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member), \
+         n = list_entry(pos->member.next, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+/*
+ * memory. A struct page is never dereferenced by the ftl, so a page is
+ * simply its own page aligned memory and page_address() is a cast.
+ */
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1UL << PAGE_SHIFT)
+
+#define GFP_KERNEL      0x0
+#define GFP_NOIO        0x0
+#define GFP_ATOMIC      0x0
+#define GFP_NOWAIT      0x0
+#define __GFP_NOWARN    0x0
+#define __GFP_ZERO      0x1
+
+struct page;
+
+static inline void * kmalloc(size_t size, gfp_t flags)
+{
+    return (flags & __GFP_ZERO) ? calloc(1, size) : malloc(size);
+}
+
+static inline void * kzalloc(size_t size, gfp_t flags)
+{
+    return calloc(1, size);
+}
+
+static inline void * kcalloc(size_t n, size_t size, gfp_t flags)
+{
+    return calloc(n, size);
+}
+
+static inline void * krealloc(const void * p, size_t size, gfp_t flags)
+{
+    return realloc((void *)p, size);
+}
+
+static inline void kfree(const void * p)
+{
+    free((void *)p);
+}
+
+extern void * vmalloc(unsigned long size);
+extern void * vzalloc(unsigned long size);
+
+static inline void vfree(const void * addr)
+{
+    free((void *)addr);
+}
+
+/* the pages of an order are contiguous, nth_page() steps over them */
+static inline struct page * alloc_pages(gfp_t flags, unsigned int order)
+{
+    void * addr = aligned_alloc(PAGE_SIZE, PAGE_SIZE << order);
+
+    if (addr && (flags & __GFP_ZERO))
+        memset(addr, 0, PAGE_SIZE << order);
+    return addr;
+}
+
+#define alloc_page(flags)           alloc_pages(flags, 0)
+#define nth_page(page, n)           ((struct page *)((char *)(page) + ((unsigned long)(n) << PAGE_SHIFT)))
+
+static inline void __free_pages(struct page * page, unsigned int order)
+{
+    free(page);
+}
+
+#define __free_page(page)           __free_pages(page, 0)
+
+static inline void * page_address(struct page * page)
+{
+    return page;
+}
+
+static inline struct page * vmalloc_to_page(const void * addr)
+{
+    return (struct page *)((uintptr_t)addr & ~(PAGE_SIZE - 1));
+}
+
+#define virt_to_page(addr)  vmalloc_to_page(addr)
+
+/*
+ * numa, a single node. Contiguous pages come from vmalloc as well.
+ */
+#define NUMA_NO_NODE        (-1)
+#define MAX_ORDER           11
+#define nr_node_ids         1
+#define numa_node_id()      0
+#define num_online_nodes()  1
+#define MAX_NUMNODES        1
+#define first_online_node   0
+#define next_online_node(node)  MAX_NUMNODES
+#define for_each_online_node(node)  for ((node) = 0; (node) < 1; (node)++)
+
+#define kmalloc_node(size, flags, node)     kmalloc(size, flags)
+#define kzalloc_node(size, flags, node)     kzalloc(size, flags)
+#define vmalloc_node(size, node)            vmalloc(size)
+#define vzalloc_node(size, node)            vzalloc(size)
+#define alloc_pages_node(node, flags, order)    alloc_pages(flags, order)
+#define alloc_pages_exact_nid(node, size, flags)    vzalloc(size)
+#define free_pages_exact(addr, size)        vfree(addr)
+#define is_vmalloc_addr(addr)               1
+
+/*
+ * slab caches and mempools, both only keep the object size
+ */
+struct kmem_cache {
+    size_t size;
+};
+
+static inline struct kmem_cache * kmem_cache_create(const char * name, size_t size,
+        size_t align, unsigned long flags, void (*ctor)(void *))
+{
+    struct kmem_cache * c = malloc(sizeof(struct kmem_cache));
+
+    if (c)
+        c->size = size;
+    return c;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache * c)
+{
+    free(c);
+}
+
+typedef struct mempool_s {
+    size_t size;
+} mempool_t;
+
+static inline mempool_t * mempool_create_kmalloc_pool(int min_nr, size_t size)
+{
+    mempool_t * pool = malloc(sizeof(mempool_t));
+
+    if (pool)
+        pool->size = size;
+    return pool;
+}
+
+static inline mempool_t * mempool_create_slab_pool(int min_nr, struct kmem_cache * c)
+{
+    return mempool_create_kmalloc_pool(min_nr, c->size);
+}
+
+static inline void * mempool_alloc(mempool_t * pool, gfp_t flags)
+{
+    return malloc(pool->size);
+}
+
+static inline void mempool_free(void * element, mempool_t * pool)
+{
+    free(element);
+}
+
+static inline void mempool_destroy(mempool_t * pool)
+{
+    free(pool);
+}
+
+/*
+ * bitmaps, only used under a lock
+ */
+#define BITS_PER_LONG       (8 * sizeof(long))
+#define BITS_TO_LONGS(n)    DIV_ROUND_UP(n, BITS_PER_LONG)
+#define BIT_WORD(nr)        ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)        (1UL << ((nr) % BITS_PER_LONG))
+
+static inline int test_bit(unsigned int nr, const unsigned long * addr)
+{
+    return (addr[BIT_WORD(nr)] & BIT_MASK(nr)) != 0;
+}
+
+static inline void __set_bit(unsigned int nr, unsigned long * addr)
+{
+    addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __clear_bit(unsigned int nr, unsigned long * addr)
+{
+    addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline void bitmap_zero(unsigned long * dst, unsigned int nbits)
+{
+    memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(long));
+}
+
+static inline void bitmap_set(unsigned long * map, unsigned int start, unsigned int nr)
+{
+    for (; nr; nr--, start++)
+        map[BIT_WORD(start)] |= BIT_MASK(start);
+}
+
+static inline unsigned long find_next_zero_bit(const unsigned long * addr, unsigned long size,
+        unsigned long offset)
+{
+    for (; offset < size; offset++) {
+        if (!test_bit(offset, addr))
+            return offset;
+    }
+    return size;
+}
+
+static inline int bitmap_full(const unsigned long * src, unsigned int nbits)
+{
+    return find_next_zero_bit(src, nbits, 0) == nbits;
+}
+
+static inline int bitmap_weight(const unsigned long * src, unsigned int nbits)
+{
+    unsigned int i;
+    int w = 0;
+
+    for (i = 0; i < nbits; i++)
+        w += test_bit(i, src);
+    return w;
+}
+
+/*
+ * atomics and barriers
+ */
+#define barrier()       __asm__ __volatile__("" ::: "memory")
+#define smp_mb()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb()       __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()       __atomic_thread_fence(__ATOMIC_RELEASE)
+#define ACCESS_ONCE(x)  (*(volatile __typeof__(x) *)&(x))
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+typedef struct {
+    long long counter;
+} atomic64_t;
+
+#define ATOMIC_INIT(i)  { (i) }
+
+#define atomic_read(v)              __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i)            __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_add(i, v)            ((void)__atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+#define atomic_sub(i, v)            ((void)__atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+#define atomic_inc(v)               atomic_add(1, v)
+#define atomic_dec(v)               atomic_sub(1, v)
+#define atomic_add_return(i, v)     __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_inc_return(v)        atomic_add_return(1, v)
+#define atomic_dec_return(v)        atomic_add_return(-1, v)
+#define atomic_dec_and_test(v)      (__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+#define atomic64_read(v)            atomic_read(v)
+#define atomic64_set(v, i)          atomic_set(v, i)
+#define atomic64_add(i, v)          atomic_add(i, v)
+#define atomic64_inc(v)             atomic_inc(v)
+#define atomic64_inc_return(v)      atomic_inc_return(v)
+
+/*
+ * per cpu data. Each thread takes one of NR_CPUS slots, a slot may be
+ * shared so updates are atomic. Like the kernel's percpu units, every
+ * slot of an allocation is PERCPU_UNIT bytes apart.
+ */
+#define NR_CPUS         64
+#define PERCPU_UNIT     32768   // PCPU_MIN_UNIT_SIZE, the largest the kernel allows
+#define __percpu
+
+extern __thread int usys_cpu;
+extern int usys_assign_cpu(void);
+
+static inline int smp_processor_id(void)
+{
+    if (unlikely(usys_cpu < 0))
+        usys_cpu = usys_assign_cpu();
+    return usys_cpu;
+}
+
+extern void * __alloc_percpu(size_t size);
+
+#define alloc_percpu(type)      ((type __percpu *)__alloc_percpu(sizeof(type)))
+#define free_percpu(ptr)        free(ptr)
+#define per_cpu_ptr(ptr, cpu)   ((__typeof__(ptr))((char *)(ptr) + (size_t)(cpu) * PERCPU_UNIT))
+#define this_cpu_ptr(ptr)       per_cpu_ptr(ptr, smp_processor_id())
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < NR_CPUS; (cpu)++)
+
+#define this_cpu_add(pcp, n) \
+    ((void)__atomic_add_fetch(per_cpu_ptr(&(pcp), smp_processor_id()), (n), __ATOMIC_RELAXED))
+#define this_cpu_inc(pcp)       this_cpu_add(pcp, 1)
+
+/*
+ * locks. Spinlocks and rwlocks are only held over short sections, there
+ * are no interrupts to disable and the flags are unused.
+ */
+typedef struct {
+    pthread_mutex_t m;
+} spinlock_t;
+
+#define spin_lock_init(l)               pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l)                    pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l)                  pthread_mutex_unlock(&(l)->m)
+#define spin_lock_irq(l)                spin_lock(l)
+#define spin_unlock_irq(l)              spin_unlock(l)
+#define spin_lock_irqsave(l, flags)     do { (flags) = 0; spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags) do { (void)(flags); spin_unlock(l); } while (0)
+
+typedef struct {
+    pthread_rwlock_t rw;
+} rwlock_t;
+
+#define rwlock_init(l)                  pthread_rwlock_init(&(l)->rw, NULL)
+#define read_lock(l)                    pthread_rwlock_rdlock(&(l)->rw)
+#define read_unlock(l)                  pthread_rwlock_unlock(&(l)->rw)
+#define write_lock(l)                   pthread_rwlock_wrlock(&(l)->rw)
+#define write_unlock(l)                 pthread_rwlock_unlock(&(l)->rw)
+#define read_lock_irqsave(l, flags)     do { (flags) = 0; read_lock(l); } while (0)
+#define read_unlock_irqrestore(l, flags) do { (void)(flags); read_unlock(l); } while (0)
+#define write_lock_irqsave(l, flags)    do { (flags) = 0; write_lock(l); } while (0)
+#define write_unlock_irqrestore(l, flags) do { (void)(flags); write_unlock(l); } while (0)
+
+struct mutex {
+    pthread_mutex_t m;
+};
+
+#define mutex_init(l)       pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l)       pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l)     pthread_mutex_unlock(&(l)->m)
+
+/*
+ * rw_semaphore is released by the io completion, which may run on another
+ * thread than the one that took it, so it cannot be a pthread rwlock.
+ */
+struct rw_semaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+    int count;              // readers holding it, -1 if held for write
+};
+
+extern void init_rwsem(struct rw_semaphore * sem);
+extern void down_read(struct rw_semaphore * sem);
+extern void up_read(struct rw_semaphore * sem);
+extern void down_write(struct rw_semaphore * sem);
+extern void up_write(struct rw_semaphore * sem);
+
+typedef struct {
+    unsigned int sequence;
+    spinlock_t lock;
+} seqlock_t;
+
+static inline void seqlock_init(seqlock_t * sl)
+{
+    sl->sequence = 0;
+    spin_lock_init(&sl->lock);
+}
+
+static inline unsigned int read_seqbegin(const seqlock_t * sl)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&sl->sequence, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return seq;
+}
+
+static inline int read_seqretry(const seqlock_t * sl, unsigned int start)
+{
+    smp_rmb();
+    return __atomic_load_n(&sl->sequence, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqlock(seqlock_t * sl)
+{
+    spin_lock(&sl->lock);
+    __atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELAXED);
+    smp_wmb();
+}
+
+static inline void write_sequnlock(seqlock_t * sl)
+{
+    __atomic_store_n(&sl->sequence, sl->sequence + 1, __ATOMIC_RELEASE);
+    spin_unlock(&sl->lock);
+}
+
+/*
+ * completions and wait queues
+ */
+struct completion {
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+    unsigned int done;
+};
+
+extern void init_completion(struct completion * x);
+extern void complete(struct completion * x);
+extern void complete_all(struct completion * x);
+extern void wait_for_completion(struct completion * x);
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+} wait_queue_head_t;
+
+extern void init_waitqueue_head(wait_queue_head_t * q);
+extern void wake_up(wait_queue_head_t * q);
+
+#define wake_up_all(q)  wake_up(q)
+
+/* no count of the waiters is kept, wake_up always looks */
+static inline int waitqueue_active(wait_queue_head_t * q)
+{
+    return 1;
+}
+
+/* the condition is rechecked under the queue lock, which wake_up takes */
+#define wait_event(wq, condition) do { \
+    pthread_mutex_lock(&(wq).lock); \
+    while (!(condition)) \
+        pthread_cond_wait(&(wq).wait, &(wq).lock); \
+    pthread_mutex_unlock(&(wq).lock); \
+} while (0)
+
+extern void usys_deadline(struct timespec * ts, long timeout);
+
+/* zero if @condition is still false after @timeout jiffies */
+#define wait_event_timeout(wq, condition, timeout) ({ \
+    struct timespec __ts; \
+    long __ret = 1; \
+    usys_deadline(&__ts, timeout); \
+    pthread_mutex_lock(&(wq).lock); \
+    while (!(condition)) { \
+        if (pthread_cond_timedwait(&(wq).wait, &(wq).lock, &__ts) == ETIMEDOUT) { \
+            __ret = (condition) ? 1 : 0; \
+            break; \
+        } \
+    } \
+    pthread_mutex_unlock(&(wq).lock); \
+    __ret; \
+})
+
+/*
+ * workqueues, each served by max_active threads
+ */
+struct work_struct;
+struct workqueue_struct;
+
+typedef void (*work_func_t)(struct work_struct * work);
+
+struct work_struct {
+    struct list_head entry;
+    work_func_t func;
+    struct workqueue_struct * wq;   // queue it was last queued on
+    unsigned int state;
+};
+
+#define WORK_PENDING    0x1
+
+#define INIT_WORK(w, f) do { \
+    INIT_LIST_HEAD(&(w)->entry); \
+    (w)->func = (f); \
+    (w)->wq = NULL; \
+    (w)->state = 0; \
+} while (0)
+
+#define WQ_NON_REENTRANT 0x1
+#define WQ_UNBOUND      0x2
+#define WQ_MEM_RECLAIM  0x8
+#define WQ_HIGHPRI      0x10
+
+extern struct workqueue_struct * system_wq;
+extern struct workqueue_struct * system_unbound_wq;
+
+extern struct workqueue_struct * alloc_workqueue(const char * name, unsigned int flags,
+        int max_active);
+extern void destroy_workqueue(struct workqueue_struct * wq);
+extern bool queue_work(struct workqueue_struct * wq, struct work_struct * work);
+extern bool flush_work(struct work_struct * work);
+extern bool cancel_work_sync(struct work_struct * work);
+extern void flush_workqueue(struct workqueue_struct * wq);
+
+#define create_workqueue(name)  alloc_workqueue(name, WQ_MEM_RECLAIM, 1)
+#define schedule_work(work)     queue_work(system_wq, work)
+
+/*
+ * time, jiffies are milliseconds
+ */
+#define HZ 1000
+
+extern unsigned long usys_jiffies(void);
+#define jiffies usys_jiffies()
+
+#define usecs_to_jiffies(us)    DIV_ROUND_UP((unsigned long)(us), 1000000 / HZ)
+
+#define time_after(a, b)    ((long)((b) - (a)) < 0)
+#define time_before(a, b)   time_after(b, a)
+
+extern unsigned int num_online_cpus(void);
+
+/*
+ * block layer. The ftl only keeps pointers to these, struct block_device
+ * is the simulated flash device of sim/nand.h.
+ */
+#define READ    0
+#define WRITE   1
+
+#define BIO_MAX_PAGES   256
+
+struct bio;
+struct request;
+struct request_queue;
+struct scsi_device;
+struct block_device;
+
+typedef void (make_request_fn)(struct request_queue * q, struct bio * bio);
+typedef int (prep_rq_fn)(struct request_queue * q, struct request * rq);
+typedef void (request_fn_proc)(struct request_queue * q);
+
+struct gendisk {
+    char disk_name[32];
+    void * private_data;
+};
+
+struct blk_plug {
+    int unused;
+};
+
+static inline void blk_start_plug(struct blk_plug * plug) { }
+static inline void blk_finish_plug(struct blk_plug * plug) { }
+
+/*
+ * bios with the 3.2 layout. A bio_set only hands out bios with their
+ * vectors inline, there are no highmem pages to map.
+ */
+#define BIO_UPTODATE    0
+#define BIO_CLONED      4
+
+#define REQ_WRITE       (1UL << 0)
+#define REQ_SYNC        (1UL << 4)
+#define REQ_DISCARD     (1UL << 7)
+#define REQ_FUA         (1UL << 12)
+#define REQ_FLUSH       (1UL << 16)
+
+struct bio_vec {
+    struct page * bv_page;
+    unsigned int bv_len;
+    unsigned int bv_offset;
+};
+
+typedef void (bio_end_io_t)(struct bio * bio, int error);
+typedef void (bio_destructor_t)(struct bio * bio);
+
+struct bio {
+    sector_t bi_sector;
+    struct bio * bi_next;
+    struct block_device * bi_bdev;
+    unsigned long bi_flags;
+    unsigned long bi_rw;
+    unsigned short bi_vcnt;
+    unsigned short bi_idx;
+    unsigned int bi_size;
+    unsigned int bi_max_vecs;
+    atomic_t bi_cnt;
+    struct bio_vec * bi_io_vec;
+    bio_end_io_t * bi_end_io;
+    void * bi_private;
+    bio_destructor_t * bi_destructor;
+    struct bio_vec bi_inline_vecs[0];
+};
+
+/* front_pad bytes of the caller are allocated in front of each bio */
+struct bio_set {
+    unsigned int front_pad;
+};
+
+#define bio_data_dir(bio)   ((bio)->bi_rw & REQ_WRITE ? WRITE : READ)
+#define bio_sectors(bio)    ((bio)->bi_size >> 9)
+
+extern struct bio_set * bioset_create(unsigned int pool_size, unsigned int front_pad);
+extern void bioset_free(struct bio_set * bs);
+extern struct bio * bio_alloc_bioset(gfp_t gfp_mask, int nr_iovecs, struct bio_set * bs);
+extern void bio_free(struct bio * bio, struct bio_set * bs);
+extern void bio_put(struct bio * bio);
+extern void bio_endio(struct bio * bio, int error);
+
+/* a fifo of bios linked through bi_next */
+struct bio_list {
+    struct bio * head;
+    struct bio * tail;
+};
+
+static inline void bio_list_init(struct bio_list * bl)
+{
+    bl->head = bl->tail = NULL;
+}
+
+static inline int bio_list_empty(const struct bio_list * bl)
+{
+    return bl->head == NULL;
+}
+
+static inline void bio_list_add(struct bio_list * bl, struct bio * bio)
+{
+    bio->bi_next = NULL;
+    if (bl->tail)
+        bl->tail->bi_next = bio;
+    else
+        bl->head = bio;
+    bl->tail = bio;
+}
+
+static inline struct bio * bio_list_pop(struct bio_list * bl)
+{
+    struct bio * bio = bl->head;
+
+    if (bio) {
+        bl->head = bio->bi_next;
+        if (!bl->head)
+            bl->tail = NULL;
+        bio->bi_next = NULL;
+    }
+    return bio;
+}
+
+/* the block device of the bio is the simulated flash, see sim/nand.c */
+extern void generic_make_request(struct bio * bio);
+
+static inline char * bvec_kmap_irq(struct bio_vec * bvec, unsigned long * flags)
+{
+    return (char *)page_address(bvec->bv_page) + bvec->bv_offset;
+}
+
+static inline void bvec_kunmap_irq(char * buffer, unsigned long * flags) { }
+static inline void flush_dcache_page(struct page * page) { }
+
+/*
+ * lzo, the interface of lib/lzo. usys.c compresses with a plain lz77 of
+ * its own, not the lzo1x format, the simulated flash is never read by
+ * the module.
+ */
+#define LZO1X_1_MEM_COMPRESS        (16384 * sizeof(unsigned char *))
+#define lzo1x_worst_compress(x)     ((x) + ((x) / 16) + 64 + 3)
+
+#define LZO_E_OK                    0
+#define LZO_E_ERROR                 (-1)
+#define LZO_E_INPUT_OVERRUN         (-4)
+#define LZO_E_OUTPUT_OVERRUN        (-5)
+#define LZO_E_LOOKBEHIND_OVERRUN    (-6)
+
+extern int lzo1x_1_compress(const unsigned char * src, size_t src_len, unsigned char * dst,
+        size_t * dst_len, void * wrkmem);
+extern int lzo1x_decompress_safe(const unsigned char * src, size_t src_len, unsigned char * dst,
+        size_t * dst_len);
+
+/*
+ * crc32c, the interface of lib/libcrc32c: no inversion of the crc on the
+ * way in or out. usys.c uses the crc32 instruction of sse4.2 when the cpu
+ * has it, like the crc32c-intel driver the kernel picks then.
+ */
+extern u32 crc32c(u32 crc, const void * address, unsigned int length);
+
+/*
+ * threads and time
+ */
+struct task_struct;
+
+extern struct task_struct * kthread_run(int (*threadfn)(void * data), void * data,
+        const char * namefmt, ...);
+
+static inline void cond_resched(void) { }
+
+/* a thread always owns its fpu */
+static inline bool irq_fpu_usable(void) { return true; }
+static inline void kernel_fpu_begin(void) { }
+static inline void kernel_fpu_end(void) { }
+
+typedef union {
+    s64 tv64;
+} ktime_t;
+
+extern ktime_t ktime_get(void);
+
+/* from /dev/urandom, or the clock if it cannot be read */
+extern void get_random_bytes(void * buf, int nbytes);
+
+static inline ktime_t ktime_sub(ktime_t a, ktime_t b)
+{
+    ktime_t r = { .tv64 = a.tv64 - b.tv64 };
+
+    return r;
+}
+
+static inline s64 ktime_to_ns(ktime_t kt)
+{
+    return kt.tv64;
+}
+
+/*
+ * tracepoints, every trace_<event>() is an empty function
+ */
+#define TP_PROTO(args...)   args
+#define TP_ARGS(args...)    args
+
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_##name(proto) { }
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+    static inline void trace_##name(proto) { }
+
+#endif
@@ -23,6 +23,12 @@
 #include <linux/slab.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/log2.h>
 #include <asm/unaligned.h>
 
 #include <scsi/scsi.h>
@@ -36,7 +42,13 @@
 #include <../drivers/scsi/scsi_logging.h>
 
 #include "ftl.h"
+#include "wbuf.h"
 #include "ssd.h"
+#include "alloc.h"
+#include "scan.h"
+
+#define CREATE_TRACE_POINTS
+#include "sftl_trace.h"
 
 MODULE_AUTHOR("Xiaolin Guo");
 MODULE_DESCRIPTION("driver for ssd wi soft-ftl");
@@ -63,7 +75,7 @@ static struct scsi_driver ss_template = {
     .done           = ss_done,
 };*/
 
-unsigned int ssd_major[SSD_MAJOR];
+static int ssd_major;
 
 static struct kmem_cache * ss_cdb_cache;
 static struct kmem_cache * ss_io_cache;
@@ -71,20 +83,150 @@ static mempool_t * ss_cdb_pool;
 
 make_request_fn * mrf = NULL;
 
-const char * ssds[] = { "/dev/sdb",};
+/* the backing devices attached at load time */
+static char * devices[SSD_MAX_DISKS] = { "/dev/sdb", };
+static unsigned int nr_devices = 1;
+module_param_array(devices, charp, &nr_devices, 0444);
+MODULE_PARM_DESC(devices, "comma separated block devices to attach a disk to");
+
+/* with stripe set, the devices make one volume instead of a disk each */
+static bool stripe;
+module_param(stripe, bool, 0444);
+MODULE_PARM_DESC(stripe, "stripe one disk over all the devices");
+
+/* the geometry of every flash device a volume is striped over */
+static unsigned int channels = 1;
+module_param(channels, uint, 0444);
+MODULE_PARM_DESC(channels, "channels of each device of a volume");
+
+static unsigned int dies = 1;
+module_param(dies, uint, 0444);
+MODULE_PARM_DESC(dies, "dies on each channel");
+
+static unsigned int planes = 1;
+module_param(planes, uint, 0444);
+MODULE_PARM_DESC(planes, "planes of each die");
+
+static unsigned int block_pages = PAGE_NUM_BLOCK;
+module_param(block_pages, uint, 0444);
+MODULE_PARM_DESC(block_pages, "pages of an erase block, a power of two");
+
+/*
+ * the mapping unit of a disk, in flash pages. It is the layout of the
+ * mapping pages on the flash, a disk has to be attached with the unit it
+ * was formatted with.
+ */
+static unsigned int map_pages = 1;
+module_param(map_pages, uint, 0444);
+MODULE_PARM_DESC(map_pages, "flash pages of a mapping unit of a new volume, a power of two up to 16");
+
+/* map the logical blocks of a volume written in order with an entry each */
+static bool block_map;
+module_param(block_map, bool, 0444);
+MODULE_PARM_DESC(block_map, "map sequentially written erase blocks of a new volume as a whole, not saved");
+
+/* compress the units of a volume on write back and pack them into pages */
+static bool compress;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "pack units of a new volume compressed with lzo, with map_pages=1, not saved");
+
+/* map the units of a volume written with the same data to one copy */
+static bool dedup;
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "share the units of a new volume written with the same data, with map_pages=1, not saved");
+
+/* the vector loops of the mapping and rmap scans, see scan.c */
+module_param_named(simd, scan_simd, bool, 0644);
+MODULE_PARM_DESC(simd, "scan mapping pages with sse2 where the fpu may be used");
+
+static unsigned int cmt_shards;
+module_param(cmt_shards, uint, 0444);
+MODULE_PARM_DESC(cmt_shards, "lpn ranges the cmt of a disk is split into, 0 for one per cpu");
+
+static unsigned int cmt_pages;
+module_param(cmt_pages, uint, 0444);
+MODULE_PARM_DESC(cmt_pages, "mapping pages the cmt of a disk keeps at most, 0 for the default");
+
+/* the background io of a disk, in flash pages a second */
+static unsigned int gc_rate;
+module_param(gc_rate, uint, 0444);
+MODULE_PARM_DESC(gc_rate, "most pages a second gc moves unless writes wait for it, 0 for no limit");
+
+static unsigned int map_rate;
+module_param(map_rate, uint, 0444);
+MODULE_PARM_DESC(map_rate, "most mapping pages a second read ahead, 0 for no limit");
+
+/*
+ * with selftest set to a block device, e.g. /dev/ram0, loading the module
+ * only runs the microbenchmarks on it and attaches no disk
+ */
+static char * selftest;
+module_param(selftest, charp, 0444);
+MODULE_PARM_DESC(selftest, "block device to run the self test on");
+
+static unsigned long selftest_ops = 100000;
+module_param(selftest_ops, ulong, 0444);
+MODULE_PARM_DESC(selftest_ops, "operations per thread of each self test");
+
+static unsigned int selftest_threads;
+module_param(selftest_threads, uint, 0444);
+MODULE_PARM_DESC(selftest_threads, "most threads of the self test, 0 for all cpus");
 
+/*
+ * ssd_list is changed under ssd_mutex, the io path walks it under rcu.
+ * ssd_index holds the indexes of the disks, their minors and names.
+ */
 LIST_HEAD(ssd_list);
+static DEFINE_MUTEX(ssd_mutex);
+static DECLARE_BITMAP(ssd_index, SSD_MAX_DISKS);
+static bool ss_loaded;
+
+static const struct block_device_operations ss_fops;
+
+/*
+ * The request queue is shared with the backing disk, so it also sees io
+ * for that disk, including the ftl's own io on the flash.
+ */
+static inline bool is_ss_disk(struct gendisk * disk)
+{
+    return disk && disk->fops == &ss_fops;
+}
+
+static struct ssd_disk * queue_to_ssd(struct request_queue * q)
+{
+    struct ssd_disk * sdk, * found = NULL;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(sdk, &ssd_list, list) {
+        if (sdk->gd && sdk->gd->queue == q) {
+            found = sdk;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return found;
+}
 
 static int ss_open(struct block_device *bdev, fmode_t mode) {
     //struct scsi_disk *sdkp = scsi_disk_get(bdev->bd_disk);
     //struct scsi_device *sdev;
-    return 0;
+    struct ssd_disk * sdk = ssd_disk(bdev->bd_disk);
+    int err = 0;
+
+    spin_lock(&sdk->open_lock);
+    if (sdk->removing)
+        err = -ENXIO;
+    else
+        atomic_inc(&sdk->open_count);
+    spin_unlock(&sdk->open_lock);
+    return err;
 }
 
 static int ss_release(struct gendisk * disk, fmode_t mode) {
     //struct scsi_disk *sdkp = scsi_disk(disk);
 
     //scsi_disk_put(sdkp);
+    atomic_dec(&ssd_disk(disk)->open_count);
     return 0;
 }
 
@@ -124,168 +266,27 @@ static int format_disk_name(char * prefix, int index, char * buf, int len)
     return 0;
 }
 
-struct ss_io {
-    int error;
-    atomic_t io_count;
-    unsigned int start_time;
-    struct bio * bio;
-    struct ssd_disk * sd;
-    spinlock_t endio_lock;
-};
-
-struct clone_info {
-    struct bio * bio;
-    struct ss_io * io;
-    sector_t sector;
-    sector_t sector_count;
-    unsigned int idx;
-};
-
-static struct ss_io * alloc_io(struct ssd_disk * sdk)
-{
-    return mempool_alloc(sdk->io_pool, GFP_NOIO);
-}
-
-static void free_io(struct ssd_disk * sdk, struct ss_io * io)
-{
-    mempool_free(io, sdk->io_pool);
-}
-
-static void ss_bio_destructor(struct bio * bio)
-{
-    struct bio_set * bs = bio->bi_private;
-
-    SDEBUG("ss bio destructor: execute %llx\n", bio->bi_sector);
-    bio_free(bio, bs);
-}
-
-static void dec_pending(struct ss_io * io, int error)
-{
-    unsigned long flags;
-    struct bio * bio;
-    int io_error;
-    /*
-     * we are supposed to push back any error bio here
-     * should be added in the future
-     */
-    if (unlikely(error)) {
-        spin_lock_irqsave(&io->endio_lock, flags);
-        io->error = error;
-        spin_unlock_irqrestore(&io->endio_lock, flags);
-    }
-
-    if (atomic_dec_and_test(&io->io_count)) {
-        bio = io->bio;
-        io_error = io->error;
-        free_io(io->sd, io);
-        bio_endio(bio, io_error);
-    }
-}
-
-static void clone_endio(struct bio * bio, int error)
-{
-    struct ss_io * sio = bio->bi_private;
-    struct ssd_disk * sd = sio->sd;
-
-    bio->bi_private = sd->bs;
-    bio_put(bio);
-    dec_pending(sio, error);
-}
-
 /*
- * clone a bio from existing bio, starting from @sector with @len sects
- * bio_vec used starts from @idx in the bio_vec. @idx will be updated to
- * be set to the uncloned entry with @offset also updated. 
+ * Whole units covered by a discard read as zeros afterwards, a volume
+ * drops their mappings. The discard itself is still passed to the device,
+ * except on a volume where its sectors are not those of any device, it
+ * fails there if a mapping page cannot be read.
  */
-static struct bio * clone_bio(struct bio * bio, sector_t sector, unsigned int * idx, sector_t * offset, sector_t len, struct bio_set * bs)
-{
-    struct bio * clone = NULL;
-    struct bio_vec * bv = bio->bi_io_vec + *idx, * nbv;
-    sector_t remaining = len;
-    clone = bio_alloc_bioset(GFP_NOIO, bio->bi_max_vecs, bs);
-
-    if (!clone)
-        return NULL;
-
-    nbv = clone->bi_io_vec;
-
-    for (; bv < bio->bi_io_vec + bio->bi_vcnt; bv ++) {
-        if (to_sector(bv->bv_len) - *offset > remaining)
-            break;
-        nbv->bv_page = bv->bv_page;
-        nbv->bv_offset = bv->bv_offset + to_bytes(*offset);
-        nbv->bv_len = bv->bv_len - to_bytes(*offset);
-        nbv ++;
-        remaining -= (to_sector(bv->bv_len) - *offset);
-        *offset = 0;
-    }
-
-    if (remaining) {
-        /*
-         *  if there is any io_vec left , 
-         *  we should not reach the end of the io vector list
-         */
-        BUG_ON(bv == bio->bi_io_vec + bio->bi_vcnt);
-
-        nbv->bv_page = bv->bv_page;
-        nbv->bv_offset = bv->bv_offset + to_bytes(*offset);
-        nbv->bv_len = to_bytes(remaining);
-        nbv ++;
-        *offset += remaining;
-    } else
-        *offset = 0;
-
-    clone->bi_vcnt = nbv - clone->bi_io_vec;
-    clone->bi_sector = sector;
-    clone->bi_size = to_bytes(len);
-    clone->bi_destructor = ss_bio_destructor;
-    clone->bi_bdev = bio->bi_bdev;
-    clone->bi_rw = bio->bi_rw;
-    clone->bi_idx = 0;
-    // we have no idea what flags we should use, should check in the future
-    clone->bi_flags = bio->bi_flags | (1 << BIO_CLONED);
-
-    *idx = bv - bio->bi_io_vec;
-
-    return clone;
-}
-
-static void map_bio(struct bio * clone, struct ss_io * sio)
-{
-    clone->bi_end_io = clone_endio;
-    clone->bi_private = sio;
-
-    atomic_inc(&sio->io_count);
-    generic_make_request(clone);
-}
-
-static int __clone_and_map(struct clone_info * ci)
+static int ss_discard(struct ssd_disk * sdk, struct bio * bio)
 {
-    struct bio * clone, *bio = ci->bio;
-    struct bio_set * bs =  ci->io->sd->bs;
-
-    sector_t ns, len, offset;
-    ns = (ci->sector + PAGE_SECTOR) & PAGE_SECTOR_MASK;
-    if (ns - ci->sector > ci->sector_count)
-        len = ci->sector_count;
-    else
-        len = ns - ci->sector;
-
-    offset = 0;
-    while (ci->sector_count) {
-        SDEBUG("Clone Request %llx with %llx sectors\n", ci->sector, len);
-        ci->sector_count -= len;
+    sector_t start = sector_to_lpn(sdk, bio->bi_sector + unit_sectors(sdk) - 1);
+    sector_t end = sector_to_lpn(sdk, bio->bi_sector + bio_sectors(bio));
+    sector_t lpn;
 
-        clone = clone_bio(bio, ci->sector, &ci->idx, &offset, len, bs);
-        map_bio(clone, ci->io);
+    if (end <= start)
+        return 0;
 
-        if (ci->sector_count < PAGE_SECTOR)
-            len = ci->sector_count;
-        else
-            len = PAGE_SECTOR;
-        ci->sector += len;
+    // a volume would map a buffered unit again when writing it back
+    if (sdk->vol) {
+        for (lpn = start; lpn < end; lpn++)
+            wbuf_evict(sdk, lpn, true);
     }
-    return 0;
+    return unmap_phys_range(sdk->gd, start, end - start);
 }
 
 static void ss_prot_op(struct scsi_cmnd *scmd, unsigned int dif)
@@ -413,9 +414,8 @@ static int scsi_setup_flush_cmnd(struct scsi_device *sdp, struct request *rq)
 
 static void ss_make_request_fn(struct request_queue * q, struct bio * bio)
 {
-    struct gendisk * gdisk;
     struct ssd_disk * sdk;
-    struct clone_info ci;
+    ktime_t start;
     int error;
     BUG_ON(bio == NULL);
     /*if (bio->bi_flags & (1<<BIO_QUIET)) {
@@ -423,29 +423,52 @@ static void ss_make_request_fn(struct request_queue * q, struct bio * bio)
         return;
     }*/
 
-    if (bio->bi_bdev && !(bio->bi_flags & (1 << BIO_CLONED))) {
-        SDEBUG("Issue Rquest %llx %x sectors flg %lx\n", bio->bi_sector, bio_sectors(bio), bio->bi_flags);
-        gdisk = bio->bi_bdev->bd_disk;
-        sdk = ssd_disk(gdisk);
-        ci.bio = bio;
-        ci.io = alloc_io(sdk);
-        ci.io->sd = sdk;
-        ci.io->bio = bio;
-        ci.io->error = 0;
-        atomic_set(&ci.io->io_count, 1);
-        spin_lock_init(&ci.io->endio_lock);
-        ci.sector = bio->bi_sector;
-        ci.idx = bio->bi_idx;
-        ci.sector_count = bio_sectors(bio);
-        error = __clone_and_map(&ci);
-
-        // bio split done, drop the extra ref count
-        dec_pending(ci.io, error);
-    } else {
-        if (!bio->bi_bdev)
-            SDEBUG("Issue Rquest %llx %x sectors, no block dev\n", bio->bi_sector, bio_sectors(bio));
+    if (bio->bi_bdev && is_ss_disk(bio->bi_bdev->bd_disk) && (bio->bi_rw & REQ_DISCARD) &&
+            !(bio->bi_flags & (1 << BIO_CLONED))) {
+        sdk = ssd_disk(bio->bi_bdev->bd_disk);
+        error = ss_discard(sdk, bio);
+        if (sdk->vol)
+            bio_endio(bio, error);
+        else
+            blk_queue_bio(q, bio);
+    } else if (bio->bi_bdev && is_ss_disk(bio->bi_bdev->bd_disk) && !(bio->bi_flags & (1 << BIO_CLONED))) {
+        sdk = ssd_disk(bio->bi_bdev->bd_disk);
+
+        if (bio->bi_rw & (REQ_FLUSH | REQ_FUA)) {
+            start = ktime_get();
+            trace_sftl_flush(bio->bi_bdev->bd_disk->disk_name, SFTL_FLUSH_START,
+                    bio_sectors(bio), 0);
+            error = wbuf_drain(sdk);
+            // the devices of a volume are all flushed here, with its mapping
+            if (!error && sdk->vol && (bio->bi_rw & REQ_FLUSH))
+                error = ftl_map_sync(sdk);
+            trace_sftl_flush(bio->bi_bdev->bd_disk->disk_name, SFTL_FLUSH_DRAINED,
+                    bio_sectors(bio), error);
+            ftl_stat_inc(sdk, FTL_STAT_FLUSHES);
+            ftl_stat_add(sdk, FTL_STAT_FLUSH_NS, ktime_to_ns(ktime_sub(ktime_get(), start)));
+            if (error) {
+                bio_endio(bio, error);
+                return;
+            }
+            /*
+             * an empty flush goes to the device as it is, only the drain
+             * of the write buffer is in its latency
+             */
+            if (!bio_sectors(bio)) {
+                ftl_lat_record(sdk, LAT_FLUSH, LAT_NO_STALL,
+                        ktime_to_ns(ktime_sub(ktime_get(), start)));
+                if (sdk->vol)
+                    bio_endio(bio, 0);
+                else
+                    blk_queue_bio(q, bio);
+                return;
+            }
+        } else
+            start = ktime_get();
+
+        __ss_map_request(sdk, bio, start);
+    } else
         blk_queue_bio(q,bio);
-    }
 }
 
 /* Build a scsi command and initiate the block address, including the flash device address
@@ -456,7 +479,7 @@ static void ss_make_request_fn(struct request_queue * q, struct bio * bio)
 static int ss_prep_rq_fn(struct request_queue * q, struct request * rq)
 {
     struct scsi_device * sdp = q->queuedata;
-    struct ssd_disk * sdkp = ssd_disk(rq->rq_disk);
+    struct ssd_disk * sdkp;
     struct scsi_cmnd *SCpnt;
     struct gendisk *disk = rq->rq_disk;
     sector_t block = blk_rq_pos(rq);
@@ -467,6 +490,14 @@ static int ss_prep_rq_fn(struct request_queue * q, struct request * rq)
 
     BUG_ON(!sdp->host);
 
+    // requests of the backing disk are prepared by its own driver
+    if (!is_ss_disk(rq->rq_disk)) {
+        sdkp = queue_to_ssd(q);
+        BUG_ON(!sdkp);
+        return sdkp->old_prep_fn(q, rq);
+    }
+    sdkp = ssd_disk(rq->rq_disk);
+
     /*
      * Discard request come in as REQ_TYPE_FS but we turn them into
      * block PC requests to make life easier.
@@ -732,119 +763,437 @@ static const struct block_device_operations ss_fops = {
         .unlock_native_capacity = NULL,
 };
 
-static int find_and_init_disk(void)
+#define SS_MEMBER_MODE  (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/*
+ * The disk that uses request queue @q already, as the disk it is on or
+ * as another device of its volume. Called with ssd_mutex held.
+ */
+static struct ssd_disk * ss_queue_user(struct request_queue * q)
 {
-    int i, found = 0, partno;
-    struct block_device * bdev;
     struct ssd_disk * sdk;
+    unsigned int i;
+
+    list_for_each_entry(sdk, &ssd_list, list) {
+        if (sdk->gd->queue == q)
+            return sdk;
+        for (i = 1; sdk->vol && i < sdk->vol->nr_devs; i++) {
+            if (bdev_get_queue(sdk->vol->devs[i].bdev) == q)
+                return sdk;
+        }
+    }
+    return NULL;
+}
+
+/* the devices of a volume after the first one, that the disk is on */
+static void ss_put_members(struct block_device ** bdevs, unsigned int nr)
+{
+    unsigned int i;
+
+    for (i = 1; i < nr; i++) {
+        if (bdevs[i])
+            blkdev_put(bdevs[i], SS_MEMBER_MODE);
+    }
+}
+
+/*
+ * Attach a disk with the soft ftl to the scsi disk at @paths[0]. Every
+ * disk has its own cmt, gmd and workers; the backing disk must not
+ * already carry one, as the request queue is taken over. With @vol set
+ * the disk is a volume striped over all @nr devices of @paths, the others
+ * are opened exclusively and keep their own queues.
+ */
+static int ss_add_disk(char ** paths, unsigned int nr, bool vol)
+{
+    struct block_device * bdev, * bdevs[VOL_MAX_DEVS] = { NULL, };
+    u64 nr_pages[VOL_MAX_DEVS];
+    struct ssd_disk * sdk, * other;
     struct gendisk * gd, * oldgd;
     struct scsi_device * sdp;
     struct scsi_disk * sdkp;
+    const char * path = paths[0];
+    struct request_queue * q;
+    int index, partno, err;
+    unsigned int i, j;
 
-    for (i = 0; i < sizeof(ssds) / sizeof(ssds[0]) && i < SSD_MAJOR; i++) {
-        bdev = lookup_bdev(ssds[i]);
-        if (!IS_ERR_OR_NULL(bdev)) {
-            SDEBUG("%s as ssd wi soft-ftl found!\n", ssds[i]);
-            sdk = kzalloc(sizeof(struct ssd_disk), GFP_KERNEL);
-            INIT_LIST_HEAD(&sdk->mflush_list);
-            list_add(&sdk->list, &ssd_list);
-            sdk->bdev = bdev;
-            sdk->name = ssds[i];
-            gd = alloc_disk(SSD_MINORS);
-            if (!gd) {
-                printk(KERN_ERR "ss: cannot alloc gendisk!\n");
-                continue;
-            }
-            format_disk_name("ss", i, gd->disk_name, DISK_NAME_LEN);
-            SDEBUG("disk %s created\n", gd->disk_name);
-
-            oldgd = get_gendisk(bdev->bd_dev, &partno);
-            if (!oldgd)
-                printk(KERN_ERR "ss: cannot get gendisk associated with the block device!\n");
-            else {
-                gd->queue = oldgd->queue;
-                sdkp = scsi_disk(oldgd);
-                sdk->protection_type = sdkp->protection_type;
-                sdk->provisioning_mode = sdkp->provisioning_mode;
-                sdk->device = sdkp->device;
-            }
+    if (!nr || nr > VOL_MAX_DEVS) {
+        printk(KERN_ERR "ss: a volume has 1 to %u devices\n", VOL_MAX_DEVS);
+        return -EINVAL;
+    }
+    if (!is_power_of_2(map_pages) || ilog2(map_pages) > UNIT_MAX_SHIFT) {
+        printk(KERN_ERR "ss: a mapping unit is a power of two up to %u pages\n", 1 << UNIT_MAX_SHIFT);
+        return -EINVAL;
+    }
 
-            if (!gd->queue)
-                printk(KERN_ERR "ss: cannot get request queue !\n");
-            else {
-                sdk->old_make_request_fn = gd->queue->make_request_fn;
-                sdk->old_prep_fn = gd->queue->prep_rq_fn;
-                sdk->old_request_fn = gd->queue->request_fn;
-                gd->queue->make_request_fn = ss_make_request_fn;
-
-                mrf = sdk->old_make_request_fn;
-                if (mrf != blk_queue_bio)
-                    SDEBUG("make_request_fn is not blk_queue_bio!\n");
-
-                gd->queue->prep_rq_fn = ss_prep_rq_fn;
-                sdp = gd->queue->queuedata;
-                if (!sdp->host) {
-                    printk(KERN_ERR "ss: host in queue is null!\n");
-                    break;
-                }
-            }
+    bdev = lookup_bdev(path);
+    if (IS_ERR(bdev)) {
+        printk(KERN_ERR "ss: cannot find block device %s\n", path);
+        return PTR_ERR(bdev);
+    }
 
-            sdk->bs = bioset_create(MEMPOOL_SIZE, 0);
-            sdk->io_pool = mempool_create_slab_pool(MEMPOOL_SIZE, ss_io_cache);
+    oldgd = get_gendisk(bdev->bd_dev, &partno);
+    if (!oldgd || !oldgd->queue) {
+        printk(KERN_ERR "ss: cannot get gendisk associated with %s!\n", path);
+        err = -ENODEV;
+        goto out_bdev;
+    }
+    sdp = oldgd->queue->queuedata;
+    if (!sdp || !sdp->host) {
+        printk(KERN_ERR "ss: %s is not a scsi disk!\n", path);
+        err = -ENODEV;
+        goto out_bdev;
+    }
 
-            gd->fops = &ss_fops;
-            gd->major = ssd_major[i];
-            gd->first_minor = 0;
-            gd->minors = SSD_MINORS;
-            gd->private_data = &sdk->list;
-            set_capacity(gd, oldgd->part0.nr_sects);
-            sdk->gd = gd;
-            sdk->capacity = oldgd->part0.nr_sects;
+    mutex_lock(&ssd_mutex);
+    err = -ENODEV;
+    if (!ss_loaded)
+        goto out_unlock;
+
+    err = -EBUSY;
+    other = ss_queue_user(oldgd->queue);
+    if (other) {
+        printk(KERN_ERR "ss: %s already has soft-ftl disk %s\n", path,
+                other->gd->disk_name);
+        goto out_unlock;
+    }
 
-            add_disk(gd);
-            SDEBUG("disk %s added successfully!\n", gd->disk_name);
-            init_mapping_dir(gd);
+    err = -ENOSPC;
+    index = find_first_zero_bit(ssd_index, SSD_MAX_DISKS);
+    if (index >= SSD_MAX_DISKS)
+        goto out_unlock;
+
+    err = -ENOMEM;
+    sdk = kzalloc(sizeof(struct ssd_disk), GFP_KERNEL);
+    if (!sdk)
+        goto out_unlock;
+    INIT_LIST_HEAD(&sdk->list);
+    ftl_qos_init(sdk);
+    ftl_qos_set_rate(sdk, IO_GC, gc_rate);
+    ftl_qos_set_rate(sdk, IO_MAP, map_rate);
+    sdk->bdev_err = -ENODEV;    // not opened by the ftl yet
+    sdk->bdev = bdev;
+    sdk->index = index;
+    sdk->unit_shift = ilog2(map_pages);
+    atomic_set(&sdk->open_count, 0);
+    spin_lock_init(&sdk->open_lock);
+    sdk->name = kstrdup(path, GFP_KERNEL);
+    sdk->bs = bioset_create(MEMPOOL_SIZE, SS_BIO_PAD);
+    sdk->io_pool = mempool_create_slab_pool(MEMPOOL_SIZE, ss_io_cache);
+    gd = alloc_disk(SSD_MINORS);
+    if (!gd) {
+        printk(KERN_ERR "ss: cannot alloc gendisk!\n");
+        goto out_free;
+    }
+    sdk->gd = gd;
+    if (!sdk->name || !sdk->bs || !sdk->io_pool)
+        goto out_free;
+
+    format_disk_name("ss", index, gd->disk_name, DISK_NAME_LEN);
+    SDEBUG("%s as ssd wi soft-ftl found, disk %s created\n", path, gd->disk_name);
+
+    gd->queue = oldgd->queue;
+    sdkp = scsi_disk(oldgd);
+    sdk->protection_type = sdkp->protection_type;
+    sdk->provisioning_mode = sdkp->provisioning_mode;
+    sdk->device = sdkp->device;
+    sdk->old_make_request_fn = gd->queue->make_request_fn;
+    sdk->old_prep_fn = gd->queue->prep_rq_fn;
+    sdk->old_request_fn = gd->queue->request_fn;
+
+    mrf = sdk->old_make_request_fn;
+    if (mrf != blk_queue_bio)
+        SDEBUG("make_request_fn is not blk_queue_bio!\n");
+
+    gd->fops = &ss_fops;
+    gd->major = ssd_major;
+    gd->first_minor = index * SSD_MINORS;
+    gd->minors = SSD_MINORS;
+    gd->private_data = &sdk->list;
+    // in place, only whole units are mapped
+    sdk->capacity = oldgd->part0.nr_sects & ~(unit_sectors(sdk) - 1);
+
+    for (i = 1; i < nr; i++) {
+        bdevs[i] = blkdev_get_by_path(paths[i], SS_MEMBER_MODE, sdk);
+        if (IS_ERR(bdevs[i])) {
+            err = PTR_ERR(bdevs[i]);
+            bdevs[i] = NULL;
+            printk(KERN_ERR "ss: cannot open block device %s\n", paths[i]);
+            goto out_free;
+        }
 
-            found ++;
+        q = bdev_get_queue(bdevs[i]);
+        other = ss_queue_user(q);
+        for (j = 0; j < i && !other; j++) {
+            if (q == (j ? bdev_get_queue(bdevs[j]) : gd->queue))
+                other = sdk;
+        }
+        if (other) {
+            printk(KERN_ERR "ss: %s is in use by soft-ftl disk %s\n", paths[i],
+                    other->gd->disk_name);
+            err = -EBUSY;
+            goto out_free;
         }
+        nr_pages[i] = i_size_read(bdevs[i]->bd_inode) >> (PAGE_SECTOR_SHIFT + SECTOR_SHIFT);
     }
 
-    return found;
+    /* the disk is not added yet, the ftl does its io on the backing device */
+    err = ftl_io_open(sdk);
+    sdk->bdev_err = err;
+    if (err < 0) {
+        sdk->bdev = NULL;
+        printk(KERN_ERR "ss: cannot get block device %s!\n", path);
+        goto out_free;
+    }
+
+    if (vol) {
+        struct ftl_geo geo = {
+            .nr_channels = channels,
+            .nr_dies = dies,
+            .nr_planes = planes,
+            .block_shift = is_power_of_2(block_pages) ? ilog2(block_pages) : GEO_MAX_BLOCK_SHIFT + 1,
+        };
+
+        bdevs[0] = bdev;
+        nr_pages[0] = sdk->capacity >> PAGE_SECTOR_SHIFT;
+        err = ftl_vol_init(sdk, bdevs, nr_pages, nr, &geo, (block_map ? VOL_BMAP : 0) |
+                (compress ? VOL_PACK : 0) | (dedup ? VOL_DEDUP : 0));
+        if (err) {
+            printk(KERN_ERR "ss: cannot stripe %s over %u devices\n", gd->disk_name, nr);
+            goto out_free;
+        }
+    }
+    set_capacity(gd, sdk->capacity);
+
+    err = wbuf_init(sdk);
+    if (err) {
+        printk(KERN_ERR "ss: cannot init write buffer!\n");
+        goto out_free;
+    }
+
+    // the mapping dir is fully loaded before the disk takes any io
+    err = ftl_stats_init(sdk);
+    sdk->cmt.nr_shards = cmt_shards;
+    sdk->cmt.max_pages = cmt_pages;
+    if (!err)
+        err = init_mapping_dir(gd);
+    if (err) {
+        printk(KERN_ERR "ss: cannot load mapping dir of %s!\n", path);
+        wbuf_exit(sdk);
+        ftl_vol_exit(sdk);
+        exit_mapping_dir(gd);
+        goto out_free;
+    }
+
+    // the backing disk's own requests on the queue look up their sdk
+    list_add_rcu(&sdk->list, &ssd_list);
+    spin_lock_irq(gd->queue->queue_lock);
+    gd->queue->make_request_fn = ss_make_request_fn;
+    gd->queue->prep_rq_fn = ss_prep_rq_fn;
+    spin_unlock_irq(gd->queue->queue_lock);
+
+    add_disk(gd);
+    SDEBUG("disk %s added successfully!\n", gd->disk_name);
+    if (ss_stats_register(sdk))
+        printk(KERN_ERR "ss: cannot export stats of %s\n", gd->disk_name);
+
+    set_bit(index, ssd_index);
+    mutex_unlock(&ssd_mutex);
+    put_disk(oldgd);
+    printk(KERN_INFO "ss: %s on %s%s, %llu sectors\n", gd->disk_name, path,
+            nr > 1 ? " and more" : "", (unsigned long long)sdk->capacity);
+    return 0;
+
+out_free:
+    ftl_vol_exit(sdk);
+    ss_put_members(bdevs, nr);
+    ftl_stats_exit(sdk);
+    if (sdk->io_pool)
+        mempool_destroy(sdk->io_pool);
+    if (sdk->bs)
+        bioset_free(sdk->bs);
+    if (sdk->gd)
+        put_disk(sdk->gd);
+    // the reference of lookup_bdev went to the ftl if it opened the device,
+    // exit_mapping_dir closes it
+    if (sdk->bdev && !(sdk->bdev_err < 0))
+        ftl_io_close(sdk);
+    bdev = sdk->bdev && sdk->bdev_err < 0 ? sdk->bdev : NULL;
+    kfree(sdk->name);
+    kfree(sdk);
+out_unlock:
+    mutex_unlock(&ssd_mutex);
+out_bdev:
+    if (oldgd)
+        put_disk(oldgd);
+    if (bdev)
+        bdput(bdev);
+    return err;
+}
+
+/*
+ * Detach @sdk and give the request queue back to the backing disk. It
+ * fails while the disk is open, and leaves a volume attached if its
+ * mapping cannot be saved unless @force is set, as when the module goes.
+ * Called with ssd_mutex held.
+ */
+static int ss_remove_disk(struct ssd_disk * sdk, bool force)
+{
+    struct request_queue * q = sdk->gd->queue;
+    struct block_device * bdevs[VOL_MAX_DEVS];
+    struct block_device * whole;
+    unsigned int i, nr = 0;
+    int err;
+
+    spin_lock(&sdk->open_lock);
+    if (atomic_read(&sdk->open_count)) {
+        spin_unlock(&sdk->open_lock);
+        return -EBUSY;
+    }
+    sdk->removing = true;
+    spin_unlock(&sdk->open_lock);
+
+    // nothing is open, the buffered units are the last to change the mapping
+    if (sdk->vol) {
+        err = wbuf_drain(sdk);
+        if (!err)
+            err = save_mapping_dir(sdk->gd);
+        if (err && !force) {
+            spin_lock(&sdk->open_lock);
+            sdk->removing = false;
+            spin_unlock(&sdk->open_lock);
+            return err;
+        }
+    }
+
+    SDEBUG("%s freed\n", sdk->gd->disk_name);
+    ss_stats_unregister(sdk);
+    whole = bdget_disk(sdk->gd, 0);
+    del_gendisk(sdk->gd);
+    // an open that found the disk before del_gendisk runs ss_open under
+    // bd_mutex, wait it out so nothing touches sdk once it is freed
+    if (whole) {
+        mutex_lock(&whole->bd_mutex);
+        mutex_unlock(&whole->bd_mutex);
+        bdput(whole);
+    }
+    WARN_ON(atomic_read(&sdk->open_count));
+    wbuf_exit(sdk);
+
+    spin_lock_irq(q->queue_lock);
+    q->make_request_fn = sdk->old_make_request_fn;
+    q->prep_rq_fn = sdk->old_prep_fn;
+    spin_unlock_irq(q->queue_lock);
+    list_del_rcu(&sdk->list);
+    synchronize_rcu();
+
+    if (sdk->vol) {
+        nr = sdk->vol->nr_devs;
+        for (i = 0; i < nr; i++)
+            bdevs[i] = sdk->vol->devs[i].bdev;
+        ftl_vol_exit(sdk);
+        ss_put_members(bdevs, nr);
+    }
+    exit_mapping_dir(sdk->gd);
+    ftl_stats_exit(sdk);
+    bioset_free(sdk->bs);
+    mempool_destroy(sdk->io_pool);
+    put_disk(sdk->gd);
+    clear_bit(sdk->index, ssd_index);
+    kfree(sdk->name);
+    kfree(sdk);
+    return 0;
 }
 
 static void destroy_disk(void)
 {
-    struct list_head * ptr, *next;
-    struct ssd_disk * sdk = NULL;
-
-    list_for_each_safe(ptr, next, &ssd_list) {
-        sdk = list_entry(ptr, typeof(*sdk), list);
-        SDEBUG("%s freed\n", sdk->gd->disk_name);
-        exit_mapping_dir(sdk->gd);
-        sdk->gd->queue->make_request_fn = sdk->old_make_request_fn;
-        sdk->gd->queue->prep_rq_fn = sdk->old_prep_fn;
-        bioset_free(sdk->bs);
-        mempool_destroy(sdk->io_pool);
-        del_gendisk(sdk->gd);
-        list_del(ptr);
-        if (sdk == NULL)
-            printk(KERN_ERR "ss: null ssd_disk!\n");
-        else
-            kfree(sdk);
-    } 
+    struct ssd_disk * sdk, * next;
+
+    mutex_lock(&ssd_mutex);
+    ss_loaded = false;
+    list_for_each_entry_safe(sdk, next, &ssd_list, list) {
+        if (ss_remove_disk(sdk, true))
+            printk(KERN_ERR "ss: %s is still open!\n", sdk->gd->disk_name);
+    }
+    mutex_unlock(&ssd_mutex);
+}
+
+/*
+ * echo /dev/sdc > /sys/module/sftl/parameters/add attaches a disk to a
+ * backing device, echo /dev/sdc,/dev/sdd > .../add stripes one over both
+ * and echo ssb (or /dev/sdc) > .../remove detaches it
+ */
+static int ss_param_add(const char * val, const struct kernel_param * kp)
+{
+    char * buf, * s, * p, * paths[VOL_MAX_DEVS];
+    unsigned int nr = 0;
+    int err = -EINVAL;
+
+    buf = kstrdup(val, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    s = buf;
+    while ((p = strsep(&s, ", \t\n"))) {
+        if (!*p)
+            continue;
+        if (nr == VOL_MAX_DEVS) {
+            err = -E2BIG;
+            goto out;
+        }
+        paths[nr++] = p;
+    }
+    if (nr)
+        err = ss_add_disk(paths, nr, nr > 1);
+out:
+    kfree(buf);
+    return err;
+}
+
+static int ss_param_remove(const char * val, const struct kernel_param * kp)
+{
+    struct ssd_disk * sdk;
+    char * buf, * name;
+    int err = -ENODEV;
+
+    buf = kstrdup(val, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    name = strim(buf);
+
+    mutex_lock(&ssd_mutex);
+    list_for_each_entry(sdk, &ssd_list, list) {
+        if (!strcmp(sdk->gd->disk_name, name) || !strcmp(sdk->name, name)) {
+            err = ss_remove_disk(sdk, false);
+            break;
+        }
+    }
+    mutex_unlock(&ssd_mutex);
+
+    kfree(buf);
+    return err;
 }
 
+static struct kernel_param_ops ss_add_ops = {
+    .set = ss_param_add,
+};
+
+static struct kernel_param_ops ss_remove_ops = {
+    .set = ss_param_remove,
+};
+
+module_param_cb(add, &ss_add_ops, NULL, 0200);
+MODULE_PARM_DESC(add, "attach a disk to the block device written, or stripe it over a list");
+module_param_cb(remove, &ss_remove_ops, NULL, 0200);
+MODULE_PARM_DESC(remove, "detach the disk, by its name or backing device, written");
 
 static int __init init_ssd(void)
 {
-    int major, i, err = 0;
-    major = 0;
+    unsigned int i, found = 0;
+    int err = 0;
 
-    for (i = 0; i < SSD_MAJOR; i++)
-        if ((ssd_major[i] = register_blkdev(ssd_major[i], "ss")) >= 0)
-            major ++;
-    if (!major)
-        return -ENODEV;
+    ssd_major = register_blkdev(0, "ss");
+    if (ssd_major < 0)
+        return ssd_major;
 
     ss_cdb_cache = kmem_cache_create("ss_cdb_cache", CDB_SIZE, 0, 0, NULL);
     ss_io_cache = kmem_cache_create("ss_io_cache", sizeof(struct ss_io), 0, 0, NULL);
@@ -866,34 +1215,51 @@ static int __init init_ssd(void)
         goto err_io;
     }
 
-    if (!find_and_init_disk()) {
-        err = -ENODEV;
+    ss_debugfs_init();
+
+    if (selftest) {
+        err = ss_selftest(selftest, ss_io_cache, selftest_ops, selftest_threads);
+        // nothing to stay loaded for
+        if (!err)
+            err = -EAGAIN;
         goto err_pool;
     }
 
+    ss_loaded = true;
+    if (stripe && nr_devices) {
+        if (!ss_add_disk(devices, nr_devices, true))
+            found ++;
+    } else {
+        for (i = 0; i < nr_devices; i++) {
+            if (!ss_add_disk(&devices[i], 1, false))
+                found ++;
+        }
+    }
+    // more disks can still be attached through the add parameter
+    if (!found)
+        printk(KERN_INFO "ss: no soft-ftl disk attached\n");
+
     return 0;
 err_pool:
+    ss_debugfs_exit();
     mempool_destroy(ss_cdb_pool);
 err_io:
     kmem_cache_destroy(ss_io_cache);
 err_cache:
     kmem_cache_destroy(ss_cdb_cache);
 err_out:
-    for (i = 0; i < SSD_MAJOR; i++)
-        unregister_blkdev(ssd_major[i], "ss");
+    unregister_blkdev(ssd_major, "ss");
     return err;
 }
 
 static void __exit exit_ssd(void)
 {
-    int i;
-
     mempool_destroy(ss_cdb_pool);
     kmem_cache_destroy(ss_cdb_cache);
     destroy_disk();
+    ss_debugfs_exit();
     kmem_cache_destroy(ss_io_cache);
-    for (i = 0; i < SSD_MAJOR; i ++)
-        unregister_blkdev(ssd_major[i], "ss");
+    unregister_blkdev(ssd_major, "ss");
 }
 
 module_init(init_ssd);
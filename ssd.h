@@ -19,11 +19,11 @@
 #ifndef _SSD_H_
 #define _SSD_H_
 
+#ifdef __KERNEL__
 #include <linux/list.h>
+#endif
 
-#define SSD_DEBUG
-
-#define SSD_MAJOR 4
+#define SSD_MAX_DISKS 64
 #define SSD_MINORS 16
 
 #define SSD_TIMEOUT (30 * HZ)
@@ -50,32 +50,146 @@ enum {
     #define SDEBUG(fmt, args...)
 #endif
 
+struct ftl_volume;
+
 struct ssd_disk {
     struct list_head list;
-    struct list_head mflush_list;
     struct gendisk * gd;
     struct scsi_device * device;
     struct block_device * bdev;
-    const char * name;
+    const char * name;          // path of the backing device
+    struct ftl_volume * vol;    // flash devices striped over, NULL if in place
+    int node;                   // numa node of the backing device, its metadata is there
+    int index;                  // of the disk name and minors
+    atomic_t open_count;
+    spinlock_t open_lock;       // orders opens against removal
+    bool removing;              // refuse new opens, the disk is being torn down
     make_request_fn * old_make_request_fn;
     prep_rq_fn * old_prep_fn;
     request_fn_proc * old_request_fn;
     u8 protection_type;
     u8 provisioning_mode;
     sector_t capacity;
+    unsigned int unit_shift;    // flash pages of a mapping unit, log2, an lpn is a unit
     struct hw_meta_root root;
     struct global_mapping_dir gmt;
     struct cached_mapping_table cmt;
+    unsigned long * discarded;      // pages discarded since attach, a bit each
+    spinlock_t discard_lock;
+    struct mapping_prefetch mpf;
+    struct write_buffer wb;
+    struct ftl_stats __percpu * stats;
+    struct ftl_latency __percpu * lat;
+    struct ftl_qos qos;
+    struct kobject * stats_kobj;    // sysfs dir of the counters
+    struct dentry * debugfs;        // debugfs dir of the disk
     int bdev_err;
 
     struct bio_set * bs;
     mempool_t * io_pool;
 };
 
+/*
+ * a bio of the disk, completed when all the clones it is split into are.
+ * It is split once the mapping pages of all its pages are in the cmt,
+ * until then it waits on the read of the first missing one.
+ */
+#define SS_IO_CMT_MISS  0x1     /* a mapping page had to be read */
+#define SS_IO_GC_STALL  0x2     /* a page write waited for a free block */
+
+struct ss_io {
+    int error;
+    atomic_t io_count;
+    unsigned int flags;
+    ktime_t start_time;
+    struct bio * bio;
+    struct ssd_disk * sd;
+    spinlock_t endio_lock;
+    struct map_waiter wait;
+    pfn_t map_lpn;              // where map_io goes on looking for mapping pages
+    struct work_struct work;    // completes a fua write once its mapping is synced
+};
+
+/*
+ * the bios of a disk come from its bio_set with the ppn in front of
+ * them, a clone on a volume keeps the flash page it was mapped to for
+ * its completion, a write the unit it replaces as well. A write held
+ * back by the die dispatcher keeps its own end_io there while the
+ * dispatcher's is in the bio.
+ */
+struct ss_clone {
+    pfn_t ppn;
+    pfn_t lpn, old;         // see ftl_map_done
+    struct ssd_disk * sdk;
+    bio_end_io_t * end_io;
+    struct bio bio;
+};
+
+#define SS_BIO_PAD  offsetof(struct ss_clone, bio)
+
+static inline struct ss_clone * ss_clone(struct bio * bio)
+{
+    return container_of(bio, struct ss_clone, bio);
+}
+
+static inline pfn_t * clone_ppn(struct bio * bio)
+{
+    return &ss_clone(bio)->ppn;
+}
+
+struct clone_info {
+    struct bio * bio;
+    struct ss_io * io;
+    sector_t sector;
+    sector_t sector_count;
+    unsigned int idx;
+};
+
 static inline struct ssd_disk * ssd_disk(struct gendisk * disk) {
     return container_of(disk->private_data, struct ssd_disk, list);
 }
 
+/* count a bio sent to the backing device */
+static inline void ss_account_io(struct ssd_disk * sdk, struct bio * bio)
+{
+    if (bio_data_dir(bio) == WRITE)
+        ftl_stat_add(sdk, FTL_STAT_FLASH_WRITE_BYTES, bio->bi_size);
+    else
+        ftl_stat_add(sdk, FTL_STAT_FLASH_READ_BYTES, bio->bi_size);
+}
+
+#ifdef __KERNEL__
+/*
+ * Submit a bio the caller is going to wait for. Inside our own
+ * make_request_fn, generic_make_request only queues the bio on
+ * current->bio_list until we return, so it is given to the queue directly.
+ * The queue of the disk has ours in it, the other devices of a volume
+ * keep their own.
+ */
+static inline void ss_submit_bio(struct ssd_disk * sdk, struct bio * bio)
+{
+    struct request_queue * q = bdev_get_queue(bio->bi_bdev);
+
+    if (!current->bio_list)
+        generic_make_request(bio);
+    else if (q == bdev_get_queue(sdk->bdev))
+        sdk->old_make_request_fn(q, bio);
+    else
+        q->make_request_fn(q, bio);
+}
+#else
+static inline void ss_submit_bio(struct ssd_disk * sdk, struct bio * bio)
+{
+    generic_make_request(bio);
+}
+#endif
+
+static inline void submit_sync_bio(struct ssd_disk * sdk, struct bio * bio)
+{
+    ss_account_io(sdk, bio);
+    ss_submit_bio(sdk, bio);
+}
+
 static inline sector_t to_sector(unsigned long n)
 {
     return (n >> SECTOR_SHIFT);
@@ -86,4 +200,46 @@ static inline unsigned long to_bytes(sector_t n)
     return (n << SECTOR_SHIFT);
 }
 
+/*
+ * An lpn is a mapping unit of 1 << unit_shift flash pages, set when the
+ * disk is formatted; a mapping entry, a cmt slot and a write buffer entry
+ * each cover one.
+ */
+static inline unsigned int unit_sector_shift(struct ssd_disk * sdk)
+{
+    return PAGE_SECTOR_SHIFT + sdk->unit_shift;
+}
+
+static inline sector_t unit_sectors(struct ssd_disk * sdk)
+{
+    return (sector_t)1 << unit_sector_shift(sdk);
+}
+
+static inline pfn_t sector_to_lpn(struct ssd_disk * sdk, sector_t sector)
+{
+    return sector >> unit_sector_shift(sdk);
+}
+
+static inline sector_t lpn_to_sector(struct ssd_disk * sdk, pfn_t lpn)
+{
+    return (sector_t)lpn << unit_sector_shift(sdk);
+}
+
+extern struct bio * clone_bio(struct bio * bio, sector_t sector, unsigned int * idx,
+        sector_t * offset, sector_t len, struct bio_set * bs);
+extern void copy_bio_range(struct bio * bio, unsigned int * idx, sector_t * offset,
+        sector_t len, char * buf, int rw);
+extern bool zero_data(const void * data, size_t len);
+extern bool zero_bio_range(struct bio * bio, unsigned int * idx, sector_t * offset, sector_t len);
+extern void __ss_map_request(struct ssd_disk * sdk, struct bio * bio, ktime_t start);
+extern void ss_map_request(struct ssd_disk * sdk, struct bio * bio);
+#ifdef __KERNEL__
+extern int ss_stats_register(struct ssd_disk * sdk);
+extern void ss_stats_unregister(struct ssd_disk * sdk);
+extern void ss_debugfs_init(void);
+extern void ss_debugfs_exit(void);
+extern int ss_selftest(const char * path, struct kmem_cache * io_cache, unsigned long ops,
+        unsigned int max_threads);
+#endif
+
 #endif
@@ -0,0 +1,386 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  stats.c
+ *
+ *    Description:  per cpu event counters and latency histograms of a disk.
+ *                  The module exports the counters as one sysfs file each
+ *                  under /sys/block/<disk>/ftl/ and together with some
+ *                  ratios in debugfs, sftl/<disk>/stats. The histograms
+ *                  are in sftl/<disk>/latency.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#ifdef __KERNEL__
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#endif
+
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+
+const char * const ftl_stat_names[FTL_STAT_NR] = {
+    [FTL_STAT_CMT_HITS]         = "cmt_hits",
+    [FTL_STAT_CMT_MISSES]       = "cmt_misses",
+    [FTL_STAT_CMT_PAGES]        = "cmt_pages",
+    [FTL_STAT_CMT_EVICTIONS]    = "cmt_evictions",
+    [FTL_STAT_MAP_READS]        = "map_reads",
+    [FTL_STAT_MAP_QUEUED]       = "map_queued",
+    [FTL_STAT_HOST_READS]       = "host_reads",
+    [FTL_STAT_HOST_WRITES]      = "host_writes",
+    [FTL_STAT_HOST_READ_BYTES]  = "host_read_bytes",
+    [FTL_STAT_HOST_WRITE_BYTES] = "host_write_bytes",
+    [FTL_STAT_CLONES]           = "clones",
+    [FTL_STAT_UNMAPPED_READS]   = "unmapped_reads",
+    [FTL_STAT_FLASH_READ_BYTES] = "flash_read_bytes",
+    [FTL_STAT_FLASH_WRITE_BYTES] = "flash_write_bytes",
+    [FTL_STAT_FLUSHES]          = "flushes",
+    [FTL_STAT_FLUSH_NS]         = "flush_ns",
+    [FTL_STAT_GC_COPIES]        = "gc_copies",
+    [FTL_STAT_GC_ERASES]        = "gc_erases",
+    [FTL_STAT_GC_STALLS]        = "gc_stalls",
+    [FTL_STAT_DIE_WAITS]        = "die_waits",
+    [FTL_STAT_GC_SUSPENDS]      = "gc_suspends",
+    [FTL_STAT_QOS_THROTTLES]    = "qos_throttles",
+    [FTL_STAT_BMAP_MERGES]      = "bmap_merges",
+    [FTL_STAT_BMAP_BREAKS]      = "bmap_breaks",
+    [FTL_STAT_PACKED_UNITS]     = "packed_units",
+    [FTL_STAT_PACKED_PAGES]     = "packed_pages",
+    [FTL_STAT_DEDUP_HITS]       = "dedup_hits",
+    [FTL_STAT_DEDUP_MISMATCHES] = "dedup_mismatches",
+    [FTL_STAT_ZERO_UNITS]       = "zero_units",
+    [FTL_STAT_MAP_CRC_ERRORS]   = "map_crc_errors",
+};
+
+const char * const ftl_lat_op_names[LAT_OPS] = {
+    [LAT_READ]  = "read",
+    [LAT_WRITE] = "write",
+    [LAT_FLUSH] = "flush",
+};
+
+const char * const ftl_lat_stall_names[LAT_STALLS] = {
+    [LAT_NO_STALL]  = "no_stall",
+    [LAT_CMT_MISS]  = "cmt_miss",
+    [LAT_GC_STALL]  = "gc_stall",
+};
+
+int ftl_stats_init(struct ssd_disk * sdk)
+{
+    sdk->stats = alloc_percpu(struct ftl_stats);
+    sdk->lat = alloc_percpu(struct ftl_latency);
+    if (!sdk->stats || !sdk->lat) {
+        printk(KERN_ERR "ftl: cannot alloc stats of %s\n", sdk->name);
+        ftl_stats_exit(sdk);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void ftl_stats_exit(struct ssd_disk * sdk)
+{
+    if (sdk->stats)
+        free_percpu(sdk->stats);
+    if (sdk->lat)
+        free_percpu(sdk->lat);
+    sdk->stats = NULL;
+    sdk->lat = NULL;
+}
+
+/* the sum over all cpus, not a snapshot: counters may move while read */
+u64 ftl_stat_read(struct ssd_disk * sdk, int item)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(sdk->stats, cpu)->cnt[item];
+    return sum;
+}
+
+static unsigned int lat_bucket(u64 ns)
+{
+    u64 v = ns >> LAT_UNIT_SHIFT;
+    unsigned int e, b;
+
+    if (v < (1 << LAT_SUB_SHIFT))
+        return v;
+
+    // the power of two of v and the next LAT_SUB_SHIFT bits below it
+    e = fls64(v) - 1;
+    b = ((e - LAT_SUB_SHIFT + 1) << LAT_SUB_SHIFT) |
+        ((v >> (e - LAT_SUB_SHIFT)) & ((1 << LAT_SUB_SHIFT) - 1));
+    return min_t(unsigned int, b, LAT_BUCKETS - 1);
+}
+
+/* the lowest latency of bucket @b */
+u64 ftl_lat_bucket_ns(unsigned int b)
+{
+    unsigned int g = b >> LAT_SUB_SHIFT;
+
+    if (!g)
+        return (u64)b << LAT_UNIT_SHIFT;
+    return ((u64)((1 << LAT_SUB_SHIFT) | (b & ((1 << LAT_SUB_SHIFT) - 1))) << (g - 1))
+        << LAT_UNIT_SHIFT;
+}
+
+void ftl_lat_record(struct ssd_disk * sdk, int op, int stall, u64 ns)
+{
+    this_cpu_inc(sdk->lat->h[op][stall].buckets[lat_bucket(ns)]);
+    this_cpu_add(sdk->lat->h[op][stall].sum_ns, ns);
+}
+
+void ftl_lat_read(struct ssd_disk * sdk, int op, int stall, struct ftl_lat_hist * sum)
+{
+    struct ftl_lat_hist * h;
+    int cpu, b;
+
+    memset(sum, 0, sizeof(struct ftl_lat_hist));
+    for_each_possible_cpu(cpu) {
+        h = &per_cpu_ptr(sdk->lat, cpu)->h[op][stall];
+        sum->sum_ns += h->sum_ns;
+        for (b = 0; b < LAT_BUCKETS; b++)
+            sum->buckets[b] += h->buckets[b];
+    }
+}
+
+/*
+ * the latency @permyriad / 10000 of the requests in @h stay within, as
+ * the upper bound of its bucket. Zero for an empty histogram.
+ */
+u64 ftl_lat_percentile(const struct ftl_lat_hist * h, unsigned int permyriad)
+{
+    u64 total = 0, target, seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+        total += h->buckets[b];
+    if (!total)
+        return 0;
+
+    target = div64_u64(total * permyriad + 9999, 10000);
+    for (b = 0; b < LAT_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= target)
+            break;
+    }
+    return ftl_lat_bucket_ns(b < LAT_BUCKETS - 1 ? b + 1 : b);
+}
+
+#ifdef __KERNEL__
+
+static struct dentry * ss_debugfs_root;
+
+struct ftl_stat_attr {
+    struct kobj_attribute attr;
+    int item;
+};
+
+static struct ftl_stat_attr ftl_stat_attrs[FTL_STAT_NR];
+static struct attribute * ftl_stat_attr_list[FTL_STAT_NR + 1];
+
+static struct attribute_group ftl_stat_group = {
+    .attrs = ftl_stat_attr_list,
+};
+
+/* the ftl dir is a child of the disk */
+static struct ssd_disk * kobj_to_sdk(struct kobject * kobj)
+{
+    struct device * dev = container_of(kobj->parent, struct device, kobj);
+
+    return ssd_disk(dev_to_disk(dev));
+}
+
+static ssize_t ftl_stat_show(struct kobject * kobj, struct kobj_attribute * attr, char * buf)
+{
+    struct ftl_stat_attr * sa = container_of(attr, struct ftl_stat_attr, attr);
+
+    return sprintf(buf, "%llu\n", (unsigned long long)ftl_stat_read(kobj_to_sdk(kobj), sa->item));
+}
+
+/* @a / @b with two decimals */
+static void seq_ratio(struct seq_file * m, const char * name, u64 a, u64 b)
+{
+    u64 r = b ? div64_u64(a * 100, b) : 0;
+
+    seq_printf(m, "%-20s %llu.%02llu\n", name, r / 100, r % 100);
+}
+
+static int ss_stats_show(struct seq_file * m, void * v)
+{
+    struct ssd_disk * sdk = m->private;
+    u64 val[FTL_STAT_NR];
+    int i;
+
+    for (i = 0; i < FTL_STAT_NR; i++) {
+        val[i] = ftl_stat_read(sdk, i);
+        seq_printf(m, "%-20s %llu\n", ftl_stat_names[i], val[i]);
+    }
+
+    seq_ratio(m, "cmt_hit_percent", val[FTL_STAT_CMT_HITS] * 100,
+            val[FTL_STAT_CMT_HITS] + val[FTL_STAT_CMT_MISSES]);
+    seq_ratio(m, "clones_per_bio", val[FTL_STAT_CLONES],
+            val[FTL_STAT_HOST_READS] + val[FTL_STAT_HOST_WRITES]);
+    seq_ratio(m, "flush_avg_us", val[FTL_STAT_FLUSH_NS], val[FTL_STAT_FLUSHES] * 1000);
+    seq_ratio(m, "write_amp", val[FTL_STAT_FLASH_WRITE_BYTES], val[FTL_STAT_HOST_WRITE_BYTES]);
+    return 0;
+}
+
+static const unsigned int lat_percentiles[] = { 5000, 9000, 9900, 9990, 9999 };
+
+/*
+ * a summary line for each kind of request that was seen, then the
+ * non-empty buckets of them with the lowest latency of each
+ */
+static int ss_latency_show(struct seq_file * m, void * v)
+{
+    struct ssd_disk * sdk = m->private;
+    struct ftl_lat_hist * h;
+    int op, stall, i, b;
+    u64 count;
+
+    h = kmalloc(sizeof(struct ftl_lat_hist) * LAT_OPS * LAT_STALLS, GFP_KERNEL);
+    if (!h)
+        return -ENOMEM;
+
+    seq_printf(m, "%-6s %-9s %10s %10s %10s %10s %10s %10s %10s\n", "op", "stall",
+            "count", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "p999_ns", "p9999_ns");
+    for (op = 0; op < LAT_OPS; op++) {
+        for (stall = 0; stall < LAT_STALLS; stall++) {
+            struct ftl_lat_hist * lh = &h[op * LAT_STALLS + stall];
+
+            ftl_lat_read(sdk, op, stall, lh);
+            for (count = 0, b = 0; b < LAT_BUCKETS; b++)
+                count += lh->buckets[b];
+            if (!count)
+                continue;
+            seq_printf(m, "%-6s %-9s %10llu %10llu", ftl_lat_op_names[op],
+                    ftl_lat_stall_names[stall], count, div64_u64(lh->sum_ns, count));
+            for (i = 0; i < ARRAY_SIZE(lat_percentiles); i++)
+                seq_printf(m, " %10llu", ftl_lat_percentile(lh, lat_percentiles[i]));
+            seq_putc(m, '\n');
+        }
+    }
+
+    seq_putc(m, '\n');
+    for (op = 0; op < LAT_OPS; op++) {
+        for (stall = 0; stall < LAT_STALLS; stall++) {
+            struct ftl_lat_hist * lh = &h[op * LAT_STALLS + stall];
+
+            for (b = 0; b < LAT_BUCKETS; b++) {
+                if (lh->buckets[b])
+                    seq_printf(m, "%s %s %llu %llu\n", ftl_lat_op_names[op],
+                            ftl_lat_stall_names[stall], ftl_lat_bucket_ns(b), lh->buckets[b]);
+            }
+        }
+    }
+
+    kfree(h);
+    return 0;
+}
+
+static int ss_latency_open(struct inode * inode, struct file * file)
+{
+    return single_open(file, ss_latency_show, inode->i_private);
+}
+
+static const struct file_operations ss_latency_fops = {
+    .owner      = THIS_MODULE,
+    .open       = ss_latency_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static int ss_stats_open(struct inode * inode, struct file * file)
+{
+    return single_open(file, ss_stats_show, inode->i_private);
+}
+
+static const struct file_operations ss_stats_fops = {
+    .owner      = THIS_MODULE,
+    .open       = ss_stats_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+/*
+ * Export the counters of an added disk. Without debugfs only the sysfs
+ * files are there.
+ */
+int ss_stats_register(struct ssd_disk * sdk)
+{
+    int i, err;
+
+    for (i = 0; i < FTL_STAT_NR; i++) {
+        sysfs_attr_init(&ftl_stat_attrs[i].attr.attr);
+        ftl_stat_attrs[i].attr.attr.name = ftl_stat_names[i];
+        ftl_stat_attrs[i].attr.attr.mode = S_IRUGO;
+        ftl_stat_attrs[i].attr.show = ftl_stat_show;
+        ftl_stat_attrs[i].item = i;
+        ftl_stat_attr_list[i] = &ftl_stat_attrs[i].attr.attr;
+    }
+
+    sdk->stats_kobj = kobject_create_and_add("ftl", &disk_to_dev(sdk->gd)->kobj);
+    if (!sdk->stats_kobj)
+        return -ENOMEM;
+
+    err = sysfs_create_group(sdk->stats_kobj, &ftl_stat_group);
+    if (err) {
+        kobject_put(sdk->stats_kobj);
+        sdk->stats_kobj = NULL;
+        return err;
+    }
+
+    if (ss_debugfs_root) {
+        sdk->debugfs = debugfs_create_dir(sdk->gd->disk_name, ss_debugfs_root);
+        if (IS_ERR_OR_NULL(sdk->debugfs))
+            sdk->debugfs = NULL;
+        else {
+            debugfs_create_file("stats", S_IRUGO, sdk->debugfs, sdk, &ss_stats_fops);
+            debugfs_create_file("latency", S_IRUGO, sdk->debugfs, sdk, &ss_latency_fops);
+        }
+    }
+
+    return 0;
+}
+
+void ss_stats_unregister(struct ssd_disk * sdk)
+{
+    debugfs_remove_recursive(sdk->debugfs);
+    sdk->debugfs = NULL;
+
+    if (sdk->stats_kobj) {
+        sysfs_remove_group(sdk->stats_kobj, &ftl_stat_group);
+        kobject_put(sdk->stats_kobj);
+        sdk->stats_kobj = NULL;
+    }
+}
+
+void ss_debugfs_init(void)
+{
+    ss_debugfs_root = debugfs_create_dir("sftl", NULL);
+    if (IS_ERR_OR_NULL(ss_debugfs_root)) {
+        printk(KERN_ERR "ss: no debugfs, stats are in sysfs only\n");
+        ss_debugfs_root = NULL;
+    }
+}
+
+void ss_debugfs_exit(void)
+{
+    debugfs_remove_recursive(ss_debugfs_root);
+    ss_debugfs_root = NULL;
+}
+
+#endif
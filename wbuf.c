@@ -0,0 +1,780 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  wbuf.c
+ *
+ *    Description:  dram write buffer. Sub-unit writes are absorbed here and
+ *                  merged into full mapping units, which are written back by
+ *                  a worker so the flash only sees whole unit programs.
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 10:12:31 AM
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#include "ftl_compat.h"
+
+#include "ftl.h"
+#include "wbuf.h"
+#include "ssd.h"
+#include "alloc.h"
+#include "pack.h"
+#include "dedup.h"
+#include "sftl_trace.h"
+
+static void wbuf_bio_destructor(struct bio * bio)
+{
+    struct bio_set * bs = bio->bi_private;
+
+    bio_free(bio, bs);
+}
+
+/*
+ * the lock of the write buffer should be held
+ */
+static struct wbuf_page * wbuf_lookup(struct write_buffer * wb, pfn_t lpn)
+{
+    struct wbuf_page * wp;
+
+    list_for_each_entry(wp, &wb->hash[WBUF_HASH(lpn)], hlist) {
+        if (wp->lpn == lpn)
+            return wp;
+    }
+
+    return NULL;
+}
+
+static bool wbuf_pending(struct write_buffer * wb, pfn_t lpn)
+{
+    unsigned long flags;
+    bool ret;
+
+    spin_lock_irqsave(&wb->lock, flags);
+    ret = wbuf_lookup(wb, lpn) != NULL;
+    spin_unlock_irqrestore(&wb->lock, flags);
+
+    return ret;
+}
+
+static struct wbuf_page * wbuf_alloc_page(struct ssd_disk * sdk, pfn_t lpn, bool zero)
+{
+    struct wbuf_page * wp = kmalloc(sizeof(struct wbuf_page), GFP_NOIO);
+
+    if (!wp)
+        return NULL;
+
+    wp->data = alloc_pages(GFP_NOIO | __GFP_ZERO, sdk->unit_shift);
+    if (!wp->data) {
+        kfree(wp);
+        return NULL;
+    }
+
+    INIT_LIST_HEAD(&wp->list);
+    wp->lpn = lpn;
+    wp->ppn = 0;
+    wp->old = 0;
+    bitmap_zero(wp->valid, UNIT_MAX_SECTORS);
+    wp->wflags = zero ? WB_FLG_ZERO : 0;
+    wp->error = 0;
+    wp->sdk = sdk;
+
+    return wp;
+}
+
+static void wbuf_destroy_page(struct ssd_disk * sdk, struct wbuf_page * wp)
+{
+    __free_pages(wp->data, sdk->unit_shift);
+    kfree(wp);
+}
+
+/*
+ * the lock of the write buffer should be held, the page should already
+ * be off the partial and full lists
+ */
+static void wbuf_free_page(struct write_buffer * wb, struct wbuf_page * wp)
+{
+    list_del(&wp->hlist);
+    list_del(&wp->age);
+    wb->nents --;
+    wbuf_destroy_page(wp->sdk, wp);
+}
+
+/* a bio of the whole unit in @page, at flash page @ppn */
+static struct bio * wbuf_alloc_bio(struct ssd_disk * sdk, struct page * page, int rw, pfn_t ppn,
+        bio_end_io_t bio_end, void * priv)
+{
+    unsigned int i, nr = HW_TO_MEM_PAGE << sdk->unit_shift;
+    struct bio * bio = bio_alloc_bioset(GFP_NOIO, nr, sdk->bs);
+
+    if (!bio)
+        return NULL;
+
+    bio->bi_sector = ppn_sector(sdk, ppn);
+    bio->bi_size = to_bytes(unit_sectors(sdk));
+    bio->bi_vcnt = nr;
+    for (i = 0; i < nr; i++) {
+        bio->bi_io_vec[i].bv_page = nth_page(page, i);
+        bio->bi_io_vec[i].bv_offset = 0;
+        bio->bi_io_vec[i].bv_len = MEM_PAGE_SIZE;
+    }
+    bio->bi_bdev = ppn_bdev(sdk, ppn);
+    bio->bi_rw = rw;
+    bio->bi_idx = 0;
+    bio->bi_destructor = wbuf_bio_destructor;
+
+    bio->bi_end_io = bio_end;
+    bio->bi_private = priv;
+    bio->bi_flags |= (1 << BIO_CLONED);
+
+    return bio;
+}
+
+static void wbuf_read_endio(struct bio * bio, int error)
+{
+    struct wbuf_page * wp = bio->bi_private;
+
+    wp->error = error;
+    bio->bi_private = wp->sdk->bs;
+    bio_put(bio);
+    complete(&wp->done);
+}
+
+static void wbuf_write_endio(struct bio * bio, int error)
+{
+    struct wbuf_page * wp = bio->bi_private;
+    struct ssd_disk * sdk = wp->sdk;
+    struct write_buffer * wb = &sdk->wb;
+    unsigned long flags;
+
+    bio->bi_private = sdk->bs;
+    bio_put(bio);
+    if (wp->ppn) {
+        if (!error && sdk->vol->dedup)
+            ftl_dedup_add(sdk, wp->ppn, wp->fp);
+        ftl_map_done(sdk, wp->lpn, wp->ppn, wp->old, error);
+        ftl_write_done(sdk, wp->ppn);
+    }
+
+    spin_lock_irqsave(&wb->lock, flags);
+    if (error) {
+        printk(KERN_ERR "ss: write back of unit %x failed %d\n", wp->lpn, error);
+        wb->error = error;
+        wb->errors ++;
+    }
+    wbuf_free_page(wb, wp);
+    spin_unlock_irqrestore(&wb->lock, flags);
+
+    wake_up_all(&wb->wait);
+}
+
+/* the write back of @wp failed with wp->error */
+static void wbuf_fail(struct write_buffer * wb, struct wbuf_page * wp)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&wb->lock, flags);
+    printk(KERN_ERR "ss: cannot write back unit %x, error %d\n", wp->lpn, wp->error);
+    wb->error = wp->error;
+    wb->errors ++;
+    wbuf_free_page(wb, wp);
+    spin_unlock_irqrestore(&wb->lock, flags);
+    wake_up_all(&wb->wait);
+}
+
+/* @wp is on the flash already and needs no program */
+static void wbuf_done(struct write_buffer * wb, struct wbuf_page * wp)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&wb->lock, flags);
+    wbuf_free_page(wb, wp);
+    spin_unlock_irqrestore(&wb->lock, flags);
+    wake_up_all(&wb->wait);
+}
+
+/* replace the packed page read into @page by unit @lpn decompressed out of it */
+static int wbuf_unpack(pfn_t lpn, struct page ** page)
+{
+    struct page * unit = alloc_page(GFP_NOIO);
+    int err;
+
+    if (!unit)
+        return -ENOMEM;
+    err = pack_unpack(page_address(*page), lpn, page_address(unit));
+    __free_page(*page);
+    *page = unit;
+    return err;
+}
+
+/*
+ * Fill the sectors of @wp that are not in the buffer from the flash. On
+ * a volume the unit is read from where it is mapped. Returns wp->error.
+ */
+static int wbuf_fill(struct ssd_disk * sdk, struct wbuf_page * wp)
+{
+    struct bio * bio = NULL;
+    struct page * old;
+    char * src, * dst;
+    unsigned int i, nr = unit_sectors(sdk);
+    pfn_t ppn = inplace_ppn(sdk, wp->lpn), held = 0;
+    bool fill = !bitmap_full(wp->valid, nr) && !(wp->wflags & WB_FLG_ZERO);
+
+    trace_sftl_wbuf_writeback(sdk->gd->disk_name, wp->lpn, bitmap_weight(wp->valid, nr));
+    if (fill && sdk->vol) {
+        // an unmapped unit of a volume has nothing to read, the rest is zeros
+        ppn = held = ftl_read_get(sdk, wp->lpn, &wp->error);
+        fill = held != 0;
+    }
+
+    if (fill) {
+        old = alloc_pages(GFP_NOIO, sdk->unit_shift);
+        if (old)
+            bio = wbuf_alloc_bio(sdk, old, READ, ppn, wbuf_read_endio, wp);
+        if (bio) {
+            init_completion(&wp->done);
+            submit_sync_bio(sdk, bio);
+            wait_for_completion(&wp->done);
+        } else
+            wp->error = -ENOMEM;
+
+        if (!wp->error && ppn_packed(sdk, ppn))
+            wp->error = wbuf_unpack(wp->lpn, &old);
+        if (!wp->error) {
+            src = page_address(old);
+            dst = page_address(wp->data);
+            for (i = 0; i < nr; i++) {
+                if (!test_bit(i, wp->valid))
+                    memcpy(dst + to_bytes(i), src + to_bytes(i), to_bytes(1));
+            }
+        }
+        if (old)
+            __free_pages(old, sdk->unit_shift);
+    }
+    if (held)
+        ftl_read_put(sdk, held);
+
+    return wp->error;
+}
+
+/*
+ * Program the whole unit of @wp, filled unless wp->error is set. On a
+ * volume it goes to a newly allocated unit, is only unmapped if it is
+ * all zeros, or is mapped to a copy of the same data if the volume shares
+ * units. A fua unit is programmed, the copy may still be in the cache of
+ * the device.
+ */
+static void wbuf_program(struct write_buffer * wb, struct wbuf_page * wp)
+{
+    struct ssd_disk * sdk = wp->sdk;
+    struct bio * bio;
+
+    if (!wp->error && sdk->vol && zero_data(page_address(wp->data), to_bytes(unit_sectors(sdk)))) {
+        wp->error = unmap_phys_range(sdk->gd, wp->lpn, 1);
+        if (!wp->error) {
+            ftl_stat_inc(sdk, FTL_STAT_ZERO_UNITS);
+            wbuf_done(wb, wp);
+            return;
+        }
+    }
+    if (!wp->error && sdk->vol && sdk->vol->dedup) {
+        wp->fp = dedup_fp(page_address(wp->data), PHYS_PAGE_SIZE);
+        if (!(wp->wflags & WB_FLG_FUA) && ftl_map_dedup(sdk, wp->lpn, page_address(wp->data), wp->fp)) {
+            wbuf_done(wb, wp);
+            return;
+        }
+    }
+    if (!wp->error && sdk->vol)
+        wp->ppn = ftl_map_write(sdk, wp->lpn, &wp->old, NULL, &wp->error);
+
+    if (!wp->error) {
+        bio = wbuf_alloc_bio(sdk, wp->data, WRITE | (wp->wflags & WB_FLG_FUA ? REQ_FUA : 0),
+                sdk->vol ? wp->ppn : inplace_ppn(sdk, wp->lpn), wbuf_write_endio, wp);
+        if (bio) {
+            if (wp->ppn) {
+                ss_account_io(sdk, bio);
+                ftl_submit_write(sdk, wp->ppn, bio);
+            } else
+                submit_sync_bio(sdk, bio);
+            return;
+        }
+        wp->error = -ENOMEM;
+        if (wp->ppn) {
+            ftl_map_done(sdk, wp->lpn, wp->ppn, wp->old, wp->error);
+            ftl_write_done(sdk, wp->ppn);
+        }
+    }
+
+    wbuf_fail(wb, wp);
+}
+
+/*
+ * Fill @wp and program the whole unit. The unit must be marked
+ * WB_FLG_FLUSH, it is freed when the write completes.
+ */
+static void wbuf_write_back(struct write_buffer * wb, struct wbuf_page * wp)
+{
+    wbuf_fill(wp->sdk, wp);
+    wbuf_program(wb, wp);
+}
+
+/* units written back compressed into one flash page, see pack.h */
+struct wbuf_pack {
+    struct ssd_disk * sdk;
+    struct page * page;
+    pfn_t ppn;
+    unsigned int nr;
+    struct wbuf_page * wps[PACK_MAX_UNITS];
+    pfn_t olds[PACK_MAX_UNITS];     // the units they replace, see ftl_map_done
+};
+
+static struct wbuf_pack * wbuf_alloc_pack(struct ssd_disk * sdk)
+{
+    struct wbuf_pack * pk = kmalloc(sizeof(struct wbuf_pack), GFP_NOIO);
+
+    if (!pk)
+        return NULL;
+    pk->page = alloc_page(GFP_NOIO);
+    if (!pk->page) {
+        kfree(pk);
+        return NULL;
+    }
+    pk->sdk = sdk;
+    pk->ppn = 0;
+    pk->nr = 0;
+    pack_start(page_address(pk->page));
+    return pk;
+}
+
+static void wbuf_free_pack(struct wbuf_pack * pk)
+{
+    __free_page(pk->page);
+    kfree(pk);
+}
+
+static void wbuf_pack_endio(struct bio * bio, int error)
+{
+    struct wbuf_pack * pk = bio->bi_private;
+    struct ssd_disk * sdk = pk->sdk;
+    struct write_buffer * wb = &sdk->wb;
+    unsigned long flags;
+    unsigned int i;
+
+    bio->bi_private = sdk->bs;
+    bio_put(bio);
+    for (i = 0; i < pk->nr; i++)
+        ftl_map_done(sdk, pk->wps[i]->lpn, pk->ppn, pk->olds[i], error);
+    ftl_write_done(sdk, pk->ppn);
+
+    spin_lock_irqsave(&wb->lock, flags);
+    if (error) {
+        printk(KERN_ERR "ss: write back of %u units packed at %x failed %d\n", pk->nr,
+                pk->ppn, error);
+        wb->error = error;
+        wb->errors ++;
+    }
+    for (i = 0; i < pk->nr; i++)
+        wbuf_free_page(wb, pk->wps[i]);
+    spin_unlock_irqrestore(&wb->lock, flags);
+
+    wake_up_all(&wb->wait);
+    wbuf_free_pack(pk);
+}
+
+/* map the units of @pk to a page of their own and program it */
+static void wbuf_pack_write(struct write_buffer * wb, struct wbuf_pack * pk)
+{
+    struct ssd_disk * sdk = pk->sdk;
+    pfn_t lpns[PACK_MAX_UNITS];
+    struct bio * bio = NULL;
+    unsigned long flags;
+    unsigned int i;
+    int rw = WRITE, err = 0;
+
+    // a single unit is as well written as it is
+    if (pk->nr == 1) {
+        wbuf_program(wb, pk->wps[0]);
+        wbuf_free_pack(pk);
+        return;
+    }
+
+    for (i = 0; i < pk->nr; i++) {
+        lpns[i] = pk->wps[i]->lpn;
+        if (pk->wps[i]->wflags & WB_FLG_FUA)
+            rw |= REQ_FUA;
+    }
+    pk->ppn = ftl_map_pack(sdk, lpns, pk->nr, pk->olds, NULL, &err);
+    // some units are left out, the flush after them fails
+    if (pk->ppn && err) {
+        spin_lock_irqsave(&wb->lock, flags);
+        printk(KERN_ERR "ss: cannot map units packed at %x, error %d\n", pk->ppn, err);
+        wb->error = err;
+        wb->errors ++;
+        spin_unlock_irqrestore(&wb->lock, flags);
+    }
+    if (pk->ppn)
+        bio = wbuf_alloc_bio(sdk, pk->page, rw, pk->ppn, wbuf_pack_endio, pk);
+    if (bio) {
+        ss_account_io(sdk, bio);
+        ftl_submit_write(sdk, pk->ppn, bio);
+        return;
+    }
+
+    for (i = 0; pk->ppn && i < pk->nr; i++)
+        ftl_map_done(sdk, lpns[i], pk->ppn, pk->olds[i], -ENOMEM);
+    if (pk->ppn)
+        ftl_write_done(sdk, pk->ppn);
+    for (i = 0; i < pk->nr; i++) {
+        pk->wps[i]->error = pk->ppn ? -ENOMEM : err;
+        wbuf_fail(wb, pk->wps[i]);
+    }
+    wbuf_free_pack(pk);
+}
+
+/*
+ * Write back the @nr units of @wps compressed, as many in a flash page
+ * as fit. A unit that does not compress well is written as it is.
+ */
+static void wbuf_write_packed(struct write_buffer * wb, struct wbuf_page ** wps, unsigned int nr)
+{
+    struct wbuf_pack * pk = NULL;
+    struct wbuf_page * wp;
+    const void * data;
+    unsigned int i, len;
+
+    for (i = 0; i < nr; i++) {
+        wp = wps[i];
+        if (wbuf_fill(wp->sdk, wp)) {
+            wbuf_fail(wb, wp);
+            continue;
+        }
+
+        // nothing is programmed for zeros at all
+        if (zero_data(page_address(wp->data), PHYS_PAGE_SIZE)) {
+            wbuf_program(wb, wp);
+            continue;
+        }
+        data = pack_compress(wb->pack, page_address(wp->data), &len);
+        if (!data) {
+            wbuf_program(wb, wp);
+            continue;
+        }
+        if (pk && !pack_add(page_address(pk->page), wp->lpn, data, len)) {
+            wbuf_pack_write(wb, pk);
+            pk = NULL;
+        }
+        if (!pk) {
+            pk = wbuf_alloc_pack(wp->sdk);
+            if (!pk) {
+                wbuf_program(wb, wp);
+                continue;
+            }
+            // one always fits in an empty page
+            pack_add(page_address(pk->page), wp->lpn, data, len);
+        }
+        pk->wps[pk->nr ++] = wp;
+    }
+
+    if (pk)
+        wbuf_pack_write(wb, pk);
+}
+
+/*
+ * whether there is anything to write back. Full units to be packed wait
+ * until there are enough of them to fill a page, partial ones until the
+ * buffer is drained or over its size. Called under the lock.
+ */
+static bool wbuf_ready(struct write_buffer * wb)
+{
+    struct list_head * pos;
+    unsigned int nr = 0;
+
+    if (wb->draining || wb->nents > wb->max_ents)
+        return true;
+    if (!wb->pack)
+        return !list_empty(&wb->full);
+    list_for_each(pos, &wb->full) {
+        if (++ nr == PACK_MAX_UNITS)
+            return true;
+    }
+    return false;
+}
+
+static void wbuf_flush_work(struct work_struct * work)
+{
+    struct write_buffer * wb = container_of(work, struct write_buffer, work);
+    struct wbuf_page * wp, * op, * wps[PACK_MAX_UNITS];
+    unsigned int nr, max = wb->pack ? PACK_MAX_UNITS : 1;
+    unsigned long flags;
+    bool ready;
+
+    for (;;) {
+        nr = 0;
+        spin_lock_irqsave(&wb->lock, flags);
+        ready = wbuf_ready(wb);
+        while (ready && nr < max) {
+            wp = NULL;
+            if (!list_empty(&wb->full))
+                wp = list_first_entry(&wb->full, struct wbuf_page, list);
+            if (!list_empty(&wb->partial) && (wb->draining || wb->nents > wb->max_ents)) {
+                op = list_first_entry(&wb->partial, struct wbuf_page, list);
+                // a drain goes oldest first, units filled since cannot hold it up
+                if (!wp || (wb->draining && op->seq < wp->seq))
+                    wp = op;
+            }
+            if (!wp)
+                break;
+            list_del_init(&wp->list);
+            wp->wflags |= WB_FLG_FLUSH;
+            wps[nr ++] = wp;
+        }
+        spin_unlock_irqrestore(&wb->lock, flags);
+
+        if (!nr)
+            break;
+        if (wb->pack)
+            wbuf_write_packed(wb, wps, nr);
+        else
+            wbuf_write_back(wb, wps[0]);
+    }
+}
+
+/*
+ * Buffer a write of @len sects at sector @sect of unit @lpn, taking the
+ * data from @bio the same way clone_bio does. The write is complete once
+ * this returns 0, otherwise it should be sent to the flash directly.
+ */
+int wbuf_write(struct ssd_disk * sdk, pfn_t lpn, struct bio * bio, unsigned int * idx,
+        sector_t * offset, unsigned int sect, sector_t len)
+{
+    struct write_buffer * wb = &sdk->wb;
+    struct wbuf_page * wp, * np = NULL;
+    unsigned int nr = unit_sectors(sdk);
+    unsigned long flags;
+    bool kick;
+
+retry:
+    spin_lock_irqsave(&wb->lock, flags);
+    wp = wbuf_lookup(wb, lpn);
+    if (wp && (wp->wflags & WB_FLG_FLUSH)) {
+        // the new data must not reach the flash before the old one
+        spin_unlock_irqrestore(&wb->lock, flags);
+        wait_event(wb->wait, !wbuf_pending(wb, lpn));
+        goto retry;
+    }
+
+    if (!wp) {
+        // writers wait at twice the size, a drain has that much at most to write back
+        if (wb->nents >= 2 * wb->max_ents) {
+            spin_unlock_irqrestore(&wb->lock, flags);
+            queue_work(wb->wq, &wb->work);
+            wait_event(wb->wait, ACCESS_ONCE(wb->nents) < 2 * wb->max_ents);
+            goto retry;
+        }
+        if (!np) {
+            spin_unlock_irqrestore(&wb->lock, flags);
+            np = wbuf_alloc_page(sdk, lpn, get_unmapped_run(sdk->gd, lpn, 1) != 0);
+            if (!np)
+                return -ENOMEM;
+            goto retry;
+        }
+        wp = np;
+        np = NULL;
+        list_add(&wp->hlist, &wb->hash[WBUF_HASH(lpn)]);
+        list_add_tail(&wp->list, &wb->partial);
+        wp->seq = ++ wb->seq;
+        list_add_tail(&wp->age, &wb->all);
+        wb->nents ++;
+    }
+
+    copy_bio_range(bio, idx, offset, len, (char *)page_address(wp->data) + to_bytes(sect), WRITE);
+    bitmap_set(wp->valid, sect, len);
+    if (bio->bi_rw & REQ_FUA)
+        wp->wflags |= WB_FLG_FUA;
+    if (bitmap_full(wp->valid, nr))
+        list_move_tail(&wp->list, &wb->full);
+
+    kick = wbuf_ready(wb);
+    spin_unlock_irqrestore(&wb->lock, flags);
+
+    if (np)
+        wbuf_destroy_page(sdk, np);
+
+    if (kick)
+        queue_work(wb->wq, &wb->work);
+
+    return 0;
+}
+
+/*
+ * Serve a read of @len sects at sector @sect of unit @lpn from the buffer.
+ * Returns 0 if the read is served, otherwise anything buffered for the
+ * unit has been written back and the caller should read the flash.
+ */
+int wbuf_read(struct ssd_disk * sdk, pfn_t lpn, struct bio * bio, unsigned int * idx,
+        sector_t * offset, unsigned int sect, sector_t len)
+{
+    struct write_buffer * wb = &sdk->wb;
+    struct wbuf_page * wp;
+    unsigned long flags;
+
+    if (!wb->nents)
+        return -ENOENT;
+
+    spin_lock_irqsave(&wb->lock, flags);
+    wp = wbuf_lookup(wb, lpn);
+    if (!wp) {
+        spin_unlock_irqrestore(&wb->lock, flags);
+        return -ENOENT;
+    }
+
+    if (find_next_zero_bit(wp->valid, sect + len, sect) >= sect + len || (wp->wflags & WB_FLG_ZERO)) {
+        copy_bio_range(bio, idx, offset, len, (char *)page_address(wp->data) + to_bytes(sect), READ);
+        spin_unlock_irqrestore(&wb->lock, flags);
+        return 0;
+    }
+    spin_unlock_irqrestore(&wb->lock, flags);
+
+    wbuf_evict(sdk, lpn, false);
+    return -EAGAIN;
+}
+
+/*
+ * Get unit @lpn out of the buffer before it is written to the flash
+ * directly. If @drop is set the whole unit is about to be overwritten
+ * and the buffered data is simply discarded, otherwise it is written back.
+ */
+void wbuf_evict(struct ssd_disk * sdk, pfn_t lpn, bool drop)
+{
+    struct write_buffer * wb = &sdk->wb;
+    struct wbuf_page * wp;
+    unsigned long flags;
+
+    if (!wb->nents)
+        return;
+
+    spin_lock_irqsave(&wb->lock, flags);
+    wp = wbuf_lookup(wb, lpn);
+    if (wp && !(wp->wflags & WB_FLG_FLUSH)) {
+        list_del_init(&wp->list);
+        if (drop) {
+            wbuf_free_page(wb, wp);
+            spin_unlock_irqrestore(&wb->lock, flags);
+            return;
+        }
+        wp->wflags |= WB_FLG_FLUSH;
+        spin_unlock_irqrestore(&wb->lock, flags);
+        wbuf_write_back(wb, wp);
+    } else
+        spin_unlock_irqrestore(&wb->lock, flags);
+
+    wait_event(wb->wait, !wbuf_pending(wb, lpn));
+}
+
+/* whether no unit buffered up to @seq is left */
+static bool wbuf_drained(struct write_buffer * wb, u64 seq)
+{
+    unsigned long flags;
+    bool ret;
+
+    spin_lock_irqsave(&wb->lock, flags);
+    ret = list_empty(&wb->all) || list_first_entry(&wb->all, struct wbuf_page, age)->seq > seq;
+    spin_unlock_irqrestore(&wb->lock, flags);
+
+    return ret;
+}
+
+/*
+ * Write back everything in the buffer and wait for it, used by REQ_FLUSH
+ * and REQ_FUA. Units buffered after the drain started are not waited
+ * for. Returns the last write back error if any happened since the drain
+ * before it finished, every drain running then gets it.
+ */
+int wbuf_drain(struct ssd_disk * sdk)
+{
+    struct write_buffer * wb = &sdk->wb;
+    unsigned long flags;
+    unsigned int seen;
+    u64 seq;
+    int err = 0;
+
+    spin_lock_irqsave(&wb->lock, flags);
+    wb->draining ++;
+    seq = wb->seq;
+    seen = wb->errors_seen;
+    spin_unlock_irqrestore(&wb->lock, flags);
+
+    queue_work(wb->wq, &wb->work);
+    wait_event(wb->wait, wbuf_drained(wb, seq));
+
+    spin_lock_irqsave(&wb->lock, flags);
+    wb->draining --;
+    if (wb->errors != seen)
+        err = wb->error;
+    wb->errors_seen = wb->errors;
+    spin_unlock_irqrestore(&wb->lock, flags);
+
+    return err;
+}
+
+int wbuf_init(struct ssd_disk * sdk)
+{
+    struct write_buffer * wb = &sdk->wb;
+    int i;
+
+    wb->hash = kmalloc(sizeof(struct list_head) * WBUF_HASH_SIZE, GFP_KERNEL);
+    if (!wb->hash)
+        return -ENOMEM;
+
+    wb->wq = alloc_workqueue("ss_wbuf", WQ_MEM_RECLAIM, 1);
+    if (!wb->wq) {
+        kfree(wb->hash);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < WBUF_HASH_SIZE; i++)
+        INIT_LIST_HEAD(&wb->hash[i]);
+    INIT_LIST_HEAD(&wb->partial);
+    INIT_LIST_HEAD(&wb->full);
+    INIT_LIST_HEAD(&wb->all);
+    spin_lock_init(&wb->lock);
+    init_waitqueue_head(&wb->wait);
+    INIT_WORK(&wb->work, wbuf_flush_work);
+    wb->nents = 0;
+    wb->max_ents = max(WBUF_MAX_PAGES >> sdk->unit_shift, 1);
+    wb->draining = 0;
+    wb->seq = 0;
+    wb->error = 0;
+    wb->errors = 0;
+    wb->errors_seen = 0;
+
+    // a volume that packs its units compresses them here
+    wb->pack = NULL;
+    if (sdk->vol && sdk->vol->devs[0].packs) {
+        wb->pack = pack_alloc_wrk();
+        if (!wb->pack) {
+            destroy_workqueue(wb->wq);
+            wb->wq = NULL;
+            kfree(wb->hash);
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+void wbuf_exit(struct ssd_disk * sdk)
+{
+    struct write_buffer * wb = &sdk->wb;
+
+    if (!wb->wq)
+        return;
+
+    wbuf_drain(sdk);
+    destroy_workqueue(wb->wq);
+    kfree(wb->hash);
+    if (wb->pack)
+        pack_free_wrk(wb->pack);
+}
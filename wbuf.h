@@ -0,0 +1,76 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  wbuf.h
+ *
+ *    Description:  header for wbuf.c, dram write buffer for sub-unit writes
+ *
+ *        Version:  1.0
+ *        Created:  10/19/2026 10:12:31 AM
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ * =====================================================================================
+ */
+
+#ifndef _WBUF_H_
+#define _WBUF_H_
+
+#define WBUF_HASH_SHIFT 8
+#define WBUF_HASH_SIZE  (1 << WBUF_HASH_SHIFT)
+#define WBUF_HASH(lpn)  ((lpn) & (WBUF_HASH_SIZE - 1))
+#define WBUF_MAX_PAGES  1024    /* buffered pages before partial units are written back */
+
+#define WB_FLG_ZERO     0x1     /* unit was unmapped, unwritten sectors are zeros */
+#define WB_FLG_FLUSH    0x2     /* unit is being written back */
+#define WB_FLG_FUA      0x4     /* unit is written back with REQ_FUA */
+
+struct ssd_disk;
+struct pack_wrk;
+
+struct wbuf_page {
+    struct list_head hlist; // hash chain
+    struct list_head list;  // partial or full list
+    struct list_head age;   // list of all the buffered units, oldest first
+    u64 seq;                // order it was buffered in
+    pfn_t lpn;              // mapping unit buffered
+    pfn_t ppn;              // page of a volume it is written back to
+    pfn_t old;              // and the unit it replaces, see ftl_map_done
+    u64 fp;                 // fingerprint of its data, if the volume shares units
+    unsigned long valid[BITS_TO_LONGS(UNIT_MAX_SECTORS)];  // sectors in the buffer
+    u8 wflags;
+    int error;
+    struct page * data;     // the unit, 1 << unit_shift pages
+    struct ssd_disk * sdk;
+    struct completion done; // read of the missing sectors
+};
+
+struct write_buffer {
+    spinlock_t lock;
+    struct list_head * hash;
+    struct list_head partial;   // units with missing sectors, oldest first
+    struct list_head full;      // units ready to be written back
+    struct list_head all;       // every unit buffered, oldest first
+    u64 seq;                    // of the last unit buffered
+    unsigned int nents;
+    unsigned int max_ents;      // WBUF_MAX_PAGES in units
+    unsigned int draining;
+    int error;                  // last write back error
+    unsigned int errors;        // write back errors so far
+    unsigned int errors_seen;   // the errors a finished drain has returned
+    struct pack_wrk * pack;     // compressor of the units written back, NULL if not packed
+    struct workqueue_struct * wq;
+    struct work_struct work;
+    wait_queue_head_t wait;
+};
+
+extern int wbuf_init(struct ssd_disk * sdk);
+extern void wbuf_exit(struct ssd_disk * sdk);
+extern int wbuf_write(struct ssd_disk * sdk, pfn_t lpn, struct bio * bio, unsigned int * idx,
+        sector_t * offset, unsigned int sect, sector_t len);
+extern int wbuf_read(struct ssd_disk * sdk, pfn_t lpn, struct bio * bio, unsigned int * idx,
+        sector_t * offset, unsigned int sect, sector_t len);
+extern void wbuf_evict(struct ssd_disk * sdk, pfn_t lpn, bool drop);
+extern int wbuf_drain(struct ssd_disk * sdk);
+
+#endif